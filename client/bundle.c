@@ -0,0 +1,471 @@
+/*========================================================================
+ * bundle.c  --  File bundle routines for Tsunami client.
+ *
+ * This contains the routines that split a bundle back into its files.
+ * A bundle is a set of files and directory trees that the server sends
+ * as one stream of their data, one file after the other, with a
+ * manifest of their names, sizes and modes (see ttp_read_manifest()).
+ * The directories and files of the manifest are made under the
+ * destination directory before the data comes, and every block is
+ * written into the files it spans.  Only BUNDLE_OPEN_FILES of them are
+ * kept open at once, and a file is closed as soon as all of its data
+ * is in.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <errno.h>      /* for errno                    */
+#include <fcntl.h>      /* for open()                   */
+#include <stdlib.h>     /* for malloc(), free(), etc.   */
+#include <string.h>     /* for strdup(), strchr()       */
+#include <sys/stat.h>   /* for mkdir(), chmod()         */
+#include <unistd.h>     /* for pwrite(), ftruncate()    */
+
+#include <tsunami-client.h>
+
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static int   bundle_fd     (bundle_t *bundle, u_int32_t index);
+static void  bundle_unopen (bundle_t *bundle, u_int32_t index);
+static int   bundle_parents(char *path);
+static char *bundle_path   (bundle_t *bundle, u_int32_t index);
+
+
+/*------------------------------------------------------------------------
+ * bundle_t *bundle_create(const char *root);
+ *
+ * Returns a new, empty bundle that goes into the given directory, or
+ * NULL if there is no memory.
+ *------------------------------------------------------------------------*/
+bundle_t *bundle_create(const char *root)
+{
+    bundle_t *bundle = (bundle_t *) calloc(1, sizeof(bundle_t));
+
+    if (bundle == NULL)
+        return NULL;
+    bundle->root = strdup(root);
+    if (bundle->root == NULL) {
+        free(bundle);
+        return NULL;
+    }
+    return bundle;
+}
+
+
+/*------------------------------------------------------------------------
+ * int bundle_add(bundle_t *bundle, const char *name, u_int64_t size,
+ *                u_int32_t mode);
+ *
+ * Appends the file or directory of the given name, size and mode from
+ * the manifest to the bundle, its data after that of the entries
+ * before it.  A name that is absolute or climbs out of the destination
+ * with ".." is refused.  Returns 0 on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int bundle_add(bundle_t *bundle, const char *name, u_int64_t size, u_int32_t mode)
+{
+    bundle_entry_t *entry;
+    const char     *part;
+
+    /* keep the files where they belong */
+    if ((name[0] == '\0') || (name[0] == '/'))
+        return warn("Bundle entry without a relative name");
+    for (part = name; part != NULL; part = strchr(part, '/')) {
+        if (*part == '/')
+            ++part;
+        if (!strncmp(part, "..", 2) && ((part[2] == '/') || (part[2] == '\0'))) {
+            sprintf(g_error, "Bundle entry '%s' would leave the destination", name);
+            return warn(g_error);
+        }
+    }
+
+    /* make room for it, one step at a time as the manifest is read */
+    if ((bundle->count & (bundle->count - 1)) == 0) {
+        entry = (bundle_entry_t *) realloc(bundle->entry, (bundle->count ? 2 * bundle->count : 1) * sizeof(bundle_entry_t));
+        if (entry == NULL)
+            return warn("Could not grow the bundle manifest");
+        bundle->entry = entry;
+    }
+
+    entry          = &bundle->entry[bundle->count];
+    entry->name    = strdup(name);
+    entry->offset  = bundle->size;
+    entry->size    = S_ISDIR(mode) ? 0 : size;
+    entry->mode    = mode;
+    entry->written = 0;
+    entry->fd      = -1;
+    if (entry->name == NULL)
+        return warn("Could not allocate a bundle entry");
+    bundle->size += entry->size;
+    ++bundle->count;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int bundle_prepare(bundle_t *bundle);
+ *
+ * Makes the destination directory, with what is missing above it, and
+ * every directory and file of the bundle under it, the files empty and
+ * at their final size, so that empty files and directories come
+ * through as well and the blocks can go into place as they arrive.
+ * Files and directories are writable by us until bundle_close() gives
+ * them their modes.  Returns 0 on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int bundle_prepare(bundle_t *bundle)
+{
+    bundle_entry_t *entry;
+    char           *path;
+    u_int32_t       index;
+    int             fd, status = 0;
+
+    status = mkdir(bundle->root, 0755);
+    if ((status < 0) && (errno == ENOENT) && (bundle_parents(bundle->root) == 0))
+        status = mkdir(bundle->root, 0755);
+    if ((status < 0) && (errno != EEXIST)) {
+        sprintf(g_error, "Could not make the directory '%s' for the bundle", bundle->root);
+        return warn(g_error);
+    }
+
+    for (index = 0, status = 0; (index < bundle->count) && (status == 0); ++index) {
+        entry = &bundle->entry[index];
+        path  = bundle_path(bundle, index);
+        if (path == NULL)
+            return warn("Could not allocate a bundle path");
+
+        /* a file of "bundle:*" may come without its directories */
+        if (S_ISDIR(entry->mode)) {
+            status = mkdir(path, 0700 | (entry->mode & 0777));
+            if ((status < 0) && (errno == ENOENT) && (bundle_parents(path) == 0))
+                status = mkdir(path, 0700 | (entry->mode & 0777));
+            if ((status < 0) && (errno == EEXIST))
+                status = 0;
+        } else {
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600 | (entry->mode & 0777));
+            if ((fd < 0) && (errno == ENOENT) && (bundle_parents(path) == 0))
+                fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600 | (entry->mode & 0777));
+            status = ((fd < 0) || (ftruncate(fd, entry->size) < 0)) ? -1 : 0;
+            if (fd >= 0)
+                close(fd);
+        }
+
+        if (status < 0) {
+            sprintf(g_error, "Could not make '%s' of the bundle", path);
+            warn(g_error);
+        }
+        free(path);
+    }
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int bundle_write(bundle_t *bundle, u_int64_t offset,
+ *                  const u_char *data, u_int32_t length);
+ *
+ * Writes the given data from the given offset of the stream into the
+ * files of the bundle that it spans.  Returns 0 on success and
+ * non-zero on failure.
+ *------------------------------------------------------------------------*/
+int bundle_write(bundle_t *bundle, u_int64_t offset, const u_char *data, u_int32_t length)
+{
+    bundle_entry_t *entry;
+    u_int64_t       end  = min(offset + length, bundle->size);
+    u_int64_t       piece;
+    u_int32_t       low  = 0;
+    u_int32_t       high = bundle->count;
+    u_int32_t       middle;
+    ssize_t         bytes;
+    int             fd;
+
+    if (bundle->count == 0)
+        return 0;
+
+    /* find the last entry that starts at or before the offset */
+    while (high - low > 1) {
+        middle = (low + high) / 2;
+        if (bundle->entry[middle].offset <= offset)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    /* and write on through the files until the data is out */
+    while (offset < end) {
+        entry = &bundle->entry[low];
+        if (offset >= entry->offset + entry->size) {
+            ++low;
+            continue;
+        }
+        fd = bundle_fd(bundle, low);
+        if (fd < 0)
+            return -1;
+        piece = min(end - offset, entry->offset + entry->size - offset);
+        bytes = pwrite(fd, data, piece, offset - entry->offset);
+        if (bytes < (ssize_t) piece)
+            return warn("Could not write into a file of the bundle");
+        entry->written += piece;
+        if (entry->written >= entry->size)
+            bundle_unopen(bundle, low);
+        offset += piece;
+        data   += piece;
+    }
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int bundle_digest(bundle_t *bundle, u_int32_t *digest);
+ *
+ * Computes the CRC32C tree hash of the stream of the bundle from its
+ * files as they are on disk, which is what the server hashes on its
+ * side, and stores it in digest.  Returns 0 on success and non-zero on
+ * error.
+ *------------------------------------------------------------------------*/
+int bundle_digest(bundle_t *bundle, u_int32_t *digest)
+{
+    crc32c_tree_t   tree;
+    u_char         *buffer;
+    char           *path;
+    u_int64_t       done;
+    ssize_t         bytes;
+    u_int32_t       index;
+    int             fd, status = 0;
+
+    buffer = (u_char *) malloc(BUNDLE_BUFFER);
+    if (buffer == NULL)
+        return warn("Could not allocate the hashing buffer");
+    memset(&tree, 0, sizeof(tree));
+
+    for (index = 0; (index < bundle->count) && (status == 0); ++index) {
+        if (bundle->entry[index].size == 0)
+            continue;
+        path = bundle_path(bundle, index);
+        fd   = (path == NULL) ? -1 : open(path, O_RDONLY);
+        free(path);
+        if (fd < 0) {
+            status = -1;
+            break;
+        }
+        for (done = 0; done < bundle->entry[index].size; done += bytes) {
+            bytes = read(fd, buffer, min(BUNDLE_BUFFER, bundle->entry[index].size - done));
+            if (bytes <= 0) {
+                status = -1;
+                break;
+            }
+            crc32c_tree_add(&tree, buffer, bytes);
+        }
+        close(fd);
+    }
+
+    free(buffer);
+    if (status < 0)
+        return warn("Could not read the bundle for hashing");
+    *digest = crc32c_tree_end(&tree);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int bundle_close(bundle_t *bundle, int complete);
+ *
+ * Closes the files of the bundle that are still open, and if the
+ * transfer is complete gives every file and directory its mode from
+ * the manifest, the directories after what they hold.  Returns 0 on
+ * success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int bundle_close(bundle_t *bundle, int complete)
+{
+    char      *path;
+    u_int32_t  index;
+    int        status = 0;
+
+    while (bundle->opened > 0)
+        bundle_unopen(bundle, bundle->open[0]);
+
+    for (index = bundle->count; complete && (index > 0); --index) {
+        path = bundle_path(bundle, index - 1);
+        if ((path == NULL) || (chmod(path, bundle->entry[index - 1].mode & 07777) < 0))
+            status = -1;
+        free(path);
+    }
+    if (status < 0)
+        return warn("Could not set the modes of the bundle");
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * void bundle_destroy(bundle_t *bundle);
+ *
+ * Closes what the given bundle has open and frees it.  A NULL bundle
+ * is ignored.
+ *------------------------------------------------------------------------*/
+void bundle_destroy(bundle_t *bundle)
+{
+    u_int32_t index;
+
+    if (bundle == NULL)
+        return;
+    bundle_close(bundle, 0);
+    for (index = 0; index < bundle->count; ++index)
+        free(bundle->entry[index].name);
+    free(bundle->entry);
+    free(bundle->root);
+    free(bundle);
+}
+
+
+/*------------------------------------------------------------------------
+ * static int bundle_fd(bundle_t *bundle, u_int32_t index);
+ *
+ * Returns the open descriptor of the given entry of the bundle, first
+ * opening it and closing another if BUNDLE_OPEN_FILES are open, or -1
+ * on error.
+ *------------------------------------------------------------------------*/
+static int bundle_fd(bundle_t *bundle, u_int32_t index)
+{
+    bundle_entry_t *entry = &bundle->entry[index];
+    char           *path;
+
+    if (entry->fd >= 0)
+        return entry->fd;
+
+    /* make room among the open files, in turn */
+    if (bundle->opened == BUNDLE_OPEN_FILES) {
+        bundle->victim = (bundle->victim + 1) % BUNDLE_OPEN_FILES;
+        bundle_unopen(bundle, bundle->open[bundle->victim]);
+    }
+
+    path = bundle_path(bundle, index);
+    if (path != NULL)
+        entry->fd = open(path, O_WRONLY);
+    if (entry->fd < 0) {
+        sprintf(g_error, "Could not open '%s' of the bundle", (path != NULL) ? path : entry->name);
+        free(path);
+        return warn(g_error);
+    }
+    free(path);
+    bundle->open[bundle->opened++] = index;
+    return entry->fd;
+}
+
+
+/*------------------------------------------------------------------------
+ * static void bundle_unopen(bundle_t *bundle, u_int32_t index);
+ *
+ * Closes the descriptor of the given entry of the bundle, if it has
+ * one, and takes it off the list of open files.
+ *------------------------------------------------------------------------*/
+static void bundle_unopen(bundle_t *bundle, u_int32_t index)
+{
+    u_int32_t slot;
+
+    if (bundle->entry[index].fd < 0)
+        return;
+    close(bundle->entry[index].fd);
+    bundle->entry[index].fd = -1;
+    for (slot = 0; slot < bundle->opened; ++slot)
+        if (bundle->open[slot] == index) {
+            bundle->open[slot] = bundle->open[--bundle->opened];
+            break;
+        }
+}
+
+
+/*------------------------------------------------------------------------
+ * static int bundle_parents(char *path);
+ *
+ * Makes the missing directories above the given path, which is changed
+ * while at it and back again.  Returns 0 on success and non-zero on
+ * failure.
+ *------------------------------------------------------------------------*/
+static int bundle_parents(char *path)
+{
+    char *slash;
+    int   status = 0;
+
+    for (slash = strchr(path + 1, '/'); (slash != NULL) && (status == 0); slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if ((mkdir(path, 0755) < 0) && (errno != EEXIST))
+            status = -1;
+        *slash = '/';
+    }
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * static char *bundle_path(bundle_t *bundle, u_int32_t index);
+ *
+ * Returns the local path of the given entry of the bundle, newly
+ * allocated, or NULL if there is no memory.
+ *------------------------------------------------------------------------*/
+static char *bundle_path(bundle_t *bundle, u_int32_t index)
+{
+    char *path = (char *) malloc(strlen(bundle->root) + strlen(bundle->entry[index].name) + 2);
+
+    if (path != NULL)
+        sprintf(path, "%s/%s", bundle->root, bundle->entry[index].name);
+    return path;
+}
+
+
+/*========================================================================
+ * $Log: bundle.c,v $
+ */
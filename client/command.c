@@ -62,6 +62,7 @@
  *========================================================================*/
 
 #include <pthread.h>      /* for the pthreads library              */
+#include <signal.h>       /* for sigaction()                       */
 #include <stdlib.h>       /* for *alloc() and free()               */
 #include <string.h>       /* for standard string routines          */
 #include <sys/socket.h>   /* for the BSD socket library            */
@@ -74,11 +75,17 @@
 
 //#define DEBUG_RETX xxx // enable to show retransmit debug infos
 
+static volatile sig_atomic_t interrupted = 0;  /* set when a signal cuts a transfer short */
+
 /*------------------------------------------------------------------------
  * Prototypes for module-scope routines.
  *------------------------------------------------------------------------*/
 
 void *disk_thread   (void *arg);
+int   get_files     (command_t *command, ttp_session_t *session, int resume);
+void  interrupt_get (int signum);
+void  show_report   (ttp_session_t *session, double time_secs);
+int   spill_drain   (ttp_session_t *session, u_char *datagram, u_char *scratch);
 void  dump_blockmap (const char *postfix, const ttp_transfer_t *xfer);
 int   parse_fraction(const char *fraction, u_int16_t *num, u_int16_t *den);
 
@@ -96,9 +103,12 @@ int command_close(command_t *command, ttp_session_t *session)
     if (session == NULL || session->server == NULL)
 	return warn("Tsunami session was not active");
 
-    /* otherwise, go ahead and close it */
+    /* otherwise, go ahead and close it, and the data socket with it */
     fclose(session->server);
     session->server = NULL;
+    if (session->udp_fd >= 0)
+	close(session->udp_fd);
+    session->udp_fd = -1;
     if (session->parameter->verbose_yn)
 	printf("Connection closed.\n\n");
     return 0;
@@ -143,6 +153,7 @@ ttp_session_t *command_connect(command_t *command, ttp_parameter_t *parameter)
     if (session == NULL)
 	error("Could not allocate session object");
     session->parameter = parameter;
+    session->udp_fd    = -1;
 
     /* obtain our client socket */
     server_fd = create_tcp_socket(session, parameter->server_name, parameter->server_port);
@@ -190,6 +201,10 @@ ttp_session_t *command_connect(command_t *command, ttp_parameter_t *parameter)
     if (session->parameter->verbose_yn)
 	printf("Connected.\n\n");
     free(secret);
+
+    /* start from what worked last time with this server */
+    if (parameter->profile)
+	profile_load(session);
     return session;
 }
 
@@ -250,28 +265,58 @@ int command_dir(command_t *command, ttp_session_t *session)
  * nonzero on an error condition.
  *------------------------------------------------------------------------*/
 int command_get(command_t *command, ttp_session_t *session)
+{
+    int status;
+
+    /* with 'set parallel' a large file comes in byte ranges over several sessions at once */
+    if ((session != NULL) && (session->parameter->parallel > 1) && ((status = parallel_get(command, session)) <= 0))
+        return status;
+    return get_files(command, session, 0);
+}
+
+
+/*------------------------------------------------------------------------
+ * int get_files(command_t *command, ttp_session_t *session, int resume);
+ *
+ * Does the work of the get and resume commands: transfers the remote
+ * file given in the command, or all files the server shares for "*".
+ * With resume set, the transfer continues from the block record the
+ * earlier one left, without checking the blocks.  Returns 0 on a
+ * successful transfer and nonzero on an error condition.
+ *------------------------------------------------------------------------*/
+int get_files(command_t *command, ttp_session_t *session, int resume)
 {
     u_char         *datagram = NULL;            /* the buffer (in ring) for incoming blocks       */
     u_char         *local_datagram = NULL;      /* the local temp space for incoming block        */
-    u_int32_t       this_block = 0;             /* the block number for the block just received   */
+    u_int64_t       this_block = 0;             /* the block number for the block just received   */
     u_int16_t       this_type = 0;              /* the block type for the block just received     */
+    u_int16_t       packed = 0;                 /* the compressed flag of the block just received */
+    u_int16_t       packed_size = 0;            /* the packed length carried by a compressed block */
     u_int64_t       delta = 0;                  /* generic holder of elapsed times                */
-    u_int32_t       block = 0;                  /* generic holder of a block number               */
+    u_int64_t       block = 0;                  /* generic holder of a block number               */
     u_int32_t       dumpcount = 0;
+    int             ring_is_full = 0;           /* ring state when the block arrived              */
+    u_int32_t       datagram_size = 0;          /* the size of a datagram as it arrives           */
+    u_int32_t       length = 0;                 /* the size the datagram just received should have */
+    u_int32_t       crc = 0;                    /* the checksum trailer of the datagram           */
 
-    double          mbit_thru, mbit_good;       /* helpers for final statistics                   */
-    double          mbit_file;
+    double          mbit_file;                  /* helpers for final statistics                   */
     double          time_secs;
 
     ttp_transfer_t *xfer          = &(session->transfer);
     retransmit_t   *rexmit        = &(session->transfer.retransmit);
     int             status = 0;
     pthread_t       disk_thread_id = 0;
+    jmp_buf         trap;                       /* where a fatal error during the transfer goes   */
+    jmp_buf        *outer = g_error_trap;       /* where it goes on to once the transfer is over  */
+    int             fatal = 0;                  /* 1 if the transfer ended in a fatal error       */
 
     /* The following variables will be used only in multiple file transfer
      * session they are used to recieve the file names and other parameters
      */
     int             multimode = 0;
+    int             bundle = 0;
+    char            bundle_name[1024 + sizeof(BUNDLE_PREFIX)];
     char          **file_names = NULL;
     u_int32_t       f_counter = 0, f_total = 0, f_arrsize = 0;
 
@@ -279,6 +324,9 @@ int command_get(command_t *command, ttp_session_t *session)
     struct timeval ping_s, ping_e;
     long wait_u_sec = 1;
 
+    /* the signal handlers in place outside of the transfer */
+    struct sigaction interrupt, old_int, old_term;
+
     /* make sure that we have a remote file name */
     if (command->count < 2)
 	return warn("Invalid command syntax (use 'help get' for details)");
@@ -289,9 +337,16 @@ int command_get(command_t *command, ttp_session_t *session)
 
     /* reinitialize the transfer data */
     memset(xfer, 0, sizeof(*xfer));
+    xfer->verified = -1;
+
+    /* with 'set bundle yes' every request is for a bundle, which comes as one stream */
+    bundle = !strncmp(command->text[1], BUNDLE_PREFIX, strlen(BUNDLE_PREFIX));
+    snprintf(bundle_name, sizeof(bundle_name), "%s%s", bundle ? "" : BUNDLE_PREFIX, command->text[1]);
+    if (session->parameter->bundle)
+       bundle = 1;
 
     /* if the client asking for multiple files to be transfered */
-    if(!strcmp("*",command->text[1])) {
+    if(!strcmp("*",command->text[1]) && !bundle) {
        char  filearray_size[10];
        char  file_count[10];
 
@@ -359,12 +414,14 @@ int command_get(command_t *command, ttp_session_t *session)
 
     /* store the remote filename */
     if(!multimode)
-       xfer->remote_filename = command->text[1];
+       xfer->remote_filename = bundle ? bundle_name : command->text[1];
     else
        xfer->remote_filename = file_names[f_counter];
 
-    /* store the local filename */
-    if(!multimode) {
+    /* store the local filename, which is the directory a bundle goes into */
+    if (bundle) {
+       xfer->local_filename = (command->count >= 3) ? command->text[2] : ".";
+    } else if(!multimode) {
        if (command->count >= 3) {
           /* command was in "GET remotefile localfile" style */
           xfer->local_filename = command->text[2];
@@ -383,28 +440,37 @@ int command_get(command_t *command, ttp_session_t *session)
     }
 
     /* negotiate the file request with the server */
-    if (ttp_open_transfer(session, xfer->remote_filename, xfer->local_filename) < 0)
+    xfer->resume = resume;
+    if (ttp_open_transfer(session, xfer->remote_filename, xfer->local_filename) < 0) {
+	bundle_destroy(xfer->bundle);
+	xfer->bundle = NULL;
 	return warn("File transfer request failed");
+    }
 
     /* create the UDP data socket */
     if (ttp_open_port(session) < 0)
 	return warn("Creation of data socket failed");
 
+    /* let the server find a good starting rate */
+    if ((xfer->options & TS_OPT_PROBE) && (ttp_probe_path(session) < 0))
+	return warn("Path probe failed");
+
     /* allocate the retransmission table */
-    rexmit->table = (u_int32_t *) calloc(DEFAULT_TABLE_SIZE, sizeof(u_int32_t));
+    rexmit->table = (u_int64_t *) calloc(DEFAULT_TABLE_SIZE, sizeof(u_int64_t));
     if (rexmit->table == NULL)
 	error("Could not allocate retransmission table");
 
-    /* allocate the received bitfield */
-    xfer->received = (u_char *) calloc(xfer->block_count / 8 + 2, sizeof(u_char));
-    if (xfer->received == NULL)
-	error("Could not allocate received-data bitfield");
-
-    /* allocate the ring buffer */
-    xfer->ring_buffer = ring_create(session);
-
-    /* allocate the faster local buffer */
-    local_datagram = (u_char *) calloc(6 + session->parameter->block_size, sizeof(u_char));
+    /* allocate the ring buffer and the optional overflow spill */
+    xfer->ring_buffer  = ring_create(session);
+    xfer->spill_buffer = spill_create(session);
+    xfer->super_cache  = super_create(session);
+    xfer->fec_cache    = fec_create(session);
+
+    /* allocate the faster local buffer, with room for the checksum trailer */
+    datagram_size  = TS_HEADER_SIZE + session->parameter->block_size;
+    if (xfer->options & TS_OPT_CHECKSUM)
+        datagram_size += TS_CRC_SIZE;
+    local_datagram = (u_char *) calloc(datagram_size, sizeof(u_char));
     if (local_datagram == NULL)
         error("Could not allocate fast local datagram buffer in command_get()");
 
@@ -413,6 +479,13 @@ int command_get(command_t *command, ttp_session_t *session)
     if (status != 0)
 	error("Could not create I/O thread");
 
+    /* a fatal error from here on leaves through the abort path, which stops the disk thread, and goes on from there */
+    g_error_trap = &trap;
+    if (setjmp(trap) != 0) {
+        fatal = 1;
+        goto abort;
+    }
+
     /* Finish initializing the retransmission object */
     rexmit->table_size = DEFAULT_TABLE_SIZE;
     rexmit->index_max  = 0;
@@ -425,6 +498,18 @@ int command_get(command_t *command, ttp_session_t *session)
    * START TIMING
    *---------------------------*/
 
+   /* an interrupt ends the transfer through the abort path, which keeps a record of the blocks;
+    * a program we are embedded in keeps its own signal handlers and cancels through the session */
+   memset(&interrupt, 0, sizeof(interrupt));
+   interrupt.sa_handler = interrupt_get;
+   interrupt.sa_flags   = SA_RESETHAND;
+   interrupted = 0;
+   session->cancelled = 0;
+   if (!session->parameter->embedded) {
+       sigaction(SIGINT,  &interrupt, &old_int);
+       sigaction(SIGTERM, &interrupt, &old_term);
+   }
+
    memset(&xfer->stats, 0, sizeof(xfer->stats));
    xfer->stats.start_udp_errors = get_udp_in_errors();
    xfer->stats.this_udp_errors = xfer->stats.start_udp_errors;
@@ -437,7 +522,15 @@ int command_get(command_t *command, ttp_session_t *session)
    while (1) {
 
       /* try to receive a datagram */
-      status = recvfrom(xfer->udp_fd, local_datagram, 6 + session->parameter->block_size, 0, NULL, 0);
+      status = recvfrom(xfer->udp_fd, local_datagram, datagram_size, 0, NULL, 0);
+      if (interrupted || session->cancelled) {
+          warn("Transfer interrupted");
+          goto abort;
+      }
+      if (xfer->disk_failed) {
+          warn("Could not write the file");
+          goto abort;
+      }
       if (status < 0) {
           warn("UDP data transmission error");
           printf("Apparently frozen transfer, trying to do retransmit request\n");
@@ -447,9 +540,53 @@ int command_get(command_t *command, ttp_session_t *session)
           }
       }
 
+      /* late datagrams of an earlier transfer on our data socket are not part of this one */
+      if (!(xfer->options & TS_OPT_MULTICAST) && (ntohs(*((u_int16_t *) (local_datagram + 10))) != xfer->tag))
+          continue;
+
       /* retrieve the block number and block type */
-      this_block = ntohl(*((u_int32_t *) local_datagram));       // in range of 1..xfer->block_count
-      this_type  = ntohs(*((u_int16_t *) (local_datagram + 4))); // TS_BLOCK_ORIGINAL etc
+      this_block = ntohll(*((u_int64_t *) local_datagram));      // in range of 1..xfer->block_count
+      this_type  = ntohs(*((u_int16_t *) (local_datagram + 8))); // TS_BLOCK_ORIGINAL etc
+      packed     = this_type & TS_BLOCK_COMPRESSED;
+      this_type &= ~TS_BLOCK_COMPRESSED;
+
+      /* late packets of the path probe carry no file data */
+      if (this_type == TS_BLOCK_PROBE)
+          continue;
+
+      /* a block that fails its checksum, or is cut short, is dropped, to be requested again like a lost one */
+      length = datagram_size;
+      if (packed) {
+          memcpy(&packed_size, local_datagram + TS_HEADER_SIZE, TS_PACKED_SIZE);
+          length -= session->parameter->block_size - TS_PACKED_SIZE - ntohs(packed_size);
+          if (status != length) {
+              xfer->stats.total_corrupt++;
+              continue;
+          }
+      }
+      if (xfer->options & TS_OPT_CHECKSUM) {
+          memcpy(&crc, local_datagram + length - TS_CRC_SIZE, TS_CRC_SIZE);
+          if ((status != length) || (ntohl(crc) != crc32c(0, local_datagram, length - TS_CRC_SIZE))) {
+              xfer->stats.total_corrupt++;
+              continue;
+          }
+      }
+
+      /* a growing file announces each growth on the control channel before the new blocks */
+      if ((xfer->options & TS_OPT_FOLLOW) && (this_block > xfer->block_count) && (ttp_read_growth(session, this_block) < 0)) {
+          warn("Could not read the growth of the file");
+          goto abort;
+      }
+
+      /* a parity block may stand in for the one block its group lost, the others are kept for that */
+      if ((this_type & 0xff) == TS_BLOCK_PARITY) {
+          if ((xfer->fec_cache == NULL) || !fec_recover(session, local_datagram))
+              continue;
+          this_block = ntohll(*((u_int64_t *) local_datagram));
+          this_type  = TS_BLOCK_RETRANSMISSION;
+      } else if (xfer->fec_cache != NULL) {
+          fec_store(xfer->fec_cache, local_datagram, length - ((xfer->options & TS_OPT_CHECKSUM) ? TS_CRC_SIZE : 0));
+      }
 
       /* keep statistics on received blocks */
       xfer->stats.total_blocks++;
@@ -460,28 +597,50 @@ int command_get(command_t *command, ttp_session_t *session)
           xfer->stats.total_recvd_retransmits++;
       }
 
+      /* with the ring full, new blocks can only go into the spill, otherwise they are lost */
+      ring_is_full = ring_full(xfer->ring_buffer);
+      if (ring_is_full && spill_full(xfer->spill_buffer)) {
+          if (!got_block(session, this_block))
+              xfer->stats.total_dropped++;
+          goto send_stats; /* don't let disk-I/O freeze stop feedback of stats to server */
+      }
+
       /* main transfer control logic */
-      if (!ring_full(xfer->ring_buffer)) /* don't let disk-I/O freeze stop feedback of stats to server */
       if (!got_block(session, this_block) || this_type == TS_BLOCK_TERMINATE || xfer->restart_pending)
       {
 
           /* insert new blocks into disk write ringbuffer */
           if (!got_block(session, this_block)) {
 
-              /* reserve ring space, copy the data in, confirm the reservation */
-              datagram = ring_reserve(xfer->ring_buffer);
-              memcpy(datagram, local_datagram, 6 + session->parameter->block_size);
-              if (ring_confirm(xfer->ring_buffer) < 0) {
-                  warn("Error in accepting block");
-                  goto abort;
+              if (!ring_is_full) {
+                  /* reserve ring space, copy the data in, confirm the reservation */
+                  datagram = ring_reserve(xfer->ring_buffer);
+                  if (datagram == NULL) {
+                      warn("Could not write the file");
+                      goto abort;
+                  }
+                  memcpy(datagram, local_datagram, TS_HEADER_SIZE + session->parameter->block_size);
+                  if (ring_confirm(xfer->ring_buffer) < 0) {
+                      warn("Error in accepting block");
+                      goto abort;
+                  }
+              } else if (spill_push(xfer->spill_buffer, local_datagram) < 0) {
+                  /* spill storage failed, the block will have to be retransmitted */
+                  xfer->stats.total_dropped++;
+                  goto send_stats;
               }
 
               /* mark the block as received */
-              xfer->received[this_block / 8] |= (1 << (this_block % 8));
+              if (blockmap_set(xfer->received, this_block) < 0) {
+                  warn("Could not allocate received-data bitfield page");
+                  goto abort;
+              }
+              if (xfer->super_cache != NULL)
+                  super_received(xfer->super_cache, this_block);
               if (xfer->blocks_left > 0) {
                   --(xfer->blocks_left);
               } else {
-                  printf("Oops! Negative-going blocks_left count at block: type=%c this=%u final=%u left=%u\n", this_type, this_block, xfer->block_count, xfer->blocks_left);
+                  printf("Oops! Negative-going blocks_left count at block: type=%c this=%llu final=%llu left=%llu\n", this_type, (ull_t) this_block, (ull_t) xfer->block_count, (ull_t) xfer->blocks_left);
               }
           }
 
@@ -505,7 +664,7 @@ int command_get(command_t *command, ttp_session_t *session)
                     double path_capability;
                     path_capability  = 0.8 * (xfer->stats.this_transmit_rate + xfer->stats.this_retransmit_rate); // reduced effective Mbit/s rate
                     path_capability *= (0.001 * session->parameter->losswindow_ms); // MBit inside window, round-trip user estimated in losswindow_ms!
-                    u_int32_t earliest_block = this_block -
+                    u_int64_t earliest_block = this_block -
                        min(
                          1024 * 1024 * path_capability / (8 * session->parameter->block_size),  // # of blocks inside window
                          (this_block - xfer->gapless_to_block)                                  // # of blocks missing (tops)
@@ -523,7 +682,7 @@ int command_get(command_t *command, ttp_session_t *session)
 
              /* lossless transfer mode, request all missing data to be resent */
              } else {
-                for (block = xfer->next_block; block < this_block; ++block) {
+                for (block = blockmap_next(xfer->received, xfer->next_block, 0); block < this_block; block = blockmap_next(xfer->received, block + 1, 0)) {
                     if (ttp_request_retransmit(session, block) < 0) {
                         warn("Retransmission request failed");
                         goto abort;
@@ -533,9 +692,7 @@ int command_get(command_t *command, ttp_session_t *session)
           }//if(missing blocks)
 
           /* advance the index of the gapless section going from start block to highest block  */
-          while (got_block(session, xfer->gapless_to_block + 1) && (xfer->gapless_to_block < xfer->block_count)) {
-              xfer->gapless_to_block++;
-          }
+          xfer->gapless_to_block = min(blockmap_next(xfer->received, xfer->gapless_to_block + 1, 0) - 1, xfer->block_count);
 
           /* if this is an orignal, we expect to receive the successor to this block next */
           /* transmit restart note: these resent blocks are labeled original as well      */
@@ -552,8 +709,9 @@ int command_get(command_t *command, ttp_session_t *session)
           if (this_type == TS_BLOCK_TERMINATE) {
 
               #if DEBUG_RETX
-              fprintf(stderr, "Got end block: blk %u, final blk %u, left blks %u, tail %u, head %u\n",
-                      this_block, xfer->block_count, xfer->blocks_left, xfer->gapless_to_block, xfer->next_block);
+              fprintf(stderr, "Got end block: blk %llu, final blk %llu, left blks %llu, tail %llu, head %llu\n",
+                      (ull_t) this_block, (ull_t) xfer->block_count, (ull_t) xfer->blocks_left,
+                      (ull_t) xfer->gapless_to_block, (ull_t) xfer->next_block);
               #endif
 
               /* got all blocks by now */
@@ -566,7 +724,7 @@ int command_get(command_t *command, ttp_session_t *session)
               }
 
               /* add possible still missing blocks to retransmit list */
-              for (block = xfer->gapless_to_block+1; block < xfer->block_count; ++block) {
+              for (block = blockmap_next(xfer->received, xfer->gapless_to_block + 1, 0); block < xfer->block_count; block = blockmap_next(xfer->received, block + 1, 0)) {
                   if (ttp_request_retransmit(session, block) < 0) {
                       warn("Retransmission request failed");
                       goto abort;
@@ -607,28 +765,46 @@ int command_get(command_t *command, ttp_session_t *session)
 
     } /* Transfer of the file completes here*/
 
-    printf("Transfer complete. Flushing to disk and signaling server to stop...\n");
+    if (!session->parameter->embedded) {
+        printf("Transfer complete. Flushing to disk and signaling server to stop...\n");
+        sigaction(SIGINT,  &old_int,  NULL);
+        sigaction(SIGTERM, &old_term, NULL);
+    }
 
     /*---------------------------
      * STOP TIMING
      *---------------------------*/
 
-    /* tell the server to quit transmitting */
-    close(xfer->udp_fd);
+    /* tell the server to quit transmitting, keeping the data socket of the session for the next transfer */
+    if (xfer->udp_fd != session->udp_fd)
+        close(xfer->udp_fd);
     if (ttp_request_stop(session) < 0) {
 	warn("Could not request end of transfer");
 	goto abort;
     }
+    if (xfer->disk_failed) {
+	warn("Could not write the file");
+	goto abort;
+    }
 
     /* add a stop block to the ring buffer */
     datagram = ring_reserve(xfer->ring_buffer);
-    *((u_int32_t *) datagram) = 0;
+    if (datagram == NULL) {
+	warn("Could not write the file");
+	goto abort;
+    }
+    *((u_int64_t *) datagram) = 0;
     if (ring_confirm(xfer->ring_buffer) < 0)
 	warn("Error in terminating disk thread");
 
     /* wait for the disk thread to die */
     if (pthread_join(disk_thread_id, NULL) < 0)
 	warn("Disk thread terminated with error");
+    g_error_trap = outer;
+
+    /* have the sink write out what it still holds, a stream its lost blocks as zeros */
+    if (xfer->sink->close(session, 1) < 0)
+        warn("Could not finish writing the file");
 
     /*------------------------------------
      * MORE TRUE POINT TO STOP TIMING ;-)
@@ -641,45 +817,22 @@ int command_get(command_t *command, ttp_session_t *session)
     delta = get_usec_since(&(xfer->stats.start_time));
 
     /* count the truly lost blocks from the 'received' bitmap table */
-    xfer->stats.total_lost = 0;
-    for (block=1; block <= xfer->block_count; block++) {
-        if (!got_block(session, block)) xfer->stats.total_lost++;
-    }
+    xfer->stats.total_lost = xfer->block_count - blockmap_count(xfer->received);
+
+    /* keep a record of what we have if blocks were lost, so that a later get can fill them in */
+    if (blockmap_count(xfer->written) < xfer->block_count)
+        resume_save(session);
+    else
+        resume_remove(session);
+
+    /* in checksum mode compare the file we wrote with the server's */
+    xfer->verified = (xfer->options & TS_OPT_CHECKSUM) ? ttp_verify_file(session) : -1;
 
     /* display the final results */
-    mbit_thru     = 8.0 * xfer->stats.total_blocks * session->parameter->block_size;
-    mbit_good     = mbit_thru - 8.0 * xfer->stats.total_recvd_retransmits * session->parameter->block_size;
-    mbit_file     = 8.0 * xfer->file_size;
-    mbit_thru    /= (1024.0*1024.0);
-    mbit_good    /= (1024.0*1024.0);
-    mbit_file    /= (1024.0*1024.0);
-    time_secs     = delta / 1e6;
-    printf("PC performance figure : %llu packets dropped (if high this indicates receiving PC overload)\n", 
-                                         (ull_t)(xfer->stats.this_udp_errors - xfer->stats.start_udp_errors));
-    printf("Transfer duration     : %0.2f seconds\n", time_secs);
-    printf("Total packet data     : %0.2f Mbit\n", mbit_thru);
-    printf("Goodput data          : %0.2f Mbit\n", mbit_good);
-    printf("File data             : %0.2f Mbit\n", mbit_file);
-    printf("Throughput            : %0.2f Mbps\n", mbit_thru / time_secs);
-    printf("Goodput w/ restarts   : %0.2f Mbps\n", mbit_good / time_secs);
-    printf("Final file rate       : %0.2f Mbps\n", mbit_file / time_secs);
-    printf("Transfer mode         : ");
-    if (session->parameter->lossless) {
-        if (xfer->stats.total_lost == 0) {
-           printf("lossless\n");
-        } else {
-           printf("lossless mode - but lost count=%u > 0, please file a bug report!!\n", xfer->stats.total_lost);
-        }
-    } else { 
-        if (session->parameter->losswindow_ms == 0) {
-            printf("lossy\n");
-        } else {
-            printf("semi-lossy, time window %d ms\n", session->parameter->losswindow_ms);
-        }
-        printf("Data blocks lost      : %llu (%.2f%% of data) per user-specified time window constraint\n",
-                  (ull_t)xfer->stats.total_lost, ( 100.0 * xfer->stats.total_lost ) / xfer->block_count );
-    }
-    printf("\n");
+    time_secs = delta / 1e6;
+    mbit_file = 8.0 * xfer->file_size / (1024.0*1024.0);
+    if (!session->parameter->embedded)
+        show_report(session, time_secs);
 
     /* update the transcript */
     if (session->parameter->transcript_yn) {
@@ -697,10 +850,20 @@ int command_get(command_t *command, ttp_session_t *session)
 
     /* deallocate memory */
     ring_destroy(xfer->ring_buffer);
+    spill_destroy(xfer->spill_buffer);  xfer->spill_buffer = NULL;
+    super_destroy(xfer->super_cache);   xfer->super_cache  = NULL;
+    fec_destroy(xfer->fec_cache);       xfer->fec_cache    = NULL;
+    stream_destroy(xfer->stream);       xfer->stream       = NULL;
+    bundle_destroy(xfer->bundle);       xfer->bundle       = NULL;
     if (rexmit->table != NULL)  { free(rexmit->table);   rexmit->table  = NULL; }
-    if (xfer->received != NULL) { free(xfer->received);  xfer->received = NULL; }
+    blockmap_destroy(xfer->received);  xfer->received = NULL;
+    blockmap_destroy(xfer->written);   xfer->written  = NULL;
     if (local_datagram != NULL) { free(local_datagram);  local_datagram = NULL; }
 
+    /* remember how this server did */
+    if (session->parameter->profile)
+        profile_save(session, 8.0 * xfer->file_size / time_secs, time_secs);
+
     /* update the target rate */
     if (session->parameter->rate_adjust) {
         session->parameter->target_rate = 1.15 * 1e6 * (mbit_file / time_secs);
@@ -722,17 +885,126 @@ int command_get(command_t *command, ttp_session_t *session)
     return 0;
 
  abort:
+    g_error_trap = outer;
     fprintf(stderr, "Transfer not successful.  (WARNING: You may need to reconnect.)\n\n");
-    close(xfer->udp_fd);
+    if (!session->parameter->embedded) {
+        sigaction(SIGINT,  &old_int,  NULL);
+        sigaction(SIGTERM, &old_term, NULL);
+    }
+    if (xfer->udp_fd != session->udp_fd)
+        close(xfer->udp_fd);
+
+    /* have the disk thread write out what it holds, and keep a record of it for a later get */
+    if (disk_thread_id != 0) {
+        datagram = ring_reserve(xfer->ring_buffer);
+        if (datagram != NULL) {
+            *((u_int64_t *) datagram) = 0;
+            ring_confirm(xfer->ring_buffer);
+        }
+        pthread_join(disk_thread_id, NULL);
+        if (xfer->sink != NULL)
+            xfer->sink->close(session, 0);
+        if (resume_save(session) == 0)
+            fprintf(stderr, "Kept a record of the %llu blocks written, 'get' or 'resume' the file to continue.\n",
+                    (ull_t) blockmap_count(xfer->written));
+    }
     ring_destroy(xfer->ring_buffer);
+    spill_destroy(xfer->spill_buffer);  xfer->spill_buffer = NULL;
+    super_destroy(xfer->super_cache);   xfer->super_cache  = NULL;
+    fec_destroy(xfer->fec_cache);       xfer->fec_cache    = NULL;
+    stream_destroy(xfer->stream);       xfer->stream       = NULL;
+    bundle_destroy(xfer->bundle);       xfer->bundle       = NULL;
     if (xfer->file     != NULL) { fclose(xfer->file);    xfer->file     = NULL; }
     if (rexmit->table  != NULL) { free(rexmit->table);   rexmit->table  = NULL; }
-    if (xfer->received != NULL) { free(xfer->received);  xfer->received = NULL; }
+    blockmap_destroy(xfer->received);  xfer->received = NULL;
+    blockmap_destroy(xfer->written);   xfer->written  = NULL;
     if (local_datagram != NULL) { free(local_datagram);  local_datagram = NULL; }    
+
+    /* a fatal error goes on where it was headed, now that the disk thread has stopped */
+    if (fatal && (outer != NULL))
+        longjmp(*outer, 1);
+    if (fatal)
+        exit(1);
     return -1;
 }
 
 
+/*------------------------------------------------------------------------
+ * void show_report(ttp_session_t *session, double time_secs);
+ *
+ * Prints the final statistics of the transfer just finished, which took
+ * the given number of seconds.
+ *------------------------------------------------------------------------*/
+void show_report(ttp_session_t *session, double time_secs)
+{
+    ttp_transfer_t *xfer = &(session->transfer);
+    double          mbit_thru, mbit_good, mbit_file;
+
+    mbit_thru     = 8.0 * xfer->stats.total_blocks * session->parameter->block_size;
+    mbit_good     = mbit_thru - 8.0 * xfer->stats.total_recvd_retransmits * session->parameter->block_size;
+    mbit_file     = 8.0 * xfer->file_size;
+    mbit_thru    /= (1024.0*1024.0);
+    mbit_good    /= (1024.0*1024.0);
+    mbit_file    /= (1024.0*1024.0);
+    printf("PC performance figure : %llu packets dropped (if high this indicates receiving PC overload)\n", 
+                                         (ull_t)(xfer->stats.this_udp_errors - xfer->stats.start_udp_errors));
+    printf("Transfer duration     : %0.2f seconds\n", time_secs);
+    printf("Total packet data     : %0.2f Mbit\n", mbit_thru);
+    printf("Goodput data          : %0.2f Mbit\n", mbit_good);
+    printf("File data             : %0.2f Mbit\n", mbit_file);
+    printf("Throughput            : %0.2f Mbps\n", mbit_thru / time_secs);
+    printf("Goodput w/ restarts   : %0.2f Mbps\n", mbit_good / time_secs);
+    printf("Final file rate       : %0.2f Mbps\n", mbit_file / time_secs);
+    if (xfer->spill_buffer != NULL) {
+        printf("Spilled blocks        : %llu (peak %llu held in spill)\n",
+               (ull_t)xfer->spill_buffer->total_spilled, (ull_t)xfer->spill_buffer->peak_data);
+    }
+    printf("Ring-full drops       : %llu\n", (ull_t)xfer->stats.total_dropped);
+    if (xfer->options & TS_OPT_CHECKSUM) {
+        printf("Corrupt blocks        : %llu (failed their checksum)\n", (ull_t)xfer->stats.total_corrupt);
+        if (xfer->verified < 0)
+            printf("File verification     : not done\n");
+        else if (xfer->verified)
+            printf("File verification     : ok (crc32c tree %08x)\n", xfer->digest);
+        else
+            printf("File verification     : MISMATCH (crc32c tree %08x, server has %08x)\n", xfer->digest, xfer->server_digest);
+    }
+    if (xfer->super_cache != NULL) {
+        printf("Super-block writes    : %llu (%u blocks per super-block)\n",
+               (ull_t)xfer->super_cache->total_writes, xfer->super_cache->blocks);
+    }
+    if (xfer->fec_cache != NULL) {
+        printf("Parity recoveries     : %llu (from %llu parity blocks)\n",
+               (ull_t)xfer->fec_cache->total_recovered, (ull_t)xfer->fec_cache->total_parity);
+    }
+    if (xfer->disk_usec > 0) {
+        printf("Sink                  : %s, %0.2f MB/s while writing\n", xfer->sink->name,
+               (xfer->disk_blocks * (double) session->parameter->block_size) / xfer->disk_usec);
+    }
+    if (xfer->stream != NULL) {
+        printf("Stream output         : %llu blocks (peak %llu held early, %llu lost as zeros)\n",
+               (ull_t)xfer->block_count, (ull_t)xfer->stream->peak, (ull_t)xfer->stream->total_zeroed);
+    }
+    printf("Transfer mode         : ");
+    if (session->parameter->lossless) {
+        if (xfer->stats.total_lost == 0) {
+           printf("lossless\n");
+        } else {
+           printf("lossless mode - but lost count=%llu > 0, please file a bug report!!\n", (ull_t)xfer->stats.total_lost);
+        }
+    } else { 
+        if (session->parameter->losswindow_ms == 0) {
+            printf("lossy\n");
+        } else {
+            printf("semi-lossy, time window %d ms\n", session->parameter->losswindow_ms);
+        }
+        printf("Data blocks lost      : %llu (%.2f%% of data) per user-specified time window constraint\n",
+                  (ull_t)xfer->stats.total_lost, ( 100.0 * xfer->stats.total_lost ) / xfer->block_count );
+    }
+    printf("\n");
+}
+
+
 /*------------------------------------------------------------------------
  * int command_help(command_t *command, ttp_session_t *session);
  *
@@ -745,7 +1017,7 @@ int command_help(command_t *command, ttp_session_t *session)
     /* if no command was supplied */
     if (command->count < 2) {
 	printf("Help is available for the following commands:\n\n");
-	printf("    close    connect    get    dir    help    quit    set\n\n");
+	printf("    close    connect    get    dir    help    quit    resume    set\n\n");
 	printf("Use 'help <command>' for help on an individual command.\n\n");
 
     /* handle the CLOSE command */
@@ -771,7 +1043,30 @@ int command_help(command_t *command, ttp_session_t *session)
 	printf("Attempts to retrieve the remote file with the given name using the\n");
 	printf("Tsunami file transfer protocol.  If the local filename is not\n");
 	printf("specified, the final part of the remote filename (after the last path\n");
-	printf("separator) will be used.\n\n");
+	printf("separator) will be used.  If an interrupted transfer left the local\n");
+	printf("file and a record of its blocks behind, the blocks are checked against\n");
+	printf("the server's copy and only the missing or differing ones are fetched.\n");
+	printf("With 'set delta yes', an existing local file without such a record is\n");
+	printf("compared with the server's copy block by block, and only the blocks\n");
+	printf("that differ are fetched.\n\n");
+	printf("A remote name of 'bundle:*', or 'bundle:' and a file or directory,\n");
+	printf("gets all shared files, or the file or the whole directory tree, as\n");
+	printf("one stream, which is split back into the files under the local name\n");
+	printf("as a directory, or the current directory.  With 'set bundle yes'\n");
+	printf("every 'get' asks for a bundle.\n\n");
+	printf("With 'set parallel <n>', a large file is split into up to n byte\n");
+	printf("ranges that are fetched over as many sessions at once, all into the\n");
+	printf("one local file, sharing the target rate between them.\n\n");
+
+    /* handle the RESUME command */
+    } else if (!strcasecmp(command->text[1], "resume")) {
+	printf("Usage: resume <remote-file>\n");
+	printf("       resume <remote-file> <local-file>\n\n");
+	printf("Continues an interrupted transfer of the remote file into the local\n");
+	printf("file, which is not truncated.  The blocks that the record left next to\n");
+	printf("the local file lists are taken as they are, without checking them, and\n");
+	printf("the server sends only the others.  During a transfer the record is\n");
+	printf("brought up to date every 'checkpoint' seconds.\n\n");
 
     /* handle the DIR command */
     } else if (!strcasecmp(command->text[1], "dir")) {
@@ -832,6 +1127,38 @@ int command_quit(command_t *command, ttp_session_t *session)
 }
 
 
+/*------------------------------------------------------------------------
+ * int command_resume(command_t *command, ttp_session_t *session);
+ *
+ * Continues an interrupted transfer of the remote file given in the
+ * command into the local file, which has to have the block record the
+ * earlier transfer left.  The recorded blocks are taken as they are
+ * and only the others are fetched.  Returns 0 on a successful transfer
+ * and nonzero on an error condition.
+ *------------------------------------------------------------------------*/
+int command_resume(command_t *command, ttp_session_t *session)
+{
+    const char *local_filename;
+
+    /* make sure that we have a single remote file name */
+    if ((command->count < 2) || !strcmp("*", command->text[1]))
+	return warn("Invalid command syntax (use 'help resume' for details)");
+
+    /* and that there is something to resume */
+    local_filename = (command->count >= 3) ? command->text[2] : strrchr(command->text[1], '/');
+    if (local_filename == NULL)
+	local_filename = command->text[1];
+    else if (command->count < 3)
+	++local_filename;
+    if (!resume_exists(local_filename)) {
+	sprintf(g_error, "No record of an interrupted transfer into '%s'", local_filename);
+	return warn(g_error);
+    }
+
+    return get_files(command, session, 1);
+}
+
+
 /*------------------------------------------------------------------------
  * int command_set(command_t *command, ttp_parameter_t *parameter);
  *
@@ -842,6 +1169,31 @@ int command_quit(command_t *command, ttp_session_t *session)
 int command_set(command_t *command, ttp_parameter_t *parameter)
 {
     int do_all = (command->count == 1);
+    int word;
+
+    /* the stream may be a command of several words, put back together here */
+    if ((command->count >= 3) && !strcasecmp(command->text[1], "stream")) {
+        if (parameter->stream_to != NULL) free(parameter->stream_to);
+        parameter->stream_to = NULL;
+        if (strcasecmp(command->text[2], "none")) {
+            parameter->stream_to = (char *) calloc(MAX_COMMAND_LENGTH, 1);
+            if (parameter->stream_to == NULL) error("Could not update stream output");
+            for (word = 2; word < command->count; ++word) {
+                if (word > 2) strcat(parameter->stream_to, " ");
+                strcat(parameter->stream_to, command->text[word]);
+            }
+        }
+
+        /* a stream is written by the stream sink, which goes back to the default without one */
+        if (parameter->stream_to != NULL)
+            parameter->sink = sink_find("stream");
+        else if (!strcmp(parameter->sink->name, "stream"))
+            parameter->sink = sink_find(DEFAULT_SINK);
+
+        /* keep our messages out of the data from now on */
+        if ((parameter->stream_to != NULL) && !strcmp(parameter->stream_to, "-") && (stream_stdout() == NULL))
+            warn("Could not take over standard output for the stream");
+    }
 
     /* handle actual set operations first */
     if (command->count == 3) {
@@ -851,8 +1203,11 @@ int command_set(command_t *command, ttp_parameter_t *parameter)
         if (parameter->server_name == NULL) error("Could not update server name");
     } else if (!strcasecmp(command->text[1], "port"))       parameter->server_port   = atoi(command->text[2]);
       else if (!strcasecmp(command->text[1], "udpport"))    parameter->client_port   = atoi(command->text[2]);
-      else if (!strcasecmp(command->text[1], "buffer"))     parameter->udp_buffer    = atol(command->text[2]);
-      else if (!strcasecmp(command->text[1], "blocksize"))  parameter->block_size    = atol(command->text[2]);
+      else if (!strcasecmp(command->text[1], "buffer"))     parameter->udp_buffer    = strcasecmp(command->text[2], "auto") ? atol(command->text[2]) : 0;
+      else if (!strcasecmp(command->text[1], "blocksize")) {
+        parameter->block_auto = (strcasecmp(command->text[2], "auto") == 0);
+        if (!parameter->block_auto) parameter->block_size = atol(command->text[2]);
+    }
       else if (!strcasecmp(command->text[1], "verbose"))    parameter->verbose_yn    = (strcmp(command->text[2], "yes") == 0);
       else if (!strcasecmp(command->text[1], "transcript")) parameter->transcript_yn = (strcmp(command->text[2], "yes") == 0);
       else if (!strcasecmp(command->text[1], "ip"))         parameter->ipv6_yn       = (strcmp(command->text[2], "v6")  == 0);
@@ -878,6 +1233,34 @@ int command_set(command_t *command, ttp_parameter_t *parameter)
       else if (!strcasecmp(command->text[1], "lossless"))     parameter->lossless      = (strcmp(command->text[2], "yes") == 0);
       else if (!strcasecmp(command->text[1], "losswindow"))   parameter->losswindow_ms = atol(command->text[2]);
       else if (!strcasecmp(command->text[1], "blockdump"))    parameter->blockdump     = (strcmp(command->text[2], "yes") == 0);    
+      else if (!strcasecmp(command->text[1], "spill"))        parameter->spill_mb      = atol(command->text[2]);
+      else if (!strcasecmp(command->text[1], "probe"))        parameter->probe         = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "superblock"))   parameter->super_kb      = atol(command->text[2]);
+      else if (!strcasecmp(command->text[1], "checksum"))     parameter->checksum      = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "checkpoint"))   parameter->checkpoint    = atol(command->text[2]);
+      else if (!strcasecmp(command->text[1], "delta"))        parameter->delta         = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "sparse"))       parameter->sparse        = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "compress"))     parameter->compress      = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "fec"))          parameter->fec           = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "multicast"))    parameter->multicast     = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "follow"))       parameter->follow        = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "bundle"))       parameter->bundle        = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "parallel"))     parameter->parallel      = max(1, min(atol(command->text[2]), PARALLEL_MAX));
+      else if (!strcasecmp(command->text[1], "profile"))      parameter->profile       = (strcmp(command->text[2], "yes") == 0);
+      else if (!strcasecmp(command->text[1], "sink")) {
+        if (sink_find(command->text[2]) == NULL)
+            warn("No such sink, choose stdio, pwrite, mmap, null, hash or stream");
+        else
+            parameter->sink = sink_find(command->text[2]);
+      }
+      else if (!strcasecmp(command->text[1], "spilldir")) {
+        if (parameter->spill_dir != NULL) free(parameter->spill_dir);
+        parameter->spill_dir = NULL;
+        if (strcasecmp(command->text[2], "ram")) {
+            parameter->spill_dir = strdup(command->text[2]);
+            if (parameter->spill_dir == NULL) error("Could not update spill directory");
+        }
+      }
       else if (!strcasecmp(command->text[1], "passphrase")) {
         if (parameter->passphrase != NULL) free(parameter->passphrase);
         parameter->passphrase = strdup(command->text[2]);
@@ -885,12 +1268,19 @@ int command_set(command_t *command, ttp_parameter_t *parameter)
       }
     }
 
+    /* a program we are embedded in reads the values itself */
+    if (parameter->embedded)
+        return 0;
+
     /* report on current values */
     if (do_all || !strcasecmp(command->text[1], "server"))     printf("server = %s\n",      parameter->server_name);
     if (do_all || !strcasecmp(command->text[1], "port"))       printf("port = %u\n",        parameter->server_port);
     if (do_all || !strcasecmp(command->text[1], "udpport"))    printf("udpport = %u\n",     parameter->client_port);
-    if (do_all || !strcasecmp(command->text[1], "buffer"))     printf("buffer = %u\n",      parameter->udp_buffer);
-    if (do_all || !strcasecmp(command->text[1], "blocksize"))  printf("blocksize = %u\n",   parameter->block_size);
+    if (do_all || !strcasecmp(command->text[1], "buffer")) {
+        if (parameter->udp_buffer) printf("buffer = %u\n", parameter->udp_buffer);
+        else                       printf("buffer = auto\n");
+    }
+    if (do_all || !strcasecmp(command->text[1], "blocksize"))  printf("blocksize = %u%s\n", parameter->block_size, parameter->block_auto ? " (auto)" : "");
     if (do_all || !strcasecmp(command->text[1], "verbose"))    printf("verbose = %s\n",     parameter->verbose_yn    ? "yes" : "no");
     if (do_all || !strcasecmp(command->text[1], "transcript")) printf("transcript = %s\n",  parameter->transcript_yn ? "yes" : "no");
     if (do_all || !strcasecmp(command->text[1], "ip"))         printf("ip = %s\n",          parameter->ipv6_yn       ? "v6"  : "v4");
@@ -904,6 +1294,23 @@ int command_set(command_t *command, ttp_parameter_t *parameter)
     if (do_all || !strcasecmp(command->text[1], "lossless"))   printf("lossless = %s\n",    parameter->lossless ? "yes" : "no");
     if (do_all || !strcasecmp(command->text[1], "losswindow")) printf("losswindow = %d msec\n", parameter->losswindow_ms);
     if (do_all || !strcasecmp(command->text[1], "blockdump"))  printf("blockdump = %s\n",   parameter->blockdump ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "spill"))      printf("spill = %u MB\n",    parameter->spill_mb);
+    if (do_all || !strcasecmp(command->text[1], "probe"))      printf("probe = %s\n",       parameter->probe ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "superblock")) printf("superblock = %u kB\n", parameter->super_kb);
+    if (do_all || !strcasecmp(command->text[1], "checksum"))   printf("checksum = %s\n",    parameter->checksum ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "checkpoint")) printf("checkpoint = %u sec\n", parameter->checkpoint);
+    if (do_all || !strcasecmp(command->text[1], "delta"))      printf("delta = %s\n",       parameter->delta ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "sparse"))     printf("sparse = %s\n",      parameter->sparse ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "compress"))   printf("compress = %s\n",    parameter->compress ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "fec"))        printf("fec = %s\n",         parameter->fec ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "multicast"))  printf("multicast = %s\n",   parameter->multicast ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "follow"))     printf("follow = %s\n",      parameter->follow ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "sink"))       printf("sink = %s\n",        parameter->sink->name);
+    if (do_all || !strcasecmp(command->text[1], "bundle"))     printf("bundle = %s\n",      parameter->bundle ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "parallel"))   printf("parallel = %u\n",    parameter->parallel);
+    if (do_all || !strcasecmp(command->text[1], "profile"))    printf("profile = %s\n",     parameter->profile ? "yes" : "no");
+    if (do_all || !strcasecmp(command->text[1], "spilldir"))   printf("spilldir = %s\n",    (parameter->spill_dir == NULL) ? "ram" : parameter->spill_dir);
+    if (do_all || !strcasecmp(command->text[1], "stream"))     printf("stream = %s\n",      (parameter->stream_to == NULL) ? "none" : parameter->stream_to);
     if (do_all || !strcasecmp(command->text[1], "passphrase")) printf("passphrase = %s\n",  (parameter->passphrase == NULL) ? "default" : "<user-specified>");
     printf("\n");
 
@@ -923,34 +1330,136 @@ void *disk_thread(void *arg)
 {
     ttp_session_t *session = (ttp_session_t *) arg;
     u_char        *datagram;
+    u_char        *volatile spilled = NULL;
+    u_char        *volatile unpacked = NULL;
     int            status;
-    u_int32_t      block_index;
-    u_int16_t      block_type;
+    u_int64_t      block_index;
+    struct timeval busy_start;
+    struct timeval last_checkpoint;
+    sigset_t       signals;
+    jmp_buf        trap;
+
+    /* interrupts are for the network thread, which may be waiting for data */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    /* a fatal error in here fails the writes, which the network thread notices and aborts the transfer on;
+     * the buffers are volatile, as they are freed after it */
+    g_error_trap = &trap;
+    if (setjmp(trap) != 0) {
+	session->transfer.disk_failed = 1;
+	goto done;
+    }
+
+    /* buffer for blocks coming back out of the spill */
+    if (session->transfer.spill_buffer != NULL) {
+	spilled = (u_char *) malloc(TS_HEADER_SIZE + session->parameter->block_size);
+	if (spilled == NULL)
+	    error("Could not allocate spill datagram buffer in disk_thread()");
+    }
+
+    /* buffer for unpacking blocks the server sent compressed */
+    if (session->transfer.options & TS_OPT_COMPRESS) {
+	unpacked = (u_char *) malloc(session->parameter->block_size);
+	if (unpacked == NULL)
+	    error("Could not allocate unpacking buffer in disk_thread()");
+    }
 
     /* while the world is turning */
+    gettimeofday(&last_checkpoint, NULL);
     while (1) {
 
+	/* record what is on disk now and then, so a crash costs little */
+	if (session->parameter->checkpoint && (get_usec_since(&last_checkpoint) > 1000000LL * session->parameter->checkpoint)) {
+	    resume_save(session);
+	    gettimeofday(&last_checkpoint, NULL);
+	}
+
+	/* merge back the overflow first, it only grows while the ring is full */
+	if (spill_drain(session, spilled, unpacked) < 0) {
+	    session->transfer.disk_failed = 1;
+	    break;
+	}
+
 	/* get another block */
 	datagram    = ring_peek(session->transfer.ring_buffer);
-	block_index = ntohl(*((u_int32_t *) datagram));
-	block_type  = ntohs(*((u_int16_t *) (datagram + 4)));
+	block_index = ntohll(*((u_int64_t *) datagram));
 
-	/* quit if we got the mythical 0 block */
+	/* quit if we got the mythical 0 block, after the last spilled blocks */
 	if (block_index == 0) {
-	    printf("!!!!\n");
-	    return NULL;
+	    if ((spill_drain(session, spilled, unpacked) < 0) || (super_flush(session) < 0)) {
+		warn("Could not write out the last super-blocks");
+		session->transfer.disk_failed = 1;
+	    }
+	    if (!session->parameter->embedded)
+		printf("!!!!\n");
+	    break;
 	}
 
-	/* save it to disk */
-	status = accept_block(session, block_index, datagram + 6);
+	/* save it to disk, timing it for the flow-control feedback */
+	gettimeofday(&busy_start, NULL);
+	status = accept_datagram(session, datagram, unpacked);
 	if (status < 0) {
 	    warn("Block accept failed");
-	    return NULL;
+	    session->transfer.disk_failed = 1;
+	    break;
 	}
+	session->transfer.disk_usec += get_usec_since(&busy_start);
+	session->transfer.disk_blocks++;
 
 	/* pop the block */
 	ring_pop(session->transfer.ring_buffer);
     }
+
+ done:
+    /* nothing drains the ring from here on, so never leave the network thread waiting for space */
+    ring_abandon(session->transfer.ring_buffer);
+    if (spilled != NULL)
+	free(spilled);
+    if (unpacked != NULL)
+	free(unpacked);
+    return NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * void interrupt_get(int signum);
+ *
+ * Signal handler that notes that the user wants the transfer in progress
+ * to stop.  The receive loop notices and leaves through its abort path.
+ *------------------------------------------------------------------------*/
+void interrupt_get(int signum)
+{
+    interrupted = 1;
+}
+
+
+/*------------------------------------------------------------------------
+ * int spill_drain(ttp_session_t *session, u_char *datagram,
+ *                 u_char *scratch);
+ *
+ * Writes all blocks currently held in the overflow spill to disk, using
+ * the given datagram buffer as scratch space, and the given block buffer
+ * for unpacking compressed blocks.  Returns 0 on success and nonzero on
+ * error.
+ *------------------------------------------------------------------------*/
+int spill_drain(ttp_session_t *session, u_char *datagram, u_char *scratch)
+{
+    int            status;
+    struct timeval busy_start;
+
+    while ((status = spill_pop(session->transfer.spill_buffer, datagram)) > 0) {
+	gettimeofday(&busy_start, NULL);
+	status = accept_datagram(session, datagram, scratch);
+	if (status < 0)
+	    return warn("Spilled block accept failed");
+	session->transfer.disk_usec += get_usec_since(&busy_start);
+	session->transfer.disk_blocks++;
+    }
+
+    return status;
 }
 
 
@@ -981,15 +1490,15 @@ int parse_fraction(const char *fraction, u_int16_t *num, u_int16_t *den)
 
 
 /*------------------------------------------------------------------------
- * int got_block(ttp_session_t* session, u_int32_t blocknr)
+ * int got_block(ttp_session_t* session, u_int64_t blocknr)
  *
  * Returns non-0 if the block has already been received
  *------------------------------------------------------------------------*/
-int got_block(ttp_session_t* session, u_int32_t blocknr)
+int got_block(ttp_session_t* session, u_int64_t blocknr)
 {
     if (blocknr > session->transfer.block_count)
         return 1;
-    return (session->transfer.received[blocknr / 8] & (1 << (blocknr % 8)));
+    return blockmap_get(session->transfer.received, blocknr);
 }
 
 /*------------------------------------------------------------------------
@@ -1008,11 +1517,11 @@ void dump_blockmap(const char *postfix, const ttp_transfer_t *xfer)
     strcpy(fname, xfer->local_filename);
     strcat(fname, postfix);
 
-    /* write: [4 bytes block_count] [map byte 0] [map byte 1] ... [map N (partial final byte)] */
+    /* write: [8 bytes block_count] [map byte 0] [map byte 1] ... [map N (partial final byte)] */
     fbits = fopen(fname, "wb");
     if (fbits != NULL) {
         fwrite(&xfer->block_count, sizeof(xfer->block_count), 1, fbits);
-        fwrite(xfer->received, sizeof(u_char), xfer->block_count / 8 + 1, fbits);
+        blockmap_write(xfer->received, fbits);
         fclose(fbits);
     } else {
         fprintf(stderr, "Could not create a file for the blockmap dump");
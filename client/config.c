@@ -75,7 +75,7 @@ const int        DEFAULT_TABLE_SIZE    = 4096;         /* initial size of the re
 const char      *DEFAULT_SERVER_NAME   = "localhost";  /* default name of the remote server            */
 const u_int16_t  DEFAULT_SERVER_PORT   = TS_TCP_PORT;  /* default TCP port of the remote server        */
 const u_int16_t  DEFAULT_CLIENT_PORT   = TS_UDP_PORT;  /* default UDP port of the client               */
-const u_int32_t  DEFAULT_UDP_BUFFER    = 20000000;     /* default size of the UDP receive buffer       */
+const u_int32_t  DEFAULT_UDP_BUFFER    = 20000000;     /* least size of an automatic receive buffer    */
 const u_char     DEFAULT_VERBOSE_YN    = 1;            /* the default verbosity setting                */
 const u_char     DEFAULT_TRANSCRIPT_YN = 0;            /* the default transcript setting               */
 const u_char     DEFAULT_IPV6_YN       = 0;            /* the default IPv6 setting                     */
@@ -93,6 +93,22 @@ const u_char     DEFAULT_LOSSLESS      = 1;            /* default to lossless tr
 const u_int32_t  DEFAULT_LOSSWINDOW_MS = 1000;         /* default time window (msec) for semi-lossless */
 
 const u_char     DEFAULT_BLOCKDUMP     = 0;            /* on default do not write bitmap dump to file  */
+const u_int32_t  DEFAULT_SPILL_MB      = 0;            /* on default no overflow spill buffer          */
+const u_char     DEFAULT_PROBE         = 0;            /* on default start at the target rate          */
+const u_char     DEFAULT_PROFILE       = 0;            /* on default no per-server profile cache       */
+const u_char     DEFAULT_BLOCK_AUTO    = 0;            /* on default use the block size as set         */
+const u_int32_t  DEFAULT_SUPER_KB      = 0;            /* on default no super-blocks                   */
+const u_char     DEFAULT_CHECKSUM      = 0;            /* on default trust the UDP checksums           */
+const u_int32_t  DEFAULT_CHECKPOINT    = 30;           /* default seconds between records of the blocks */
+const u_char     DEFAULT_DELTA         = 0;            /* on default overwrite an existing local file  */
+const u_char     DEFAULT_SPARSE        = 1;            /* on default leave out the holes of a file     */
+const u_char     DEFAULT_COMPRESS      = 0;            /* on default blocks are sent uncompressed      */
+const u_char     DEFAULT_FEC           = 0;            /* on default no parity blocks are sent         */
+const u_char     DEFAULT_MULTICAST     = 0;            /* on default every client gets its own stream  */
+const u_char     DEFAULT_FOLLOW        = 0;            /* on default a file is sent as it is now       */
+const char      *DEFAULT_SINK          = "stdio";      /* default backend the blocks are written to    */
+const u_char     DEFAULT_BUNDLE        = 0;            /* on default 'get *' gets the files one by one */
+const u_int32_t  DEFAULT_PARALLEL      = 1;            /* on default a file comes over one session     */
 
 const int        MAX_COMMAND_LENGTH    = 1024;         /* maximum length of a single command           */
 
@@ -107,6 +123,10 @@ void reset_client(ttp_parameter_t *parameter)
     /* free the previous hostname if necessary */
     if (parameter->server_name != NULL)
 	free(parameter->server_name);
+    if (parameter->spill_dir != NULL)
+	free(parameter->spill_dir);
+    if (parameter->stream_to != NULL)
+	free(parameter->stream_to);
 
     /* zero out the memory structure */
     memset(parameter, 0, sizeof(*parameter));
@@ -116,7 +136,7 @@ void reset_client(ttp_parameter_t *parameter)
     parameter->server_name   = strdup(DEFAULT_SERVER_NAME);
     parameter->server_port   = DEFAULT_SERVER_PORT;
     parameter->client_port   = DEFAULT_CLIENT_PORT;
-    parameter->udp_buffer    = DEFAULT_UDP_BUFFER;
+    parameter->udp_buffer    = 0;  /* sized from the path */
     parameter->verbose_yn    = DEFAULT_VERBOSE_YN;
     parameter->transcript_yn = DEFAULT_TRANSCRIPT_YN;
     parameter->ipv6_yn       = DEFAULT_IPV6_YN;
@@ -132,6 +152,22 @@ void reset_client(ttp_parameter_t *parameter)
     parameter->lossless      = DEFAULT_LOSSLESS;
     parameter->losswindow_ms = DEFAULT_LOSSWINDOW_MS;
     parameter->blockdump     = DEFAULT_BLOCKDUMP;
+    parameter->spill_mb      = DEFAULT_SPILL_MB;
+    parameter->probe         = DEFAULT_PROBE;
+    parameter->profile       = DEFAULT_PROFILE;
+    parameter->block_auto    = DEFAULT_BLOCK_AUTO;
+    parameter->super_kb      = DEFAULT_SUPER_KB;
+    parameter->checksum      = DEFAULT_CHECKSUM;
+    parameter->checkpoint    = DEFAULT_CHECKPOINT;
+    parameter->delta         = DEFAULT_DELTA;
+    parameter->sparse        = DEFAULT_SPARSE;
+    parameter->compress      = DEFAULT_COMPRESS;
+    parameter->fec           = DEFAULT_FEC;
+    parameter->multicast     = DEFAULT_MULTICAST;
+    parameter->follow        = DEFAULT_FOLLOW;
+    parameter->bundle        = DEFAULT_BUNDLE;
+    parameter->parallel      = DEFAULT_PARALLEL;
+    parameter->sink          = sink_find(DEFAULT_SINK);
 
     /* make sure the strdup() worked */
     if (parameter->server_name == NULL)
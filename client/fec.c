@@ -0,0 +1,208 @@
+/*========================================================================
+ * fec.c  --  Parity recovery routines for Tsunami client.
+ *
+ * This contains routines for forward error correction.  The server
+ * follows each group of consecutive original blocks with a parity
+ * block, the XOR of the data of the group as sent.  The receive loop
+ * keeps the blocks of the last few groups, and when a parity block
+ * finds just one block of its group missing, that block is rebuilt on
+ * the spot instead of waiting for a retransmission round trip.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <stdlib.h>   /* for malloc(), free(), etc.   */
+#include <string.h>   /* for memcpy(), memset()       */
+
+#include <tsunami-client.h>
+
+
+/*------------------------------------------------------------------------
+ * fec_cache_t *fec_create(ttp_session_t *session);
+ *
+ * Creates the parity recovery state for the transfer in the given
+ * session and returns a pointer to the new data structure.  Returns
+ * NULL if the server does not send parity blocks.
+ *------------------------------------------------------------------------*/
+fec_cache_t *fec_create(ttp_session_t *session)
+{
+    fec_cache_t *cache;
+
+    /* see if parity blocks are coming at all */
+    if (!(session->transfer.options & TS_OPT_FEC))
+	return NULL;
+
+    /* try to allocate the structure and the block slots */
+    cache = (fec_cache_t *) calloc(1, sizeof(*cache));
+    if (cache == NULL)
+	error("Could not allocate parity recovery object");
+    cache->block_size = session->parameter->block_size;
+    cache->block      = (u_int64_t *) calloc(FEC_CACHE_SLOTS, sizeof(u_int64_t));
+    cache->packed     = (u_char *)    calloc(FEC_CACHE_SLOTS, 1);
+    cache->data       = (u_char *)    malloc((u_int64_t) FEC_CACHE_SLOTS * cache->block_size);
+    if ((cache->block == NULL) || (cache->packed == NULL) || (cache->data == NULL))
+	error("Could not allocate parity recovery slots");
+
+    /* and return the new structure */
+    return cache;
+}
+
+
+/*------------------------------------------------------------------------
+ * int fec_destroy(fec_cache_t *cache);
+ *
+ * Frees the given parity recovery state, which may be NULL.  Returns 0.
+ *------------------------------------------------------------------------*/
+int fec_destroy(fec_cache_t *cache)
+{
+    if (cache == NULL)
+	return 0;
+
+    free(cache->block);
+    free(cache->packed);
+    free(cache->data);
+    free(cache);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * void fec_store(fec_cache_t *cache, const u_char *datagram,
+ *                u_int32_t length);
+ *
+ * Keeps the data of the block in the given datagram, of which the
+ * header and data take up the given length, for parity recovery.  The
+ * data is kept as it arrived, packed or not, and zeroed past the
+ * length, which is how the server adds it to the parity.
+ *------------------------------------------------------------------------*/
+void fec_store(fec_cache_t *cache, const u_char *datagram, u_int32_t length)
+{
+    u_int64_t block = ntohll(*((u_int64_t *) datagram));
+    u_int32_t slot  = block % FEC_CACHE_SLOTS;
+    u_char   *data  = cache->data + (u_int64_t) slot * cache->block_size;
+
+    length -= TS_HEADER_SIZE;
+    memcpy(data, datagram + TS_HEADER_SIZE, length);
+    memset(data + length, 0, cache->block_size - length);
+    cache->block[slot]  = block;
+    cache->packed[slot] = (ntohs(*((u_int16_t *) (datagram + 8))) & TS_BLOCK_COMPRESSED) != 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int fec_recover(ttp_session_t *session, u_char *datagram);
+ *
+ * Tries to rebuild the one missing block of the group covered by the
+ * parity block in the given datagram.  This works when every other
+ * block of the group has been received and is still kept.  The
+ * datagram is then turned into the rebuilt block, typed as a
+ * retransmission and flagged packed if the lost block was, and the
+ * block is kept too.  Returns 1 if a block was rebuilt and 0 if not.
+ *------------------------------------------------------------------------*/
+int fec_recover(ttp_session_t *session, u_char *datagram)
+{
+    fec_cache_t *cache   = session->transfer.fec_cache;
+    u_int64_t    first   = ntohll(*((u_int64_t *) datagram));
+    u_int16_t    type    = ntohs(*((u_int16_t *) (datagram + 8)));
+    u_int32_t    count   = (type >> TS_PARITY_SHIFT) & FEC_GROUP_MAX;
+    u_int16_t    packed  = type & TS_PARITY_PACKED;
+    u_int64_t    missing = 0;
+    u_int64_t    block;
+    u_int32_t    slot;
+    u_int32_t    i;
+    u_char      *data;
+
+    cache->total_parity++;
+
+    /* find the missing block, giving up on two or on others not kept */
+    if (first + count - 1 > session->transfer.block_count)
+	return 0;
+    for (block = first; block < first + count; ++block) {
+	if (!got_block(session, block)) {
+	    if (missing)
+		return 0;
+	    missing = block;
+	} else if (cache->block[block % FEC_CACHE_SLOTS] != block) {
+	    return 0;
+	}
+    }
+    if (missing == 0)
+	return 0;
+
+    /* take the others out of the parity, which leaves the missing block */
+    for (block = first; block < first + count; ++block) {
+	if (block == missing)
+	    continue;
+	slot = block % FEC_CACHE_SLOTS;
+	data = cache->data + (u_int64_t) slot * cache->block_size;
+	for (i = 0; i < cache->block_size; ++i)
+	    datagram[TS_HEADER_SIZE + i] ^= data[i];
+	if (cache->packed[slot])
+	    packed ^= TS_PARITY_PACKED;
+    }
+
+    /* and give it its own header */
+    *((u_int64_t *) (datagram + 0)) = htonll(missing);
+    *((u_int16_t *) (datagram + 8)) = htons(TS_BLOCK_RETRANSMISSION | (packed ? TS_BLOCK_COMPRESSED : 0));
+    fec_store(cache, datagram, TS_HEADER_SIZE + cache->block_size);
+    cache->total_recovered++;
+    return 1;
+}
+
+
+/*========================================================================
+ * $Log: fec.c,v $
+ */
@@ -64,17 +64,17 @@
 
 /*------------------------------------------------------------------------
  * int accept_block(ttp_session_t *session,
- *                  u_int32_t block_index, u_char *block);
+ *                  u_int64_t block_index, u_char *block);
  *
  * Accepts the given block of data, which involves writing the block
- * to disk.  Returns 0 on success and nonzero on failure.
+ * to the sink of the transfer.  Returns 0 on success and nonzero on
+ * failure.
  *------------------------------------------------------------------------*/
-int accept_block(ttp_session_t *session, u_int32_t block_index, u_char *block)
+int accept_block(ttp_session_t *session, u_int64_t block_index, u_char *block)
 {
     ttp_transfer_t  *transfer   = &session->transfer;
     u_int32_t        block_size = session->parameter->block_size;
     u_int32_t        write_size;
-    int              status;
     #ifdef VSIB_REALTIME
     u_int32_t       ringbuf_pointer;
     #endif
@@ -98,28 +98,66 @@ int accept_block(ttp_session_t *session, u_int32_t block_index, u_char *block)
     /* check if we need to feed the VSIB */
     write_vsib_block(session, block, write_size);
     #endif
- 
-    #ifndef DEBUG_DISKLESS
-    /* seek to the proper location */
-    status = fseeko(transfer->file, ((u_int64_t) block_size) * (block_index - 1), SEEK_SET);
-    if (status < 0) {
-        sprintf(g_error, "Could not seek at block %d of file", block_index);
-        return warn(g_error);
-    }
 
-    /* write the block to disk */
-    status = fwrite(block, 1, write_size, transfer->file);
-    if (status < write_size) {
-        sprintf(g_error, "Could not write block %d of file", block_index);
+    /* in super-block mode the block waits for the rest of its super-block */
+    if (transfer->super_cache != NULL)
+        return super_accept(session, block_index, block);
+
+    #ifndef DEBUG_DISKLESS
+    /* hand the block to the sink */
+    if (transfer->sink->write_block(session, block_index, block, write_size) < 0) {
+        sprintf(g_error, "Could not write block %llu of file", (ull_t) block_index);
         return warn(g_error);
     }
     #endif
 
+    /* note it for the block record, which may have to grow with a followed file */
+    if ((transfer->written != NULL) && (block_index > transfer->written->blocks) && (blockmap_grow(transfer->written, transfer->block_count) < 0))
+        return warn("Could not extend written-data bitfield");
+    if ((transfer->written != NULL) && (blockmap_set(transfer->written, block_index) < 0))
+        return warn("Could not allocate written-data bitfield page");
+
     /* we succeeded */
     return 0;
 }
 
 
+/*------------------------------------------------------------------------
+ * int accept_datagram(ttp_session_t *session, u_char *datagram,
+ *                     u_char *scratch);
+ *
+ * Accepts the block carried by the given datagram.  A block the server
+ * sent packed is first unpacked into the given scratch space of one
+ * block size, with the rest of it zeroed.  Returns 0 on success and
+ * nonzero on failure.
+ *------------------------------------------------------------------------*/
+int accept_datagram(ttp_session_t *session, u_char *datagram, u_char *scratch)
+{
+    u_int64_t block_index = ntohll(*((u_int64_t *) datagram));
+    u_int16_t block_type  = ntohs(*((u_int16_t *) (datagram + 8)));
+    u_int32_t block_size  = session->parameter->block_size;
+    u_int16_t packed;
+    int       length;
+
+    /* most blocks arrive as they are */
+    if (!(block_type & TS_BLOCK_COMPRESSED))
+        return accept_block(session, block_index, datagram + TS_HEADER_SIZE);
+
+    /* unpack the others */
+    memcpy(&packed, datagram + TS_HEADER_SIZE, TS_PACKED_SIZE);
+    packed = ntohs(packed);
+    length = (packed > block_size - TS_PACKED_SIZE) ? -1
+           : decompress_block(datagram + TS_HEADER_SIZE + TS_PACKED_SIZE, packed, scratch, block_size);
+    if (length < 0) {
+        sprintf(g_error, "Could not unpack block %llu", (ull_t) block_index);
+        return warn(g_error);
+    }
+    memset(scratch + length, 0, block_size - length);
+
+    return accept_block(session, block_index, scratch);
+}
+
+
 /*========================================================================
  * $Log: io.c,v $
  * Revision 1.7  2008/05/25 15:36:44  jwagnerhki
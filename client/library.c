@@ -0,0 +1,439 @@
+/*========================================================================
+ * library.c  --  Library interface of Tsunami client.
+ *
+ * This contains the client calls of libtsunami.h, which run the same
+ * connect, set and get commands as the tsunami program, on a parameter
+ * set and session of their own, without a report on standard output
+ * and with fatal errors caught and returned.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <setjmp.h>     /* for setjmp()                 */
+#include <stdio.h>      /* for snprintf()               */
+#include <stdlib.h>     /* for calloc(), free()         */
+#include <string.h>     /* for memset()                 */
+#include <unistd.h>     /* for close()                  */
+
+#include <tsunami-client.h>
+#include <libtsunami.h>
+
+
+/*------------------------------------------------------------------------
+ * Data structures.
+ *------------------------------------------------------------------------*/
+
+/* a client of the library */
+struct ts_client {
+    ttp_parameter_t     parameter;      /* the settings, as 'set' changes them        */
+    ttp_session_t      *session;        /* the connection to the server, NULL if none */
+    ts_progress_fn      progress;       /* the progress callback, NULL for none       */
+    void               *user;           /* the last argument of the progress callback */
+    ts_progress_t       result;         /* the state of the last transfer             */
+    char                error[MAX_ERROR_MESSAGE];  /* the message of the last error   */
+};
+
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static int  client_run      (ts_client_t *client, command_t *command, int (*call)(ts_client_t *, command_t *));
+static int  client_connect  (ts_client_t *client, command_t *command);
+static int  client_get      (ts_client_t *client, command_t *command);
+static int  client_set      (ts_client_t *client, command_t *command);
+static void client_drop     (ts_client_t *client);
+static int  client_progress (ttp_session_t *session);
+static void client_snapshot (ts_client_t *client, int done);
+
+
+/*------------------------------------------------------------------------
+ * ts_client_t *ts_client_create(void);
+ *
+ * Returns a new client with the default settings of the tsunami
+ * program, except that it is quiet, or NULL if there is no memory.
+ *------------------------------------------------------------------------*/
+ts_client_t *ts_client_create(void)
+{
+    ts_client_t *client = (ts_client_t *) calloc(1, sizeof(ts_client_t));
+
+    if (client == NULL)
+        return NULL;
+    reset_client(&client->parameter);
+    client->parameter.verbose_yn = 0;
+    client->parameter.embedded   = 1;
+    client->result.verified      = -1;
+    return client;
+}
+
+
+/*------------------------------------------------------------------------
+ * void ts_client_destroy(ts_client_t *client);
+ *
+ * Closes the connection of the given client, if it has one, and frees
+ * the client.
+ *------------------------------------------------------------------------*/
+void ts_client_destroy(ts_client_t *client)
+{
+    if (client == NULL)
+        return;
+    ts_client_close(client);
+    free(client->parameter.server_name);
+    free(client->parameter.spill_dir);
+    free(client->parameter.stream_to);
+    free(client->parameter.passphrase);
+    free(client);
+}
+
+
+/*------------------------------------------------------------------------
+ * int ts_client_set(ts_client_t *client, const char *name,
+ *                   const char *value);
+ *
+ * Changes a setting of the client, by the names and values of the
+ * 'set' command of the tsunami program.  Returns 0 on success and
+ * non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ts_client_set(ts_client_t *client, const char *name, const char *value)
+{
+    command_t command;
+
+    command.count   = 3;
+    command.text[0] = "set";
+    command.text[1] = name;
+    command.text[2] = value;
+    return client_run(client, &command, client_set);
+}
+
+
+/*------------------------------------------------------------------------
+ * void ts_client_progress(ts_client_t *client, ts_progress_fn progress,
+ *                         void *user);
+ *
+ * Has the given callback called with the given argument at every
+ * statistics update of the transfers to come, or no callback for NULL.
+ *------------------------------------------------------------------------*/
+void ts_client_progress(ts_client_t *client, ts_progress_fn progress, void *user)
+{
+    client->progress = progress;
+    client->user     = user;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ts_client_connect(ts_client_t *client, const char *host,
+ *                       u_int16_t port);
+ *
+ * Connects the client to the server at the given host and TCP port,
+ * closing the connection it had before.  Returns 0 on success and
+ * non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ts_client_connect(ts_client_t *client, const char *host, u_int16_t port)
+{
+    command_t command;
+    char      port_text[8];
+
+    ts_client_close(client);
+    snprintf(port_text, sizeof(port_text), "%u", port);
+    command.count   = 3;
+    command.text[0] = "connect";
+    command.text[1] = host;
+    command.text[2] = port_text;
+    return client_run(client, &command, client_connect);
+}
+
+
+/*------------------------------------------------------------------------
+ * int ts_client_get(ts_client_t *client, const char *remote,
+ *                   const char *local);
+ *
+ * Fetches the given remote file, or all files the server shares for
+ * "*", into the given local file, or the last part of the remote name
+ * for NULL, through the sink that is set.  Returns 0 on success and
+ * non-zero on failure; ts_client_result() tells how it went.
+ *------------------------------------------------------------------------*/
+int ts_client_get(ts_client_t *client, const char *remote, const char *local)
+{
+    command_t command;
+
+    command.count   = (local == NULL) ? 2 : 3;
+    command.text[0] = "get";
+    command.text[1] = remote;
+    command.text[2] = local;
+    return client_run(client, &command, client_get);
+}
+
+
+/*------------------------------------------------------------------------
+ * int ts_client_get_memory(ts_client_t *client, const char *remote,
+ *                          u_char *buffer, u_int64_t size);
+ *
+ * Fetches the given remote file into the given buffer of the given
+ * size, which the file has to fit into.  Returns 0 on success and
+ * non-zero on failure; the size of the file is in ts_client_result().
+ *------------------------------------------------------------------------*/
+int ts_client_get_memory(ts_client_t *client, const char *remote, u_char *buffer, u_int64_t size)
+{
+    ttp_parameter_t *param = &client->parameter;
+    const sink_t    *sink  = param->sink;
+    int              status;
+
+    param->sink             = sink_find("memory");
+    param->sink_memory      = buffer;
+    param->sink_memory_size = size;
+    status = ts_client_get(client, remote, NULL);
+    param->sink             = sink;
+    param->sink_memory      = NULL;
+    param->sink_memory_size = 0;
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ts_client_get_callback(ts_client_t *client, const char *remote,
+ *                            ts_write_fn write, void *user);
+ *
+ * Fetches the given remote file into the given callback, which gets
+ * the data with its offset in the file and the given argument as it
+ * arrives.  Returns 0 on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ts_client_get_callback(ts_client_t *client, const char *remote, ts_write_fn write, void *user)
+{
+    ttp_parameter_t *param = &client->parameter;
+    const sink_t    *sink  = param->sink;
+    int              status;
+
+    param->sink          = sink_find("callback");
+    param->sink_callback = write;
+    param->sink_user     = user;
+    status = ts_client_get(client, remote, NULL);
+    param->sink          = sink;
+    param->sink_callback = NULL;
+    param->sink_user     = NULL;
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ts_client_close(ts_client_t *client);
+ *
+ * Closes the connection of the client to its server.  Returns 0 on
+ * success and non-zero if there was none.
+ *------------------------------------------------------------------------*/
+int ts_client_close(ts_client_t *client)
+{
+    if (client->session == NULL)
+        return -1;
+    command_close(NULL, client->session);
+    client_drop(client);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * const ts_progress_t *ts_client_result(const ts_client_t *client);
+ *
+ * Returns the state of the last transfer of the client, as it ended.
+ *------------------------------------------------------------------------*/
+const ts_progress_t *ts_client_result(const ts_client_t *client)
+{
+    return &client->result;
+}
+
+
+/*------------------------------------------------------------------------
+ * const char *ts_client_error(const ts_client_t *client);
+ *
+ * Returns the message of the last call of the client that failed.
+ *------------------------------------------------------------------------*/
+const char *ts_client_error(const ts_client_t *client)
+{
+    return client->error;
+}
+
+
+/*------------------------------------------------------------------------
+ * static int client_run(ts_client_t *client, command_t *command,
+ *                       int (*call)(ts_client_t *, command_t *));
+ *
+ * Runs the given call with the given command, with the fatal errors of
+ * the client code caught.  Such an error leaves the connection in an
+ * unknown state, so it is dropped.  A transfer stops its disk thread
+ * before it passes the error on to us, and the disk thread and the
+ * sessions of a parallel get catch their own.  Keeps the message of a failure for
+ * ts_client_error().  Returns what the call returned, or -1 after a
+ * fatal error.
+ *------------------------------------------------------------------------*/
+static int client_run(ts_client_t *client, command_t *command, int (*call)(ts_client_t *, command_t *))
+{
+    jmp_buf  trap;
+    jmp_buf *outer = g_error_trap;
+    int      status;
+
+    g_error[0]   = '\0';
+    g_error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        status = call(client, command);
+    } else {
+        client_drop(client);
+        status = -1;
+    }
+    g_error_trap = outer;
+
+    if (status != 0)
+        snprintf(client->error, sizeof(client->error), "%s", (g_error[0] != '\0') ? g_error : "Unknown error");
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * The calls that client_run() runs.
+ *------------------------------------------------------------------------*/
+
+static int client_connect(ts_client_t *client, command_t *command)
+{
+    client->session = command_connect(command, &client->parameter);
+    return (client->session == NULL) ? -1 : 0;
+}
+
+static int client_get(ts_client_t *client, command_t *command)
+{
+    int status;
+
+    if (client->session != NULL) {
+        client->session->progress      = (client->progress != NULL) ? client_progress : NULL;
+        client->session->progress_data = client;
+    }
+    memset(&client->result, 0, sizeof(client->result));
+    client->result.verified = -1;
+    status = command_get(command, client->session);
+    if (client->session != NULL)
+        client_snapshot(client, 1);
+    return status;
+}
+
+static int client_set(ts_client_t *client, command_t *command)
+{
+    return command_set(command, &client->parameter);
+}
+
+
+/*------------------------------------------------------------------------
+ * static void client_drop(ts_client_t *client);
+ *
+ * Frees the session of the client, closing its connection if that is
+ * still open.
+ *------------------------------------------------------------------------*/
+static void client_drop(ts_client_t *client)
+{
+    ttp_session_t *session = client->session;
+
+    if (session == NULL)
+        return;
+    if (session->server != NULL)
+        fclose(session->server);
+    if (session->udp_fd >= 0)
+        close(session->udp_fd);
+    free(session->server_address);
+    free(session);
+    client->session = NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * static int client_progress(ttp_session_t *session);
+ *
+ * Passes a statistics update of the session on to the progress
+ * callback of its client.  Returns what the callback returned.
+ *------------------------------------------------------------------------*/
+static int client_progress(ttp_session_t *session)
+{
+    ts_client_t *client = (ts_client_t *) session->progress_data;
+
+    client_snapshot(client, 0);
+    return client->progress(&client->result, client->user);
+}
+
+
+/*------------------------------------------------------------------------
+ * static void client_snapshot(ts_client_t *client, int done);
+ *
+ * Copies the state of the transfer of the client into its result, the
+ * final state if done is set.
+ *------------------------------------------------------------------------*/
+static void client_snapshot(ts_client_t *client, int done)
+{
+    ttp_transfer_t *xfer   = &client->session->transfer;
+    ts_progress_t  *result = &client->result;
+
+    result->file_size   = xfer->file_size;
+    result->block_count = xfer->block_count;
+    result->blocks_left = xfer->blocks_left;
+    result->blocks_lost = done ? xfer->stats.total_lost : 0;
+    result->received    = xfer->stats.total_blocks;
+    result->retransmits = xfer->stats.total_retransmits;
+    result->seconds     = (done && (xfer->stats.stop_time.tv_sec != 0))
+                        ? tv_diff_usec(xfer->stats.stop_time, xfer->stats.start_time) / 1e6
+                        : get_usec_since(&xfer->stats.start_time) / 1e6;
+    result->rate_mbps   = xfer->stats.transmit_rate;
+    result->error_rate  = xfer->stats.error_rate;
+    result->verified    = done ? xfer->verified : -1;
+}
+
+
+/*========================================================================
+ * $Log: library.c,v $
+ */
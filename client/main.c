@@ -90,6 +90,7 @@ int main(int argc, const char *argv[])
    
     int argc_curr       = 1;                            /* command line argument currently to be processed */
     char *ptr_command_text = &command_text[0];
+    FILE *console       = stdout;                       /* where the prompt goes                           */
    
     /* reset the client */
     memset(&parameter, 0, sizeof(parameter));
@@ -106,6 +107,19 @@ int main(int argc, const char *argv[])
             PROTOCOL_REVISION, TSUNAMI_CVS_BUILDNR, __DATE__ , __TIME__);    
     #endif
 
+    /* a stream to standard output takes it over before any of our messages can get into the data */
+    for (argc_curr = 1; argc_curr + 2 < argc; ++argc_curr)
+        if (!strcasecmp(argv[argc_curr], "set") && !strcasecmp(argv[argc_curr + 1], "stream") && !strcmp(argv[argc_curr + 2], "-")) {
+            if (stream_stdout() == NULL)
+                warn("Could not take over standard output for the stream");
+            break;
+        }
+    argc_curr = 1;
+
+    /* a prompt into a pipe or file would only end up in what is captured there */
+    if (!isatty(STDOUT_FILENO))
+        console = stderr;
+
     /* while the command loop is still running */   
     while (1) {
 
@@ -113,8 +127,8 @@ int main(int argc, const char *argv[])
       if (argc<=1 || argc_curr>=argc) {
          
          /* present the prompt */
-         fprintf(stdout, "tsunami> ");
-         fflush(stdout);
+         fprintf(console, "tsunami> ");
+         fflush(console);
          /* read next command */
          
          if (fgets(command_text, MAX_COMMAND_LENGTH, stdin) == NULL) {
@@ -148,7 +162,7 @@ int main(int argc, const char *argv[])
                argc_curr += 2;
                break;
             }
-            if (!strcasecmp(argv[argc_curr], "get")) {
+            if (!strcasecmp(argv[argc_curr], "get") || !strcasecmp(argv[argc_curr], "resume")) {
                if (argc_curr+1 < argc) {
                   strcpy(ptr_command_text, argv[argc_curr]);
                   strcat(command_text, " ");
@@ -192,6 +206,7 @@ int main(int argc, const char *argv[])
            if (!strcasecmp(command.text[0], "close"))             command_close  (&command, session);
       else if (!strcasecmp(command.text[0], "connect")) session = command_connect(&command, &parameter);
       else if (!strcasecmp(command.text[0], "get"))               command_get    (&command, session);
+      else if (!strcasecmp(command.text[0], "resume"))            command_resume (&command, session);
       else if (!strcasecmp(command.text[0], "dir"))               command_dir    (&command, session);
       else if (!strcasecmp(command.text[0], "help"))              command_help   (&command, session);
       else if (!strcasecmp(command.text[0], "quit"))              command_quit   (&command, session);
@@ -163,8 +163,8 @@ int create_tcp_socket(ttp_session_t *session, const char *server_name, u_int16_t
  * int create_udp_socket(ttp_parameter_t *parameter);
  *
  * Establishes a new UDP socket for data transfer, returning the file
- * descriptor of the socket on success and -1 on error.  The parameter
- * structure is used for setting the size of the UDP receive buffer.
+ * descriptor of the socket on success and -1 on error.  The receive
+ * buffer is sized later by ttp_open_port().
  * This will be an IPv6 socket if ipv6_yn is true and an IPv4 socket
  * otherwise. The next available port starting from parameter->client_port 
  * will be taken, and the value of client_port is updated.
@@ -205,17 +205,12 @@ int create_udp_socket(ttp_parameter_t *parameter)
                 continue;
             }
             
-            /* set the receive buffer size */
-            status = setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &parameter->udp_buffer, sizeof(parameter->udp_buffer));
-            if (status < 0) {
-                warn("Error in resizing UDP receive buffer");
-            }
-            
             /* and try to bind it */
             status = bind(socket_fd, info->ai_addr, info->ai_addrlen);
             if (status == 0) {
                 parameter->client_port = ntohs(((struct sockaddr_in*)info->ai_addr)->sin_port);
-                fprintf(stderr, "Receiving data on UDP port %d\n", parameter->client_port);
+                if (!parameter->embedded)
+                    fprintf(stderr, "Receiving data on UDP port %d\n", parameter->client_port);
                 break;
             }
    
@@ -239,6 +234,55 @@ int create_udp_socket(ttp_parameter_t *parameter)
 }
 
 
+/*------------------------------------------------------------------------
+ * int create_mcast_socket(u_int32_t group, u_int16_t port);
+ *
+ * Establishes a new UDP socket that receives the datagrams sent to the
+ * given IPv4 multicast group (in network order) and port.  Other
+ * clients on this host may receive from the same group and port.
+ * Returns the file descriptor of the socket on success and -1 on error.
+ *------------------------------------------------------------------------*/
+int create_mcast_socket(u_int32_t group, u_int16_t port)
+{
+    struct sockaddr_in address;
+    struct ip_mreq     membership;
+    int                socket_fd;
+    int                yes = 1;
+
+    /* create the socket */
+    socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socket_fd < 0)
+        return warn("Error in creating multicast socket");
+
+    /* share the port with other receivers of the group */
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
+        close(socket_fd);
+        return warn("Error in configuring multicast socket");
+    }
+
+    /* bind to the group port */
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port        = htons(port);
+    if (bind(socket_fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        close(socket_fd);
+        return warn("Error in binding multicast socket");
+    }
+
+    /* and join the group */
+    membership.imr_multiaddr.s_addr = group;
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (setsockopt(socket_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+        close(socket_fd);
+        return warn("Error in joining multicast group");
+    }
+
+    fprintf(stderr, "Receiving data from multicast group %s port %d\n", inet_ntoa(membership.imr_multiaddr), port);
+    return socket_fd;
+}
+
+
 /*========================================================================
  * $Log: network.c,v $
  * Revision 1.10  2009/05/18 07:51:31  jwagnerhki
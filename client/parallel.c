@@ -0,0 +1,371 @@
+/*========================================================================
+ * parallel.c  --  Parallel get routines for Tsunami client.
+ *
+ * This contains the routines that fetch one large file over several
+ * sessions at once.  The file is split into byte ranges, one for each
+ * session, which the server sends as the whole file less the blocks
+ * outside the range (see TS_OPT_RANGE).  Every session runs in a thread
+ * of its own, against a server process of its own, and writes into the
+ * same local file, which is made its full size up front.  The sessions
+ * share the target rate: each one asks the server for no more than its
+ * share through the flow control reports.
+ *
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <fcntl.h>      /* for open()                   */
+#include <pthread.h>    /* for pthread_create()         */
+#include <signal.h>     /* for sigaction()              */
+#include <stdlib.h>     /* for calloc(), free()         */
+#include <string.h>     /* for strcmp(), strrchr()      */
+#include <sys/time.h>   /* for gettimeofday()           */
+#include <unistd.h>     /* for ftruncate(), close()     */
+
+#include <tsunami-client.h>
+
+
+/*------------------------------------------------------------------------
+ * Module-scope data.
+ *------------------------------------------------------------------------*/
+
+/* one session of a parallel get and the byte range it fetches */
+typedef struct {
+    parallel_t         *parallel;                 /* the parallel get it is part of              */
+    int                 slot;                     /* its index there                             */
+    ttp_parameter_t     parameter;                /* its own copy of the parameters              */
+    ttp_session_t      *session;                  /* its own session with the server             */
+    command_t           command;                  /* the get it runs                             */
+    u_int64_t           offset;                   /* the first byte of its range                 */
+    u_int64_t           length;                   /* the bytes in its range                      */
+    pthread_t           thread;                   /* the thread that runs it                     */
+    int                 started;                  /* 1 once that thread is running               */
+    int                 status;                   /* what the get returned                       */
+    double              secs;                     /* how long the get took                       */
+} parallel_chunk_t;
+
+static volatile sig_atomic_t parallel_interrupted = 0;  /* set when a signal cuts the get short */
+
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static void *parallel_chunk    (void *arg);
+static void  parallel_interrupt(int signum);
+
+
+/*------------------------------------------------------------------------
+ * int parallel_get(command_t *command, ttp_session_t *session);
+ *
+ * Gets the single remote file the command names over as many sessions
+ * as 'set parallel' allows, each fetching one byte range of it into the
+ * local file.  The session given only asks for the size of the file.
+ * Returns 0 on success, negative on an error condition, and 1 if the
+ * file is not one to split, such as a small one or one the server
+ * cannot tell the size of, which leaves it to the plain get.
+ *------------------------------------------------------------------------*/
+int parallel_get(command_t *command, ttp_session_t *session)
+{
+    ttp_parameter_t  *param = session->parameter;
+    parallel_t        parallel;
+    parallel_chunk_t *chunk;
+    const char       *local_filename;
+    u_int64_t         file_size, blocks, span;
+    u_int32_t         count, index;
+    struct timeval    start;
+    struct sigaction  interrupt, old_int, old_term;
+    double            secs, mbit_file;
+    int               fd, verified = 1, status = 0;
+
+    /* only a single file that goes into a local file is split up */
+    if ((session->server == NULL) || (command->count < 2) || !strcmp(command->text[1], "*") ||
+        !strncmp(command->text[1], BUNDLE_PREFIX, strlen(BUNDLE_PREFIX)) || param->bundle ||
+        !param->sink->local || param->multicast || param->follow)
+        return 1;
+
+    /* and only one that is large enough, which the server has to know the size of */
+    if (ttp_query_size(session, command->text[1], &file_size) < 0)
+        return warn("Could not ask for the size of the file");
+    if (file_size == ~0ULL)
+        return 1;
+    count = (u_int32_t) min((u_int64_t) min(param->parallel, PARALLEL_MAX), file_size / PARALLEL_MIN_CHUNK);
+    if (count < 2)
+        return 1;
+
+    /* the local name, as the plain get would pick it */
+    if (command->count >= 3) {
+        local_filename = command->text[2];
+    } else {
+        local_filename = strrchr(command->text[1], '/');
+        local_filename = (local_filename == NULL) ? command->text[1] : local_filename + 1;
+    }
+
+    /* every session writes into the one file, so it is made its full size first */
+    if (!access(local_filename, F_OK))
+        printf("Warning: overwriting existing file '%s'\n", local_filename);
+    fd = open(local_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if ((fd < 0) || (ftruncate(fd, file_size) < 0)) {
+        if (fd >= 0)
+            close(fd);
+        return warn("Could not create the local file");
+    }
+    close(fd);
+
+    /* the ranges are whole blocks, the last one takes what is left */
+    chunk = (parallel_chunk_t *) calloc(count, sizeof(parallel_chunk_t));
+    if (chunk == NULL)
+        error("Could not allocate the sessions of the parallel get");
+    memset(&parallel, 0, sizeof(parallel));
+    pthread_mutex_init(&parallel.mutex, NULL);
+    parallel.target_rate = param->target_rate;
+    parallel.count       = count;
+    blocks = (file_size + param->block_size - 1) / param->block_size;
+    span   = ((blocks + count - 1) / count) * param->block_size;
+
+    if (param->verbose_yn)
+        printf("Getting '%s' (%llu bytes) over %u sessions\n", command->text[1], (ull_t) file_size, count);
+
+    /* a signal cuts every session short, through its share */
+    parallel_interrupted = 0;
+    if (!param->embedded) {
+        memset(&interrupt, 0, sizeof(interrupt));
+        interrupt.sa_handler = parallel_interrupt;
+        interrupt.sa_flags   = SA_RESETHAND;
+        sigaction(SIGINT,  &interrupt, &old_int);
+        sigaction(SIGTERM, &interrupt, &old_term);
+    }
+
+    /* start the sessions, each quiet and starting out at a few times its even share of the rate */
+    gettimeofday(&start, NULL);
+    for (index = 0; index < count; ++index) {
+        chunk[index].parallel  = &parallel;
+        chunk[index].slot      = index;
+        chunk[index].offset    = index * span;
+        chunk[index].length    = (index + 1 < count) ? span : file_size - index * span;
+        chunk[index].parameter = *param;
+        chunk[index].parameter.parallel      = 1;
+        chunk[index].parameter.client_port   = param->client_port + index + 1;
+        chunk[index].parameter.target_rate   = min((u_int64_t) param->target_rate, (u_int64_t) param->target_rate * PARALLEL_START_SHARE / count);
+        chunk[index].parameter.verbose_yn    = 0;
+        chunk[index].parameter.transcript_yn = 0;
+        chunk[index].parameter.rate_adjust   = 0;
+        chunk[index].parameter.profile       = 0;
+        chunk[index].parameter.blockdump     = 0;
+        chunk[index].parameter.embedded      = 1;
+        chunk[index].command.count   = 3;
+        chunk[index].command.text[0] = "get";
+        chunk[index].command.text[1] = command->text[1];
+        chunk[index].command.text[2] = local_filename;
+        chunk[index].started = (pthread_create(&chunk[index].thread, NULL, parallel_chunk, &chunk[index]) == 0);
+        if (!chunk[index].started) {
+            chunk[index].status = warn("Could not start a session of the parallel get");
+            pthread_mutex_lock(&parallel.mutex);
+            parallel.failed = 1;
+            pthread_mutex_unlock(&parallel.mutex);
+        }
+    }
+
+    /* and wait for them */
+    for (index = 0; index < count; ++index) {
+        if (chunk[index].started)
+            pthread_join(chunk[index].thread, NULL);
+        if (chunk[index].status != 0)
+            status = -1;
+        if (chunk[index].status == 0)
+            verified = min(verified, (chunk[index].session != NULL) ? chunk[index].session->transfer.verified : -1);
+    }
+    secs = get_usec_since(&start) / 1e6;
+    if (!param->embedded) {
+        sigaction(SIGINT,  &old_int,  NULL);
+        sigaction(SIGTERM, &old_term, NULL);
+    }
+
+    /* report how each session and all of them together did */
+    mbit_file = 8.0 * file_size / (1024.0 * 1024.0);
+    if (!param->embedded && (status == 0)) {
+        for (index = 0; index < count; ++index)
+            printf("Session %-2u            : bytes %llu-%llu, %0.2f Mbps, %llu retransmits\n", index,
+                   (ull_t) chunk[index].offset, (ull_t) (chunk[index].offset + chunk[index].length),
+                   8.0 * chunk[index].length / (1024.0 * 1024.0) / chunk[index].secs,
+                   (ull_t) chunk[index].session->transfer.stats.total_recvd_retransmits);
+        printf("Transfer duration     : %0.2f seconds\n", secs);
+        printf("File data             : %0.2f Mbit\n", mbit_file);
+        printf("Final file rate       : %0.2f Mbps\n", mbit_file / secs);
+        if (param->checksum)
+            printf("File verification     : %s\n", (verified < 0) ? "not done" : verified ? "ok" : "MISMATCH");
+        printf("\n");
+    }
+
+    /* close the sessions */
+    for (index = 0; index < count; ++index) {
+        if (chunk[index].session == NULL)
+            continue;
+        command_close(&chunk[index].command, chunk[index].session);
+        free(chunk[index].session->server_address);
+        free(chunk[index].session);
+    }
+    pthread_mutex_destroy(&parallel.mutex);
+    free(chunk);
+
+    if (status < 0)
+        return warn("Parallel get not successful");
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * double parallel_share(ttp_session_t *session);
+ *
+ * Notes the current receive rate of the given session of a parallel get
+ * and returns the rate (in bps) it may go at: what the other sessions
+ * leave of the common target rate, but at least an even share of it.
+ * Also cuts the session short once the get was interrupted or another
+ * session failed.
+ *------------------------------------------------------------------------*/
+double parallel_share(ttp_session_t *session)
+{
+    parallel_t *parallel = session->parallel;
+    double      others   = 0.0;
+    u_int32_t   active   = 0;
+    u_int32_t   index;
+
+    pthread_mutex_lock(&parallel->mutex);
+    parallel->rate[session->parallel_slot] = session->transfer.stats.this_transmit_rate * 1024.0 * 1024.0;
+    for (index = 0; index < parallel->count; ++index) {
+        active += parallel->active[index];
+        if (parallel->active[index] && (index != (u_int32_t) session->parallel_slot))
+            others += parallel->rate[index];
+    }
+    if (parallel->failed || parallel_interrupted)
+        session->cancelled = 1;
+    pthread_mutex_unlock(&parallel->mutex);
+
+    return max(parallel->target_rate / (double) max(active, 1), parallel->target_rate - others);
+}
+
+
+/*------------------------------------------------------------------------
+ * void *parallel_chunk(void *arg);
+ *
+ * Runs one session of a parallel get: connects to the server and gets
+ * the byte range of the file given in the parallel_chunk_t it is
+ * passed.  A failure stops the other sessions as well.
+ *------------------------------------------------------------------------*/
+static void *parallel_chunk(void *arg)
+{
+    parallel_chunk_t *chunk    = (parallel_chunk_t *) arg;
+    parallel_t       *parallel = chunk->parallel;
+    command_t         connect;
+    struct timeval    start;
+    jmp_buf           trap;
+
+    /* a fatal error fails this session like any other failure, instead of ending the program */
+    g_error_trap = &trap;
+    if (setjmp(trap) != 0) {
+        chunk->status = -1;
+        goto done;
+    }
+
+    /* open a session of our own */
+    memset(&connect, 0, sizeof(connect));
+    connect.count   = 1;
+    connect.text[0] = "connect";
+    chunk->session  = command_connect(&connect, &chunk->parameter);
+    if (chunk->session == NULL) {
+        chunk->status = -1;
+        goto done;
+    }
+    chunk->session->range_offset  = chunk->offset;
+    chunk->session->range_length  = chunk->length;
+    chunk->session->parallel      = parallel;
+    chunk->session->parallel_slot = chunk->slot;
+
+    /* and get our range while we count as active */
+    pthread_mutex_lock(&parallel->mutex);
+    parallel->active[chunk->slot] = !parallel->failed;
+    pthread_mutex_unlock(&parallel->mutex);
+
+    gettimeofday(&start, NULL);
+    chunk->status = (parallel->active[chunk->slot] && !parallel_interrupted) ? command_get(&chunk->command, chunk->session) : -1;
+    chunk->secs   = get_usec_since(&start) / 1e6;
+
+ done:
+    pthread_mutex_lock(&parallel->mutex);
+    parallel->active[chunk->slot] = 0;
+    parallel->rate[chunk->slot]   = 0.0;
+    if (chunk->status != 0)
+        parallel->failed = 1;
+    pthread_mutex_unlock(&parallel->mutex);
+    return NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * void parallel_interrupt(int signum);
+ *
+ * Signal handler that notes that the user wants the parallel get to
+ * stop.  Every session notices with its next share of the rate.
+ *------------------------------------------------------------------------*/
+static void parallel_interrupt(int signum)
+{
+    parallel_interrupted = 1;
+}
+
+
+/*========================================================================
+ * $Log: parallel.c,v $
+ */
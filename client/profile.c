@@ -0,0 +1,318 @@
+/*========================================================================
+ * profile.c  --  Per-server performance profile cache for Tsunami client.
+ *
+ * This contains routines for remembering how transfers to a given
+ * server went (rate, loss, RTT, best block size, ring occupancy) in a
+ * small text file in the home directory, and for seeding the transfer
+ * parameters of the next session to that server from it.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <fcntl.h>        /* for open()                */
+#include <stdio.h>        /* for file I/O routines     */
+#include <stdlib.h>       /* for getenv(), mkstemp()   */
+#include <string.h>       /* for string routines       */
+#include <sys/file.h>     /* for flock()               */
+#include <time.h>         /* for time()                */
+#include <unistd.h>       /* for close(), unlink()     */
+
+#include <tsunami-client.h>
+
+
+/*------------------------------------------------------------------------
+ * Module-scope constants.
+ *------------------------------------------------------------------------*/
+
+#define PROFILE_FILENAME   ".tsunami_profile"  /* the cache file in $HOME            */
+#define PROFILE_MAX_LINES  256                 /* the most servers we remember       */
+#define PROFILE_MIN_SECS   1.0                 /* shorter transfers are not recorded */
+
+
+/*------------------------------------------------------------------------
+ * Prototypes for module-scope routines.
+ *------------------------------------------------------------------------*/
+
+int profile_merge (ttp_session_t *session, const char *path, double rate_bps);
+int profile_path  (char *path, size_t length);
+int profile_parse (const char *line, char *key, ttp_profile_t *profile);
+
+
+/*------------------------------------------------------------------------
+ * int profile_load(ttp_session_t *session);
+ *
+ * Looks up the profile of the server of the given session and seeds
+ * target_rate, block_size and losswindow from it.  Only parameters that
+ * are still at their defaults, or at the values seeded by an earlier
+ * profile_load(), are changed.  The UDP buffer is left to the automatic
+ * sizing in ttp_open_port(), which has the measured round trip time.  Returns 0 if a profile was
+ * applied, 1 if there was none and -1 on error.
+ *------------------------------------------------------------------------*/
+int profile_load(ttp_session_t *session)
+{
+    ttp_parameter_t *param = session->parameter;
+    ttp_profile_t   *seed  = &param->profile_seed;
+    ttp_profile_t    profile;
+    char             path[1024], line[1024], key[512], wanted[512];
+    double           rate;
+    FILE            *cache;
+    int              found = 0;
+
+    /* find the cache entry of this server */
+    if (profile_path(path, sizeof(path)) < 0)
+        return -1;
+    cache = fopen(path, "r");
+    if (cache == NULL)
+        return 1;
+    snprintf(wanted, sizeof(wanted), "%s:%u", param->server_name, param->server_port);
+    while (!found && fgets(line, sizeof(line), cache) != NULL)
+        found = (profile_parse(line, key, &profile) == 0) && !strcmp(key, wanted);
+    fclose(cache);
+    if (!found)
+        return 1;
+
+    /* go 15% above the last rate, unless the disk or the path had no more to give */
+    rate = profile.rate_bps;
+    if ((profile.ring_peak < MAX_BLOCKS_QUEUED - 1) && (profile.loss_ppm * 0.1 < param->error_rate))
+        rate *= 1.15;
+    rate = min(rate, 4294967295.0);
+    if ((rate > 0) && ((param->target_rate == DEFAULT_TARGET_RATE) || (param->target_rate == seed->rate_bps)))
+        param->target_rate = seed->rate_bps = (u_int32_t) rate;
+
+    /* the block size that did best so far */
+    if ((profile.block_size > 0) && ((param->block_size == DEFAULT_BLOCK_SIZE) || (param->block_size == seed->block_size)))
+        param->block_size = seed->block_size = profile.block_size;
+
+    /* a few round trips for retransmissions in semi-lossy mode */
+    if ((profile.rtt_usec > 0) && ((param->losswindow_ms == DEFAULT_LOSSWINDOW_MS) || (param->losswindow_ms == seed->losswindow_ms)))
+        param->losswindow_ms = seed->losswindow_ms = 100 + 3 * (profile.rtt_usec / 1000);
+
+    if (param->verbose_yn)
+        printf("Profile for %s (%u transfers): rate %u, blocksize %u, losswindow %u msec\n",
+               wanted, profile.transfers, param->target_rate, param->block_size, param->losswindow_ms);
+
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int profile_save(ttp_session_t *session, double rate_bps, double secs);
+ *
+ * Folds the outcome of the transfer that just completed into the profile
+ * of the session's server and rewrites the cache file.  The whole
+ * read-merge-write holds an exclusive flock() on a lock file next to the
+ * cache, so that concurrent clients, also several in one process, do not
+ * lose each other's results.  Returns 0 on success and nonzero on error.
+ *------------------------------------------------------------------------*/
+int profile_save(ttp_session_t *session, double rate_bps, double secs)
+{
+    char path[1024], name[1100];
+    int  lock, status;
+
+    /* too short to tell anything about the path */
+    if (secs < PROFILE_MIN_SECS)
+        return 0;
+    if (profile_path(path, sizeof(path)) < 0)
+        return -1;
+
+    /* the cache itself is replaced by rename(), so lock a file that stays */
+    snprintf(name, sizeof(name), "%s.lock", path);
+    lock = open(name, O_RDWR | O_CREAT, 0600);
+    if (lock < 0)
+        return warn("Could not open the profile cache lock");
+    if (flock(lock, LOCK_EX) < 0) {
+        close(lock);
+        return warn("Could not lock the profile cache");
+    }
+
+    status = profile_merge(session, path, rate_bps);
+    close(lock);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int profile_merge(ttp_session_t *session, const char *path,
+ *                   double rate_bps);
+ *
+ * Folds the outcome of the transfer into the entry of the session's
+ * server in the cache file at the given path.  The file is written to a
+ * unique temporary file and replaced atomically, so that readers never
+ * see a partial file.  Returns 0 on success and nonzero on error.
+ *------------------------------------------------------------------------*/
+int profile_merge(ttp_session_t *session, const char *path, double rate_bps)
+{
+    ttp_parameter_t *param = session->parameter;
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_profile_t    profile, entry;
+    char             temp[1100], line[1024], key[512], wanted[512];
+    char            *lines[PROFILE_MAX_LINES];
+    int              count = 0, index, found = -1, fd;
+    double           loss;
+    FILE            *cache;
+
+    snprintf(wanted, sizeof(wanted), "%s:%u", param->server_name, param->server_port);
+
+    /* read in the existing entries */
+    memset(&profile, 0, sizeof(profile));
+    cache = fopen(path, "r");
+    if (cache != NULL) {
+        while ((count < PROFILE_MAX_LINES) && (fgets(line, sizeof(line), cache) != NULL)) {
+            if (profile_parse(line, key, &entry) < 0)
+                continue;
+            if (!strcmp(key, wanted)) {
+                found   = count;
+                profile = entry;
+            }
+            lines[count++] = strdup(line);
+        }
+        fclose(cache);
+    }
+
+    /* blend in the new results, the newest transfer counting half */
+    loss = 1e6 * xfer->stats.total_retransmits / (1.0 + xfer->stats.total_blocks);
+    if (profile.transfers == 0) {
+        profile.rate_bps = rate_bps;
+        profile.loss_ppm = loss;
+        profile.rtt_usec = xfer->rtt_usec;
+    } else {
+        profile.rate_bps = 0.5 * profile.rate_bps + 0.5 * rate_bps;
+        profile.loss_ppm = 0.5 * profile.loss_ppm + 0.5 * loss;
+        profile.rtt_usec = (xfer->rtt_usec > 0) ? (profile.rtt_usec + xfer->rtt_usec) / 2 : profile.rtt_usec;
+    }
+    profile.ring_peak = xfer->stats.ring_peak;
+    profile.transfers++;
+
+    /* keep the block size with the best rate, tracking how that one does now */
+    if ((param->block_size == profile.block_size) && (profile.block_rate_bps > 0)) {
+        profile.block_rate_bps = 0.5 * profile.block_rate_bps + 0.5 * rate_bps;
+    } else if (rate_bps > profile.block_rate_bps) {
+        profile.block_size     = param->block_size;
+        profile.block_rate_bps = rate_bps;
+    }
+
+    /* write everything out into a temporary file */
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+    fd    = mkstemp(temp);
+    cache = (fd < 0) ? NULL : fdopen(fd, "w");
+    if (cache == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(temp);
+        }
+        for (index = 0; index < count; ++index) free(lines[index]);
+        return warn("Could not write the profile cache");
+    }
+    fprintf(cache, "%s %u %u %u %u %u %u %u %lu\n", wanted,
+            profile.rate_bps, profile.loss_ppm, profile.rtt_usec, profile.block_size,
+            profile.block_rate_bps, profile.ring_peak, profile.transfers, (unsigned long) time(NULL));
+    for (index = 0; index < count; ++index) {
+        if ((index != found) && (index < PROFILE_MAX_LINES - 1))
+            fputs(lines[index], cache);
+        free(lines[index]);
+    }
+    if (fclose(cache) != 0) {
+        unlink(temp);
+        return warn("Could not write the profile cache");
+    }
+
+    /* and swap it in */
+    if (rename(temp, path) < 0) {
+        unlink(temp);
+        return warn("Could not replace the profile cache");
+    }
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int profile_path(char *path, size_t length);
+ *
+ * Builds the name of the profile cache file.  Returns 0 on success and
+ * nonzero if there is no home directory.
+ *------------------------------------------------------------------------*/
+int profile_path(char *path, size_t length)
+{
+    const char *home = getenv("HOME");
+
+    if (home == NULL)
+        return warn("No home directory for the profile cache");
+    snprintf(path, length, "%s/%s", home, PROFILE_FILENAME);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int profile_parse(const char *line, char *key, ttp_profile_t *profile);
+ *
+ * Parses one line of the cache file into the server key (host:port)
+ * and the profile values.  Returns 0 on success and nonzero if the line
+ * is not a valid entry.
+ *------------------------------------------------------------------------*/
+int profile_parse(const char *line, char *key, ttp_profile_t *profile)
+{
+    memset(profile, 0, sizeof(*profile));
+    if (sscanf(line, "%511s %u %u %u %u %u %u %u", key,
+               &profile->rate_bps, &profile->loss_ppm, &profile->rtt_usec, &profile->block_size,
+               &profile->block_rate_bps, &profile->ring_peak, &profile->transfers) != 8)
+        return -1;
+    return 0;
+}
+
+
+/*========================================================================
+ * $Log: profile.c,v $
+ */
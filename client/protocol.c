@@ -61,9 +61,12 @@
  * INFORMATION GENERATED USING SOFTWARE.
  *========================================================================*/
 
+#include <fcntl.h>        /* for open()                            */
 #include <stdlib.h>       /* for *alloc() and free()               */
 #include <string.h>       /* for standard string routines          */
+#include <sys/select.h>   /* for select()                          */
 #include <sys/socket.h>   /* for the BSD socket library            */
+#include <sys/stat.h>     /* for fstat()                           */
 #include <sys/time.h>     /* for gettimeofday()                    */
 #include <time.h>         /* for time()                            */
 #include <unistd.h>       /* for standard Unix system calls        */
@@ -90,12 +93,18 @@
  *         If the authentication succeeds, the server transmits a
  *         result byte of 0.  Otherwise, it transmits a non-zero
  *         result byte.
+ *
+ * The time the server takes to answer is kept as the round trip time
+ * of the session, which every file request goes by.  The reply to a
+ * request is no measure of it, as the server opens the file, and may
+ * ask an upstream server for it, before it answers.
  *------------------------------------------------------------------------*/
 int ttp_authenticate(ttp_session_t *session, u_char *secret)
 {
     u_char  random[64];  /* the buffer of random data               */
     u_char  digest[16];  /* the MD5 message digest (for the server) */
     u_char  result;      /* the result byte from the server         */
+    struct timeval ping_s; /* the time the response was sent        */
     int     status;      /* return status from function calls       */
 
     /* read in the shared secret and the challenge */
@@ -109,6 +118,7 @@ int ttp_authenticate(ttp_session_t *session, u_char *secret)
 	*(secret++) = '\0';
 
     /* send the response to the server */
+    gettimeofday(&ping_s, NULL);
     status = fwrite(digest, 1, 16, session->server);
     if ((status < 16) || fflush(session->server))
 	return warn("Could not send authentication response");
@@ -117,12 +127,124 @@ int ttp_authenticate(ttp_session_t *session, u_char *secret)
     status = fread(&result, 1, 1, session->server);
     if (status < 1)
 	return warn("Could not read authentication status");
+    session->rtt_usec = get_usec_since(&ping_s);
 
     /* check the result byte */
     return (result == 0) ? 0 : -1;
 }
 
 
+/*------------------------------------------------------------------------
+ * int ttp_check_held(ttp_session_t *session);
+ *
+ * Checks the blocks an earlier transfer left in the local file against
+ * the server's Merkle tree of the file, and marks those that fail as
+ * missing again.  We hash every leaf of the tree whose data we hold in
+ * full and walk down from the root, asking the server for the hashes
+ * of one level at a time: a node that matches confirms all the blocks
+ * below it, one that does not is looked into further, and the blocks
+ * of a leaf that does not match are dropped.  Returns 0 on success and
+ * non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_check_held(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer       = &session->transfer;
+    u_int32_t        block_size = session->parameter->block_size;
+    merkle_t        *tree;
+    u_char          *want;
+    u_int64_t       *query, *next;
+    u_int64_t        queried, queued, held, index, node, child, first, end;
+    u_char           hash[MERKLE_ROUND][16];
+    u_int32_t        count, round;
+    int              fd, children, status = 0;
+
+    /* nothing to check, end the queries right away */
+    held = blockmap_count(xfer->received);
+    if (held == 0) {
+        count = 0;
+        if ((fwrite(&count, 4, 1, session->server) < 1) || fflush(session->server))
+            return warn("Could not end the Merkle tree queries");
+        return 0;
+    }
+
+    tree  = merkle_create(xfer->file_size);
+    want  = (tree == NULL) ? NULL : (u_char *)    calloc(tree->leaves, 1);
+    query = (tree == NULL) ? NULL : (u_int64_t *) calloc(tree->leaves, sizeof(u_int64_t));
+    next  = (tree == NULL) ? NULL : (u_int64_t *) calloc(tree->leaves, sizeof(u_int64_t));
+    if ((want == NULL) || (query == NULL) || (next == NULL))
+        error("Could not allocate the Merkle tree");
+
+    /* hash the leaves we hold every block of */
+    for (node = 0; node < tree->leaves; ++node) {
+        merkle_span(tree, node, &first, &end);
+        want[node] = (end > first) && (blockmap_next(xfer->received, first / block_size + 1, 0) > (end - 1) / block_size + 1);
+    }
+    fd = open(xfer->local_filename, O_RDONLY);
+    if (fd < 0)
+        error("Could not open the local file for hashing");
+    merkle_hash(tree, fd, want);
+    close(fd);
+
+    /* walk down from the root */
+    query[0] = tree->nodes - 1;
+    queued   = 1;
+    while (queued > 0) {
+        for (queried = 0, index = 0; queried < queued; queried += round) {
+
+            /* ask for the next batch of nodes */
+            round = min(queued - queried, MERKLE_ROUND);
+            count = htonl(round);
+            if (fwrite(&count, 4, 1, session->server) < 1) { status = warn("Could not send Merkle tree query"); goto done; }
+            for (count = 0; count < round; ++count) {
+                node = htonll(query[queried + count]);
+                if (fwrite(&node, 8, 1, session->server) < 1) { status = warn("Could not send Merkle tree query"); goto done; }
+            }
+            if (fflush(session->server) || (fread(hash, 16, round, session->server) < round)) {
+                status = warn("Could not read Merkle tree hashes");
+                goto done;
+            }
+
+            /* and compare */
+            for (count = 0; count < round; ++count) {
+                node = query[queried + count];
+                if (tree->valid[node] && !memcmp(tree->hash + 16 * node, hash[count], 16))
+                    continue;
+                merkle_span(tree, node, &first, &end);
+                children = merkle_children(tree, node, &child);
+                if (children == 0) {
+                    if (end > first)
+                        blockmap_clear_range(xfer->received, first / block_size + 1, (end - 1) / block_size + 1);
+                    continue;
+                }
+                for (; children > 0; --children, ++child) {
+                    merkle_span(tree, child, &first, &end);
+                    if ((end > first) && (blockmap_next(xfer->received, first / block_size + 1, 1) <= (end - 1) / block_size + 1))
+                        next[index++] = child;
+                }
+            }
+        }
+
+        /* the next level down */
+        memcpy(query, next, index * sizeof(u_int64_t));
+        queued = index;
+    }
+
+    /* that was all */
+    count = 0;
+    if ((fwrite(&count, 4, 1, session->server) < 1) || fflush(session->server))
+        status = warn("Could not end the Merkle tree queries");
+    printf("Resuming '%s': %llu of %llu blocks already here, %llu could not be confirmed\n", xfer->local_filename,
+           (ull_t) blockmap_count(xfer->received), (ull_t) xfer->block_count, (ull_t) (held - blockmap_count(xfer->received)));
+
+ done:
+    merkle_destroy(tree);
+    free(want);
+    free(query);
+    free(next);
+    return status;
+}
+
+
 /*------------------------------------------------------------------------
  * int ttp_negotiate(ttp_session_t *session);
  *
@@ -161,80 +283,243 @@ int ttp_negotiate(ttp_session_t *session)
  *
  * Tries to create a new TTP file request object for the given session
  * by submitting a file request to the server (which is waiting for
- * the name of a file to transfer).  If the request is accepted, we
- * retrieve the file parameters, open the file for writing, and return
- * 0 for success.  If anything goes wrong, we return a non-zero value.
+ * the name of a file to transfer).  The filename, the transfer
+ * parameters and the port of our data socket go out in one message,
+ * without waiting for the file to be accepted, so that the request
+ * costs a single round trip.  If the request is accepted, we retrieve
+ * the file parameters, open the file for writing, and return 0 for
+ * success.  If anything goes wrong, we return a non-zero value.
  *------------------------------------------------------------------------*/
 int ttp_open_transfer(ttp_session_t *session, const char *remote_filename, const char *local_filename)
 {
     u_char           result;    /* the result byte from the server     */
     u_int32_t        temp;      /* used for transmitting 32-bit values */
+    u_int32_t        block_size; /* the block size the server agreed to */
+    u_int32_t        super_size; /* the blocks per super-block we want  */
     u_int16_t        temp16;    /* used for transmitting 16-bit values */
+    struct sockaddr_storage udp_address; /* the address of our data socket */
+    socklen_t        udp_length = sizeof(udp_address);
+    u_int16_t        port;      /* the port of our data socket         */
+    u_int64_t        temp64;    /* used for transmitting 64-bit values */
+    u_int64_t        first, last; /* the blocks of a byte range wanted */
+    int              range;     /* 1 if we ask for a byte range only   */
+    int              resume;    /* 1 if the user asked to resume       */
+    int              resuming;  /* 1 if we continue an earlier transfer */
+    int              keep;      /* 1 if the local file keeps its data  */
+    int              local;     /* 1 if the data goes to a local file  */
+    int              bundle;    /* 1 if we asked for a bundle of files */
     int              status;
     ttp_transfer_t  *xfer  = &session->transfer;
     ttp_parameter_t *param =  session->parameter;
 
-    /* submit the transfer request */
+    /* the transfer object is cleared below */
+    resume = xfer->resume;
+
+    /* a sink without a local file, such as a stream, takes the blocks from the first one on,
+     * and a bundle goes into the files of its manifest instead */
+    bundle = !strncmp(remote_filename, BUNDLE_PREFIX, strlen(BUNDLE_PREFIX));
+    local  = param->sink->local && !bundle;
+    range  = (session->range_length > 0);
+    if (resume && !local)
+        return warn("Could not resume into a sink that leaves no local file");
+    if (range && (resume || !local))
+        return warn("Could not fetch a byte range other than into a local file");
+
+    /* the port of our data socket goes along with the request, so the socket is set up first and kept for the session */
+    if (session->udp_fd < 0)
+        session->udp_fd = create_udp_socket(param);
+    if (session->udp_fd < 0)
+        return warn("Could not create UDP socket");
+    memset(&udp_address, 0, sizeof(udp_address));
+    getsockname(session->udp_fd, (struct sockaddr *) &udp_address, &udp_length);
+    port = (udp_address.ss_family == AF_INET6) ? ((struct sockaddr_in6 *) &udp_address)->sin6_port : ((struct sockaddr_in *) &udp_address)->sin_port;
+
+    /* find the largest block that crosses the path unfragmented, once a session */
+    if (param->block_auto) {
+        struct sockaddr_storage address;
+        socklen_t               length = sizeof(address);
+        int                     block_size;
+
+        if ((session->path_block_size == 0) && (getpeername(fileno(session->server), (struct sockaddr *) &address, &length) == 0))
+            session->path_block_size = get_path_block_size((struct sockaddr *) &address, length, max(2 * session->rtt_usec, 20000));
+        block_size = session->path_block_size;
+        if ((block_size > 0) && param->checksum)
+            block_size -= TS_CRC_SIZE;
+        if (block_size > 0)
+            param->block_size = block_size;
+        if (param->verbose_yn)
+            printf("Path MTU discovery: %s, block size %u\n", (block_size > 0) ? "done" : "failed", param->block_size);
+    }
+
+    /* submit the filename, block size, target bitrate, and maximum error rate */
     status = fprintf(session->server, "%s\n", remote_filename);
-    if ((status <= 0) || fflush(session->server))
+    if (status <= 0)
 	return warn("Could not request file");
-
-    /* see if the request was successful */
-    status = fread(&result, 1, 1, session->server);
-    if (status < 1)
-	return warn("Could not read response to file request");
-
-    /* make sure the result was a good one */
-    if (result != 0)
-	return warn("Server: File does not exist or cannot be transmitted");
-
-    /* Submit the block size, target bitrate, and maximum error rate */
     temp = htonl(param->block_size);   if (fwrite(&temp, 4, 1, session->server) < 1) return warn("Could not submit block size");
     temp = htonl(param->target_rate);  if (fwrite(&temp, 4, 1, session->server) < 1) return warn("Could not submit target rate");
     temp = htonl(param->error_rate);   if (fwrite(&temp, 4, 1, session->server) < 1) return warn("Could not submit error rate");
-    if (fflush(session->server))
-	return warn("Could not flush control channel");
 
     /* submit the slower and faster factors */
     temp16 = htons(param->slower_num);  if (fwrite(&temp16, 2, 1, session->server) < 1) return warn("Could not submit slowdown numerator");
     temp16 = htons(param->slower_den);  if (fwrite(&temp16, 2, 1, session->server) < 1) return warn("Could not submit slowdown denominator");
     temp16 = htons(param->faster_num);  if (fwrite(&temp16, 2, 1, session->server) < 1) return warn("Could not submit speedup numerator");
     temp16 = htons(param->faster_den);  if (fwrite(&temp16, 2, 1, session->server) < 1) return warn("Could not submit speedup denominator");
+
+    /* submit the transfer options we would like to use */
+    temp = 0;
+    if (param->probe) temp |= TS_OPT_PROBE;
+    if (param->block_auto) temp |= TS_OPT_AUTOBLOCK;
+    super_size = local ? ((u_int64_t) param->super_kb * 1024) / param->block_size : 0;
+    if (super_size > 1) temp |= TS_OPT_SUPERBLOCK;
+    if (param->checksum) temp |= TS_OPT_CHECKSUM;
+    if (range) temp |= TS_OPT_RANGE;
+    else if (resume) temp |= TS_OPT_SKIP;
+    else if (local && resume_exists(local_filename)) temp |= TS_OPT_MERKLE | TS_OPT_SKIP;
+    else if (local && param->delta && !access(local_filename, F_OK)) temp |= TS_OPT_DELTA;
+    if (local && param->sparse && !range) temp |= TS_OPT_SPARSE;
+    if (param->compress) temp |= TS_OPT_COMPRESS;
+    if (param->fec) temp |= TS_OPT_FEC;
+    if (param->multicast && !param->ipv6_yn) temp |= TS_OPT_MULTICAST;
+    if (param->follow) temp |= TS_OPT_FOLLOW;
+    if (bundle) temp |= TS_OPT_BUNDLE;
+    temp = htonl(temp);                if (fwrite(&temp, 4, 1, session->server) < 1) return warn("Could not submit transfer options");
+    if (super_size > 1) {
+        temp = htonl(super_size);      if (fwrite(&temp, 4, 1, session->server) < 1) return warn("Could not submit super-block size");
+    }
+    if (range) {
+        temp64 = htonll(session->range_offset);  if (fwrite(&temp64, 8, 1, session->server) < 1) return warn("Could not submit range offset");
+        temp64 = htonll(session->range_length);  if (fwrite(&temp64, 8, 1, session->server) < 1) return warn("Could not submit range length");
+    }
+
+    /* and the port the data is to go to, sending the request off in one piece */
+    if (fwrite(&port, 2, 1, session->server) < 1)
+	return warn("Could not send UDP port number");
     if (fflush(session->server))
 	return warn("Could not flush control channel");
 
+    /* see if the request was successful */
+    status = fread(&result, 1, 1, session->server);
+    if (status < 1)
+	return warn("Could not read response to file request");
+
+    /* make sure the result was a good one */
+    if (result != 0)
+	return warn("Server: File does not exist or cannot be transmitted");
+
     /* populate the fields of the transfer object */
     memset(xfer, 0, sizeof(*xfer));
     xfer->remote_filename = remote_filename;
     xfer->local_filename  = local_filename;
+    xfer->rtt_usec        = session->rtt_usec;  /* the reply also waits for the file to be opened */
+    xfer->verified        = -1;
+
+    /* read in the file length, block size, block count, run epoch, options and datagram tag */
+    if (fread(&xfer->file_size,   8, 1, session->server) < 1) return warn("Could not read file size");
+    if (fread(&block_size,        4, 1, session->server) < 1) return warn("Could not read block size");
+    if (fread(&xfer->block_count, 8, 1, session->server) < 1) return warn("Could not read number of blocks");
+    if (fread(&xfer->epoch,       4, 1, session->server) < 1) return warn("Could not read run epoch");
+    if (fread(&xfer->options,     4, 1, session->server) < 1) return warn("Could not read transfer options");
+    if (fread(&xfer->tag,         2, 1, session->server) < 1) return warn("Could not read datagram tag");
+    xfer->file_size   = ntohll(xfer->file_size);
+    block_size        = ntohl (block_size);
+    xfer->block_count = ntohll(xfer->block_count);
+    xfer->epoch       = ntohl (xfer->epoch);
+    xfer->options     = ntohl (xfer->options);
+    xfer->tag         = ntohs (xfer->tag);
+    if (xfer->options & TS_OPT_SUPERBLOCK) {
+        if (fread(&xfer->super_size, 4, 1, session->server) < 1) return warn("Could not read super-block size");
+        xfer->super_size = ntohl(xfer->super_size);
+    }
+    if (xfer->options & TS_OPT_MULTICAST) {
+        if (fread(&xfer->mcast_group, 4, 1, session->server) < 1) return warn("Could not read multicast group");
+        if (fread(&xfer->mcast_port,  2, 1, session->server) < 1) return warn("Could not read multicast port");
+        xfer->mcast_port = ntohs(xfer->mcast_port);
+    }
 
-    /* read in the file length, block size, block count, and run epoch */
-    if (fread(&xfer->file_size,   8, 1, session->server) < 1) return warn("Could not read file size");         xfer->file_size   = ntohll(xfer->file_size);
-    if (fread(&temp,              4, 1, session->server) < 1) return warn("Could not read block size");        if (htonl(temp) != param->block_size) return warn("Block size disagreement");
-    if (fread(&xfer->block_count, 4, 1, session->server) < 1) return warn("Could not read number of blocks");  xfer->block_count = ntohl (xfer->block_count);
-    if (fread(&xfer->epoch,       4, 1, session->server) < 1) return warn("Could not read run epoch");         xfer->epoch       = ntohl (xfer->epoch);
-
-    /* we start out with every block yet to transfer */
-    xfer->blocks_left = xfer->block_count;
+    /* the server may only lower the block size, and only if we let it, or keep that of its multicast */
+    if ((block_size < param->block_size) && (xfer->options & TS_OPT_AUTOBLOCK) && (block_size > 0))
+        param->block_size = block_size;
+    if ((xfer->options & TS_OPT_MULTICAST) && (block_size > 0) && (block_size <= MAX_BLOCK_SIZE))
+        param->block_size = block_size;
+    if (block_size != param->block_size)
+        return warn("Block size disagreement");
+    if (bundle && !(xfer->options & TS_OPT_BUNDLE))
+        return warn("The server does not send bundles");
+    if (range && !(xfer->options & TS_OPT_RANGE))
+        return warn("The server does not send byte ranges of this file");
+
+    /* allocate the received bitfield */
+    xfer->received = blockmap_create(xfer->block_count);
+    if (xfer->received == NULL)
+        error("Could not allocate received-data bitfield");
+
+    /* the server leaves out the blocks outside a byte range, so they count as received from the start */
+    if (range) {
+        first = min(session->range_offset, xfer->file_size);
+        last  = (first + min(session->range_length, xfer->file_size - first) + param->block_size - 1) / param->block_size;
+        first = first / param->block_size + 1;
+        if ((first > 1) && (blockmap_set_range(xfer->received, 1, min(first - 1, xfer->block_count)) < 0))
+            error("Could not allocate a received-data bitfield page");
+        if ((last < xfer->block_count) && (blockmap_set_range(xfer->received, last + 1, xfer->block_count) < 0))
+            error("Could not allocate a received-data bitfield page");
+    }
 
-    /* try to open the local file for writing */
-    if (!access(xfer->local_filename, F_OK))
-        printf("Warning: overwriting existing file '%s'\n", local_filename);     
-    xfer->file = fopen(xfer->local_filename, "wb");
-    if (xfer->file == NULL) {
+    /* pick up the blocks an earlier transfer left behind, if they can be checked or we were told to */
+    resuming = (resume || (xfer->options & TS_OPT_MERKLE)) && (resume_load(session) == 0);
+    if (resume && !resuming)
+        return warn("Could not resume from the block record");
+    if (resume)
+        printf("Resuming '%s': %llu of %llu blocks already here\n", xfer->local_filename,
+               (ull_t) blockmap_count(xfer->received), (ull_t) xfer->block_count);
+
+    /* try to open the local file for writing, keeping its data if we resume or update it or only fill in a range */
+    keep = resuming || (xfer->options & (TS_OPT_DELTA | TS_OPT_RANGE));
+    if (local) {
+        if (!keep && !access(xfer->local_filename, F_OK))
+            printf("Warning: overwriting existing file '%s'\n", local_filename);     
+        xfer->file = fopen(xfer->local_filename, keep ? "r+b" : "w+b");  /* read too for the mmap sink */
+    }
+    if ((xfer->file == NULL) && keep)
+        return warn("Could not open local file for updating");
+    if ((xfer->file == NULL) && local) {
         char * trimmed = rindex(xfer->local_filename, '/');
         if ((trimmed != NULL) && (strlen(trimmed)>1)) {
            printf("Warning: could not open file %s for writing, trying local directory instead.\n", xfer->local_filename);
            xfer->local_filename = trimmed + 1;
            if (!access(xfer->local_filename, F_OK))
               printf("Warning: overwriting existing file '%s'\n", xfer->local_filename);     
-           xfer->file = fopen(xfer->local_filename, "wb");
+           xfer->file = fopen(xfer->local_filename, "w+b");
         }
         if(xfer->file == NULL) {
            return warn("Could not open local file for writing");
         }
     }
 
+    /* have the blocks we hold checked, and the server leave them out */
+    if ((xfer->options & TS_OPT_MERKLE) && (ttp_check_held(session) < 0))
+        return warn("Could not check the blocks already received");
+    if ((xfer->options & TS_OPT_SKIP) && (ttp_send_skip(session) < 0))
+        return warn("Could not send the blocks already received");
+    if ((xfer->options & TS_OPT_DELTA) && (ttp_send_delta(session) < 0))
+        return warn("Could not compare the local file with the server's copy");
+    if ((xfer->options & TS_OPT_SPARSE) && (ttp_read_holes(session) < 0))
+        return warn("Could not take over the holes of the file");
+    if ((xfer->options & TS_OPT_BUNDLE) && (ttp_read_manifest(session) < 0))
+        return warn("Could not read the manifest of the bundle");
+
+    /* and set up the sink the blocks are written to, over the local file if it has one */
+    xfer->sink = (xfer->options & TS_OPT_BUNDLE) ? sink_find("bundle") : param->sink;
+    if (xfer->sink->open(session) < 0) {
+        sprintf(g_error, "Could not open the '%s' sink", xfer->sink->name);
+        return warn(g_error);
+    }
+
+    /* we start out with every other block yet to transfer */
+    xfer->blocks_left = xfer->block_count - blockmap_count(xfer->received);
+    xfer->written     = blockmap_copy(xfer->received);
+    if (xfer->written == NULL)
+        error("Could not allocate written-data bitfield");
+
     #ifdef VSIB_REALTIME
     /* try to open the vsib for output */
     xfer->vsib = fopen("/dev/vsib", "wb");
@@ -248,7 +533,7 @@ int ttp_open_transfer(ttp_session_t *session, const char *remote_filename, const
     #endif
 
     /* make crude estimate of blocks on the wire if RTT delay is 500ms */
-    xfer->on_wire_estimate = (u_int32_t)(0.5 * param->target_rate/(8*param->block_size));
+    xfer->on_wire_estimate = (u_int64_t)(0.5 * param->target_rate/(8*param->block_size));
     xfer->on_wire_estimate = min(xfer->block_count, xfer->on_wire_estimate);
 
     /* if we're doing a transcript */
@@ -263,35 +548,169 @@ int ttp_open_transfer(ttp_session_t *session, const char *remote_filename, const
 /*------------------------------------------------------------------------
  * int ttp_open_port(ttp_session_t *session);
  *
- * Creates a new UDP socket for receiving the file data associated with
- * our pending transfer and communicates the port number back to the
- * server.  Returns 0 on success and non-zero on failure.
+ * Sets up the UDP socket for receiving the file data associated with
+ * our pending transfer: the data socket of the session, whose port
+ * went to the server with the request, or a socket that joins the
+ * multicast group.  Returns 0 on success and non-zero on failure.
  *------------------------------------------------------------------------*/
 int ttp_open_port(ttp_session_t *session)
 {
-    struct sockaddr udp_address;
-    unsigned int    udp_length = sizeof(udp_address);
-    int             status;
-    u_int16_t      *port;
-
-    /* open a new datagram socket */
-    session->transfer.udp_fd = create_udp_socket(session->parameter);
+    /* take the data socket of the session, or join the multicast group */
+    if (session->transfer.options & TS_OPT_MULTICAST)
+	session->transfer.udp_fd = create_mcast_socket(session->transfer.mcast_group, session->transfer.mcast_port);
+    else
+	session->transfer.udp_fd = session->udp_fd;
     if (session->transfer.udp_fd < 0)
 	return warn("Could not create UDP socket");
 
-    /* find out the port number we're using */
-    memset(&udp_address, 0, sizeof(udp_address));
-    getsockname(session->transfer.udp_fd, (struct sockaddr *) &udp_address, &udp_length);
+    /* size its receive buffer for the path, unless the user fixed the size */
+    if (session->parameter->udp_buffer)
+	ttp_size_buffer(session, session->parameter->udp_buffer);
+    else
+	ttp_size_buffer(session, udp_buffer_for_path(DEFAULT_UDP_BUFFER, session->parameter->target_rate, session->transfer.rtt_usec));
+
+    /* we succeeded */
+    return 0;
+}
 
-    /* get a hold of the port number */
-    port = (session->parameter->ipv6_yn ? &((struct sockaddr_in6 *) &udp_address)->sin6_port : &((struct sockaddr_in *) &udp_address)->sin_port);
 
-    /* send that port number to the server */
-    status = fwrite(port, 2, 1, session->server);
-    if ((status < 1) || fflush(session->server)) {
-	close(session->transfer.udp_fd);
-	return warn("Could not send UDP port number");
+/*------------------------------------------------------------------------
+ * int ttp_query_size(ttp_session_t *session, const char *remote_filename,
+ *                    u_int64_t *size);
+ *
+ * Asks the server for the size of the given remote file without
+ * transferring it, which a parallel get needs to split the file into
+ * byte ranges.  The size is all ones if the server cannot tell, such as
+ * for a file it does not have.  Returns 0 on success and non-zero on
+ * failure.
+ *------------------------------------------------------------------------*/
+int ttp_query_size(ttp_session_t *session, const char *remote_filename, u_int64_t *size)
+{
+    if ((fprintf(session->server, "%s\n%s\n", TS_SIZE_QUERY_CMD, remote_filename) <= 0) || fflush(session->server))
+        return warn("Could not ask for the file size");
+    if (fread(size, 8, 1, session->server) < 1)
+        return warn("Could not read the file size");
+    *size = ntohll(*size);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_probe_path(ttp_session_t *session);
+ *
+ * Receives the probe packet trains that the server sends right after
+ * the data port has been opened.  The bottleneck bandwidth is estimated
+ * from the arrival dispersion of each train.  The queueing onset is the
+ * rate of the fastest train that arrived complete, at its nominal rate
+ * and without a growing one-way delay.  Both estimates (in kbit/s) go
+ * back to the server to seed its starting IPD.  Returns 0 on success
+ * and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_probe_path(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param =  session->parameter;
+    u_int16_t        plan[2];
+    u_int32_t        result[2];
+    u_int32_t        count[PROBE_TRAINS], nominal[PROBE_TRAINS];
+    u_int64_t        first_rx[PROBE_TRAINS], last_rx[PROBE_TRAINS];
+    int64_t          first_owd[PROBE_TRAINS], last_owd[PROBE_TRAINS];
+    u_int32_t        trains, length, train, seq, received = 0;
+    u_int64_t        now, stamp;
+    u_char          *datagram;
+    struct timeval   tv;
+    fd_set           fds;
+    double           rx_kbps, growth;
+    int              status, onset_open = 1;
+    char             probe_line[128];
+
+    /* read the probe layout */
+    if (fread(plan, 4, 1, session->server) < 1)
+        return warn("Could not read probe layout");
+    trains = min(ntohs(plan[0]), PROBE_TRAINS);
+    length = ntohs(plan[1]);
+
+    datagram = (u_char *) malloc(TS_HEADER_SIZE + param->block_size);
+    if (datagram == NULL)
+        error("Could not allocate probe datagram");
+    memset(count, 0, sizeof(count));
+
+    /* collect the trains until all arrived or the path went quiet */
+    while (received < trains * length) {
+        FD_ZERO(&fds);
+        FD_SET(xfer->udp_fd, &fds);
+        tv.tv_sec  = (received == 0) ? 2 : 0;
+        tv.tv_usec = (received == 0) ? 0 : 500000;
+        if (select(xfer->udp_fd + 1, &fds, NULL, NULL, &tv) <= 0)
+            break;
+        status = recvfrom(xfer->udp_fd, datagram, TS_HEADER_SIZE + param->block_size, 0, NULL, 0);
+        gettimeofday(&tv, NULL);
+        if (status < TS_HEADER_SIZE + 12 || ntohs(*((u_int16_t *) (datagram + 8))) != TS_BLOCK_PROBE ||
+            ntohs(*((u_int16_t *) (datagram + 10))) != xfer->tag)
+            continue;
+
+        now   = 1000000ULL * tv.tv_sec + tv.tv_usec;
+        train = (u_int32_t) (ntohll(*((u_int64_t *) datagram)) >> 16);
+        seq   = (u_int32_t) (ntohll(*((u_int64_t *) datagram)) & 0xFFFF);
+        if (train >= trains || seq >= length)
+            continue;
+        memcpy(&stamp, datagram + TS_HEADER_SIZE, 8);
+        stamp = ntohll(stamp);
+
+        /* the clocks are not synchronized, but only the change within a train matters */
+        if (count[train]++ == 0) {
+            first_rx[train]  = now;
+            first_owd[train] = (int64_t) (now - stamp);
+            nominal[train]   = ntohl(*((u_int32_t *) (datagram + TS_HEADER_SIZE + 8)));
+        }
+        last_rx[train]  = now;
+        last_owd[train] = (int64_t) (now - stamp);
+        ++received;
+    }
+    free(datagram);
+
+    /* evaluate the trains from the slowest to the fastest */
+    result[0] = result[1] = 0;
+    for (train = 0; train < trains; ++train) {
+        if (count[train] < 2 || last_rx[train] == first_rx[train]) {
+            onset_open = 0;
+            continue;
+        }
+        rx_kbps = 8000.0 * (count[train] - 1) * (TS_HEADER_SIZE + param->block_size) / (last_rx[train] - first_rx[train]);
+        growth  = (double) (last_owd[train] - first_owd[train]);
+
+        /* the dispersion can not show more than the rate the train was sent at */
+        result[0] = max(result[0], (u_int32_t) min(rx_kbps, (double) nominal[train]));
+
+        /* queueing starts at the first train that is lossy, slowed down or delayed */
+        if ((count[train] < length) || (rx_kbps < 0.9 * nominal[train]) ||
+            (growth > max(200.0, 0.1 * (last_rx[train] - first_rx[train]))))
+            onset_open = 0;
+        if (onset_open)
+            result[1] = nominal[train];
+
+        snprintf(probe_line, sizeof(probe_line), "PROBE train %u sent %u kbps got %0.0f kbps %u/%u pkts owd %+0.0f us\n",
+                 train, nominal[train], rx_kbps, count[train], length, growth);
+        if (param->transcript_yn)
+            xscript_data_log(session, probe_line);
     }
+    xfer->probe_bottleneck_kbps = result[0];
+    xfer->probe_onset_kbps      = result[1];
+
+    /* report the outcome */
+    snprintf(probe_line, sizeof(probe_line), "PROBE bottleneck %u kbps onset %u kbps (%u of %u packets)\n",
+             result[0], result[1], received, trains * length);
+    if (param->verbose_yn)
+        printf("%s", probe_line);
+    if (param->transcript_yn)
+        xscript_data_log(session, probe_line);
+
+    /* and send it to the server */
+    result[0] = htonl(result[0]);
+    result[1] = htonl(result[1]);
+    status = fwrite(result, 8, 1, session->server);
+    if ((status < 1) || fflush(session->server))
+        return warn("Could not send probe result");
 
     /* we succeeded */
     return 0;
@@ -312,7 +731,8 @@ int ttp_repeat_retransmit(ttp_session_t *session)
     retransmission_t  retransmission[MAX_RETRANSMISSION_BUFFER];  /* the retransmission request object        */
     int               entry;                                      /* an index into the retransmission table   */
     int               status;
-    int               block;
+    u_int64_t         block;
+    u_int64_t         wanted = 0;                                 /* the number of blocks asked for           */
     int               count = 0;
     retransmit_t     *rexmit = &(session->transfer.retransmit);
     ttp_transfer_t   *xfer = &session->transfer;
@@ -326,8 +746,15 @@ int ttp_repeat_retransmit(ttp_session_t *session)
     xfer->stats.this_retransmits = 0;
     count = 0;
 
+    /* in super-block mode, one request and a bitmap for each super-block listed */
+    if (xfer->super_cache != NULL) {
+        count = super_requests(session, retransmission, MAX_RETRANSMISSION_BUFFER, &wanted);
+        if (count < 0)
+            count = MAX_RETRANSMISSION_BUFFER;
+    }
+
     /* discard received blocks from the list and prepare retransmit requests */
-    for (entry = 0; (entry<rexmit->index_max) && (count<MAX_RETRANSMISSION_BUFFER); ++entry) {
+    for (entry = 0; (xfer->super_cache == NULL) && (entry<rexmit->index_max) && (count<MAX_RETRANSMISSION_BUFFER); ++entry) {
 
         /* get the block number */
         block = rexmit->table[entry];
@@ -340,7 +767,7 @@ int ttp_repeat_retransmit(ttp_session_t *session)
 
             /* insert retransmit request */
             retransmission[count].request_type = htons(REQUEST_RETRANSMIT);
-            retransmission[count].block        = htonl(block);
+            retransmission[count].block        = htonll(block);
             ++count;
 
             #ifdef DEBUG_RETX
@@ -355,7 +782,7 @@ int ttp_repeat_retransmit(ttp_session_t *session)
         /* restart from first missing block */
         block                          = min(xfer->block_count, xfer->gapless_to_block + 1);
         retransmission[0].request_type = htons(REQUEST_RESTART);
-        retransmission[0].block        = htonl(block);
+        retransmission[0].block        = htonll(block);
 
         /* send out the request */
         status = fwrite(&retransmission[0], sizeof(retransmission[0]), 1, session->server);
@@ -365,29 +792,37 @@ int ttp_repeat_retransmit(ttp_session_t *session)
 
         /* remember the request so we can then ignore blocks that are still on the wire */
         xfer->restart_pending        = 1;
-        xfer->restart_lastidx        = rexmit->table[rexmit->index_max - 1];
+        xfer->restart_lastidx        = (xfer->super_cache != NULL) ? xfer->super_cache->wanted_to : rexmit->table[rexmit->index_max - 1];
         xfer->restart_wireclearidx   = min(xfer->block_count, xfer->restart_lastidx + xfer->on_wire_estimate);
 
         #ifdef DEBUG_RETX
-        printf("ttp_repeat_restransmit: restart_pending=1, range %u to %u, clear at %u, gapless to %u, old head %u\n",
-               block, xfer->restart_lastidx, xfer->restart_wireclearidx, xfer->gapless_to_block, xfer->next_block);
+        printf("ttp_repeat_restransmit: restart_pending=1, range %llu to %llu, clear at %llu, gapless to %llu, old head %llu\n",
+               (ull_t) block, (ull_t) xfer->restart_lastidx, (ull_t) xfer->restart_wireclearidx,
+               (ull_t) xfer->gapless_to_block, (ull_t) xfer->next_block);
         #endif
 
         /* reset the retransmission table and head block */
         rexmit->index_max = 0;
         xfer->next_block  = block;
+        if (xfer->super_cache != NULL) {
+            memset(xfer->super_cache->listed, 0, xfer->super_cache->count / 8 + 1);
+            xfer->super_cache->wanted_to = 0;
+        }
 
        xfer->stats.this_retransmits = MAX_RETRANSMISSION_BUFFER;
 
     /* queue is small enough */
     } else {
 
-        /* update to shrunken size */
-        rexmit->index_max = count;
+        /* update to shrunken size, which super_requests() did for its table */
+        if (xfer->super_cache == NULL) {
+            rexmit->index_max = count;
+            wanted            = count;
+        }
 
         /* update the statistics */
-        xfer->stats.this_retransmits   = count;
-        xfer->stats.total_retransmits += count;
+        xfer->stats.this_retransmits   = wanted;
+        xfer->stats.total_retransmits += wanted;
 
         /* send out the requests */
         if (count > 0) {
@@ -413,26 +848,39 @@ int ttp_repeat_retransmit(ttp_session_t *session)
 
 
 /*------------------------------------------------------------------------
- * int ttp_request_retransmit(ttp_session_t *session, u_int32_t block);
+ * int ttp_request_retransmit(ttp_session_t *session, u_int64_t block);
  *
  * Requests a retransmission of the given block in the current transfer.
- * Returns 0 on success and non-zero otherwise.
+ * In super-block mode the table lists the super-block of the block
+ * instead, once, and the blocks it misses are only looked up when the
+ * requests go out.  Returns 0 on success and non-zero otherwise.
  *------------------------------------------------------------------------*/
-int ttp_request_retransmit(ttp_session_t *session, u_int32_t block)
+int ttp_request_retransmit(ttp_session_t *session, u_int64_t block)
 {
    #ifdef RETX_REQBLOCK_SORTING
-   u_int32_t     tmp32_ins = 0, tmp32_up;
+   u_int64_t     tmp64_ins = 0, tmp64_up;
    u_int32_t     idx = 0;
    #endif
 
-   u_int32_t    *ptr;
+   u_int64_t    *ptr;
+   u_int64_t     super = 0;
    retransmit_t *rexmit = &(session->transfer.retransmit);
+   super_cache_t *cache = session->transfer.super_cache;
 
    /* double checking: if we already got the block, don't add it */
    if (got_block(session, block)) {
       return 0;
    }
 
+   /* a super-block goes into the table once, whatever it misses */
+   if (cache != NULL) {
+      super = (block - 1) / cache->blocks;
+      cache->wanted_to = max(cache->wanted_to, block);
+      if (cache->listed[super / 8] & (1 << (super % 8)))
+         return 0;
+      block = super + 1;
+   }
+
    /* if we don't have space for the request */
    if (rexmit->index_max >= rexmit->table_size) {
 
@@ -441,13 +889,13 @@ int ttp_request_retransmit(ttp_session_t *session, u_int32_t block)
          return 0;
 
       /* try to reallocate the table twice the size*/
-      ptr = (u_int32_t *) realloc(rexmit->table, 2 * sizeof(u_int32_t)*rexmit->table_size);
+      ptr = (u_int64_t *) realloc(rexmit->table, 2 * sizeof(u_int64_t)*rexmit->table_size);
       if (ptr == NULL)
          return warn("Could not grow retransmission table");
 
       /* prepare the new table space */
       rexmit->table = ptr;
-      memset(rexmit->table + rexmit->table_size, 0, sizeof(u_int32_t) * rexmit->table_size);
+      memset(rexmit->table + rexmit->table_size, 0, sizeof(u_int64_t) * rexmit->table_size);
       rexmit->table_size *= 2;
 
       #if DEBUG_RETX
@@ -455,6 +903,9 @@ int ttp_request_retransmit(ttp_session_t *session, u_int32_t block)
       #endif
    }
 
+   if (cache != NULL)
+      cache->listed[super / 8] |= (1 << (super % 8));
+
    #ifndef RETX_REQBLOCK_SORTING
 
    /* store the request */
@@ -484,11 +935,11 @@ int ttp_request_retransmit(ttp_session_t *session, u_int32_t block)
       // fprintf(stderr, "duplicate retransmit req for block %d discarded\n", block);
    } else { 
       /* insert and shift remaining table upwards - linked list could be nice... */
-      tmp32_ins = block;
+      tmp64_ins = block;
       do {
-         tmp32_up = rexmit->table[idx];
-         rexmit->table[idx++] = tmp32_ins;
-         tmp32_ins = tmp32_up;
+         tmp64_up = rexmit->table[idx];
+         rexmit->table[idx++] = tmp64_ins;
+         tmp64_ins = tmp64_up;
       } while(idx <= rexmit->index_max);
       rexmit->index_max++;
    }
@@ -533,6 +984,298 @@ int ttp_request_stop(ttp_session_t *session)
 }
 
 
+/*------------------------------------------------------------------------
+ * int ttp_send_delta(ttp_session_t *session);
+ *
+ * Sends the server the digests of the blocks of the old copy of the file
+ * we have, in rounds of a 32-bit count followed by DELTA_DIGEST bytes
+ * per block and ended by a count of 0, and marks the blocks the server
+ * finds unchanged as received.  The local file is then cut to the size
+ * of the server's.  Returns 0 on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_send_delta(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param = session->parameter;
+    struct stat      filestat;
+    u_char          *digest;
+    u_int64_t        blocks, block;
+    u_int32_t        count, value32;
+
+    /* only the blocks the local file holds in full can match */
+    if (fstat(fileno(xfer->file), &filestat) < 0)
+        return warn("Could not stat the local file");
+    if ((u_int64_t) filestat.st_size >= xfer->file_size)
+        blocks = xfer->block_count;
+    else
+        blocks = filestat.st_size / param->block_size;
+
+    /* hash them and send the digests a round at a time */
+    digest = (u_char *) malloc(DELTA_ROUND * DELTA_DIGEST);
+    if (digest == NULL)
+        return warn("Could not allocate the block digest buffer");
+    for (block = 1; block <= blocks; block += count) {
+        count = min(DELTA_ROUND, blocks - block + 1);
+        if (delta_hash(fileno(xfer->file), xfer->file_size, param->block_size, block, count, digest) < 0) {
+            free(digest);
+            return warn("Could not hash the local file");
+        }
+        value32 = htonl(count);
+        if ((fwrite(&value32, 4, 1, session->server) < 1) || (fwrite(digest, DELTA_DIGEST, count, session->server) < count)) {
+            free(digest);
+            return warn("Could not send the block digests");
+        }
+    }
+    free(digest);
+    value32 = 0;
+    if ((fwrite(&value32, 4, 1, session->server) < 1) || fflush(session->server))
+        return warn("Could not send the end of the block digests");
+
+    /* the server answers with the blocks that match */
+    if (ttp_read_blockmap(session, xfer->received) < 0)
+        return warn("Could not read the matching blocks");
+
+    /* the file ends where the server's does */
+    if (((u_int64_t) filestat.st_size > xfer->file_size) && (ftruncate(fileno(xfer->file), xfer->file_size) < 0))
+        return warn("Could not truncate the local file");
+
+    printf("Delta: %llu of %llu blocks of '%s' unchanged\n", (ull_t) blockmap_count(xfer->received),
+           (ull_t) xfer->block_count, xfer->local_filename);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_read_blockmap(ttp_session_t *session, blockmap_t *map);
+ *
+ * Reads a list of blocks from the server, a 32-bit encoding and a 64-bit
+ * length followed by the blocks as encoded by blockmap_encode(), and
+ * marks them in the given bitfield.  Returns 0 on success and non-zero
+ * on failure.
+ *------------------------------------------------------------------------*/
+int ttp_read_blockmap(ttp_session_t *session, blockmap_t *map)
+{
+    u_int64_t  length;
+    u_int32_t  encoding;
+    u_char    *blocks;
+
+    if ((fread(&encoding, 4, 1, session->server) < 1) || (fread(&length, 8, 1, session->server) < 1))
+        return warn("Could not read the block list encoding");
+    encoding = ntohl(encoding);
+    length   = ntohll(length);
+    if (length > map->blocks / 8 + 1)
+        return warn("Block list is longer than a bitfield");
+    if (length == 0)
+        return 0;
+
+    blocks = (u_char *) malloc(length);
+    if (blocks == NULL)
+        return warn("Could not allocate the block list");
+    if ((fread(blocks, 1, length, session->server) < length) || (blockmap_decode(map, encoding, blocks, length) < 0)) {
+        free(blocks);
+        return warn("Could not read the block list");
+    }
+    free(blocks);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_read_growth(ttp_session_t *session, u_int64_t block);
+ *
+ * Reads the growth of a followed file from the server, a 64-bit file
+ * size and block count at a time, until the given block is part of
+ * the file, and makes room for the new blocks.  The server sends the
+ * growth before the blocks, so this only waits for the control channel
+ * to catch up with the data.  It is read past stdio, which could not
+ * write our feedback to the socket again while it holds the start of
+ * further growth in its buffer.  Returns 0 on success and non-zero on
+ * failure.
+ *------------------------------------------------------------------------*/
+int ttp_read_growth(ttp_session_t *session, u_int64_t block)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+    u_int64_t       file_size, block_count;
+
+    while (xfer->block_count < block) {
+        if (full_read(fileno(session->server), &file_size,   8) < 8) return warn("Could not read file size");
+        if (full_read(fileno(session->server), &block_count, 8) < 8) return warn("Could not read number of blocks");
+        file_size   = ntohll(file_size);
+        block_count = ntohll(block_count);
+        if ((block_count <= xfer->block_count) || (file_size > block_count * session->parameter->block_size))
+            return warn("Server sent an impossible growth of the file");
+
+        /* the disk thread extends its own bitfield as the blocks get there */
+        if (blockmap_grow(xfer->received, block_count) < 0)
+            return warn("Could not extend the received-data bitfield");
+        xfer->blocks_left += block_count - xfer->block_count;
+        xfer->block_count  = block_count;
+        xfer->file_size    = file_size;
+    }
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_read_holes(ttp_session_t *session);
+ *
+ * Reads the blocks that lie wholly in holes of the server's file and
+ * marks them as received.  Whatever the local file holds there is cut
+ * out of it, punching holes where the file system can, and the file is
+ * extended to its full size, so that the holes stay holes.  Returns 0
+ * on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_read_holes(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param = session->parameter;
+    blockmap_t      *holes;
+    struct stat      filestat;
+    u_int64_t        first, last, offset, end;
+    int              status = 0;
+
+    holes = blockmap_create(xfer->block_count);
+    if (holes == NULL)
+        error("Could not allocate the hole bitfield");
+    if ((ttp_read_blockmap(session, holes) < 0) || (fstat(fileno(xfer->file), &filestat) < 0)) {
+        blockmap_destroy(holes);
+        return warn("Could not read the holes of the file");
+    }
+
+    for (first = blockmap_next(holes, 1, 1); (first <= xfer->block_count) && (status == 0); first = blockmap_next(holes, last + 1, 1)) {
+        last = blockmap_next(holes, first, 0) - 1;
+
+        /* clear what an older copy of the file has there */
+        offset = (first - 1) * param->block_size;
+        end    = min(min(last * param->block_size, xfer->file_size), (u_int64_t) filestat.st_size);
+        if ((offset < end) && (punch_hole(fileno(xfer->file), offset, end - offset) < 0))
+            status = warn("Could not clear a hole in the local file");
+        if (blockmap_set_range(xfer->received, first, last) < 0)
+            error("Could not allocate a received-data bitfield page");
+    }
+    if ((status == 0) && ((u_int64_t) filestat.st_size < xfer->file_size) && (ftruncate(fileno(xfer->file), xfer->file_size) < 0))
+        status = warn("Could not extend the local file");
+
+    if (param->verbose_yn)
+        printf("Sparse: %llu of %llu blocks are holes\n", (ull_t) blockmap_count(holes), (ull_t) xfer->block_count);
+    blockmap_destroy(holes);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_read_manifest(ttp_session_t *session);
+ *
+ * Reads the manifest of the bundle being transferred from the server,
+ * as ttp_send_manifest() sends it, into a new bundle that goes into
+ * the local filename of the transfer as its directory.  The sizes of
+ * the entries have to add up to the size of the stream.  Returns 0 on
+ * success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_read_manifest(ttp_session_t *session)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+    char            name[65536];
+    u_int64_t       size;
+    u_int32_t       count, mode, index;
+    u_int16_t       length;
+
+    xfer->bundle = bundle_create(xfer->local_filename);
+    if (xfer->bundle == NULL)
+        error("Could not allocate the bundle");
+
+    if (fread(&count, 4, 1, session->server) < 1)
+        return warn("Could not read the number of bundle entries");
+    count = ntohl(count);
+
+    for (index = 0; index < count; ++index) {
+        if (fread(&size,   8, 1, session->server) < 1) return warn("Could not read the size of a bundle entry");
+        if (fread(&mode,   4, 1, session->server) < 1) return warn("Could not read the mode of a bundle entry");
+        if (fread(&length, 2, 1, session->server) < 1) return warn("Could not read the name of a bundle entry");
+        length = ntohs(length);
+        if ((length > 0) && (fread(name, length, 1, session->server) < 1))
+            return warn("Could not read the name of a bundle entry");
+        name[length] = '\0';
+        if ((strlen(name) != length) || (bundle_add(xfer->bundle, name, ntohll(size), ntohl(mode)) < 0))
+            return warn("Invalid bundle entry");
+    }
+
+    if (xfer->bundle->size != xfer->file_size)
+        return warn("The bundle manifest does not add up to the size of the stream");
+    if (session->parameter->verbose_yn)
+        printf("Bundle of %u entries into '%s'\n", count, xfer->local_filename);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_send_skip(ttp_session_t *session);
+ *
+ * Tells the server which blocks we already hold, so that it leaves them
+ * out of its first pass: a 32-bit encoding and 64-bit length, followed
+ * by the blocks as encoded by blockmap_encode().  Returns 0 on success
+ * and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_send_skip(ttp_session_t *session)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+    u_int64_t       length, value64;
+    u_int32_t       encoding, value32;
+    u_char         *held;
+
+    /* encode the blocks */
+    length = blockmap_encode(xfer->received, NULL, &encoding);
+    held   = (u_char *) malloc(length + 1);
+    if (held == NULL)
+        return warn("Could not allocate the held blocks list");
+    blockmap_encode(xfer->received, held, &encoding);
+
+    /* and send them */
+    value32 = htonl(encoding);
+    value64 = htonll(length);
+    if ((fwrite(&value32, 4, 1, session->server) < 1) || (fwrite(&value64, 8, 1, session->server) < 1) ||
+        (fwrite(held, 1, length, session->server) < length)) {
+        free(held);
+        return warn("Could not send the held blocks");
+    }
+    free(held);
+
+    if (fflush(session->server))
+        return warn("Could not flush control channel");
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_size_buffer(ttp_session_t *session, u_int32_t size);
+ *
+ * Asks for a UDP receive buffer of the given size on the data socket
+ * and remembers what the kernel actually granted.  Both go to the
+ * transcript, so that truncated buffers don't go unnoticed.  Returns 0
+ * on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_size_buffer(ttp_session_t *session, u_int32_t size)
+{
+    ttp_transfer_t  *xfer = &session->transfer;
+    char             buffer_line[96];
+
+    /* set the buffer and read back the real size */
+    xfer->udp_request = size;
+    xfer->udp_buffer  = set_udp_buffer(xfer->udp_fd, 0, size);
+    if (xfer->udp_buffer == 0)
+        return warn("Could not size the UDP receive buffer");
+
+    /* report it */
+    snprintf(buffer_line, sizeof(buffer_line), "UDPBUF requested %u granted %u bytes\n", size, xfer->udp_buffer);
+    if (session->parameter->verbose_yn)
+        printf("%s", buffer_line);
+    if (session->parameter->transcript_yn)
+        xscript_data_log(session, buffer_line);
+
+    return 0;
+}
+
+
 /*------------------------------------------------------------------------
  * int ttp_update_stats(ttp_session_t *session);
  *
@@ -556,13 +1299,15 @@ int ttp_update_stats(ttp_session_t *session)
     double            data_this_goodpt;                       /* the amount of data as non-lost packets         */
     double            retransmits_fraction;                   /* how many retransmit requests there were vs received blocks */
     double            total_retransmits_fraction;
-    double            ringfill_fraction;
+    u_int64_t         disk_blocks, disk_usec;                 /* disk thread progress during this interval      */
+    u_int64_t         free_slots;                             /* free ring and spill slots                      */
+    u_int32_t         drain_rate;                             /* the blocks/s the disk drains, 0 if unknown     */
+    u_int32_t         share_rate;                             /* the blocks/s of a parallel session's share     */
     statistics_t     *stats = &(session->transfer.stats);
     retransmission_t  retransmission;
     int               status;
-    static u_int32_t  iteration = 0;
-    static char       stats_line[128];
-    static char       stats_flags[8];
+    char              stats_line[128];
+    char              stats_flags[8];
 
     double ff, fb;
 
@@ -592,7 +1337,6 @@ int ttp_update_stats(ttp_session_t *session)
 
     /* precalculate some fractions */
     retransmits_fraction = stats->this_retransmits / (1.0 + stats->this_retransmits + stats->total_blocks - stats->this_blocks);
-    ringfill_fraction    = session->transfer.ring_buffer->count_data / MAX_BLOCKS_QUEUED;
     total_retransmits_fraction = stats->total_retransmits / (stats->total_retransmits + stats->total_blocks);
 
     /* update the rate statistics */
@@ -607,39 +1351,76 @@ int ttp_update_stats(ttp_session_t *session)
     // IIR filter rate R
     stats->transmit_rate = fb * stats->transmit_rate + ff * stats->this_transmit_rate;
 
-    // IIR filtered composite error and loss, some sort of knee function
-    stats->error_rate = fb * stats->error_rate + ff * 500*100 * (retransmits_fraction + ringfill_fraction);
-        
-    /* send the current error rate information to the server */
+    // IIR filtered network error and loss, some sort of knee function
+    // (receiver disk backpressure is reported separately as flow control below)
+    stats->error_rate = fb * stats->error_rate + ff * 500*100 * retransmits_fraction;
+
+    /* note the ring buffer high-water mark */
+    stats->ring_peak = max(stats->ring_peak, (u_int32_t) session->transfer.ring_buffer->count_data);
+
+    /* grow an automatic receive buffer when the incoming rate outgrows it */
+    if (session->parameter->udp_buffer == 0) {
+        u_int32_t wanted = udp_buffer_for_path(DEFAULT_UDP_BUFFER, stats->transmit_rate * u_mega, session->transfer.rtt_usec);
+        if (wanted > 1.25 * session->transfer.udp_request)
+            ttp_size_buffer(session, wanted);
+    }
+
+    /* find the disk drain rate while busy, and the free space left for incoming blocks */
+    disk_blocks = session->transfer.disk_blocks - stats->this_disk_blocks;
+    disk_usec   = session->transfer.disk_usec   - stats->this_disk_usec;
+    stats->this_disk_blocks += disk_blocks;
+    stats->this_disk_usec   += disk_usec;
+    free_slots  = MAX_BLOCKS_QUEUED - 1 - session->transfer.ring_buffer->count_data;
+    if (session->transfer.spill_buffer != NULL)
+        free_slots += session->transfer.spill_buffer->capacity - spill_count(session->transfer.spill_buffer);
+    drain_rate  = (disk_usec > 0) ? (u_int32_t) min(1e6 * disk_blocks / disk_usec, 4e9) : 0;
+
+    /* a session of a parallel get goes no faster than its share of the common target rate */
+    if (session->parallel != NULL) {
+        share_rate = (u_int32_t) max(parallel_share(session) / (8.0 * session->parameter->block_size), 1);
+        if ((drain_rate == 0) || (share_rate < drain_rate)) {
+            drain_rate = share_rate;
+            free_slots = 0;
+        }
+    }
+
+    /* send the current error rate and flow control information to the server */
     memset(&retransmission, 0, sizeof(retransmission));
     retransmission.request_type = htons(REQUEST_ERROR_RATE);
     retransmission.error_rate   = htonl((u_int64_t) session->transfer.stats.error_rate);
     status = fwrite(&retransmission, sizeof(retransmission), 1, session->server);
+    if (status > 0) {
+        retransmission.request_type = htons(REQUEST_FLOW_CONTROL);
+        retransmission.block        = htonll(free_slots);
+        retransmission.error_rate   = htonl(drain_rate);
+        status = fwrite(&retransmission, sizeof(retransmission), 1, session->server);
+    }
     if ((status <= 0) || fflush(session->server))
         return warn("Could not send error rate information");
 
     /* build the stats string */    
-    sprintf(stats_flags, "%c%c",
+    sprintf(stats_flags, "%c%c%c",
                ((session->transfer.restart_pending) ? 'R' : '-'),
-               (!(session->transfer.ring_buffer->space_ready) ? 'F' : '-')
+               (!(session->transfer.ring_buffer->space_ready) ? 'F' : '-'),
+               (spill_count(session->transfer.spill_buffer) > 0 ? 'S' : '-')
     );
     #ifdef STATS_MATLABFORMAT
-    sprintf(stats_line, "%02d\t%02d\t%02d\t%03d\t%4u\t%6.2f\t%6.1f\t%5.1f\t%7u\t%6.1f\t%6.1f\t%5.1f\t%5d\t%5d\t%7u\t%8u\t%8Lu\t%s\n",
+    sprintf(stats_line, "%02d\t%02d\t%02d\t%03d\t%4llu\t%6.2f\t%6.1f\t%5.1f\t%7llu\t%6.1f\t%6.1f\t%5.1f\t%5d\t%5d\t%7llu\t%8u\t%8Lu\t%s\n",
     #else
-    sprintf(stats_line, "%02d:%02d:%02d.%03d %4u %6.2fM %6.1fMbps %5.1f%% %7u %6.1fG %6.1fMbps %5.1f%% %5d %5d %7u %8u %8Lu %s\n",
+    sprintf(stats_line, "%02d:%02d:%02d.%03d %4llu %6.2fM %6.1fMbps %5.1f%% %7llu %6.1fG %6.1fMbps %5.1f%% %5d %5d %7llu %8u %8Lu %s\n",
     #endif
         hours, minutes, seconds, milliseconds,
-        stats->total_blocks - stats->this_blocks,
+        (ull_t)(stats->total_blocks - stats->this_blocks),
         stats->this_retransmit_rate,
         stats->this_transmit_rate,
         100.0 * retransmits_fraction,
-        session->transfer.stats.total_blocks,
+        (ull_t)session->transfer.stats.total_blocks,
         data_total / u_giga,
         data_total_rate,
         100.0 * total_retransmits_fraction,
         session->transfer.retransmit.index_max,
         session->transfer.ring_buffer->count_data,
-        session->transfer.blocks_left, 
+        (ull_t)session->transfer.blocks_left,
         stats->this_retransmits,
         (ull_t)(stats->this_udp_errors - stats->start_udp_errors),
         stats_flags
@@ -654,15 +1435,15 @@ int ttp_update_stats(ttp_session_t *session)
             printf("Current time:   %s\n", ctime(&now_epoch));
             printf("Elapsed time:   %02d:%02d:%02d.%03d\n\n", hours, minutes, seconds, milliseconds);
             printf("Last interval\n--------------------------------------------------\n");
-            printf("Blocks count:     %u\n",             stats->total_blocks - stats->this_blocks);
+            printf("Blocks count:     %llu\n",           (ull_t)(stats->total_blocks - stats->this_blocks));
             printf("Data transferred: %0.2f GB\n",       data_this  / u_giga);
             printf("Transfer rate:    %0.2f Mbps\n",     stats->this_transmit_rate);
             printf("Retransmissions:  %u (%0.2f%%)\n\n", stats->this_retransmits, 100.0*retransmits_fraction);
             printf("Cumulative\n--------------------------------------------------\n");
-            printf("Blocks count:     %u\n",             session->transfer.stats.total_blocks);
+            printf("Blocks count:     %llu\n",           (ull_t)session->transfer.stats.total_blocks);
             printf("Data transferred: %0.2f GB\n",       data_total / u_giga);
             printf("Transfer rate:    %0.2f Mbps\n",     data_total_rate);
-            printf("Retransmissions:  %u (%0.2f%%)\n",   stats->total_retransmits, 100.0*total_retransmits_fraction);
+            printf("Retransmissions:  %llu (%0.2f%%)\n", (ull_t)stats->total_retransmits, 100.0*total_retransmits_fraction);
             printf("Flags          :  %s\n\n",           stats_flags);
             printf("OS UDP rx errors: %llu\n",           (ull_t)(stats->this_udp_errors - stats->start_udp_errors));
 
@@ -671,7 +1452,7 @@ int ttp_update_stats(ttp_session_t *session)
 
             /* print a header if necessary */
             #ifndef STATS_NOHEADER
-            if (!(iteration++ % 23)) {
+            if (!(stats->iteration++ % 23)) {
                 printf("             last_interval                   transfer_total                   buffers      transfer_remaining  OS UDP\n");
                 printf("time          blk    data       rate rexmit     blk    data       rate rexmit queue  ring     blk   rt_len      err \n");
             }
@@ -687,6 +1468,10 @@ int ttp_update_stats(ttp_session_t *session)
     if (session->parameter->transcript_yn)
         xscript_data_log(session, stats_line);
 
+    /* and tell a program we are embedded in */
+    if ((session->progress != NULL) && (session->progress(session) != 0))
+        session->cancelled = 1;
+
     /* reset the statistics for the next interval */
     stats->this_blocks              = stats->total_blocks;
     stats->this_retransmits         = 0;
@@ -699,6 +1484,65 @@ int ttp_update_stats(ttp_session_t *session)
 }
 
 
+/*------------------------------------------------------------------------
+ * int ttp_verify_file(ttp_session_t *session);
+ *
+ * Computes the CRC32C tree hash of the file we just received, or of
+ * the byte range we fetched of it, and compares it with the one the
+ * server sends after our stop request.  Returns 1 if they match, 0 if
+ * they differ and -1 on error.
+ *------------------------------------------------------------------------*/
+int ttp_verify_file(ttp_session_t *session)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+    char            digest_line[80];
+    crc32c_tree_t   tree;
+    u_int64_t       start = 0, length = xfer->file_size;
+    int             fd, status;
+
+    /* a stream hashed its data on the way out, otherwise hash what reached the disk or memory */
+    if (xfer->stream != NULL) {
+        xfer->digest = crc32c_tree_end(&xfer->stream->tree);
+    } else if (xfer->bundle != NULL) {
+        if (bundle_digest(xfer->bundle, &xfer->digest) < 0)
+            return warn("Could not hash the received bundle");
+    } else if (xfer->sink == sink_find("memory")) {
+        memset(&tree, 0, sizeof(tree));
+        crc32c_tree_add(&tree, session->parameter->sink_memory, xfer->file_size);
+        xfer->digest = crc32c_tree_end(&tree);
+    } else if (xfer->file == NULL) {
+        /* the null and callback sinks kept nothing to hash, but the server's hash still has to be taken */
+        if (fread(&xfer->server_digest, 4, 1, session->server) < 1)
+            return warn("Could not read the file digest of the server");
+        return -1;
+    } else {
+        if (fflush(xfer->file) || ((fd = open(xfer->local_filename, O_RDONLY)) < 0))
+            return warn("Could not reopen the received file for hashing");
+        if (xfer->options & TS_OPT_RANGE) {
+            start  = min(session->range_offset, xfer->file_size);
+            length = min(session->range_length, xfer->file_size - start);
+        }
+        status = crc32c_tree_range(fd, start, length, &xfer->digest);
+        close(fd);
+        if (status < 0)
+            return warn("Could not hash the received file");
+    }
+
+    /* and get the server's hash */
+    if (fread(&xfer->server_digest, 4, 1, session->server) < 1)
+        return warn("Could not read the file digest of the server");
+    xfer->server_digest = ntohl(xfer->server_digest);
+
+    /* log it */
+    snprintf(digest_line, sizeof(digest_line), "DIGEST crc32c tree %08x server %08x (%s)\n",
+             xfer->digest, xfer->server_digest, crc32c_engine());
+    if (session->parameter->transcript_yn)
+        xscript_data_log(session, digest_line);
+
+    return (xfer->digest == xfer->server_digest);
+}
+
+
 /*========================================================================
  * $Log: protocol.c,v $
  * Revision 1.30  2009/12/22 23:01:21  jwagnerhki
@@ -0,0 +1,253 @@
+/*========================================================================
+ * resume.c  --  Received-block state for resuming Tsunami transfers.
+ *
+ * This contains the routines that keep the record of which blocks of a
+ * file have been written, in a state file next to the file, during a
+ * transfer and when it ends before every block is in.  A later get of
+ * the same file picks the record up, has the blocks checked against the
+ * server's Merkle tree and asks only for the rest; the resume command
+ * takes the record as it is.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <errno.h>    /* for errno                    */
+#include <stdio.h>    /* for rename()                 */
+#include <stdlib.h>   /* for malloc(), free(), etc.   */
+#include <string.h>   /* for string-handling routines */
+#include <unistd.h>   /* for access(), fsync(), etc.  */
+
+#include <tsunami-client.h>
+
+
+/*------------------------------------------------------------------------
+ * Module-scope constants.
+ *------------------------------------------------------------------------*/
+
+#define RESUME_POSTFIX  ".tsresume"  /* appended to the local filename   */
+#define RESUME_TEMP     ".tmp"       /* appended while a record is new   */
+#define RESUME_MAGIC    "TSRESUME"   /* the first bytes of a state file  */
+#define RESUME_HEADER   28           /* magic, file size, block size and count */
+
+
+/*------------------------------------------------------------------------
+ * char *resume_name(const char *local_filename);
+ *
+ * Returns the name of the state file that belongs to the given local
+ * file, in memory the caller has to free.
+ *------------------------------------------------------------------------*/
+static char *resume_name(const char *local_filename)
+{
+    char *name;
+
+    name = (char *) malloc(strlen(local_filename) + sizeof(RESUME_POSTFIX) + sizeof(RESUME_TEMP));
+    if (name == NULL)
+        error("Could not allocate state filename");
+    strcpy(name, local_filename);
+    strcat(name, RESUME_POSTFIX);
+    return name;
+}
+
+
+/*------------------------------------------------------------------------
+ * int resume_exists(const char *local_filename);
+ *
+ * Returns nonzero if both the given local file and a state file for it
+ * exist, so that a transfer of it can be resumed.
+ *------------------------------------------------------------------------*/
+int resume_exists(const char *local_filename)
+{
+    char *name = resume_name(local_filename);
+    int   found;
+
+    found = !access(local_filename, W_OK) && !access(name, R_OK);
+    free(name);
+    return found;
+}
+
+
+/*------------------------------------------------------------------------
+ * int resume_load(ttp_session_t *session);
+ *
+ * Marks the blocks recorded in the state file of the local file as
+ * received, if the record was made for a file of the same size cut
+ * into blocks of the same size.  Returns 0 on success and -1 if there
+ * is no such record.
+ *------------------------------------------------------------------------*/
+int resume_load(ttp_session_t *session)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+    u_char          header[RESUME_HEADER];
+    u_int64_t       file_size, block_count;
+    u_int32_t       block_size;
+    FILE           *state;
+    char           *name;
+    int             status = -1;
+
+    name  = resume_name(xfer->local_filename);
+    state = fopen(name, "rb");
+    free(name);
+    if (state == NULL)
+        return -1;
+
+    /* the header has to describe the same file and blocks */
+    if ((fread(header, RESUME_HEADER, 1, state) == 1) && !memcmp(header, RESUME_MAGIC, 8)) {
+        memcpy(&file_size,   header + 8,  8);
+        memcpy(&block_size,  header + 16, 4);
+        memcpy(&block_count, header + 20, 8);
+        if ((ntohll(file_size) == xfer->file_size) && (ntohl(block_size) == session->parameter->block_size) &&
+            (ntohll(block_count) == xfer->block_count))
+            status = blockmap_read(xfer->received, state);
+    }
+    fclose(state);
+
+    /* anything half-read is worthless */
+    if (status < 0) {
+        blockmap_clear_range(xfer->received, 1, xfer->block_count);
+        return warn("State file does not match the file on the server");
+    }
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int resume_save(ttp_session_t *session);
+ *
+ * Writes the record of the blocks written so far to the state file of
+ * the local file.  The file data is synced to disk first, and the record
+ * goes to a temporary file that is synced and then renamed over the old
+ * one, so that a crash at any point leaves a record that is true.  Only
+ * the thread that writes the file may call this.  Returns 0 on success
+ * and non-zero on error, or if the sink left no local file to resume
+ * or only a byte range of it was fetched.
+ *------------------------------------------------------------------------*/
+int resume_save(ttp_session_t *session)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+    u_char          header[RESUME_HEADER];
+    u_int64_t       value64;
+    u_int32_t       value32;
+    FILE           *state;
+    char           *name, *temp;
+    int             status = 0;
+
+    if (((xfer->sink != NULL) && !xfer->sink->local) || (session->range_length > 0))
+        return -1;
+
+    /* the blocks have to be on disk before the record says so */
+    if ((xfer->sink != NULL) && (xfer->sink->flush(session) < 0))
+        return warn("Could not flush the sink");
+    if ((xfer->file != NULL) && ((fflush(xfer->file) != 0) || (fsync(fileno(xfer->file)) < 0)))
+        return warn("Could not sync the local file");
+
+    memcpy(header, RESUME_MAGIC, 8);
+    value64 = htonll(xfer->file_size);                 memcpy(header + 8,  &value64, 8);
+    value32 = htonl (session->parameter->block_size);  memcpy(header + 16, &value32, 4);
+    value64 = htonll(xfer->block_count);               memcpy(header + 20, &value64, 8);
+
+    name  = resume_name(xfer->local_filename);
+    temp  = resume_name(xfer->local_filename);
+    strcat(temp, RESUME_TEMP);
+    state = fopen(temp, "wb");
+    if (state == NULL) {
+        free(name);
+        free(temp);
+        return warn("Could not create the state file");
+    }
+    if ((fwrite(header, RESUME_HEADER, 1, state) < 1) || (blockmap_write(xfer->written, state) < 0))
+        status = -1;
+    if ((fflush(state) != 0) || (fsync(fileno(state)) < 0))
+        status = -1;
+    if (fclose(state) != 0)
+        status = -1;
+    if ((status == 0) && (rename(temp, name) < 0))
+        status = -1;
+    if (status < 0)
+        unlink(temp);
+
+    free(name);
+    free(temp);
+    return (status < 0) ? warn("Could not write the state file") : 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int resume_remove(ttp_session_t *session);
+ *
+ * Removes the state file of the local file, if there is one.  Returns 0
+ * on success and non-zero on error.
+ *------------------------------------------------------------------------*/
+int resume_remove(ttp_session_t *session)
+{
+    char *name;
+    int   status;
+
+    /* a sink without a local file has no state file either */
+    if ((session->transfer.sink != NULL) && !session->transfer.sink->local)
+        return 0;
+    name = resume_name(session->transfer.local_filename);
+
+    status = unlink(name);
+    free(name);
+    if ((status < 0) && (errno != ENOENT))
+        return warn("Could not remove the state file");
+    return 0;
+}
+
+
+/*========================================================================
+ * $Log: resume.c,v $
+ */
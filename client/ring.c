@@ -101,6 +101,37 @@ int ring_full(ring_buffer_t *ring)
     return full;
 }
 
+/*------------------------------------------------------------------------
+ * int ring_abandon(ring_buffer *ring);
+ *
+ * Flags the ring as dead once its consumer has stopped draining it, and
+ * wakes up a ring_reserve() waiting for space, which then returns NULL
+ * like every later one.  Returns 0 on success and nonzero on error.
+ *------------------------------------------------------------------------*/
+int ring_abandon(ring_buffer_t *ring)
+{
+    int status;
+
+    /* get a lock on the ring buffer */
+    status = pthread_mutex_lock(&ring->mutex);
+    if (status != 0)
+	error("Could not get access to ring buffer mutex");
+
+    /* no space will come free any more */
+    ring->dead = 1;
+    status = pthread_cond_broadcast(&ring->space_ready_cond);
+    if (status != 0)
+	error("Could not signal space-ready condition");
+
+    /* release the mutex */
+    status = pthread_mutex_unlock(&ring->mutex);
+    if (status != 0)
+	error("Could not relinquish access to ring buffer mutex");
+
+    /* we succeeded */
+    return 0;
+}
+
 /*------------------------------------------------------------------------
  * int ring_cancel(ring_buffer *ring);
  *
@@ -192,7 +223,7 @@ ring_buffer_t *ring_create(ttp_session_t *session)
 	error("Could not allocate ring buffer object");
 
     /* try to allocate the buffer */
-    ring->datagram_size = 6 + session->parameter->block_size;
+    ring->datagram_size = TS_HEADER_SIZE + session->parameter->block_size;
     ring->datagrams = (u_char *) malloc(ring->datagram_size * MAX_BLOCKS_QUEUED);
     if (ring->datagrams == NULL)
 	error("Could not allocate buffer for ring buffer");
@@ -213,6 +244,7 @@ ring_buffer_t *ring_create(ttp_session_t *session)
     if (status != 0)
 	error("Could not create space-ready condition variable");
     ring->space_ready = 1;
+    ring->dead        = 0;
 
     /* initialize the indices */
     ring->count_data     = 0;
@@ -281,12 +313,13 @@ int ring_dump(ring_buffer_t *ring, FILE *out)
     fprintf(out, "count_reserved = %d\n", ring->count_reserved);
     fprintf(out, "data_ready     = %d\n", ring->data_ready);
     fprintf(out, "space_ready    = %d\n", ring->space_ready);
+    fprintf(out, "dead           = %d\n", ring->dead);
 
     /* print out the block list */
     fprintf(out, "block list     = [");
     for (index = ring->base_data; index < ring->base_data + ring->count_data; ++index) {
 	datagram = ring->datagrams + ((index % MAX_BLOCKS_QUEUED) * ring->datagram_size);
-	fprintf(out, "%d ", ntohl(*((u_int32_t *) datagram)));
+	fprintf(out, "%llu ", (ull_t) ntohll(*((u_int64_t *) datagram)));
     }
     fprintf(out, "]\n");
 
@@ -394,7 +427,7 @@ int ring_pop(ring_buffer_t *ring)
  * Reserves a slot in the ring buffer for the next datagram.  A pointer
  * to the memory that should be used to store the datagram is returned.
  * This will block if no space is available in the ring buffer.  Returns
- * NULL on error.
+ * NULL on error and once the ring has been abandoned.
  *------------------------------------------------------------------------*/
 u_char *ring_reserve(ring_buffer_t *ring)
 {
@@ -411,7 +444,7 @@ u_char *ring_reserve(ring_buffer_t *ring)
     next = (ring->base_data + ring->count_data + ring->count_reserved) % MAX_BLOCKS_QUEUED;
 
     /* wait for the space-ready variable to make us happy */
-    while (ring->space_ready == 0) {
+    while ((ring->space_ready == 0) && !ring->dead) {
 	printf("FULL! -- ring_reserve() blocking.\n");
 	printf("space_ready = %d, data_ready = %d\n", ring->space_ready, ring->data_ready);
 	status = pthread_cond_wait(&ring->space_ready_cond, &ring->mutex);
@@ -419,6 +452,12 @@ u_char *ring_reserve(ring_buffer_t *ring)
 	    error("Could not wait for ring buffer to clear space");
     }
 
+    /* the disk thread is gone, nothing would ever take the block */
+    if (ring->dead) {
+	pthread_mutex_unlock(&ring->mutex);
+	return NULL;
+    }
+
     /* perform the reservation */
     if (++(ring->count_reserved) > 1)
 	error("Attempt made to reserve two slots in ring buffer");
@@ -0,0 +1,472 @@
+/*========================================================================
+ * sink.c  --  Block sinks for Tsunami client.
+ *
+ * This contains the backends that the disk thread writes the received
+ * blocks to, picked with 'set sink': the local file through stdio,
+ * through pwrite() with runs of consecutive blocks coalesced, or
+ * through a shared memory mapping, nowhere at all for benchmarking the
+ * network, only into the tree hash for checking a transfer, the
+ * in-order stream of 'set stream', the buffer or the callback that a
+ * program using the library gives, and the files of a bundle.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <stdlib.h>     /* for malloc(), free(), etc.   */
+#include <string.h>     /* for memcpy(), strcasecmp()   */
+#include <sys/mman.h>   /* for mmap(), msync()          */
+#include <sys/stat.h>   /* for fstat()                  */
+#include <unistd.h>     /* for pwrite(), ftruncate()    */
+
+#include <tsunami-client.h>
+
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static int  stdio_open     (ttp_session_t *session);
+static int  stdio_write    (ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length);
+static int  stdio_flush    (ttp_session_t *session);
+static int  stdio_close    (ttp_session_t *session, int complete);
+
+static int  batch_open     (ttp_session_t *session);
+static int  batch_write    (ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length);
+static int  batch_flush    (ttp_session_t *session);
+static int  batch_close    (ttp_session_t *session, int complete);
+static int  batch_put      (ttp_session_t *session, u_int64_t block, const u_char *data, u_int64_t length);
+
+static int  map_open       (ttp_session_t *session);
+static int  map_write      (ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length);
+static int  map_flush      (ttp_session_t *session);
+static int  map_close      (ttp_session_t *session, int complete);
+static int  map_extend     (ttp_session_t *session, u_int64_t size);
+
+static int  null_open      (ttp_session_t *session);
+static int  null_write     (ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length);
+static int  null_close     (ttp_session_t *session, int complete);
+
+static int  memory_open    (ttp_session_t *session);
+static int  memory_write   (ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length);
+static int  callback_open  (ttp_session_t *session);
+static int  callback_write (ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length);
+
+static int  bundle_open    (ttp_session_t *session);
+static int  bundle_put     (ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length);
+static int  bundle_finish  (ttp_session_t *session, int complete);
+
+static int  hash_open      (ttp_session_t *session);
+static int  stream_sink_open(ttp_session_t *session);
+static int  in_order_write (ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length);
+static int  in_order_close (ttp_session_t *session, int complete);
+
+/* the run of consecutive blocks the pwrite sink holds */
+typedef struct {
+    u_char             *buffer;       /* the data of the run                        */
+    u_int64_t           first;        /* the first block of the run                 */
+    u_int32_t           blocks;       /* the blocks in the run, 0 for none          */
+    u_int32_t           bytes;        /* the bytes in the run                       */
+} batch_t;
+
+/* the mapping of the mmap sink */
+typedef struct {
+    u_char             *base;         /* the start of the mapping, NULL if empty    */
+    u_int64_t           length;       /* the bytes mapped                           */
+} map_t;
+
+/* the sinks, the default first */
+static const sink_t sink_list[] = {
+    { "stdio",    1, stdio_open,       stdio_write,    stdio_flush, stdio_close    },
+    { "pwrite",   1, batch_open,       batch_write,    batch_flush, batch_close    },
+    { "mmap",     1, map_open,         map_write,      map_flush,   map_close      },
+    { "null",     0, null_open,        null_write,     null_open,   null_close     },
+    { "hash",     0, hash_open,        in_order_write, null_open,   in_order_close },
+    { "stream",   0, stream_sink_open, in_order_write, null_open,   in_order_close },
+    { "memory",   0, memory_open,      memory_write,   null_open,   null_close     },
+    { "callback", 0, callback_open,    callback_write, null_open,   null_close     },
+    { "bundle",   0, bundle_open,      bundle_put,     null_open,   bundle_finish  }
+};
+#define SINKS (sizeof(sink_list) / sizeof(sink_list[0]))
+
+
+/*------------------------------------------------------------------------
+ * const sink_t *sink_find(const char *name);
+ *
+ * Returns the sink of the given name, or NULL if there is none.
+ *------------------------------------------------------------------------*/
+const sink_t *sink_find(const char *name)
+{
+    u_int32_t index;
+
+    for (index = 0; index < SINKS; ++index)
+        if (!strcasecmp(sink_list[index].name, name))
+            return &sink_list[index];
+    return NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * The local file through stdio, a seek and a write for each block.
+ *------------------------------------------------------------------------*/
+
+static int stdio_open(ttp_session_t *session)
+{
+    return 0;
+}
+
+static int stdio_write(ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    FILE *file = session->transfer.file;
+
+    if (fseeko(file, ((u_int64_t) session->parameter->block_size) * (block - 1), SEEK_SET) < 0)
+        return -1;
+    return (fwrite(data, 1, length, file) < length) ? -1 : 0;
+}
+
+static int stdio_flush(ttp_session_t *session)
+{
+    return fflush(session->transfer.file) ? -1 : 0;
+}
+
+static int stdio_close(ttp_session_t *session, int complete)
+{
+    return stdio_flush(session);
+}
+
+
+/*------------------------------------------------------------------------
+ * The local file through pwrite(), which gets up to SINK_BATCH blocks
+ * at once as long as they come in order, as they mostly do.
+ *------------------------------------------------------------------------*/
+
+static int batch_open(ttp_session_t *session)
+{
+    batch_t *batch = (batch_t *) calloc(1, sizeof(batch_t));
+
+    if (batch != NULL)
+        batch->buffer = (u_char *) malloc(SINK_BATCH * session->parameter->block_size);
+    if ((batch == NULL) || (batch->buffer == NULL)) {
+        free(batch);
+        return warn("Could not allocate the write batch");
+    }
+    session->transfer.sink_data = batch;
+    return 0;
+}
+
+static int batch_write(ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    batch_t   *batch      = (batch_t *) session->transfer.sink_data;
+    u_int32_t  block_size = session->parameter->block_size;
+
+    /* a block that does not extend the run ends it */
+    if ((batch->blocks > 0) && ((block != batch->first + batch->blocks) || (batch->bytes + length > SINK_BATCH * block_size)))
+        if (batch_flush(session) < 0)
+            return -1;
+
+    /* several blocks at once go straight out */
+    if (length > block_size)
+        return batch_put(session, block, data, length);
+
+    if (batch->blocks == 0)
+        batch->first = block;
+    memcpy(batch->buffer + batch->bytes, data, length);
+    batch->bytes  += length;
+    batch->blocks += 1;
+    return 0;
+}
+
+static int batch_flush(ttp_session_t *session)
+{
+    batch_t *batch = (batch_t *) session->transfer.sink_data;
+    int      status;
+
+    if ((batch == NULL) || (batch->blocks == 0))
+        return 0;
+    status = batch_put(session, batch->first, batch->buffer, batch->bytes);
+    batch->blocks = 0;
+    batch->bytes  = 0;
+    return status;
+}
+
+static int batch_close(ttp_session_t *session, int complete)
+{
+    batch_t *batch  = (batch_t *) session->transfer.sink_data;
+    int      status = batch_flush(session);
+
+    if (batch != NULL)
+        free(batch->buffer);
+    free(batch);
+    session->transfer.sink_data = NULL;
+    return status;
+}
+
+static int batch_put(ttp_session_t *session, u_int64_t block, const u_char *data, u_int64_t length)
+{
+    int       fd     = fileno(session->transfer.file);
+    u_int64_t offset = ((u_int64_t) session->parameter->block_size) * (block - 1);
+    ssize_t   status;
+
+    while (length > 0) {
+        status = pwrite(fd, data, length, offset);
+        if (status <= 0)
+            return -1;
+        data   += status;
+        length -= status;
+        offset += status;
+    }
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * The local file through a shared memory mapping, which the file is
+ * extended to the full size for; a followed file extends it further.
+ *------------------------------------------------------------------------*/
+
+static int map_open(ttp_session_t *session)
+{
+    session->transfer.sink_data = calloc(1, sizeof(map_t));
+    if (session->transfer.sink_data == NULL)
+        return warn("Could not allocate the mapping state");
+    if (map_extend(session, session->transfer.file_size) < 0) {
+        map_close(session, 0);
+        return warn("Could not map the local file");
+    }
+    return 0;
+}
+
+static int map_write(ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    map_t     *map    = (map_t *) session->transfer.sink_data;
+    u_int64_t  offset = ((u_int64_t) session->parameter->block_size) * (block - 1);
+
+    if ((offset + length > map->length) && (map_extend(session, max(offset + length, session->transfer.file_size)) < 0))
+        return -1;
+    memcpy(map->base + offset, data, length);
+    return 0;
+}
+
+static int map_flush(ttp_session_t *session)
+{
+    map_t *map = (map_t *) session->transfer.sink_data;
+
+    if ((map == NULL) || (map->base == NULL))
+        return 0;
+    return msync(map->base, map->length, MS_SYNC);
+}
+
+static int map_close(ttp_session_t *session, int complete)
+{
+    map_t *map = (map_t *) session->transfer.sink_data;
+
+    if ((map != NULL) && (map->base != NULL))
+        munmap(map->base, map->length);
+    free(map);
+    session->transfer.sink_data = NULL;
+    return 0;
+}
+
+static int map_extend(ttp_session_t *session, u_int64_t size)
+{
+    map_t       *map = (map_t *) session->transfer.sink_data;
+    int          fd  = fileno(session->transfer.file);
+    struct stat  filestat;
+    void        *base;
+
+    if (size == 0)
+        return 0;
+    if ((fstat(fd, &filestat) < 0) || (((u_int64_t) filestat.st_size < size) && (ftruncate(fd, size) < 0)))
+        return -1;
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    if (map->base != NULL)
+        munmap(map->base, map->length);
+    map->base   = (u_char *) base;
+    map->length = size;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * Nowhere, which measures the network and the client without a disk.
+ *------------------------------------------------------------------------*/
+
+static int null_open(ttp_session_t *session)
+{
+    return 0;
+}
+
+static int null_write(ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    return 0;
+}
+
+static int null_close(ttp_session_t *session, int complete)
+{
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * The buffer a program using the library gives, which the whole file
+ * has to fit into.
+ *------------------------------------------------------------------------*/
+
+static int memory_open(ttp_session_t *session)
+{
+    ttp_parameter_t *param = session->parameter;
+
+    if (param->sink_memory == NULL)
+        return warn("The memory sink is only for programs using the library");
+    if (session->transfer.file_size > param->sink_memory_size) {
+        sprintf(g_error, "The file of %llu bytes does not fit the buffer of %llu bytes",
+                (ull_t) session->transfer.file_size, (ull_t) param->sink_memory_size);
+        return warn(g_error);
+    }
+    return 0;
+}
+
+static int memory_write(ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    ttp_parameter_t *param  = session->parameter;
+    u_int64_t        offset = ((u_int64_t) param->block_size) * (block - 1);
+
+    /* a followed file may outgrow the buffer */
+    if (offset + length > param->sink_memory_size)
+        return -1;
+    memcpy(param->sink_memory + offset, data, length);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * The callback a program using the library gives, which gets the blocks
+ * with their file offsets as they arrive.
+ *------------------------------------------------------------------------*/
+
+static int callback_open(ttp_session_t *session)
+{
+    if (session->parameter->sink_callback == NULL)
+        return warn("The callback sink is only for programs using the library");
+    return 0;
+}
+
+static int callback_write(ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    ttp_parameter_t *param = session->parameter;
+
+    return param->sink_callback(((u_int64_t) param->block_size) * (block - 1), data, length, param->sink_user);
+}
+
+
+/*------------------------------------------------------------------------
+ * The files of a bundle, see bundle.c, which a bundle is written to in
+ * place of the sink that is set.
+ *------------------------------------------------------------------------*/
+
+static int bundle_open(ttp_session_t *session)
+{
+    if (session->transfer.bundle == NULL)
+        return warn("The bundle sink only takes bundles, see 'set bundle'");
+    return bundle_prepare(session->transfer.bundle);
+}
+
+static int bundle_put(ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    return bundle_write(session->transfer.bundle, ((u_int64_t) session->parameter->block_size) * (block - 1), data, length);
+}
+
+static int bundle_finish(ttp_session_t *session, int complete)
+{
+    return (session->transfer.bundle == NULL) ? 0 : bundle_close(session->transfer.bundle, complete);
+}
+
+
+/*------------------------------------------------------------------------
+ * The in-order stream of stream.c, either only into the tree hash that
+ * checksum mode compares with the server's, or out to the output of
+ * 'set stream'.
+ *------------------------------------------------------------------------*/
+
+static int hash_open(ttp_session_t *session)
+{
+    session->transfer.stream = stream_open(session, NULL);
+    return (session->transfer.stream == NULL) ? -1 : 0;
+}
+
+static int stream_sink_open(ttp_session_t *session)
+{
+    if (session->parameter->stream_to == NULL)
+        return warn("No stream output set, see 'set stream'");
+    session->transfer.stream = stream_open(session, session->parameter->stream_to);
+    return (session->transfer.stream == NULL) ? -1 : 0;
+}
+
+static int in_order_write(ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    return stream_write(session, block, data, length);
+}
+
+static int in_order_close(ttp_session_t *session, int complete)
+{
+    return (session->transfer.stream == NULL) ? 0 : stream_close(session, complete);
+}
+
+
+/*========================================================================
+ * $Log: sink.c,v $
+ */
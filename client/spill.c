@@ -0,0 +1,299 @@
+/*========================================================================
+ * spill.c  --  Overflow spill buffer routines for Tsunami client.
+ *
+ * This contains routines for managing the spill buffer that catches
+ * received blocks while the disk ring buffer is full.  The spill is a
+ * FIFO kept either in a RAM arena or in an unlinked temporary file on
+ * a fast local disk, and is drained by the disk thread.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <pthread.h>  /* for the pthreads library     */
+#include <stdlib.h>   /* for malloc(), free(), etc.   */
+#include <string.h>   /* for string-handling routines */
+#include <unistd.h>   /* for pread(), pwrite(), etc.  */
+
+#include <tsunami-client.h>
+
+
+/*------------------------------------------------------------------------
+ * spill_buffer_t *spill_create(ttp_session_t *session);
+ *
+ * Creates the spill buffer for a Tsunami transfer and returns a pointer
+ * to the new data structure.  The spill holds as many datagrams as fit
+ * into 'spill' megabytes.  If 'spilldir' is set, the datagrams are kept
+ * in an unlinked temporary file in that directory, otherwise in RAM.
+ * Returns NULL if the spill buffer is disabled or could not be set up.
+ *------------------------------------------------------------------------*/
+spill_buffer_t *spill_create(ttp_session_t *session)
+{
+    ttp_parameter_t *param = session->parameter;
+    spill_buffer_t  *spill;
+    char            *template;
+    int              status;
+
+    /* see if the spill is wanted at all */
+    if (param->spill_mb == 0)
+	return NULL;
+
+    /* try to allocate the structure */
+    spill = (spill_buffer_t *) calloc(1, sizeof(*spill));
+    if (spill == NULL)
+	error("Could not allocate spill buffer object");
+
+    /* work out the capacity in datagrams */
+    spill->datagram_size = TS_HEADER_SIZE + param->block_size;
+    spill->capacity      = ((u_int64_t) param->spill_mb * 1024 * 1024) / spill->datagram_size;
+    spill->fd            = -1;
+
+    /* use a temporary file on disk if requested */
+    if (param->spill_dir != NULL) {
+	template = (char *) malloc(strlen(param->spill_dir) + 32);
+	if (template == NULL)
+	    error("Could not allocate spill file name");
+	sprintf(template, "%s/tsunami-spill-XXXXXX", param->spill_dir);
+	spill->fd = mkstemp(template);
+	if (spill->fd < 0) {
+	    sprintf(g_error, "Could not create spill file '%s', falling back to RAM", template);
+	    warn(g_error);
+	} else {
+	    unlink(template);
+	}
+	free(template);
+    }
+
+    /* otherwise use a RAM arena */
+    if (spill->fd < 0) {
+	spill->datagrams = (u_char *) malloc(spill->capacity * spill->datagram_size);
+	if (spill->datagrams == NULL) {
+	    warn("Could not allocate spill buffer arena, spill disabled");
+	    free(spill);
+	    return NULL;
+	}
+    }
+
+    /* create the mutex */
+    status = pthread_mutex_init(&spill->mutex, NULL);
+    if (status != 0)
+	error("Could not create mutex for spill buffer");
+
+    /* and return the spill structure */
+    return spill;
+}
+
+
+/*------------------------------------------------------------------------
+ * int spill_destroy(spill_buffer_t *spill);
+ *
+ * Destroys the spill buffer for a Tsunami transfer, closing the spill
+ * file if there is one.  Returns 0 on success and nonzero on failure.
+ *------------------------------------------------------------------------*/
+int spill_destroy(spill_buffer_t *spill)
+{
+    int status;
+
+    /* nothing to do if the spill was disabled */
+    if (spill == NULL)
+	return 0;
+
+    /* destroy the mutex */
+    status = pthread_mutex_destroy(&spill->mutex);
+    if (status != 0)
+	return warn("Could not destroy mutex for spill buffer");
+
+    /* release the storage */
+    if (spill->fd >= 0)
+	close(spill->fd);
+    if (spill->datagrams != NULL)
+	free(spill->datagrams);
+    free(spill);
+
+    /* we succeeded */
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int spill_full(spill_buffer_t *spill);
+ *
+ * Returns non-zero if the spill buffer is full or disabled.
+ *------------------------------------------------------------------------*/
+int spill_full(spill_buffer_t *spill)
+{
+    int full;
+
+    if (spill == NULL)
+	return 1;
+
+    pthread_mutex_lock(&spill->mutex);
+    full = (spill->count_data >= spill->capacity);
+    pthread_mutex_unlock(&spill->mutex);
+
+    return full;
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int64_t spill_count(spill_buffer_t *spill);
+ *
+ * Returns the number of datagrams currently held in the spill buffer.
+ *------------------------------------------------------------------------*/
+u_int64_t spill_count(spill_buffer_t *spill)
+{
+    u_int64_t count;
+
+    if (spill == NULL)
+	return 0;
+
+    pthread_mutex_lock(&spill->mutex);
+    count = spill->count_data;
+    pthread_mutex_unlock(&spill->mutex);
+
+    return count;
+}
+
+
+/*------------------------------------------------------------------------
+ * int spill_push(spill_buffer_t *spill, const u_char *datagram);
+ *
+ * Appends a copy of the given datagram to the tail of the spill buffer.
+ * Only the network thread pushes, so the storage write is done outside
+ * the mutex.  Returns 0 on success and nonzero if the spill is full or
+ * the datagram could not be stored.
+ *------------------------------------------------------------------------*/
+int spill_push(spill_buffer_t *spill, const u_char *datagram)
+{
+    u_int64_t slot;
+    ssize_t   status;
+
+    /* find the next free slot */
+    pthread_mutex_lock(&spill->mutex);
+    if (spill->count_data >= spill->capacity) {
+	pthread_mutex_unlock(&spill->mutex);
+	return -1;
+    }
+    slot = (spill->base_data + spill->count_data) % spill->capacity;
+    pthread_mutex_unlock(&spill->mutex);
+
+    /* store the datagram */
+    if (spill->fd >= 0) {
+	status = pwrite(spill->fd, datagram, spill->datagram_size, (off_t) (slot * spill->datagram_size));
+	if (status != spill->datagram_size)
+	    return warn("Could not write to spill file");
+    } else {
+	memcpy(spill->datagrams + slot * spill->datagram_size, datagram, spill->datagram_size);
+    }
+
+    /* publish it to the disk thread */
+    pthread_mutex_lock(&spill->mutex);
+    ++(spill->count_data);
+    ++(spill->total_spilled);
+    if (spill->count_data > spill->peak_data)
+	spill->peak_data = spill->count_data;
+    pthread_mutex_unlock(&spill->mutex);
+
+    /* we succeeded */
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int spill_pop(spill_buffer_t *spill, u_char *datagram);
+ *
+ * Removes the datagram at the head of the spill buffer and copies it
+ * into the given buffer.  Only the disk thread pops.  Returns 1 if a
+ * datagram was retrieved, 0 if the spill is empty and -1 on error.
+ *------------------------------------------------------------------------*/
+int spill_pop(spill_buffer_t *spill, u_char *datagram)
+{
+    u_int64_t slot;
+    ssize_t   status;
+
+    /* see if there is anything to do */
+    if (spill == NULL)
+	return 0;
+    pthread_mutex_lock(&spill->mutex);
+    if (spill->count_data == 0) {
+	pthread_mutex_unlock(&spill->mutex);
+	return 0;
+    }
+    slot = spill->base_data;
+    pthread_mutex_unlock(&spill->mutex);
+
+    /* fetch the datagram */
+    if (spill->fd >= 0) {
+	status = pread(spill->fd, datagram, spill->datagram_size, (off_t) (slot * spill->datagram_size));
+	if (status != spill->datagram_size)
+	    return warn("Could not read from spill file");
+    } else {
+	memcpy(datagram, spill->datagrams + slot * spill->datagram_size, spill->datagram_size);
+    }
+
+    /* release the slot */
+    pthread_mutex_lock(&spill->mutex);
+    spill->base_data = (spill->base_data + 1) % spill->capacity;
+    --(spill->count_data);
+    pthread_mutex_unlock(&spill->mutex);
+
+    /* we succeeded */
+    return 1;
+}
+
+
+/*========================================================================
+ * $Log: spill.c,v $
+ */
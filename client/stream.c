@@ -0,0 +1,363 @@
+/*========================================================================
+ * stream.c  --  In-order stream output routines for Tsunami client.
+ *
+ * This contains routines for streaming the received file to standard
+ * output, a FIFO or a command instead of writing it to a local file.
+ * The disk thread hands every block over as it comes; blocks that come
+ * before those ahead of them wait in memory, and the data goes out in
+ * file order as soon as it is contiguous, so that whatever reads it can
+ * start right away without a second pass over the disk.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <signal.h>   /* for signal()                 */
+#include <stdlib.h>   /* for malloc(), free(), etc.   */
+#include <string.h>   /* for string-handling routines */
+#include <unistd.h>   /* for dup(), dup2(), etc.      */
+
+#include <tsunami-client.h>
+
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static int       stream_drain (ttp_session_t *session);
+static int       stream_hold  (stream_t *stream, u_int64_t block, const u_char *data, u_int32_t length);
+static u_int32_t stream_length(ttp_session_t *session, u_int64_t block);
+static int       stream_put   (stream_t *stream, const u_char *data, u_int32_t length);
+
+
+/*------------------------------------------------------------------------
+ * stream_t *stream_open(ttp_session_t *session, const char *target);
+ *
+ * Opens the given output: "-" for standard output (see stream_stdout()),
+ * a leading '|' for a command that gets the data on its standard input,
+ * NULL for none at all, which only hashes the data, or else a file or
+ * FIFO.  Returns the new stream, or NULL if the output could not be
+ * opened.
+ *------------------------------------------------------------------------*/
+stream_t *stream_open(ttp_session_t *session, const char *target)
+{
+    stream_t    *stream;
+
+    stream = (stream_t *) calloc(1, sizeof(*stream));
+    if (stream == NULL)
+        error("Could not allocate stream");
+    stream->next  = 1;
+    stream->slots = STREAM_SLOTS;
+    stream->slot  = (stream_slot_t *) calloc(stream->slots, sizeof(stream_slot_t));
+    stream->zero  = (u_char *) calloc(session->parameter->block_size, 1);
+    if ((stream->slot == NULL) || (stream->zero == NULL))
+        error("Could not allocate stream buffers");
+
+    if (target == NULL) {
+        stream->kind = STREAM_TO_NOWHERE;
+        return stream;
+    } else if (!strcmp(target, "-")) {
+        stream->out  = stream_stdout();
+        stream->kind = STREAM_TO_STDOUT;
+    } else if (target[0] == '|') {
+        signal(SIGPIPE, SIG_IGN);  /* a command that quits early fails our writes instead */
+        stream->out  = popen(target + 1, "w");
+        stream->kind = STREAM_TO_COMMAND;
+    } else {
+        stream->out  = fopen(target, "wb");
+        stream->kind = STREAM_TO_FILE;
+    }
+
+    if (stream->out == NULL) {
+        sprintf(g_error, "Could not open stream output '%s'", target);
+        warn(g_error);
+        stream_destroy(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+
+/*------------------------------------------------------------------------
+ * FILE *stream_stdout(void);
+ *
+ * Takes over standard output for stream data, the first time it is
+ * called, and points descriptor 1 at standard error so that everything
+ * the client prints from then on stays out of the data.  Returns the
+ * stream for the real standard output, or NULL if it could not be taken
+ * over.
+ *------------------------------------------------------------------------*/
+FILE *stream_stdout(void)
+{
+    static FILE *stdout_data = NULL;  /* the real standard output, once taken over */
+    int          fd;
+
+    if (stdout_data == NULL) {
+        fflush(stdout);
+        fd = dup(STDOUT_FILENO);
+        if ((fd >= 0) && (dup2(STDERR_FILENO, STDOUT_FILENO) >= 0))
+            stdout_data = fdopen(fd, "wb");
+    }
+    return stdout_data;
+}
+
+
+/*------------------------------------------------------------------------
+ * int stream_write(ttp_session_t *session, u_int64_t block,
+ *                  const u_char *data, u_int32_t length);
+ *
+ * Takes the given block of the given length from the disk thread.  It
+ * goes out right away if it is the next one, and everything held after
+ * it that is now contiguous goes with it; otherwise it is held until the
+ * blocks before it are in.  In lossy mode a gap is given up on, and its
+ * blocks written as zeros, once more than STREAM_LOSSY_HOLD blocks wait
+ * behind it.  Returns 0 on success and nonzero on failure.
+ *------------------------------------------------------------------------*/
+int stream_write(ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    stream_t *stream = session->transfer.stream;
+
+    /* a block of a gap given up on comes too late */
+    if (block < stream->next)
+        return 0;
+
+    if (block > stream->next)
+        return (stream_hold(stream, block, data, length) < 0) ? -1 : stream_drain(session);
+    if (stream_put(stream, data, length) < 0)
+        return -1;
+    ++(stream->next);
+    return stream_drain(session);
+}
+
+
+/*------------------------------------------------------------------------
+ * int stream_close(ttp_session_t *session, int fill);
+ *
+ * Writes out the blocks that are still held up to the end of the file,
+ * with zeros for those that never came if fill is set, and closes the
+ * output, once.  Standard output is only flushed, so that it can take the
+ * next file too.  Returns 0 on success and nonzero on failure, which
+ * includes a command that did not exit with status 0.
+ *------------------------------------------------------------------------*/
+int stream_close(ttp_session_t *session, int fill)
+{
+    stream_t      *stream = session->transfer.stream;
+    stream_slot_t *slot;
+    int            status = 0;
+
+    if (stream->closed)
+        return 0;
+    for (; stream->next <= session->transfer.block_count; ++(stream->next)) {
+        slot = &stream->slot[stream->next % stream->slots];
+        if (slot->block == stream->next) {
+            status  = stream_put(stream, slot->data, slot->length);
+            free(slot->data);
+            slot->block = 0;
+            slot->data  = NULL;
+            --(stream->held);
+        } else if (fill) {
+            status  = stream_put(stream, stream->zero, stream_length(session, stream->next));
+            ++(stream->total_zeroed);
+        } else {
+            break;
+        }
+        if (status < 0)
+            break;
+    }
+
+    stream->closed = 1;
+    if (stream->kind == STREAM_TO_STDOUT)
+        status |= fflush(stream->out);
+    else if (stream->kind == STREAM_TO_COMMAND)
+        status |= pclose(stream->out);
+    else if (stream->kind == STREAM_TO_FILE)
+        status |= fclose(stream->out);
+    stream->out = NULL;
+    return (status != 0) ? warn("Could not finish the stream output") : 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * void stream_destroy(stream_t *stream);
+ *
+ * Releases the stream and the blocks it still holds.  The output has to
+ * be closed with stream_close() first, if it was opened.
+ *------------------------------------------------------------------------*/
+void stream_destroy(stream_t *stream)
+{
+    u_int64_t index;
+
+    if (stream == NULL)
+        return;
+    for (index = 0; (stream->slot != NULL) && (index < stream->slots); ++index)
+        free(stream->slot[index].data);
+    free(stream->slot);
+    free(stream->zero);
+    free(stream);
+}
+
+
+/*------------------------------------------------------------------------
+ * int stream_drain(ttp_session_t *session);
+ *
+ * Writes out the held blocks that follow on what went out already, and
+ * in lossy mode the gaps that too many blocks wait behind as zeros.
+ * Returns 0 on success and nonzero on failure.
+ *------------------------------------------------------------------------*/
+static int stream_drain(ttp_session_t *session)
+{
+    stream_t      *stream = session->transfer.stream;
+    stream_slot_t *slot;
+
+    while (stream->held > 0) {
+        slot = &stream->slot[stream->next % stream->slots];
+        if (slot->block == stream->next) {
+            if (stream_put(stream, slot->data, slot->length) < 0)
+                return -1;
+            free(slot->data);
+            slot->block = 0;
+            slot->data  = NULL;
+            --(stream->held);
+        } else if (!session->parameter->lossless && (stream->held > STREAM_LOSSY_HOLD)) {
+            if (stream_put(stream, stream->zero, stream_length(session, stream->next)) < 0)
+                return -1;
+            ++(stream->total_zeroed);
+        } else {
+            break;
+        }
+        ++(stream->next);
+    }
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int stream_hold(stream_t *stream, u_int64_t block,
+ *                 const u_char *data, u_int32_t length);
+ *
+ * Keeps a copy of the given block until the blocks before it are out,
+ * doubling the table of held blocks until it reaches that far ahead.
+ * Returns 0 on success and nonzero on failure.
+ *------------------------------------------------------------------------*/
+static int stream_hold(stream_t *stream, u_int64_t block, const u_char *data, u_int32_t length)
+{
+    stream_slot_t *slot, *table;
+    u_int64_t      slots, index;
+
+    /* grow the table, each held block keeping the slot of its number */
+    if (block - stream->next >= stream->slots) {
+        for (slots = stream->slots; block - stream->next >= slots; slots *= 2)
+            ;
+        table = (stream_slot_t *) calloc(slots, sizeof(stream_slot_t));
+        if (table == NULL)
+            return warn("Could not extend the stream's table of early blocks");
+        for (index = 0; index < stream->slots; ++index)
+            if (stream->slot[index].block != 0)
+                table[stream->slot[index].block % slots] = stream->slot[index];
+        free(stream->slot);
+        stream->slot  = table;
+        stream->slots = slots;
+    }
+
+    /* a block held already is a duplicate */
+    slot = &stream->slot[block % stream->slots];
+    if (slot->block == block)
+        return 0;
+    slot->data = (u_char *) malloc(length);
+    if (slot->data == NULL)
+        return warn("Could not hold an early block for the stream");
+    memcpy(slot->data, data, length);
+    slot->block  = block;
+    slot->length = length;
+    ++(stream->held);
+    stream->peak = max(stream->peak, stream->held);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int32_t stream_length(ttp_session_t *session, u_int64_t block);
+ *
+ * Returns the number of bytes of the file in the given block.
+ *------------------------------------------------------------------------*/
+static u_int32_t stream_length(ttp_session_t *session, u_int64_t block)
+{
+    u_int32_t block_size = session->parameter->block_size;
+
+    if (block < session->transfer.block_count)
+        return block_size;
+    return session->transfer.file_size - (block - 1) * block_size;
+}
+
+
+/*------------------------------------------------------------------------
+ * int stream_put(stream_t *stream, const u_char *data,
+ *                u_int32_t length);
+ *
+ * Writes the given data to the output and adds it to the tree hash.
+ * Returns 0 on success and nonzero on failure.
+ *------------------------------------------------------------------------*/
+static int stream_put(stream_t *stream, const u_char *data, u_int32_t length)
+{
+    if ((stream->out != NULL) && (fwrite(data, 1, length, stream->out) < length))
+        return warn("Could not write to the stream output");
+    crc32c_tree_add(&stream->tree, data, length);
+    return 0;
+}
+
+
+/*========================================================================
+ * $Log: stream.c,v $
+ */
@@ -0,0 +1,375 @@
+/*========================================================================
+ * superblock.c  --  Super-block assembly routines for Tsunami client.
+ *
+ * This contains routines for super-block mode, in which the blocks
+ * (datagrams) of a transfer are grouped into large logical super-blocks.
+ * The receive loop keeps a count of the blocks still missing in each
+ * super-block, and the disk thread collects the blocks of a super-block
+ * in memory so that it goes to disk in one large, aligned write.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <stdlib.h>   /* for malloc(), free(), etc.   */
+#include <string.h>   /* for string-handling routines */
+
+#include <tsunami-client.h>
+
+
+/*------------------------------------------------------------------------
+ * int super_write(ttp_session_t *session, u_int64_t block_index,
+ *                 const u_char *data, u_int32_t blocks);
+ *
+ * Writes the given number of consecutive blocks, starting at the given
+ * block, to the output file in one go.  The last block of the file is
+ * cut to the file size.  Returns 0 on success and nonzero on failure.
+ *------------------------------------------------------------------------*/
+int super_write(ttp_session_t *session, u_int64_t block_index, const u_char *data, u_int32_t blocks)
+{
+    ttp_transfer_t *xfer   = &session->transfer;
+    u_int64_t       offset = (u_int64_t) session->parameter->block_size * (block_index - 1);
+    u_int64_t       size   = (u_int64_t) session->parameter->block_size * blocks;
+
+    #ifndef DEBUG_DISKLESS
+    /* write the blocks through the sink */
+    size = min(size, xfer->file_size - offset);
+    if (xfer->sink->write_block(session, block_index, data, size) < 0) {
+        sprintf(g_error, "Could not write blocks %llu to %llu of file", (ull_t) block_index, (ull_t) (block_index + blocks - 1));
+        return warn(g_error);
+    }
+    #endif
+
+    /* note them for the block record */
+    if ((xfer->written != NULL) && (blockmap_set_range(xfer->written, block_index, block_index + blocks - 1) < 0))
+        return warn("Could not allocate written-data bitfield page");
+
+    xfer->super_cache->total_writes++;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * super_cache_t *super_create(ttp_session_t *session);
+ *
+ * Creates the super-block state for a transfer that agreed on super-block
+ * mode with the server, and returns a pointer to it.  There are enough
+ * assembly slots to hold about one second of data at the target rate,
+ * so that retransmissions usually arrive before their super-block has
+ * to be written out partially.  The data buffers of the slots are
+ * allocated as they are first needed.  Returns NULL if super-block mode
+ * is not in use.
+ *------------------------------------------------------------------------*/
+super_cache_t *super_create(ttp_session_t *session)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+    super_cache_t  *cache;
+    u_int64_t       super;
+    u_int64_t       bytes;
+    u_int64_t       first, last, block, end;
+
+    /* see if the mode is in use at all */
+    if (!(xfer->options & TS_OPT_SUPERBLOCK) || (xfer->super_size < 2))
+        return NULL;
+
+    /* try to allocate the structure */
+    cache = (super_cache_t *) calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        error("Could not allocate super-block object");
+    cache->blocks = xfer->super_size;
+    cache->count  = (xfer->block_count / cache->blocks) + ((xfer->block_count % cache->blocks) != 0);
+
+    /* every super-block starts out complete but for all its blocks */
+    cache->missing = (u_int32_t *) malloc(cache->count * sizeof(u_int32_t));
+    cache->listed  = (u_char *) calloc(cache->count / 8 + 1, 1);
+    if ((cache->missing == NULL) || (cache->listed == NULL))
+        error("Could not allocate super-block completion counts");
+    for (super = 0; super < cache->count; ++super)
+        cache->missing[super] = min(cache->blocks, xfer->block_count - super * cache->blocks);
+
+    /* except for the blocks an earlier transfer left us */
+    for (first = blockmap_next(xfer->received, 1, 1); first <= xfer->block_count; first = blockmap_next(xfer->received, last + 1, 1)) {
+        last = blockmap_next(xfer->received, first, 0) - 1;
+        for (block = first; block <= last; block = end + 1) {
+            super = (block - 1) / cache->blocks;
+            end   = min((super + 1) * cache->blocks, last);
+            cache->missing[super] -= end - block + 1;
+        }
+    }
+
+    /* and the assembly slots */
+    bytes        = (u_int64_t) cache->blocks * session->parameter->block_size;
+    cache->slots = min(session->parameter->target_rate / 8 / bytes + 1, SUPER_CACHE_MB * 1048576ULL / bytes);
+    cache->slots = max(cache->slots, SUPER_CACHE_SLOTS);
+    cache->slot  = (super_slot_t *) calloc(cache->slots, sizeof(super_slot_t));
+    if (cache->slot == NULL)
+        error("Could not allocate super-block assembly slots");
+
+    return cache;
+}
+
+
+/*------------------------------------------------------------------------
+ * int super_destroy(super_cache_t *cache);
+ *
+ * Destroys the super-block state.  Partly assembled super-blocks are
+ * lost, call super_flush() first to keep them.  Returns 0 on success
+ * and nonzero on failure.
+ *------------------------------------------------------------------------*/
+int super_destroy(super_cache_t *cache)
+{
+    int slot;
+
+    if (cache == NULL)
+        return 0;
+    for (slot = 0; slot < cache->slots; ++slot) {
+        free(cache->slot[slot].data);
+        free(cache->slot[slot].received);
+    }
+    free(cache->slot);
+    free(cache->missing);
+    free(cache->listed);
+    free(cache);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int super_received(super_cache_t *cache, u_int64_t block_index);
+ *
+ * Notes the arrival of a new block in the completion count of its
+ * super-block.  Returns the number of blocks still missing in that
+ * super-block.  Only to be called from the receive loop.
+ *------------------------------------------------------------------------*/
+int super_received(super_cache_t *cache, u_int64_t block_index)
+{
+    u_int64_t super = (block_index - 1) / cache->blocks;
+
+    if (cache->missing[super] > 0)
+        --(cache->missing[super]);
+    return cache->missing[super];
+}
+
+
+/*------------------------------------------------------------------------
+ * int super_requests(ttp_session_t *session, retransmission_t *request,
+ *                    int room, u_int64_t *wanted);
+ *
+ * Builds the retransmission requests for the super-blocks listed in the
+ * retransmission table.  Each one gets a REQUEST_RETRANSMIT_SUPER with
+ * the first block and the number of blocks of its bitmap, which follows
+ * in the requests after it and flags the blocks still missing there,
+ * from the first gap of the file up to the highest block asked for.
+ * Super-blocks with nothing left to ask for leave the table.  The number
+ * of blocks asked for is stored in wanted.  Returns the number of
+ * requests, or -1 if they take more than the given room.
+ *------------------------------------------------------------------------*/
+int super_requests(ttp_session_t *session, retransmission_t *request, int room, u_int64_t *wanted)
+{
+    ttp_transfer_t *xfer   = &session->transfer;
+    super_cache_t  *cache  = xfer->super_cache;
+    retransmit_t   *rexmit = &xfer->retransmit;
+    u_int64_t       super, first, last, block;
+    u_int32_t       entry, kept = 0, bit;
+    u_char         *bitmap;
+    int             count = 0, parts;
+
+    *wanted = 0;
+    for (entry = 0; entry < rexmit->index_max; ++entry) {
+        super = rexmit->table[entry] - 1;
+        first = max(super * cache->blocks + 1, xfer->gapless_to_block);
+        last  = min(min((super + 1) * cache->blocks, xfer->block_count), cache->wanted_to);
+
+        /* a super-block that is complete, or has no block wanted yet, is done with */
+        if ((cache->missing[super] == 0) || (first > last)) {
+            cache->listed[super / 8] &= ~(1 << (super % 8));
+            continue;
+        }
+        rexmit->table[kept++] = super + 1;
+
+        /* announce the bitmap */
+        parts = 1 + (last - first + TS_SUPER_REQUEST_BLOCKS) / TS_SUPER_REQUEST_BLOCKS;
+        if (count + parts > room)
+            return -1;
+        request[count].request_type = htons(REQUEST_RETRANSMIT_SUPER);
+        request[count].reserved     = 0;
+        request[count].error_rate   = htonl(last - first + 1);
+        request[count].block        = htonll(first);
+
+        /* and flag the blocks still missing in it */
+        bitmap = (u_char *) &request[count + 1];
+        memset(bitmap, 0, (parts - 1) * sizeof(retransmission_t));
+        for (block = blockmap_next(xfer->received, first, 0); block <= last; block = blockmap_next(xfer->received, block + 1, 0)) {
+            bit = block - first;
+            bitmap[bit / 8] |= (1 << (bit % 8));
+            ++(*wanted);
+        }
+        count += parts;
+    }
+
+    rexmit->index_max = kept;
+    return count;
+}
+
+
+/*------------------------------------------------------------------------
+ * int super_evict(ttp_session_t *session, super_slot_t *slot);
+ *
+ * Writes what has been collected in the given assembly slot to disk,
+ * with one write per run of consecutive blocks, and frees the slot.
+ * Returns 0 on success and nonzero on failure.
+ *------------------------------------------------------------------------*/
+int super_evict(ttp_session_t *session, super_slot_t *slot)
+{
+    super_cache_t *cache      = session->transfer.super_cache;
+    u_int32_t      block_size = session->parameter->block_size;
+    u_int64_t      first      = (slot->index - 1) * cache->blocks;
+    u_int32_t      run, end;
+
+    for (run = 0; (slot->index > 0) && (run < cache->blocks); run = end) {
+
+        /* find the next run of collected blocks */
+        while ((run < cache->blocks) && !(slot->received[run / 8] & (1 << (run % 8))))
+            ++run;
+        for (end = run; (end < cache->blocks) && (slot->received[end / 8] & (1 << (end % 8))); ++end);
+
+        /* and write it */
+        if ((end > run) && (super_write(session, first + run + 1, slot->data + (u_int64_t) run * block_size, end - run) < 0))
+            return -1;
+    }
+
+    slot->index   = 0;
+    slot->present = 0;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int super_accept(ttp_session_t *session, u_int64_t block_index,
+ *                  u_char *block);
+ *
+ * Copies the given block into the assembly slot of its super-block and
+ * writes the super-block to disk once it is complete.  Super-blocks map
+ * onto the slots in turn, so a super-block still incomplete when its
+ * slot comes round again is written out partially to make room.
+ * Returns 0 on success and nonzero on failure.
+ *------------------------------------------------------------------------*/
+int super_accept(ttp_session_t *session, u_int64_t block_index, u_char *block)
+{
+    ttp_transfer_t *xfer       = &session->transfer;
+    super_cache_t  *cache      = xfer->super_cache;
+    u_int32_t       block_size = session->parameter->block_size;
+    u_int64_t       super      = (block_index - 1) / cache->blocks;
+    u_int32_t       offset     = (block_index - 1) % cache->blocks;
+    super_slot_t   *slot       = &cache->slot[super % cache->slots];
+
+    /* a much older super-block in our slot has to go to disk as it is */
+    if ((slot->index != 0) && (slot->index != super + 1) && (super_evict(session, slot) < 0))
+        return -1;
+
+    /* set up a fresh slot */
+    if (slot->index == 0) {
+        if (slot->data == NULL) {
+            slot->data     = (u_char *) malloc((u_int64_t) cache->blocks * block_size);
+            slot->received = (u_char *) malloc(cache->blocks / 8 + 1);
+            if ((slot->data == NULL) || (slot->received == NULL))
+                error("Could not allocate super-block assembly buffer");
+        }
+        memset(slot->received, 0, cache->blocks / 8 + 1);
+        slot->index = super + 1;
+    }
+
+    /* collect the block, once */
+    if (!(slot->received[offset / 8] & (1 << (offset % 8)))) {
+        memcpy(slot->data + (u_int64_t) offset * block_size, block, block_size);
+        slot->received[offset / 8] |= (1 << (offset % 8));
+        ++(slot->present);
+    }
+
+    /* write out the super-block when it is complete */
+    if (slot->present == min(cache->blocks, xfer->block_count - super * cache->blocks)) {
+        if (super_write(session, super * cache->blocks + 1, slot->data, slot->present) < 0)
+            return -1;
+        slot->index   = 0;
+        slot->present = 0;
+    }
+
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int super_flush(ttp_session_t *session);
+ *
+ * Writes all partly assembled super-blocks to disk.  Returns 0 on
+ * success and nonzero on failure.
+ *------------------------------------------------------------------------*/
+int super_flush(ttp_session_t *session)
+{
+    super_cache_t *cache = session->transfer.super_cache;
+    int            slot;
+
+    if (cache == NULL)
+        return 0;
+    for (slot = 0; slot < cache->slots; ++slot)
+        if (super_evict(session, &cache->slot[slot]) < 0)
+            return -1;
+    return 0;
+}
+
+
+/*========================================================================
+ * $Log: superblock.c,v $
+ */
@@ -158,7 +158,7 @@ void xscript_open(ttp_session_t *session)
     fprintf(xfer->transcript, "remote_filename = %s\n", xfer->remote_filename);
     fprintf(xfer->transcript, "local_filename = %s\n",  xfer->local_filename);
     fprintf(xfer->transcript, "file_size = %llu\n",     (ull_t)xfer->file_size);
-    fprintf(xfer->transcript, "block_count = %u\n",     xfer->block_count);
+    fprintf(xfer->transcript, "block_count = %llu\n",   (ull_t)xfer->block_count);
     fprintf(xfer->transcript, "udp_buffer = %u\n",      param->udp_buffer);
     fprintf(xfer->transcript, "block_size = %u\n",      param->block_size);
     fprintf(xfer->transcript, "target_rate = %u\n",     param->target_rate);
@@ -171,6 +171,20 @@ void xscript_open(ttp_session_t *session)
     fprintf(xfer->transcript, "lossless = %u\n",        param->lossless);
     fprintf(xfer->transcript, "losswindow = %u\n",      param->losswindow_ms);
     fprintf(xfer->transcript, "blockdump = %u\n",       param->blockdump);
+    fprintf(xfer->transcript, "spill_mb = %u\n",        param->spill_mb);
+    fprintf(xfer->transcript, "spill_dir = %s\n",       (param->spill_dir == NULL) ? "ram" : param->spill_dir);
+    fprintf(xfer->transcript, "stream = %s\n",          (param->stream_to == NULL) ? "none" : param->stream_to);
+    fprintf(xfer->transcript, "sink = %s\n",            param->sink->name);
+    fprintf(xfer->transcript, "rtt_usec = %u\n",        xfer->rtt_usec);
+    fprintf(xfer->transcript, "super_size = %u\n",      (xfer->options & TS_OPT_SUPERBLOCK) ? xfer->super_size : 0);
+    fprintf(xfer->transcript, "checksum = %u\n",        (xfer->options & TS_OPT_CHECKSUM) ? 1 : 0);
+    fprintf(xfer->transcript, "checkpoint = %u\n",      param->checkpoint);
+    fprintf(xfer->transcript, "delta = %u\n",           (xfer->options & TS_OPT_DELTA) ? 1 : 0);
+    fprintf(xfer->transcript, "sparse = %u\n",          (xfer->options & TS_OPT_SPARSE) ? 1 : 0);
+    fprintf(xfer->transcript, "compress = %u\n",        (xfer->options & TS_OPT_COMPRESS) ? 1 : 0);
+    fprintf(xfer->transcript, "fec = %u\n",             (xfer->options & TS_OPT_FEC) ? 1 : 0);
+    fprintf(xfer->transcript, "multicast = %u\n",       (xfer->options & TS_OPT_MULTICAST) ? 1 : 0);
+    fprintf(xfer->transcript, "follow = %u\n",          (xfer->options & TS_OPT_FOLLOW) ? 1 : 0);
     fprintf(xfer->transcript, "update_period = %llu\n", UPDATE_PERIOD);
     fprintf(xfer->transcript, "rexmit_period = %llu\n", UPDATE_PERIOD);
     fprintf(xfer->transcript, "protocol_version = 0x%x\n", PROTOCOL_REVISION);
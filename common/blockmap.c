@@ -0,0 +1,639 @@
+/*========================================================================
+ * blockmap.c  --  Received-block bitfield for Tsunami file transfer.
+ *
+ * This contains the routines for the bitfield that records which blocks
+ * of a transfer have arrived.  With 64-bit block numbers a flat bitfield
+ * could run to many gigabytes, so the bitfield is split into pages that
+ * are only allocated once a block in them arrives and are released once
+ * all of their blocks have arrived.  Memory use then follows the range
+ * of blocks with holes in it rather than the size of the file.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <stdlib.h>      /* for malloc(), free(), etc.            */
+#include <string.h>      /* for standard string handling routines */
+
+#include "tsunami.h"     /* for Tsunami function prototypes, etc. */
+
+
+/*------------------------------------------------------------------------
+ * Module-scope constants.
+ *------------------------------------------------------------------------*/
+
+#define PAGE_BLOCKS  (1ULL << BLOCKMAP_PAGE_BITS)  /* the blocks per page */
+
+static u_char full_page[1];  /* marks a page whose blocks have all arrived */
+
+
+/*------------------------------------------------------------------------
+ * u_int64_t page_blocks(const blockmap_t *map, u_int64_t page);
+ *
+ * Returns the number of blocks covered by the given page, which is less
+ * than PAGE_BLOCKS only for the last page.
+ *------------------------------------------------------------------------*/
+static u_int64_t page_blocks(const blockmap_t *map, u_int64_t page)
+{
+    return min(PAGE_BLOCKS, map->blocks - (page << BLOCKMAP_PAGE_BITS));
+}
+
+
+/*------------------------------------------------------------------------
+ * blockmap_t *blockmap_create(u_int64_t blocks);
+ *
+ * Creates an empty bitfield for blocks 1 to the given number of blocks
+ * and returns a pointer to it, or NULL if it could not be allocated.
+ * Only the page directory is allocated up front.
+ *------------------------------------------------------------------------*/
+blockmap_t *blockmap_create(u_int64_t blocks)
+{
+    blockmap_t *map;
+
+    map = (blockmap_t *) calloc(1, sizeof(*map));
+    if (map == NULL)
+        return NULL;
+    map->blocks = blocks;
+    map->pages  = (blocks >> BLOCKMAP_PAGE_BITS) + 1;
+    map->page   = (u_char **)   calloc(map->pages, sizeof(u_char *));
+    map->count  = (u_int32_t *) calloc(map->pages, sizeof(u_int32_t));
+    if ((map->page == NULL) || (map->count == NULL)) {
+        blockmap_destroy(map);
+        return NULL;
+    }
+    return map;
+}
+
+
+/*------------------------------------------------------------------------
+ * blockmap_t *blockmap_copy(const blockmap_t *map);
+ *
+ * Creates a new bitfield with the same blocks marked as the given one
+ * and returns a pointer to it, or NULL if it could not be allocated.
+ *------------------------------------------------------------------------*/
+blockmap_t *blockmap_copy(const blockmap_t *map)
+{
+    blockmap_t *copy;
+    u_int64_t   first, last;
+
+    copy = blockmap_create(map->blocks);
+    if (copy == NULL)
+        return NULL;
+    for (first = blockmap_next(map, 1, 1); first <= map->blocks; first = blockmap_next(map, last + 1, 1)) {
+        last = blockmap_next(map, first, 0) - 1;
+        if (blockmap_set_range(copy, first, last) < 0) {
+            blockmap_destroy(copy);
+            return NULL;
+        }
+    }
+    return copy;
+}
+
+
+/*------------------------------------------------------------------------
+ * int blockmap_grow(blockmap_t *map, u_int64_t blocks);
+ *
+ * Extends the bitfield to the given number of blocks, the new ones not
+ * yet marked.  A smaller number leaves the bitfield as it is.  Returns
+ * 0 on success and -1 if the page directory could not be extended.
+ *------------------------------------------------------------------------*/
+int blockmap_grow(blockmap_t *map, u_int64_t blocks)
+{
+    u_int64_t   pages = (blocks >> BLOCKMAP_PAGE_BITS) + 1;
+    u_int64_t   last, index;
+    u_char    **page;
+    u_int32_t  *count;
+    u_char     *bits;
+
+    if (blocks <= map->blocks)
+        return 0;
+
+    /* extend the page directory */
+    if (pages > map->pages) {
+        page = (u_char **) realloc(map->page, pages * sizeof(u_char *));
+        if (page == NULL)
+            return -1;
+        map->page = page;
+        count = (u_int32_t *) realloc(map->count, pages * sizeof(u_int32_t));
+        if (count == NULL)
+            return -1;
+        map->count = count;
+        memset(map->page  + map->pages, 0, (pages - map->pages) * sizeof(u_char *));
+        memset(map->count + map->pages, 0, (pages - map->pages) * sizeof(u_int32_t));
+        map->pages = pages;
+    }
+
+    /* a short last page that was complete gets its bits back for the blocks to come */
+    last = (map->blocks > 0) ? (map->blocks - 1) >> BLOCKMAP_PAGE_BITS : 0;
+    if ((map->page[last] == full_page) && (map->count[last] < PAGE_BLOCKS)) {
+        bits = (u_char *) calloc(PAGE_BLOCKS / 8, 1);
+        if (bits == NULL)
+            return -1;
+        memset(bits, 0xff, map->count[last] / 8);
+        for (index = map->count[last] & ~7ULL; index < map->count[last]; ++index)
+            bits[index / 8] |= (1 << (index % 8));
+        map->page[last] = bits;
+        ++(map->allocated);
+    }
+
+    map->blocks = blocks;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * void blockmap_destroy(blockmap_t *map);
+ *
+ * Releases the bitfield and all of its pages.
+ *------------------------------------------------------------------------*/
+void blockmap_destroy(blockmap_t *map)
+{
+    u_int64_t page;
+
+    if (map == NULL)
+        return;
+    for (page = 0; (map->page != NULL) && (page < map->pages); ++page)
+        if (map->page[page] != full_page)
+            free(map->page[page]);
+    free(map->page);
+    free(map->count);
+    free(map);
+}
+
+
+/*------------------------------------------------------------------------
+ * int blockmap_get(const blockmap_t *map, u_int64_t block);
+ *
+ * Returns nonzero if the given block has arrived and 0 if it has not, or
+ * if it is outside the range of the bitfield.
+ *------------------------------------------------------------------------*/
+int blockmap_get(const blockmap_t *map, u_int64_t block)
+{
+    u_int64_t  index = block - 1;
+    u_char    *page;
+
+    if ((block == 0) || (block > map->blocks))
+        return 0;
+    page = map->page[index >> BLOCKMAP_PAGE_BITS];
+    if ((page == NULL) || (page == full_page))
+        return (page == full_page);
+    index &= PAGE_BLOCKS - 1;
+    return page[index / 8] & (1 << (index % 8));
+}
+
+
+/*------------------------------------------------------------------------
+ * int blockmap_set(blockmap_t *map, u_int64_t block);
+ *
+ * Marks the given block as arrived.  A page is allocated on its first
+ * block and released once its last block is in.  Returns 1 if the block
+ * is new, 0 if it was already marked or is out of range, and -1 if a
+ * page could not be allocated.
+ *------------------------------------------------------------------------*/
+int blockmap_set(blockmap_t *map, u_int64_t block)
+{
+    u_int64_t  index = block - 1;
+    u_int64_t  page  = index >> BLOCKMAP_PAGE_BITS;
+    u_char   **bits  = &map->page[page];
+
+    if ((block == 0) || (block > map->blocks) || (*bits == full_page))
+        return 0;
+
+    /* allocate the page on its first block */
+    if (*bits == NULL) {
+        *bits = (u_char *) calloc(PAGE_BLOCKS / 8, 1);
+        if (*bits == NULL)
+            return -1;
+        ++(map->allocated);
+    }
+
+    /* set the bit */
+    index &= PAGE_BLOCKS - 1;
+    if ((*bits)[index / 8] & (1 << (index % 8)))
+        return 0;
+    (*bits)[index / 8] |= (1 << (index % 8));
+
+    /* a page that is complete needs no bits any more */
+    if (++(map->count[page]) == page_blocks(map, page)) {
+        free(*bits);
+        *bits = full_page;
+        --(map->allocated);
+    }
+    return 1;
+}
+
+
+/*------------------------------------------------------------------------
+ * int blockmap_set_range(blockmap_t *map, u_int64_t first,
+ *                        u_int64_t last);
+ *
+ * Marks blocks first to last as arrived, whole pages at a time where
+ * the range covers them.  Returns the number of blocks that were new,
+ * or -1 if a page could not be allocated.
+ *------------------------------------------------------------------------*/
+int64_t blockmap_set_range(blockmap_t *map, u_int64_t first, u_int64_t last)
+{
+    int64_t   added = 0;
+    u_int64_t page, start, end;
+    int       status;
+
+    first = max(first, 1);
+    last  = min(last, map->blocks);
+    while (first <= last) {
+        page  = (first - 1) >> BLOCKMAP_PAGE_BITS;
+        start = (page << BLOCKMAP_PAGE_BITS) + 1;
+        end   = min(start + page_blocks(map, page) - 1, last);
+
+        /* a page the range covers completely needs no bits at all */
+        if ((first == start) && (end == start + page_blocks(map, page) - 1)) {
+            if (map->page[page] != full_page) {
+                added += page_blocks(map, page) - map->count[page];
+                if (map->page[page] != NULL) {
+                    free(map->page[page]);
+                    --(map->allocated);
+                }
+                map->page[page]  = full_page;
+                map->count[page] = page_blocks(map, page);
+            }
+        } else {
+            for (; first <= end; ++first) {
+                if ((status = blockmap_set(map, first)) < 0)
+                    return -1;
+                added += status;
+            }
+        }
+        first = end + 1;
+    }
+    return added;
+}
+
+
+/*------------------------------------------------------------------------
+ * int blockmap_clear_range(blockmap_t *map, u_int64_t first,
+ *                          u_int64_t last);
+ *
+ * Marks blocks first to last as missing again.  Returns 0 on success
+ * and -1 if a complete page had to be split and could not be allocated.
+ *------------------------------------------------------------------------*/
+int blockmap_clear_range(blockmap_t *map, u_int64_t first, u_int64_t last)
+{
+    u_int64_t  page, start, end, index;
+    u_char   **bits;
+
+    first = max(first, 1);
+    last  = min(last, map->blocks);
+    while (first <= last) {
+        page  = (first - 1) >> BLOCKMAP_PAGE_BITS;
+        start = (page << BLOCKMAP_PAGE_BITS) + 1;
+        end   = min(start + page_blocks(map, page) - 1, last);
+        bits  = &map->page[page];
+
+        if (*bits == NULL) {
+            /* nothing to clear */
+        } else if ((first == start) && (end == start + page_blocks(map, page) - 1)) {
+            if (*bits != full_page) {
+                free(*bits);
+                --(map->allocated);
+            }
+            *bits = NULL;
+            map->count[page] = 0;
+        } else {
+
+            /* a complete page gets its bits back before some are cleared */
+            if (*bits == full_page) {
+                *bits = (u_char *) malloc(PAGE_BLOCKS / 8);
+                if (*bits == NULL) {
+                    *bits = full_page;
+                    return -1;
+                }
+                memset(*bits, 0xff, PAGE_BLOCKS / 8);
+                ++(map->allocated);
+            }
+            for (index = first - start; index <= end - start; ++index) {
+                if ((*bits)[index / 8] & (1 << (index % 8))) {
+                    (*bits)[index / 8] &= ~(1 << (index % 8));
+                    --(map->count[page]);
+                }
+            }
+            if (map->count[page] == 0) {
+                free(*bits);
+                *bits = NULL;
+                --(map->allocated);
+            }
+        }
+        first = end + 1;
+    }
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int64_t blockmap_next(const blockmap_t *map, u_int64_t block,
+ *                         int arrived);
+ *
+ * Returns the first block from the given one on that has arrived (if
+ * arrived is nonzero) or is still missing (if it is zero), or one past
+ * the last block if there is none.  Empty and complete pages are
+ * stepped over whole.
+ *------------------------------------------------------------------------*/
+u_int64_t blockmap_next(const blockmap_t *map, u_int64_t block, int arrived)
+{
+    u_int64_t  page, index;
+    u_char    *bits;
+    u_char     skip = arrived ? 0x00 : 0xff;
+
+    block = max(block, 1);
+    while (block <= map->blocks) {
+        page = (block - 1) >> BLOCKMAP_PAGE_BITS;
+        bits = map->page[page];
+
+        /* whole pages either match or can be stepped over */
+        if ((bits == NULL) || (bits == full_page)) {
+            if ((bits == full_page) == !!arrived)
+                return block;
+            block = ((page + 1) << BLOCKMAP_PAGE_BITS) + 1;
+            continue;
+        }
+
+        /* otherwise look at the bits, a byte at a time where possible */
+        index = (block - 1) & (PAGE_BLOCKS - 1);
+        if (((index % 8) == 0) && (bits[index / 8] == skip)) {
+            block += 8;
+            continue;
+        }
+        if (!(bits[index / 8] & (1 << (index % 8))) == !arrived)
+            return block;
+        ++block;
+    }
+    return map->blocks + 1;
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int64_t blockmap_count(const blockmap_t *map);
+ *
+ * Returns the number of blocks marked as arrived.
+ *------------------------------------------------------------------------*/
+u_int64_t blockmap_count(const blockmap_t *map)
+{
+    u_int64_t page, count = 0;
+
+    for (page = 0; page < map->pages; ++page)
+        count += map->count[page];
+    return count;
+}
+
+
+/*------------------------------------------------------------------------
+ * int blockmap_write(const blockmap_t *map, FILE *out);
+ *
+ * Writes the bitfield to the given file as one flat bitfield indexed by
+ * block number (bit 0 of the first byte standing for the unused block 0),
+ * blocks/8 + 1 bytes long.  Returns 0 on success and -1 on error.
+ *------------------------------------------------------------------------*/
+int blockmap_write(const blockmap_t *map, FILE *out)
+{
+    u_int64_t block;
+    u_char    byte = 0;
+
+    for (block = 0; block <= map->blocks; ++block) {
+        if (blockmap_get(map, block))
+            byte |= (1 << (block % 8));
+        if ((block % 8) == 7) {
+            if (fputc(byte, out) == EOF)
+                return -1;
+            byte = 0;
+        }
+    }
+    if (((map->blocks % 8) != 7) && (fputc(byte, out) == EOF))
+        return -1;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int blockmap_read(blockmap_t *map, FILE *in);
+ *
+ * Marks the blocks set in a flat bitfield as written by blockmap_write()
+ * as arrived, one run of blocks at a time.  Returns 0 on success and -1
+ * if the bitfield is cut short or a page could not be allocated.
+ *------------------------------------------------------------------------*/
+int blockmap_read(blockmap_t *map, FILE *in)
+{
+    u_int64_t block, run = 0;
+    int       byte = 0;
+
+    for (block = 0; block <= map->blocks; ++block) {
+        if ((block % 8) == 0) {
+            if ((byte = fgetc(in)) == EOF)
+                return -1;
+
+            /* step over whole bytes inside or outside of a run */
+            if ((block > 0) && (block + 7 <= map->blocks) && (byte == (run ? 0xff : 0x00))) {
+                block += 7;
+                continue;
+            }
+        }
+        if ((block > 0) && (byte & (1 << (block % 8)))) {
+            if (run == 0)
+                run = block;
+        } else if (run != 0) {
+            if (blockmap_set_range(map, run, block - 1) < 0)
+                return -1;
+            run = 0;
+        }
+    }
+    if ((run != 0) && (blockmap_set_range(map, run, map->blocks) < 0))
+        return -1;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int put_varint(u_char *buffer, u_int64_t value);
+ *
+ * Stores the value seven bits at a time, lowest first, with the top bit
+ * of every byte but the last set, unless the buffer is NULL.  Returns
+ * the number of bytes it takes.
+ *------------------------------------------------------------------------*/
+static int put_varint(u_char *buffer, u_int64_t value)
+{
+    int bytes = 0;
+
+    do {
+        if (buffer != NULL)
+            buffer[bytes] = (value & 0x7f) | ((value > 0x7f) ? 0x80 : 0);
+        value >>= 7;
+        ++bytes;
+    } while (value > 0);
+    return bytes;
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int64_t flat_next(const u_char *bits, u_int64_t block,
+ *                     u_int64_t blocks, int set);
+ *
+ * Returns the first block from the given one on whose bit in the flat
+ * bitfield is set (if set is nonzero) or clear (if it is zero), or one
+ * past the last block if there is none.
+ *------------------------------------------------------------------------*/
+static u_int64_t flat_next(const u_char *bits, u_int64_t block, u_int64_t blocks, int set)
+{
+    u_char skip = set ? 0x00 : 0xff;
+
+    while (block <= blocks) {
+        if (((block % 8) == 0) && (bits[block / 8] == skip)) {
+            block += 8;
+            continue;
+        }
+        if (!(bits[block / 8] & (1 << (block % 8))) == !set)
+            return block;
+        ++block;
+    }
+    return blocks + 1;
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int64_t blockmap_encode(const blockmap_t *map, u_char *buffer,
+ *                           u_int32_t *encoding);
+ *
+ * Encodes the marked blocks for the wire in the shorter of two ways:
+ * the gap before and the length of every run of marked blocks as
+ * varints (TS_SKIP_RUNS), or the flat bitfield of blockmap_write()
+ * (TS_SKIP_BITMAP).  Stores the encoding picked, and the encoded blocks
+ * unless the buffer is NULL.  Returns the length of the encoding, which
+ * is 0 if no block is marked.
+ *------------------------------------------------------------------------*/
+u_int64_t blockmap_encode(const blockmap_t *map, u_char *buffer, u_int32_t *encoding)
+{
+    u_int64_t first, last, length = 0, bitmap = map->blocks / 8 + 1;
+
+    /* measure the runs */
+    for (first = blockmap_next(map, 1, 1), last = 0; first <= map->blocks; first = blockmap_next(map, last + 1, 1)) {
+        length += put_varint(NULL, first - last - 1);
+        last    = blockmap_next(map, first, 0) - 1;
+        length += put_varint(NULL, last - first + 1);
+    }
+    *encoding = (length > bitmap) ? TS_SKIP_BITMAP : TS_SKIP_RUNS;
+    if (buffer == NULL)
+        return min(length, bitmap);
+
+    /* and write the shorter encoding out */
+    if (*encoding == TS_SKIP_BITMAP) {
+        memset(buffer, 0, bitmap);
+        for (first = blockmap_next(map, 1, 1); first <= map->blocks; first = blockmap_next(map, first + 1, 1))
+            buffer[first / 8] |= (1 << (first % 8));
+        return bitmap;
+    }
+    for (first = blockmap_next(map, 1, 1), length = 0, last = 0; first <= map->blocks; first = blockmap_next(map, last + 1, 1)) {
+        length += put_varint(buffer + length, first - last - 1);
+        last    = blockmap_next(map, first, 0) - 1;
+        length += put_varint(buffer + length, last - first + 1);
+    }
+    return length;
+}
+
+
+/*------------------------------------------------------------------------
+ * int blockmap_decode(blockmap_t *map, u_int32_t encoding,
+ *                     const u_char *buffer, u_int64_t length);
+ *
+ * Marks the blocks given by an encoding from blockmap_encode() as
+ * arrived.  Returns 0 on success and -1 if the encoding is unknown or
+ * runs past the last block, or a page could not be allocated.
+ *------------------------------------------------------------------------*/
+int blockmap_decode(blockmap_t *map, u_int32_t encoding, const u_char *buffer, u_int64_t length)
+{
+    u_int64_t index, block, value[2], last = 0;
+    int       shift, part;
+
+    /* the flat bitfield, a run of blocks at a time */
+    if (encoding == TS_SKIP_BITMAP) {
+        if (length != map->blocks / 8 + 1)
+            return -1;
+        for (block = flat_next(buffer, 1, map->blocks, 1); block <= map->blocks; block = flat_next(buffer, last + 1, map->blocks, 1)) {
+            last = flat_next(buffer, block, map->blocks, 0) - 1;
+            if (blockmap_set_range(map, block, last) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    if (encoding != TS_SKIP_RUNS)
+        return -1;
+
+    /* or a gap and then a run, each a varint */
+    for (index = 0; index < length; ) {
+        for (part = 0; part < 2; ++part) {
+            for (value[part] = 0, shift = 0; (index < length) && (shift < 64); shift += 7) {
+                value[part] |= ((u_int64_t) (buffer[index] & 0x7f)) << shift;
+                if (!(buffer[index++] & 0x80))
+                    break;
+            }
+        }
+        if ((value[1] == 0) || (value[0] >= map->blocks - last) || (value[1] > map->blocks - last - value[0]))
+            return -1;
+        if (blockmap_set_range(map, last + value[0] + 1, last + value[0] + value[1]) < 0)
+            return -1;
+        last += value[0] + value[1];
+    }
+    return 0;
+}
+
+
+/*========================================================================
+ * $Log: blockmap.c,v $
+ */
@@ -67,6 +67,7 @@
 #include <time.h>        /* for time-handling functions           */
 #include <unistd.h>      /* for standard Unix system calls        */
 #include <stdlib.h>      /* for standard library definitions      */
+#include <sys/socket.h>  /* for the socket buffer options          */
 #include <errno.h>
 
 #include "md5.h"         /* for MD5 message digest support        */
@@ -77,12 +78,14 @@
  * Definitions of global constants.
  *------------------------------------------------------------------------*/
 
-const u_int32_t PROTOCOL_REVISION  = 0x20061025; // yyyymmdd
+const u_int32_t PROTOCOL_REVISION  = 0x20261023; // yyyymmdd
 
 const u_int16_t REQUEST_RETRANSMIT = 0;
 const u_int16_t REQUEST_RESTART    = 1;
 const u_int16_t REQUEST_STOP       = 2;
 const u_int16_t REQUEST_ERROR_RATE = 3;
+const u_int16_t REQUEST_FLOW_CONTROL = 4;
+const u_int16_t REQUEST_RETRANSMIT_SUPER = 5;
 
 
 /*------------------------------------------------------------------------
@@ -346,6 +349,164 @@ u_int64_t get_udp_in_errors()
     return errs;
 }
 
+/*------------------------------------------------------------------------
+ * u_int32_t udp_buffer_for_path(u_int32_t floor, double rate_bps,
+ *                               u_int64_t rtt_usec);
+ *
+ * Returns the UDP socket buffer size (in bytes) for a path running at
+ * the given rate with the given round trip time.  That is room for two
+ * bandwidth-delay products, but never less than the floor and never
+ * more than MAX_UDP_BUFFER.
+ *------------------------------------------------------------------------*/
+u_int32_t udp_buffer_for_path(u_int32_t floor, double rate_bps, u_int64_t rtt_usec)
+{
+    double size = 2.0 * (rate_bps / 8.0) * (rtt_usec / 1e6);
+
+    size = max(size, floor);
+    return (u_int32_t) min(size, MAX_UDP_BUFFER);
+}
+
+/*------------------------------------------------------------------------
+ * u_int32_t set_udp_buffer(int fd, int sending, u_int32_t size);
+ *
+ * Sets the send (sending != 0) or receive buffer of the given UDP
+ * socket to the given size.  The forcing socket options are tried first
+ * so that a privileged process can go beyond net.core.[rw]mem_max.  The
+ * size the kernel really granted is read back and returned, and a
+ * warning is printed if that is less than what was asked for.
+ *------------------------------------------------------------------------*/
+u_int32_t set_udp_buffer(int fd, int sending, u_int32_t size)
+{
+    int       option  = sending ? SO_SNDBUF : SO_RCVBUF;
+    int       value   = (int) min(size, MAX_UDP_BUFFER);
+    int       granted = 0;
+    socklen_t length  = sizeof(granted);
+    int       status  = -1;
+
+    /* try to override the system limit first */
+    #if defined(SO_SNDBUFFORCE) && defined(SO_RCVBUFFORCE)
+    status = setsockopt(fd, SOL_SOCKET, sending ? SO_SNDBUFFORCE : SO_RCVBUFFORCE, &value, sizeof(value));
+    #endif
+    if (status < 0)
+        status = setsockopt(fd, SOL_SOCKET, option, &value, sizeof(value));
+    if (status < 0)
+        warn(sending ? "Error in resizing UDP transmit buffer" : "Error in resizing UDP receive buffer");
+
+    /* see what we really got */
+    if (getsockopt(fd, SOL_SOCKET, option, &granted, &length) < 0)
+        return 0;
+    #ifdef __linux__
+    granted /= 2;  /* Linux reports the doubled size including its bookkeeping */
+    #endif
+
+    if ((u_int32_t) granted < size) {
+        sprintf(g_error, "UDP %s buffer is only %d of the %u bytes requested, raise net.core.%cmem_max",
+                sending ? "transmit" : "receive", granted, size, sending ? 'w' : 'r');
+        warn(g_error);
+    }
+    return (u_int32_t) granted;
+}
+
+/*------------------------------------------------------------------------
+ * int get_path_block_size(const struct sockaddr *address,
+ *                         socklen_t length, u_int64_t wait_usec);
+ *
+ * Runs path MTU discovery towards the given address and returns the
+ * largest block size that still fits into one unfragmented datagram
+ * together with the block header, or -1 if that cannot be found out.
+ * Datagrams of the size of the current path MTU estimate are sent
+ * with the don't-fragment bit set, and the estimate is read back after
+ * waiting wait_usec for ICMP "fragmentation needed" replies, until it
+ * stops shrinking.  The probes go to the port of the given address and
+ * carry no Tsunami header, so that nobody takes them for data.
+ *------------------------------------------------------------------------*/
+int get_path_block_size(const struct sockaddr *address, socklen_t length, u_int64_t wait_usec)
+{
+    #if defined(IP_MTU_DISCOVER) && defined(IP_MTU)
+    int        ipv6_yn  = (address->sa_family == AF_INET6);
+    int        overhead = ipv6_yn ? (40 + 8) : (20 + 8);  /* the IP and UDP headers */
+    int        mtu      = -1;
+    int        last_mtu = -1;
+    int        value, attempt, socket_fd;
+    socklen_t  value_length;
+    u_char    *probe;
+
+    /* a connected datagram socket that never fragments */
+    socket_fd = socket(address->sa_family, SOCK_DGRAM, 0);
+    if (socket_fd < 0)
+        return -1;
+    if (ipv6_yn) {
+        value = IPV6_PMTUDISC_DO;
+        setsockopt(socket_fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &value, sizeof(value));
+    } else {
+        value = IP_PMTUDISC_DO;
+        setsockopt(socket_fd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value));
+    }
+    probe = (u_char *) calloc(65536, 1);
+    if ((probe == NULL) || (connect(socket_fd, address, length) < 0)) {
+        free(probe);
+        close(socket_fd);
+        return -1;
+    }
+
+    /* probe at the current estimate until it holds */
+    for (attempt = 0; attempt < 4; ++attempt) {
+        value_length = sizeof(mtu);
+        if (getsockopt(socket_fd, ipv6_yn ? IPPROTO_IPV6 : IPPROTO_IP, ipv6_yn ? IPV6_MTU : IP_MTU, &mtu, &value_length) < 0) {
+            mtu = -1;
+            break;
+        }
+        if (mtu == last_mtu)
+            break;
+        last_mtu = mtu;
+
+        /* a probe over the local limit fails right away, others need the wait */
+        if ((send(socket_fd, probe, min(mtu - overhead, 65507), 0) < 0) && (errno == EMSGSIZE))
+            continue;
+        usleep_that_works(wait_usec);
+    }
+
+    free(probe);
+    close(socket_fd);
+    if (mtu <= overhead + TS_HEADER_SIZE)
+        return -1;
+    return min(min(mtu - overhead, 65507) - TS_HEADER_SIZE, MAX_BLOCK_SIZE);
+    #else
+    return -1;  /* no path MTU discovery on this platform */
+    #endif
+}
+
+
+/*------------------------------------------------------------------------
+ * int punch_hole(int fd, u_int64_t offset, u_int64_t length);
+ *
+ * Makes the given range of the file read back as zeros without changing
+ * the size of the file: deallocated where the file system can punch
+ * holes, and otherwise overwritten with zeros.  Returns 0 on success and
+ * -1 on error.
+ *------------------------------------------------------------------------*/
+int punch_hole(int fd, u_int64_t offset, u_int64_t length)
+{
+    u_char  *zeros;
+    ssize_t  status = 0;
+
+    #ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+        return 0;
+    #endif
+
+    zeros = (u_char *) calloc(1024 * 1024, 1);
+    if (zeros == NULL)
+        return -1;
+    while ((length > 0) && (status >= 0)) {
+        status  = pwrite(fd, zeros, min(length, 1024 * 1024), offset);
+        offset += max(status, 0);
+        length -= max(status, 0);
+    }
+    free(zeros);
+    return (status < 0) ? -1 : 0;
+}
+
 /*------------------------------------------------------------------------
  * ssize_t full_write(int fd, const void *buf, size_t count);
  *
@@ -368,7 +529,8 @@ ssize_t full_write(int fd, const void *buf, size_t count)
 /*------------------------------------------------------------------------
  * ssize_t full_read(int fd, const void *buf, size_t count);
  *
- * Reads into buffer, no partial reads.
+ * Reads into buffer, no partial reads, unless the end of the input
+ * comes first.
  *------------------------------------------------------------------------*/
 ssize_t full_read(int fd, void *buf, size_t count)
 {
@@ -379,6 +541,8 @@ ssize_t full_read(int fd, void *buf, size_t count)
            fprintf(stderr, "full_read(): %s\n", strerror(errno));
            return nread;
        }
+       if (nrd == 0)
+           return nread;
        nread += nrd;
    }
    return nread;
@@ -80,12 +80,14 @@
  * Definitions of global constants.
  *------------------------------------------------------------------------*/
 
-const u_int32_t PROTOCOL_REVISION  = 0x20061025; // yyyymmdd
+const u_int32_t PROTOCOL_REVISION  = 0x20261023; // yyyymmdd
 
 const u_int16_t REQUEST_RETRANSMIT = 0;
 const u_int16_t REQUEST_RESTART    = 1;
 const u_int16_t REQUEST_STOP       = 2;
 const u_int16_t REQUEST_ERROR_RATE = 3;
+const u_int16_t REQUEST_FLOW_CONTROL = 4;
+const u_int16_t REQUEST_RETRANSMIT_SUPER = 5;
 
 
 /*------------------------------------------------------------------------
@@ -0,0 +1,254 @@
+/*========================================================================
+ * compress.c  --  Fast block compression for Tsunami file transfer.
+ *
+ * This contains a small LZ77 compressor and decompressor for single
+ * blocks in the LZ4 block format: sequences of a token, literals, a
+ * 16-bit match offset and the match length, with the last bytes of a
+ * block always stored as literals.  It favours speed over ratio, so
+ * that blocks can be compressed as they are sent, and the decompressor
+ * checks every length and offset against its buffers.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <string.h>      /* for memcpy(), memset()                */
+
+#include "tsunami.h"     /* for Tsunami function prototypes, etc. */
+
+
+/*------------------------------------------------------------------------
+ * Module-scope constants.
+ *------------------------------------------------------------------------*/
+
+#define HASH_BITS     12     /* log2 of the entries of the match finder table  */
+#define MIN_MATCH     4      /* the shortest match worth a sequence            */
+#define LAST_LITERALS 5      /* the bytes at the end that are always literals  */
+#define MATCH_LIMIT   12     /* no match starts in this many bytes at the end  */
+
+
+/*------------------------------------------------------------------------
+ * u_int32_t read32(const u_char *data);
+ *
+ * Returns the four bytes at the given address, whatever its alignment.
+ *------------------------------------------------------------------------*/
+static u_int32_t read32(const u_char *data)
+{
+    u_int32_t value;
+
+    memcpy(&value, data, 4);
+    return value;
+}
+
+
+/*------------------------------------------------------------------------
+ * u_char *put_length(u_char *out, u_int32_t length);
+ *
+ * Stores what is left of a literal or match length after the 15 in its
+ * token as bytes of 255 and a final byte below that.  Returns the
+ * address after the last byte stored.
+ *------------------------------------------------------------------------*/
+static u_char *put_length(u_char *out, u_int32_t length)
+{
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = length;
+    return out;
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int32_t compress_block(const u_char *in, u_int32_t length,
+ *                          u_char *out, u_int32_t room);
+ *
+ * Compresses the given data of at most 64 kB into the output buffer,
+ * finding matches greedily through a hash table of the last position of
+ * every 4-byte sequence.  Returns the compressed length, or 0 if that
+ * would not fit into the room given.
+ *------------------------------------------------------------------------*/
+u_int32_t compress_block(const u_char *in, u_int32_t length, u_char *out, u_int32_t room)
+{
+    u_int16_t      table[1 << HASH_BITS];
+    const u_char  *ip     = in;
+    const u_char  *anchor = in;
+    const u_char  *end    = in + length;
+    const u_char  *limit  = (length > MATCH_LIMIT) ? end - MATCH_LIMIT : in;
+    const u_char  *match;
+    u_char        *op     = out;
+    u_char        *token;
+    u_int32_t      literals, run, sequence, hash;
+
+    memset(table, 0, sizeof(table));
+    while (ip < limit) {
+
+        /* look up the last place these four bytes were seen */
+        sequence = read32(ip);
+        hash     = (sequence * 2654435761U) >> (32 - HASH_BITS);
+        match    = in + table[hash];
+        table[hash] = ip - in;
+        if ((match >= ip) || (read32(match) != sequence)) {
+            ++ip;
+            continue;
+        }
+
+        /* extend the match as far as it goes */
+        for (run = MIN_MATCH; (ip + run < end - LAST_LITERALS) && (ip[run] == match[run]); ++run);
+
+        /* and store the literals before it and the match */
+        literals = ip - anchor;
+        if ((op - out) + 1 + literals + literals / 255 + 2 + run / 255 + 1 > room)
+            return 0;
+        token  = op++;
+        *token = min(literals, 15) << 4;
+        if (literals >= 15)
+            op = put_length(op, literals - 15);
+        memcpy(op, anchor, literals);
+        op   += literals;
+        *op++ = (ip - match) & 0xff;
+        *op++ = (ip - match) >> 8;
+        *token |= min(run - MIN_MATCH, 15);
+        if (run - MIN_MATCH >= 15)
+            op = put_length(op, run - MIN_MATCH - 15);
+        ip     += run;
+        anchor  = ip;
+    }
+
+    /* the rest goes as literals */
+    literals = end - anchor;
+    if ((op - out) + 1 + literals + literals / 255 + 1 > room)
+        return 0;
+    token  = op++;
+    *token = min(literals, 15) << 4;
+    if (literals >= 15)
+        op = put_length(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - out;
+}
+
+
+/*------------------------------------------------------------------------
+ * int decompress_block(const u_char *in, u_int32_t length,
+ *                      u_char *out, u_int32_t room);
+ *
+ * Decompresses the output of compress_block() into the output buffer.
+ * Returns the decompressed length, or -1 if the data is malformed or
+ * would not fit into the room given.
+ *------------------------------------------------------------------------*/
+int decompress_block(const u_char *in, u_int32_t length, u_char *out, u_int32_t room)
+{
+    const u_char  *ip   = in;
+    const u_char  *iend = in + length;
+    u_char        *op   = out;
+    u_char        *oend = out + room;
+    const u_char  *match;
+    u_int32_t      token, literals, run, offset, byte;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        /* copy the literals */
+        literals = token >> 4;
+        if (literals == 15)
+            do {
+                if (ip >= iend)
+                    return -1;
+                byte      = *ip++;
+                literals += byte;
+            } while (byte == 255);
+        if ((literals > (u_int32_t) (iend - ip)) || (literals > (u_int32_t) (oend - op)))
+            return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+
+        /* the last sequence has no match */
+        if (ip == iend)
+            break;
+
+        /* then the match, which may overlap what it produces */
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip    += 2;
+        if ((offset == 0) || (offset > (u_int32_t) (op - out)))
+            return -1;
+        run = token & 15;
+        if (run == 15)
+            do {
+                if (ip >= iend)
+                    return -1;
+                byte = *ip++;
+                run += byte;
+            } while (byte == 255);
+        run += MIN_MATCH;
+        if (run > (u_int32_t) (oend - op))
+            return -1;
+        match = op - offset;
+        if (offset >= run) {
+            memcpy(op, match, run);
+            op += run;
+        } else {
+            while (run--)
+                *op++ = *match++;
+        }
+    }
+    return op - out;
+}
+
+
+/*========================================================================
+ * $Log: compress.c,v $
+ */
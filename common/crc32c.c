@@ -0,0 +1,405 @@
+/*========================================================================
+ * crc32c.c  --  CRC32C checksums for Tsunami file transfer.
+ *
+ * This contains the CRC32C (Castagnoli) routines used to protect each
+ * datagram in checksum mode and the tree hash that both ends compute
+ * over the whole file at the end of such a transfer.  Where the CPU has
+ * CRC instructions (SSE4.2 on x86, the CRC extension on ARMv8) they are
+ * used, which checks well over a gigabyte per second on one core;
+ * otherwise a table-driven software version is used.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <pthread.h>     /* for the hashing threads               */
+#include <stdlib.h>      /* for malloc(), free(), etc.            */
+#include <string.h>      /* for standard string handling routines */
+#include <unistd.h>      /* for pread() and sysconf()             */
+#include <netinet/in.h>  /* for htonl()                           */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>   /* for the SSE4.2 CRC32 instructions     */
+#define CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>    /* for the ARMv8 CRC32 instructions      */
+#define CRC32C_ARMV8
+#endif
+
+#include "tsunami.h"     /* for Tsunami function prototypes, etc. */
+
+
+/*------------------------------------------------------------------------
+ * Module-scope constants and variables.
+ *------------------------------------------------------------------------*/
+
+#define CRC32C_POLY        0x82F63B78          /* the reflected Castagnoli polynomial */
+#define CRC_TREE_CHUNK     (64 * 1024 * 1024)  /* the bytes per leaf of the tree hash */
+#define CRC_TREE_READ      (1024 * 1024)       /* the bytes per read while hashing    */
+#define CRC_TREE_THREADS   8                   /* the most threads hashing one file   */
+
+static u_int32_t       crc_table[8][256];      /* the slicing-by-8 software tables    */
+static pthread_once_t  crc_once = PTHREAD_ONCE_INIT;
+static u_int32_t     (*crc_update)(u_int32_t crc, const u_char *data, size_t length);
+
+/* one hashing thread of crc32c_tree() */
+typedef struct {
+    int                 fd;        /* the file being hashed                       */
+    u_int64_t           start;     /* the offset in the file the hashed data starts at */
+    u_int64_t           size;      /* the size of the hashed data                 */
+    u_int64_t           first;     /* the first chunk of this thread              */
+    u_int64_t           stride;    /* the distance between chunks of this thread  */
+    u_int64_t           chunks;    /* the number of chunks in the file            */
+    u_int32_t          *leaf;      /* the checksum of every chunk                 */
+    int                 status;    /* 0 on success, -1 if a read failed           */
+} crc_tree_job_t;
+
+
+/*------------------------------------------------------------------------
+ * u_int32_t crc_update_soft(u_int32_t crc, const u_char *data,
+ *                           size_t length);
+ *
+ * Continues the given (inverted) CRC over the given data eight bytes
+ * at a time with the slicing-by-8 tables.
+ *------------------------------------------------------------------------*/
+static u_int32_t crc_update_soft(u_int32_t crc, const u_char *data, size_t length)
+{
+    while (length >= 8) {
+        crc ^= data[0] | (data[1] << 8) | (data[2] << 16) | ((u_int32_t) data[3] << 24);
+        crc  = crc_table[7][crc & 0xFF] ^ crc_table[6][(crc >> 8) & 0xFF] ^
+               crc_table[5][(crc >> 16) & 0xFF] ^ crc_table[4][crc >> 24] ^
+               crc_table[3][data[4]] ^ crc_table[2][data[5]] ^
+               crc_table[1][data[6]] ^ crc_table[0][data[7]];
+        data   += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = crc_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+
+#ifdef CRC32C_SSE42
+/*------------------------------------------------------------------------
+ * u_int32_t crc_update_sse42(u_int32_t crc, const u_char *data,
+ *                            size_t length);
+ *
+ * Continues the given (inverted) CRC with the SSE4.2 CRC32 instruction.
+ * Only called once the CPU is known to have it.
+ *------------------------------------------------------------------------*/
+__attribute__((target("sse4.2")))
+static u_int32_t crc_update_sse42(u_int32_t crc, const u_char *data, size_t length)
+{
+    #ifdef __x86_64__
+    u_int64_t crc64 = crc;
+    u_int64_t word;
+
+    for (; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (u_int32_t) crc64;
+    #endif
+    for (; length > 0; ++data, --length)
+        crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+#endif
+
+
+#ifdef CRC32C_ARMV8
+/*------------------------------------------------------------------------
+ * u_int32_t crc_update_armv8(u_int32_t crc, const u_char *data,
+ *                            size_t length);
+ *
+ * Continues the given (inverted) CRC with the ARMv8 CRC32C instructions.
+ *------------------------------------------------------------------------*/
+static u_int32_t crc_update_armv8(u_int32_t crc, const u_char *data, size_t length)
+{
+    u_int64_t word;
+
+    for (; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; length > 0; ++data, --length)
+        crc = __crc32cb(crc, *data);
+    return crc;
+}
+#endif
+
+
+/*------------------------------------------------------------------------
+ * void crc_init(void);
+ *
+ * Builds the software tables and picks the fastest implementation that
+ * this CPU supports.  Run once through pthread_once().
+ *------------------------------------------------------------------------*/
+static void crc_init(void)
+{
+    u_int32_t crc;
+    int       byte, bit, slice;
+
+    for (byte = 0; byte < 256; ++byte) {
+        crc = byte;
+        for (bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        crc_table[0][byte] = crc;
+    }
+    for (byte = 0; byte < 256; ++byte)
+        for (slice = 1; slice < 8; ++slice)
+            crc_table[slice][byte] = (crc_table[slice - 1][byte] >> 8) ^ crc_table[0][crc_table[slice - 1][byte] & 0xFF];
+
+    crc_update = crc_update_soft;
+    #if defined(CRC32C_SSE42)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc_update = crc_update_sse42;
+    #elif defined(CRC32C_ARMV8)
+    crc_update = crc_update_armv8;
+    #endif
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int32_t crc32c(u_int32_t crc, const void *data, size_t length);
+ *
+ * Returns the CRC32C of the given data, continuing from the given CRC
+ * of the data before it (0 to start).
+ *------------------------------------------------------------------------*/
+u_int32_t crc32c(u_int32_t crc, const void *data, size_t length)
+{
+    pthread_once(&crc_once, crc_init);
+    return ~crc_update(~crc, (const u_char *) data, length);
+}
+
+
+/*------------------------------------------------------------------------
+ * const char *crc32c_engine(void);
+ *
+ * Returns the name of the CRC32C implementation in use.
+ *------------------------------------------------------------------------*/
+const char *crc32c_engine(void)
+{
+    pthread_once(&crc_once, crc_init);
+    #ifdef CRC32C_SSE42
+    if (crc_update == crc_update_sse42)
+        return "sse4.2";
+    #endif
+    #ifdef CRC32C_ARMV8
+    if (crc_update == crc_update_armv8)
+        return "armv8";
+    #endif
+    return "software";
+}
+
+
+/*------------------------------------------------------------------------
+ * void *crc_tree_thread(void *arg);
+ *
+ * Computes the leaf checksums of every stride-th chunk of the file,
+ * starting at the given first chunk.
+ *------------------------------------------------------------------------*/
+static void *crc_tree_thread(void *arg)
+{
+    crc_tree_job_t *job = (crc_tree_job_t *) arg;
+    u_char         *buffer;
+    u_int64_t       chunk, offset, end;
+    u_int32_t       crc;
+    ssize_t         status;
+
+    buffer = (u_char *) malloc(CRC_TREE_READ);
+    if (buffer == NULL) {
+        job->status = -1;
+        return NULL;
+    }
+
+    for (chunk = job->first; chunk < job->chunks; chunk += job->stride) {
+        offset = chunk * CRC_TREE_CHUNK;
+        end    = min(offset + CRC_TREE_CHUNK, job->size);
+        crc    = 0;
+        while (offset < end) {
+            status = pread(job->fd, buffer, min(end - offset, CRC_TREE_READ), job->start + offset);
+            if (status <= 0) {
+                job->status = -1;
+                free(buffer);
+                return NULL;
+            }
+            crc     = crc32c(crc, buffer, status);
+            offset += status;
+        }
+        job->leaf[chunk] = htonl(crc);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * int crc32c_tree(int fd, u_int64_t size, u_int32_t *digest);
+ *
+ * Computes the tree hash of the first size bytes of the given file: the
+ * CRC32C of every 64 MB chunk, and the CRC32C of those in network byte
+ * order over that.  The chunks are hashed by several threads in
+ * parallel.  Returns 0 on success and -1 on error.
+ *------------------------------------------------------------------------*/
+int crc32c_tree(int fd, u_int64_t size, u_int32_t *digest)
+{
+    return crc32c_tree_range(fd, 0, size, digest);
+}
+
+
+/*------------------------------------------------------------------------
+ * int crc32c_tree_range(int fd, u_int64_t offset, u_int64_t size,
+ *                       u_int32_t *digest);
+ *
+ * Computes the tree hash, as crc32c_tree() does, of the size bytes of
+ * the given file that start at the given offset.  Returns 0 on success
+ * and -1 on error.
+ *------------------------------------------------------------------------*/
+int crc32c_tree_range(int fd, u_int64_t offset, u_int64_t size, u_int32_t *digest)
+{
+    crc_tree_job_t  job[CRC_TREE_THREADS];
+    pthread_t       thread[CRC_TREE_THREADS];
+    int             started[CRC_TREE_THREADS];
+    u_int64_t       chunks = (size + CRC_TREE_CHUNK - 1) / CRC_TREE_CHUNK;
+    u_int32_t      *leaf;
+    long            threads;
+    int             index, status = 0;
+
+    /* one thread per core, but no more than there are chunks */
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = max(1, min(min(threads, CRC_TREE_THREADS), (long) chunks));
+
+    leaf = (u_int32_t *) calloc(chunks + 1, sizeof(u_int32_t));
+    if (leaf == NULL)
+        return -1;
+
+    /* hash the chunks */
+    for (index = 0; index < threads; ++index) {
+        job[index].fd     = fd;
+        job[index].start  = offset;
+        job[index].size   = size;
+        job[index].first  = index;
+        job[index].stride = threads;
+        job[index].chunks = chunks;
+        job[index].leaf   = leaf;
+        job[index].status = 0;
+        started[index] = (pthread_create(&thread[index], NULL, crc_tree_thread, &job[index]) == 0);
+        if (!started[index])
+            crc_tree_thread(&job[index]);
+    }
+    for (index = 0; index < threads; ++index) {
+        if (started[index])
+            pthread_join(thread[index], NULL);
+        status |= job[index].status;
+    }
+
+    /* and hash the chunk checksums */
+    *digest = crc32c(0, leaf, chunks * sizeof(u_int32_t));
+    free(leaf);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * void crc32c_tree_add(crc32c_tree_t *tree, const void *data,
+ *                      size_t length);
+ *
+ * Adds the given data to the running tree hash, which starts out
+ * zeroed.  Each chunk checksum goes into the root as soon as the chunk
+ * is complete.
+ *------------------------------------------------------------------------*/
+void crc32c_tree_add(crc32c_tree_t *tree, const void *data, size_t length)
+{
+    const u_char *bytes = (const u_char *) data;
+    u_int32_t     leaf;
+    size_t        part;
+
+    while (length > 0) {
+        part        = min(length, CRC_TREE_CHUNK - (tree->size % CRC_TREE_CHUNK));
+        tree->leaf  = crc32c(tree->leaf, bytes, part);
+        tree->size += part;
+        bytes      += part;
+        length     -= part;
+        if ((tree->size % CRC_TREE_CHUNK) == 0) {
+            leaf       = htonl(tree->leaf);
+            tree->root = crc32c(tree->root, &leaf, sizeof(leaf));
+            tree->leaf = 0;
+        }
+    }
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int32_t crc32c_tree_end(crc32c_tree_t *tree);
+ *
+ * Returns the tree hash of all the data added to the running tree hash,
+ * which is the same as crc32c_tree() gives for a file of that data.
+ *------------------------------------------------------------------------*/
+u_int32_t crc32c_tree_end(crc32c_tree_t *tree)
+{
+    u_int32_t leaf;
+
+    if ((tree->size % CRC_TREE_CHUNK) == 0)
+        return tree->root;
+    leaf = htonl(tree->leaf);
+    return crc32c(tree->root, &leaf, sizeof(leaf));
+}
+
+
+/*========================================================================
+ * $Log: crc32c.c,v $
+ */
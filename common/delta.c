@@ -0,0 +1,280 @@
+/*========================================================================
+ * delta.c  --  Per-block digests for Tsunami delta transfers.
+ *
+ * This contains the routines that compute a short digest of every block
+ * of a file, with which a client that has an older copy of the file
+ * finds out which of its blocks still match the server's, so that only
+ * the others need to cross the network.  Both ends hash the same blocks
+ * with several threads; the server caches its digests in a sidecar file
+ * next to the file it serves.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <pthread.h>     /* for the hashing threads               */
+#include <stdlib.h>      /* for malloc(), free(), etc.            */
+#include <string.h>      /* for standard string handling routines */
+#include <unistd.h>      /* for pread() and sysconf()             */
+
+#include "md5.h"         /* for the MD5 message digest routines   */
+#include "tsunami.h"     /* for Tsunami function prototypes, etc. */
+
+
+/*------------------------------------------------------------------------
+ * Module-scope constants and types.
+ *------------------------------------------------------------------------*/
+
+#define DELTA_READ         (1024 * 1024)  /* the bytes per read while hashing */
+#define DELTA_THREADS      8              /* the most threads hashing one file */
+#define DELTA_MAGIC        "TSDELTA\0"    /* the first bytes of a sidecar file */
+#define DELTA_HEADER       32             /* the bytes before the digests      */
+
+/* one hashing thread of delta_hash() */
+typedef struct {
+    int                 fd;        /* the file being hashed                       */
+    u_int64_t           file_size; /* the size of the file the blocks belong to   */
+    u_int32_t           block_size;/* the size of a block                         */
+    u_int64_t           first;     /* the first block of this thread              */
+    u_int64_t           count;     /* the number of blocks of this thread         */
+    u_char             *digest;    /* DELTA_DIGEST bytes for each of them         */
+    int                 status;    /* 0 on success, -1 if a read failed           */
+} delta_job_t;
+
+
+/*------------------------------------------------------------------------
+ * void *delta_thread(void *arg);
+ *
+ * Hashes the run of blocks given to this thread, reading as many whole
+ * blocks at a time as fit into DELTA_READ bytes.
+ *------------------------------------------------------------------------*/
+static void *delta_thread(void *arg)
+{
+    delta_job_t *job = (delta_job_t *) arg;
+    md5_state_t  state;
+    u_char       hash[16];
+    u_char      *buffer;
+    u_int64_t    block, last, offset, end, index;
+    u_int64_t    per_read = max(1, DELTA_READ / job->block_size);
+    u_int32_t    length;
+    ssize_t      status;
+
+    buffer = (u_char *) malloc(per_read * job->block_size);
+    if (buffer == NULL) {
+        job->status = -1;
+        return NULL;
+    }
+
+    for (block = job->first; block < job->first + job->count; block = last + 1) {
+        last   = min(block + per_read, job->first + job->count) - 1;
+        offset = (block - 1) * job->block_size;
+        end    = min(last * job->block_size, job->file_size);
+        for (index = 0; offset + index < end; index += status) {
+            status = pread(job->fd, buffer + index, end - offset - index, offset + index);
+            if (status <= 0) {
+                job->status = -1;
+                free(buffer);
+                return NULL;
+            }
+        }
+
+        /* the digest of a block is the first bytes of its MD5 hash */
+        for (index = block; index <= last; ++index) {
+            length = min(job->block_size, end - (index - 1) * job->block_size);
+            md5_init(&state);
+            md5_append(&state, buffer + (index - block) * job->block_size, length);
+            md5_finish(&state, hash);
+            memcpy(job->digest + (index - job->first) * DELTA_DIGEST, hash, DELTA_DIGEST);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * int delta_hash(int fd, u_int64_t file_size, u_int32_t block_size,
+ *                u_int64_t first, u_int64_t count, u_char *digest);
+ *
+ * Computes the digests of count blocks of the given file from block
+ * first on, the last block of the file ending at file_size, and stores
+ * DELTA_DIGEST bytes for each.  The blocks are split between several
+ * threads.  Returns 0 on success and -1 if a block could not be read.
+ *------------------------------------------------------------------------*/
+int delta_hash(int fd, u_int64_t file_size, u_int32_t block_size, u_int64_t first, u_int64_t count, u_char *digest)
+{
+    delta_job_t  job[DELTA_THREADS];
+    pthread_t    thread[DELTA_THREADS];
+    int          started[DELTA_THREADS];
+    u_int64_t    share;
+    long         threads;
+    int          index, status = 0;
+
+    /* one thread per core, each with a run of at least one full read */
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = max(1, min(min(threads, DELTA_THREADS), (long) (count * block_size / DELTA_READ)));
+    share   = (count + threads - 1) / threads;
+
+    for (index = 0; index < threads; ++index) {
+        job[index].fd         = fd;
+        job[index].file_size  = file_size;
+        job[index].block_size = block_size;
+        job[index].first      = first + index * share;
+        job[index].count      = min(share, count - min(count, index * share));
+        job[index].digest     = digest + index * share * DELTA_DIGEST;
+        job[index].status     = 0;
+        started[index] = (pthread_create(&thread[index], NULL, delta_thread, &job[index]) == 0);
+        if (!started[index])
+            delta_thread(&job[index]);
+    }
+    for (index = 0; index < threads; ++index) {
+        if (started[index])
+            pthread_join(thread[index], NULL);
+        status |= job[index].status;
+    }
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * FILE *delta_open(const char *path, u_int64_t file_size,
+ *                  u_int32_t block_size, time_t mtime);
+ *
+ * Opens the given sidecar file for reading the digests in it, if it was
+ * written for a file of the same size and modification time and for the
+ * same block size.  Returns the sidecar positioned at the digest of the
+ * first block, or NULL if there is no such sidecar.
+ *------------------------------------------------------------------------*/
+FILE *delta_open(const char *path, u_int64_t file_size, u_int32_t block_size, time_t mtime)
+{
+    u_char     header[DELTA_HEADER];
+    u_int64_t  value;
+    FILE      *sidecar;
+
+    sidecar = fopen(path, "rb");
+    if (sidecar == NULL)
+        return NULL;
+
+    /* the header: magic, file size, modification time, block size */
+    if ((fread(header, DELTA_HEADER, 1, sidecar) == 1) && !memcmp(header, DELTA_MAGIC, 8)) {
+        memcpy(&value, header + 8, 8);
+        if (ntohll(value) == file_size) {
+            memcpy(&value, header + 16, 8);
+            if (ntohll(value) == (u_int64_t) mtime) {
+                memcpy(&value, header + 24, 8);
+                if (ntohll(value) == block_size)
+                    return sidecar;
+            }
+        }
+    }
+    fclose(sidecar);
+    return NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * int delta_save(int fd, const char *path, u_int64_t file_size,
+ *                u_int32_t block_size, time_t mtime);
+ *
+ * Hashes every block of the given file and writes the digests to the
+ * given sidecar file, tagged with the size and modification time of the
+ * file and the block size.  Returns 0 on success and -1 on error.
+ *------------------------------------------------------------------------*/
+int delta_save(int fd, const char *path, u_int64_t file_size, u_int32_t block_size, time_t mtime)
+{
+    u_char     header[DELTA_HEADER];
+    u_char    *digest;
+    u_int64_t  value, block, count;
+    u_int64_t  blocks = (file_size + block_size - 1) / block_size;
+    FILE      *sidecar;
+    int        status = 0;
+
+    memcpy(header, DELTA_MAGIC, 8);
+    value = htonll(file_size);             memcpy(header + 8,  &value, 8);
+    value = htonll((u_int64_t) mtime);     memcpy(header + 16, &value, 8);
+    value = htonll(block_size);            memcpy(header + 24, &value, 8);
+
+    digest = (u_char *) malloc(DELTA_ROUND * DELTA_DIGEST);
+    if (digest == NULL)
+        return -1;
+    sidecar = fopen(path, "wb");
+    if (sidecar == NULL) {
+        free(digest);
+        return -1;
+    }
+    if (fwrite(header, DELTA_HEADER, 1, sidecar) < 1)
+        status = -1;
+
+    /* a round of blocks at a time */
+    for (block = 1; (block <= blocks) && (status == 0); block += count) {
+        count = min(DELTA_ROUND, blocks - block + 1);
+        if ((delta_hash(fd, file_size, block_size, block, count, digest) < 0) ||
+            (fwrite(digest, DELTA_DIGEST, count, sidecar) < count))
+            status = -1;
+    }
+
+    if (fclose(sidecar) != 0)
+        status = -1;
+    if (status < 0)
+        unlink(path);
+    free(digest);
+    return status;
+}
+
+
+/*========================================================================
+ * $Log: delta.c,v $
+ */
@@ -72,7 +72,8 @@
  * Global variables.
  *------------------------------------------------------------------------*/
 
-char g_error[MAX_ERROR_MESSAGE];
+__thread char     g_error[MAX_ERROR_MESSAGE];
+__thread jmp_buf *g_error_trap = NULL;
 
 
 /*------------------------------------------------------------------------
@@ -80,9 +81,11 @@ char g_error[MAX_ERROR_MESSAGE];
  *                   int fatal_yn);
  *
  * Prints an error message (possibly with file and line number
- * information included).  If fatal_yn is true, also aborts the client.
- * The return value is always non-zero to facilitate brevity in code
- * that propagates error conditions upwards.
+ * information included) and keeps it in g_error.  If fatal_yn is true,
+ * also aborts the client, unless the thread set g_error_trap, which it
+ * then returns to with longjmp() instead.  The return value is always
+ * non-zero to facilitate brevity in code that propagates error
+ * conditions upwards.
  *------------------------------------------------------------------------*/
 int error_handler(const char *file, int line, const char *message, int fatal_yn)
 {
@@ -93,6 +96,12 @@ int error_handler(const char *file, int line, const char *message, int fatal_yn)
 
     /* print out the message */
     fprintf(stderr, "%s: %s\n", (fatal_yn ? "Error" : "Warning"), message);
+    if (message != g_error)
+	snprintf(g_error, MAX_ERROR_MESSAGE, "%s", message);
+
+    /* a library caller gets fatal errors back instead of losing its process */
+    if (fatal_yn && (g_error_trap != NULL))
+	longjmp(*g_error_trap, 1);
     if (fatal_yn)
 	exit(1);
     return -1;
@@ -0,0 +1,365 @@
+/*========================================================================
+ * merkle.c  --  Merkle tree of a file for Tsunami resume checks.
+ *
+ * This contains the routines that build the hash tree used to check the
+ * parts of a file that a client already holds against the server's
+ * copy: an MD5 hash of every 16 MB of the file at the leaves, and the
+ * MD5 hash of the child hashes at every node above.  Both ends build
+ * the same tree; the server caches its tree in a sidecar file next to
+ * the file it serves.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <pthread.h>     /* for the hashing threads               */
+#include <stdlib.h>      /* for malloc(), free(), etc.            */
+#include <string.h>      /* for standard string handling routines */
+#include <unistd.h>      /* for pread() and sysconf()             */
+
+#include "md5.h"         /* for the MD5 message digest routines   */
+#include "tsunami.h"     /* for Tsunami function prototypes, etc. */
+
+
+/*------------------------------------------------------------------------
+ * Module-scope constants and types.
+ *------------------------------------------------------------------------*/
+
+#define MERKLE_READ        (1024 * 1024)  /* the bytes per read while hashing */
+#define MERKLE_THREADS     8              /* the most threads hashing one file */
+#define MERKLE_MAGIC       "TSMERKLE"     /* the first bytes of a sidecar file */
+#define MERKLE_HEADER      32             /* the bytes before the node hashes  */
+
+/* one hashing thread of merkle_hash() */
+typedef struct {
+    merkle_t           *tree;      /* the tree whose leaves are hashed            */
+    int                 fd;        /* the file being hashed                       */
+    const u_char       *want;      /* the leaves to hash, NULL for all of them    */
+    u_int64_t           first;     /* the first leaf of this thread               */
+    u_int64_t           stride;    /* the distance between leaves of this thread  */
+    int                 status;    /* 0 on success, -1 if a read failed           */
+} merkle_job_t;
+
+
+/*------------------------------------------------------------------------
+ * merkle_t *merkle_create(u_int64_t file_size);
+ *
+ * Creates the (not yet hashed) tree for a file of the given size and
+ * returns a pointer to it, or NULL if it could not be allocated.  Even
+ * an empty file has one leaf.
+ *------------------------------------------------------------------------*/
+merkle_t *merkle_create(u_int64_t file_size)
+{
+    merkle_t  *tree;
+    u_int64_t  width;
+
+    tree = (merkle_t *) calloc(1, sizeof(*tree));
+    if (tree == NULL)
+        return NULL;
+    tree->file_size = file_size;
+    tree->leaves    = max(1, (file_size + MERKLE_LEAF_SIZE - 1) / MERKLE_LEAF_SIZE);
+
+    /* count the levels and the nodes on them */
+    for (width = tree->leaves, tree->levels = 1; width > 1; width = (width + 1) / 2)
+        ++(tree->levels);
+    tree->level = (u_int64_t *) calloc(tree->levels + 1, sizeof(u_int64_t));
+    if (tree->level == NULL) {
+        merkle_destroy(tree);
+        return NULL;
+    }
+    for (width = tree->leaves, tree->levels = 0; ; width = (width + 1) / 2) {
+        tree->level[tree->levels + 1] = tree->level[tree->levels] + width;
+        ++(tree->levels);
+        if (width == 1)
+            break;
+    }
+    tree->nodes = tree->level[tree->levels];
+
+    tree->hash  = (u_char *) calloc(tree->nodes, 16);
+    tree->valid = (u_char *) calloc(tree->nodes, 1);
+    if ((tree->hash == NULL) || (tree->valid == NULL)) {
+        merkle_destroy(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+
+/*------------------------------------------------------------------------
+ * void merkle_destroy(merkle_t *tree);
+ *
+ * Releases the tree.
+ *------------------------------------------------------------------------*/
+void merkle_destroy(merkle_t *tree)
+{
+    if (tree == NULL)
+        return;
+    free(tree->level);
+    free(tree->hash);
+    free(tree->valid);
+    free(tree);
+}
+
+
+/*------------------------------------------------------------------------
+ * int merkle_children(const merkle_t *tree, u_int64_t node,
+ *                     u_int64_t *child);
+ *
+ * Stores the index of the first child of the given node and returns
+ * the number of children it has, which is 0 for a leaf.
+ *------------------------------------------------------------------------*/
+int merkle_children(const merkle_t *tree, u_int64_t node, u_int64_t *child)
+{
+    u_int32_t level;
+
+    for (level = 0; (level < tree->levels) && (node >= tree->level[level + 1]); ++level);
+    if ((level == 0) || (level >= tree->levels))
+        return 0;
+    *child = tree->level[level - 1] + 2 * (node - tree->level[level]);
+    return (*child + 1 < tree->level[level]) ? 2 : 1;
+}
+
+
+/*------------------------------------------------------------------------
+ * void merkle_span(const merkle_t *tree, u_int64_t node,
+ *                  u_int64_t *first, u_int64_t *end);
+ *
+ * Stores the range of file bytes [first, end) the given node covers.
+ *------------------------------------------------------------------------*/
+void merkle_span(const merkle_t *tree, u_int64_t node, u_int64_t *first, u_int64_t *end)
+{
+    u_int32_t level;
+    u_int64_t index;
+
+    for (level = 0; (level < tree->levels) && (node >= tree->level[level + 1]); ++level);
+    index  = node - tree->level[min(level, tree->levels - 1)];
+    *first = min((index << level) * MERKLE_LEAF_SIZE, tree->file_size);
+    *end   = min(((index + 1) << level) * MERKLE_LEAF_SIZE, tree->file_size);
+}
+
+
+/*------------------------------------------------------------------------
+ * void *merkle_thread(void *arg);
+ *
+ * Hashes every stride-th leaf of the tree that is wanted, starting at
+ * the given first leaf.  Leaves that cannot be read in full stay
+ * invalid.
+ *------------------------------------------------------------------------*/
+static void *merkle_thread(void *arg)
+{
+    merkle_job_t *job  = (merkle_job_t *) arg;
+    merkle_t     *tree = job->tree;
+    md5_state_t   state;
+    u_char       *buffer;
+    u_int64_t     leaf, offset, end;
+    ssize_t       status;
+
+    buffer = (u_char *) malloc(MERKLE_READ);
+    if (buffer == NULL) {
+        job->status = -1;
+        return NULL;
+    }
+
+    for (leaf = job->first; leaf < tree->leaves; leaf += job->stride) {
+        if ((job->want != NULL) && !job->want[leaf])
+            continue;
+        merkle_span(tree, leaf, &offset, &end);
+        md5_init(&state);
+        while (offset < end) {
+            status = pread(job->fd, buffer, min(end - offset, MERKLE_READ), offset);
+            if (status <= 0)
+                break;
+            md5_append(&state, buffer, status);
+            offset += status;
+        }
+        if (offset < end) {
+            job->status = -1;
+            continue;
+        }
+        md5_finish(&state, tree->hash + 16 * leaf);
+        tree->valid[leaf] = 1;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * int merkle_hash(merkle_t *tree, int fd, const u_char *want);
+ *
+ * Hashes the leaves of the tree from the given file, all of them or
+ * only those with a nonzero entry in want, using several threads in
+ * parallel.  Then hashes every node above whose children are all valid.
+ * Returns 0 on success and -1 if some wanted leaf could not be read.
+ *------------------------------------------------------------------------*/
+int merkle_hash(merkle_t *tree, int fd, const u_char *want)
+{
+    merkle_job_t  job[MERKLE_THREADS];
+    pthread_t     thread[MERKLE_THREADS];
+    int           started[MERKLE_THREADS];
+    u_int64_t     node, child = 0;
+    md5_state_t   state;
+    long          threads;
+    int           index, count, status = 0;
+
+    /* one thread per core, but no more than there are leaves */
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = max(1, min(min(threads, MERKLE_THREADS), (long) tree->leaves));
+
+    /* hash the leaves */
+    for (index = 0; index < threads; ++index) {
+        job[index].tree   = tree;
+        job[index].fd     = fd;
+        job[index].want   = want;
+        job[index].first  = index;
+        job[index].stride = threads;
+        job[index].status = 0;
+        started[index] = (pthread_create(&thread[index], NULL, merkle_thread, &job[index]) == 0);
+        if (!started[index])
+            merkle_thread(&job[index]);
+    }
+    for (index = 0; index < threads; ++index) {
+        if (started[index])
+            pthread_join(thread[index], NULL);
+        status |= job[index].status;
+    }
+
+    /* and the nodes above them, level by level */
+    for (node = tree->leaves; node < tree->nodes; ++node) {
+        count = merkle_children(tree, node, &child);
+        tree->valid[node] = tree->valid[child] && ((count < 2) || tree->valid[child + 1]);
+        if (!tree->valid[node])
+            continue;
+        md5_init(&state);
+        md5_append(&state, tree->hash + 16 * child, 16 * count);
+        md5_finish(&state, tree->hash + 16 * node);
+    }
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int merkle_load(merkle_t *tree, const char *path, time_t mtime);
+ *
+ * Reads the node hashes from the given sidecar file if it was written
+ * for a file of the same size and modification time.  Returns 0 on
+ * success and -1 if there is no such sidecar.
+ *------------------------------------------------------------------------*/
+int merkle_load(merkle_t *tree, const char *path, time_t mtime)
+{
+    u_char     header[MERKLE_HEADER];
+    u_int64_t  value;
+    FILE      *sidecar;
+    int        status = -1;
+
+    sidecar = fopen(path, "rb");
+    if (sidecar == NULL)
+        return -1;
+
+    /* the header: magic, file size, modification time, leaf size */
+    if ((fread(header, MERKLE_HEADER, 1, sidecar) == 1) && !memcmp(header, MERKLE_MAGIC, 8)) {
+        memcpy(&value, header + 8, 8);
+        if (ntohll(value) == tree->file_size) {
+            memcpy(&value, header + 16, 8);
+            if (ntohll(value) == (u_int64_t) mtime) {
+                memcpy(&value, header + 24, 8);
+                if ((ntohll(value) == MERKLE_LEAF_SIZE) && (fread(tree->hash, 16, tree->nodes, sidecar) == tree->nodes)) {
+                    memset(tree->valid, 1, tree->nodes);
+                    status = 0;
+                }
+            }
+        }
+    }
+    fclose(sidecar);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int merkle_save(const merkle_t *tree, const char *path, time_t mtime);
+ *
+ * Writes the node hashes to the given sidecar file, tagged with the
+ * size and modification time of the file they describe.  Returns 0 on
+ * success and -1 on error.
+ *------------------------------------------------------------------------*/
+int merkle_save(const merkle_t *tree, const char *path, time_t mtime)
+{
+    u_char     header[MERKLE_HEADER];
+    u_int64_t  value;
+    FILE      *sidecar;
+    int        status = 0;
+
+    memcpy(header, MERKLE_MAGIC, 8);
+    value = htonll(tree->file_size);       memcpy(header + 8,  &value, 8);
+    value = htonll((u_int64_t) mtime);     memcpy(header + 16, &value, 8);
+    value = htonll(MERKLE_LEAF_SIZE);      memcpy(header + 24, &value, 8);
+
+    sidecar = fopen(path, "wb");
+    if (sidecar == NULL)
+        return -1;
+    if ((fwrite(header, MERKLE_HEADER, 1, sidecar) < 1) || (fwrite(tree->hash, 16, tree->nodes, sidecar) < tree->nodes))
+        status = -1;
+    if (fclose(sidecar) != 0)
+        status = -1;
+    if (status < 0)
+        unlink(path);
+    return status;
+}
+
+
+/*========================================================================
+ * $Log: merkle.c,v $
+ */
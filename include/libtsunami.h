@@ -0,0 +1,146 @@
+/*========================================================================
+ * libtsunami.h  --  Library interface of Tsunami file transfer.
+ *
+ * This is the interface for programs that run Tsunami transfers
+ * themselves instead of starting the tsunami and tsunamid programs.
+ * Each client or server is an object of its own, errors come back as
+ * return values with a message to fetch, never as an exit, and the
+ * progress and the final statistics come back through a callback and
+ * a result instead of on standard output.  Received files go to a local
+ * file, a memory buffer or a callback; served files come from local
+ * files, shared memory buffers or callbacks.
+ *
+ * The client calls are in libtsunami_client.a and the server calls in
+ * libtsunami_server.a, which both need libtsunami_common.a and
+ * -lpthread.  One program can link only one of the two.  Different
+ * threads can run different client or server objects at the same time,
+ * but one object must only be used by one thread at a time.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#ifndef _LIBTSUNAMI_H
+#define _LIBTSUNAMI_H
+
+#include <sys/types.h>  /* for u_char, u_int16_t, etc. */
+
+
+/*------------------------------------------------------------------------
+ * Data structures.
+ *------------------------------------------------------------------------*/
+
+typedef struct ts_client ts_client_t;  /* a client and its connection to a server */
+typedef struct ts_server ts_server_t;  /* a server and the files it shares         */
+
+/* the state of a transfer, while it runs and when it is done */
+typedef struct {
+    u_int64_t           file_size;      /* the size of the file (in bytes)            */
+    u_int64_t           block_count;    /* the number of blocks in the file           */
+    u_int64_t           blocks_left;    /* the blocks still to be received            */
+    u_int64_t           blocks_lost;    /* the blocks given up on in a lossy transfer */
+    u_int64_t           received;       /* the datagrams received, repeats included   */
+    u_int64_t           retransmits;    /* the blocks asked for again                 */
+    double              seconds;        /* the time since the transfer started        */
+    double              rate_mbps;      /* the smoothed receive rate (Mbit/s)         */
+    double              error_rate;     /* the smoothed error rate (% x 1000)         */
+    int                 verified;       /* 1 if the file hash matched the server's, 0 if not, -1 if not checked */
+} ts_progress_t;
+
+/* called with every statistics update, about three times a second; a non-zero return cancels the transfer */
+typedef int (*ts_progress_fn)(const ts_progress_t *progress, void *user);
+
+/* gets received data at the given offset of the file, in any order; returns 0, or non-zero to fail the transfer */
+typedef int (*ts_write_fn)(u_int64_t offset, const u_char *data, u_int32_t length, void *user);
+
+/* gives the size of the named file; returns 0, or non-zero if there is no such file */
+typedef int (*ts_size_fn)(const char *name, u_int64_t *size, void *user);
+
+/* reads data of the named file at the given offset; returns the bytes read, or -1 on error */
+typedef int (*ts_read_fn)(const char *name, u_int64_t offset, u_char *data, u_int32_t length, void *user);
+
+
+/*------------------------------------------------------------------------
+ * Function prototypes.
+ *------------------------------------------------------------------------*/
+
+/* client/library.c */
+ts_client_t         *ts_client_create      (void);
+void                 ts_client_destroy     (ts_client_t *client);
+int                  ts_client_set         (ts_client_t *client, const char *name, const char *value);
+void                 ts_client_progress    (ts_client_t *client, ts_progress_fn progress, void *user);
+int                  ts_client_connect     (ts_client_t *client, const char *host, u_int16_t port);
+int                  ts_client_get         (ts_client_t *client, const char *remote, const char *local);
+int                  ts_client_get_memory  (ts_client_t *client, const char *remote, u_char *buffer, u_int64_t size);
+int                  ts_client_get_callback(ts_client_t *client, const char *remote, ts_write_fn write, void *user);
+int                  ts_client_close       (ts_client_t *client);
+const ts_progress_t *ts_client_result      (const ts_client_t *client);
+const char          *ts_client_error       (const ts_client_t *client);
+
+/* server/library.c */
+ts_server_t         *ts_server_create      (void);
+void                 ts_server_destroy     (ts_server_t *server);
+int                  ts_server_set         (ts_server_t *server, const char *name, const char *value);
+int                  ts_server_share_memory(ts_server_t *server, const char *name, const u_char *data, u_int64_t size);
+void                 ts_server_share_callback(ts_server_t *server, ts_size_fn size, ts_read_fn read, void *user);
+int                  ts_server_serve       (ts_server_t *server, int client_fd);
+const char          *ts_server_error       (const ts_server_t *server);
+
+#endif
+
+
+/*========================================================================
+ * $Log: libtsunami.h,v $
+ */
@@ -81,7 +81,7 @@ extern const char      *DEFAULT_SERVER_NAME;    /* default name of the remote se
 extern const u_int16_t  DEFAULT_SERVER_PORT;    /* default TCP port of the remote server        */
 extern const u_int16_t  DEFAULT_CLIENT_PORT;    /* default UDP port of the client               */
 extern const u_int16_t  DEFAULT_UDP_PORT;       /* default UDP port of the client               */
-extern const u_int32_t  DEFAULT_UDP_BUFFER;     /* default size of the UDP receive buffer       */
+extern const u_int32_t  DEFAULT_UDP_BUFFER;     /* least size of an automatic receive buffer    */
 extern const u_char     DEFAULT_VERBOSE_YN;     /* the default verbosity setting                */
 extern const u_char     DEFAULT_TRANSCRIPT_YN;  /* the default transcript setting               */
 extern const u_char     DEFAULT_IPV6_YN;        /* the default IPv6 setting                     */
@@ -97,6 +97,22 @@ extern const u_int16_t  DEFAULT_HISTORY;        /* default percentage of history
 extern const u_char     DEFAULT_LOSSLESS;       /* default client policy for retransmit request */
 extern const u_int32_t  DEFAULT_LOSSWINDOW_MS;  /* default time window (msec) for semi-lossless */
 extern const u_char     DEFAULT_BLOCKDUMP;      /* the default to write bitmap dump to a file   */
+extern const u_int32_t  DEFAULT_SPILL_MB;       /* default size of the overflow spill (MB)      */
+extern const u_char     DEFAULT_PROBE;          /* the default for probing the path before data */
+extern const u_char     DEFAULT_PROFILE;        /* the default for using the profile cache      */
+extern const u_char     DEFAULT_BLOCK_AUTO;     /* the default for sizing blocks to the path MTU */
+extern const u_int32_t  DEFAULT_SUPER_KB;       /* default super-block size (kB), 0 for none    */
+extern const u_char     DEFAULT_CHECKSUM;       /* the default for per-block checksums          */
+extern const u_int32_t  DEFAULT_CHECKPOINT;     /* default seconds between block records, 0 off */
+extern const u_char     DEFAULT_DELTA;          /* the default for delta transfers              */
+extern const u_char     DEFAULT_SPARSE;         /* the default for leaving out holes            */
+extern const u_char     DEFAULT_COMPRESS;       /* the default for compressed blocks            */
+extern const u_char     DEFAULT_FEC;            /* the default for parity blocks                */
+extern const u_char     DEFAULT_MULTICAST;      /* the default for joining a multicast          */
+extern const u_char     DEFAULT_FOLLOW;         /* the default for following a growing file     */
+extern const char      *DEFAULT_SINK;           /* the default sink the blocks are written to   */
+extern const u_char     DEFAULT_BUNDLE;         /* the default for getting files as a bundle    */
+extern const u_int32_t  DEFAULT_PARALLEL;       /* default sessions a file is fetched over      */
 
 #define DEFAULT_SECRET             "kitten"     /* the default passphrase for servers */
 
@@ -106,6 +122,18 @@ extern const u_char     DEFAULT_BLOCKDUMP;      /* the default to write bitmap d
 #define MAX_COMMAND_WORDS          10           /* maximum number of words in any command       */
 #define MAX_RETRANSMISSION_BUFFER  2048         /* maximum number of requests to send at once   */
 #define MAX_BLOCKS_QUEUED          4096         /* maximum number of blocks in ring buffer      */
+#define SUPER_CACHE_SLOTS          8            /* least super-blocks assembled at once         */
+#define SUPER_CACHE_MB             256          /* most memory for super-block assembly (MB)    */
+#define FEC_CACHE_SLOTS            128          /* recent blocks kept for parity recovery       */
+#define STREAM_SLOTS               1024         /* first size of the stream's early block table */
+#define STREAM_LOSSY_HOLD          4096         /* early blocks a lossy stream holds for a gap  */
+#define SINK_BATCH                 64           /* blocks the pwrite sink coalesces at most     */
+#define BUNDLE_PREFIX              "bundle:"    /* the start of a request for a bundle of files  */
+#define BUNDLE_OPEN_FILES          64           /* most files of a bundle open at once          */
+#define BUNDLE_BUFFER              1048576      /* bytes read at once to hash a bundle          */
+#define PARALLEL_MAX               16           /* most sessions one file is fetched over       */
+#define PARALLEL_MIN_CHUNK         (32LL << 20) /* fewest bytes worth a session of their own    */
+#define PARALLEL_START_SHARE       3            /* even shares a session may start out at       */
 #define UPDATE_PERIOD              350000LL     /* length of the update period in microseconds  */
 
 extern const int        MAX_COMMAND_LENGTH;     /* maximum length of a single command           */
@@ -129,12 +157,12 @@ typedef struct {
     struct timeval      start_time;               /* when we started timing the transfer         */
     struct timeval      stop_time;                /* when we finished timing the transfer        */
     struct timeval      this_time;                /* when we began this data collection period   */
-    u_int32_t           this_blocks;              /* the number of blocks in this interval       */
+    u_int64_t           this_blocks;              /* the number of blocks in this interval       */
     u_int32_t           this_retransmits;         /* the number of retransmits in this interval  */
-    u_int32_t           total_blocks;             /* the total number of blocks transmitted      */
-    u_int32_t           total_retransmits;        /* the total number of retransmission requests */
-    u_int32_t           total_recvd_retransmits;  /* the total number of received retransmits    */
-    u_int32_t           total_lost;               /* the final number of data blocks lost        */
+    u_int64_t           total_blocks;             /* the total number of blocks transmitted      */
+    u_int64_t           total_retransmits;        /* the total number of retransmission requests */
+    u_int64_t           total_recvd_retransmits;  /* the total number of received retransmits    */
+    u_int64_t           total_lost;               /* the final number of data blocks lost        */
     u_int32_t           this_flow_originals;      /* the number of original blocks this interval */
     u_int32_t           this_flow_retransmitteds; /* the number of re-tx'ed blocks this interval */
     double              this_transmit_rate;       /* the unfiltered transmission rate (bps)      */
@@ -143,11 +171,17 @@ typedef struct {
     double              error_rate;               /* the smoothed error rate (% x 1000)          */
     u_int64_t           start_udp_errors;         /* the initial UDP error counter value of OS   */
     u_int64_t           this_udp_errors;          /* the current UDP error counter value of OS   */
+    u_int64_t           total_dropped;            /* blocks dropped with both ring and spill full */
+    u_int64_t           total_corrupt;            /* blocks dropped for a bad checksum           */
+    u_int32_t           ring_peak;                /* the highest ring buffer occupancy seen      */
+    u_int64_t           this_disk_blocks;         /* disk_blocks at the start of this interval   */
+    u_int64_t           this_disk_usec;           /* disk_usec at the start of this interval     */
+    u_int32_t           iteration;                /* the number of statistics lines shown        */
 } statistics_t;
 
 /* state of the retransmission table for a transfer */
 typedef struct {
-    u_int32_t          *table;                    /* the table of retransmission blocks          */
+    u_int64_t          *table;                    /* the table of retransmission blocks          */
     u_int32_t           table_size;               /* the size of the retransmission table        */
     u_int32_t           index_max;                /* the maximum table index in active use       */
 } retransmit_t;
@@ -164,14 +198,130 @@ typedef struct {
     int                 data_ready;               /* nonzero when data is ready, else 0          */
     pthread_cond_t      space_ready_cond;         /* condition variable to indicate space ready  */
     int                 space_ready;              /* nonzero when space is available, else 0     */
+    int                 dead;                     /* nonzero once nothing drains the ring any more */
 } ring_buffer_t;
 
+/* spill buffer for blocks that arrive while the ring buffer is full */
+typedef struct {
+    u_char             *datagrams;                /* the RAM arena, or NULL when using a file    */
+    int                 fd;                       /* the unlinked spill file, or -1 for RAM      */
+    int                 datagram_size;            /* the size of a single datagram               */
+    u_int64_t           capacity;                 /* the number of datagrams the spill can hold  */
+    u_int64_t           base_data;                /* the index of the first slot with data       */
+    u_int64_t           count_data;               /* the number of slots in use for data         */
+    u_int64_t           peak_data;                /* the highest count_data seen                 */
+    u_int64_t           total_spilled;            /* the number of datagrams ever spilled        */
+    pthread_mutex_t     mutex;                    /* a mutex to guard the indices                */
+} spill_buffer_t;
+
+/* a super-block being assembled for one large disk write */
+typedef struct {
+    u_int64_t           index;                    /* the super-block number + 1, 0 while free    */
+    u_int32_t           present;                  /* the number of blocks collected so far       */
+    u_char             *received;                 /* bitfield of the blocks collected            */
+    u_char             *data;                     /* the super-block contents                    */
+} super_slot_t;
+
+/* super-block mode state, see superblock.c */
+typedef struct {
+    u_int32_t           blocks;                   /* the number of blocks per super-block        */
+    u_int64_t           count;                    /* the number of super-blocks in the file      */
+    u_int32_t          *missing;                  /* blocks still missing, per super-block       */
+    u_char             *listed;                   /* bitfield of the super-blocks to request     */
+    u_int64_t           wanted_to;                /* the highest block asked for so far          */
+    super_slot_t       *slot;                     /* the assembly slots of the disk thread       */
+    int                 slots;                    /* the number of assembly slots                */
+    u_int64_t           total_writes;             /* the number of disk writes done              */
+} super_cache_t;
+
+/* recent blocks kept for rebuilding a lost one from parity, see fec.c */
+typedef struct {
+    u_int32_t           block_size;               /* the size of each block (in bytes)           */
+    u_int64_t          *block;                    /* the block held in each slot, 0 for none     */
+    u_char             *packed;                   /* 1 for each block that arrived packed        */
+    u_char             *data;                     /* the data of each block as it arrived        */
+    u_int64_t           total_parity;             /* the parity blocks received                  */
+    u_int64_t           total_recovered;          /* the blocks rebuilt from parity              */
+} fec_cache_t;
+
+/* a block that reached the stream before those ahead of it */
+typedef struct {
+    u_int64_t           block;                    /* the block held in the slot, 0 for none      */
+    u_int32_t           length;                   /* the bytes of data in the block              */
+    u_char             *data;                     /* the data of the block                       */
+} stream_slot_t;
+
+/* in-order output of the file to a pipe or process, see stream.c */
+typedef struct {
+    FILE               *out;                      /* where the data goes                         */
+    u_char              kind;                     /* STREAM_TO_FILE, _COMMAND or _STDOUT         */
+    u_int64_t           next;                     /* the next block to write out                 */
+    stream_slot_t      *slot;                     /* the early blocks, by block % slots          */
+    u_int64_t           slots;                    /* the number of slots in the table            */
+    u_int64_t           held;                     /* the number of early blocks held now         */
+    u_int64_t           peak;                     /* the most early blocks held at once          */
+    u_char             *zero;                     /* a block of zeros to stand in for lost ones  */
+    u_int64_t           total_zeroed;             /* the lost blocks written as zeros            */
+    crc32c_tree_t       tree;                     /* the tree hash of the data written out       */
+    u_char              closed;                   /* 1 once stream_close() is done               */
+} stream_t;
+
+#define STREAM_TO_FILE             0            /* stream kind: a named file or FIFO            */
+#define STREAM_TO_COMMAND          1            /* stream kind: a command started with popen()  */
+#define STREAM_TO_STDOUT           2            /* stream kind: our standard output             */
+#define STREAM_TO_NOWHERE          3            /* stream kind: only hashed, for the hash sink  */
+
+/* a file or directory that a bundle is split into */
+typedef struct {
+    char               *name;                     /* its path under the destination directory    */
+    u_int64_t           offset;                   /* where its data starts in the stream         */
+    u_int64_t           size;                     /* the size of its data, 0 for a directory     */
+    u_int32_t           mode;                     /* its type and permission bits                */
+    u_int64_t           written;                  /* the bytes of it written so far              */
+    int                 fd;                       /* its open descriptor, -1 if closed           */
+} bundle_entry_t;
+
+/* files and directory trees received as one stream of their data, see bundle.c */
+typedef struct {
+    char               *root;                     /* the directory the bundle goes into          */
+    bundle_entry_t     *entry;                    /* the entries, in the order of their data     */
+    u_int32_t           count;                    /* the number of entries                       */
+    u_int64_t           size;                     /* the size of the stream                      */
+    u_int32_t           open[BUNDLE_OPEN_FILES];  /* the entries with an open descriptor         */
+    u_int32_t           opened;                   /* the number of those                         */
+    u_int32_t           victim;                   /* the one to close when all are in use        */
+} bundle_t;
+
+struct ttp_session;
+
+/* a backend that the received blocks are written to, see sink.c */
+typedef struct {
+    const char         *name;                     /* the name that 'set sink' picks it by        */
+    u_char              local;                    /* 1 if it writes the local file               */
+    int               (*open)       (struct ttp_session *session);
+    int               (*write_block)(struct ttp_session *session, u_int64_t block, const u_char *data, u_int32_t length);
+    int               (*flush)      (struct ttp_session *session);
+    int               (*close)      (struct ttp_session *session, int complete);
+} sink_t;
+
+/* performance profile of one server, see profile.c */
+typedef struct {
+    u_int32_t           rate_bps;                 /* the achieved file rate (bps)                */
+    u_int32_t           loss_ppm;                 /* the retransmission requests per 10^6 blocks */
+    u_int32_t           rtt_usec;                 /* the control channel round trip time         */
+    u_int32_t           block_size;               /* the block size that gave the best rate      */
+    u_int32_t           block_rate_bps;           /* the rate achieved with that block size      */
+    u_int32_t           ring_peak;                /* the highest ring buffer occupancy seen      */
+    u_int32_t           transfers;                /* the number of transfers folded in           */
+    u_int32_t           losswindow_ms;            /* the loss window seeded from the profile     */
+} ttp_profile_t;
+
 /* Tsunami transfer protocol parameters */
 typedef struct {
     char               *server_name;              /* the name of the host running tsunamid       */
     u_int16_t           server_port;              /* the TCP port on which the server listens    */
     u_int16_t           client_port;              /* the UDP port on which the client receives   */
-    u_int32_t           udp_buffer;               /* the size of the UDP receive buffer in bytes */
+    u_int32_t           udp_buffer;               /* the UDP receive buffer size, 0 for auto     */
     u_char              verbose_yn;               /* 1 for verbose mode, 0 for quiet             */
     u_char              transcript_yn;            /* 1 for transcripts on, 0 for no transcript   */
     u_char              ipv6_yn;                  /* 1 for IPv6, 0 for IPv4                      */
@@ -188,6 +338,30 @@ typedef struct {
     u_char              lossless;                 /* 1 for lossless, 0 for data rate priority    */
     u_int32_t           losswindow_ms;            /* data rate priority: time window for re-tx's */
     u_char              blockdump;                /* 1 to write received block bitmap to a file  */
+    u_int32_t           spill_mb;                 /* size of the ring-full spill buffer (MB)     */
+    char               *spill_dir;                /* directory of the spill file, NULL for RAM   */
+    char               *stream_to;                /* "-", a FIFO or "|command" to stream the file to in order, NULL for a local file */
+    const sink_t       *sink;                     /* the backend the blocks are written to       */
+    u_char             *sink_memory;              /* the buffer of the memory sink               */
+    u_int64_t           sink_memory_size;         /* the size of that buffer                     */
+    int               (*sink_callback)(u_int64_t offset, const u_char *data, u_int32_t length, void *user);
+    void               *sink_user;                /* the last argument of the callback sink      */
+    u_char              embedded;                 /* 1 when run as a library: no report, no signal handlers */
+    u_char              probe;                    /* 1 to probe the path for the starting rate   */
+    u_char              profile;                  /* 1 to use the per-server profile cache       */
+    ttp_profile_t       profile_seed;             /* the values last seeded from the profile     */
+    u_char              block_auto;               /* 1 to size blocks to the path MTU            */
+    u_int32_t           super_kb;                 /* the super-block size in kB, 0 for none      */
+    u_char              checksum;                 /* 1 to checksum every block and the file      */
+    u_int32_t           checkpoint;               /* seconds between block records, 0 for none   */
+    u_char              delta;                    /* 1 to fetch only the blocks that changed     */
+    u_char              sparse;                   /* 1 to leave out the holes of sparse files    */
+    u_char              compress;                 /* 1 to let the server send blocks compressed  */
+    u_char              fec;                      /* 1 to have the server send parity blocks     */
+    u_char              multicast;                /* 1 to join the server's multicast of the file */
+    u_char              follow;                   /* 1 to keep receiving while the file grows    */
+    u_char              bundle;                   /* 1 to get every file or tree as a bundle     */
+    u_int32_t           parallel;                 /* the sessions a get splits a file over       */
     char                *passphrase;              /* the passphrase to use for authentication    */
     char                *ringbuf;                 /* Pointer to ring buffer start                */
 } ttp_parameter_t;    
@@ -202,27 +376,72 @@ typedef struct {
     FILE               *transcript;               /* the transcript file that we're writing to   */
     int                 udp_fd;                   /* the file descriptor of our UDP socket       */
     u_int64_t           file_size;                /* the total file size (in bytes)              */
-    u_int32_t           block_count;              /* the total number of blocks in the file      */
-    u_int32_t           next_block;               /* the index of the next block we expect       */
-    u_int32_t           gapless_to_block;         /* the last block in the fully received range  */
+    u_int64_t           block_count;              /* the total number of blocks in the file      */
+    u_int64_t           next_block;               /* the index of the next block we expect       */
+    u_int64_t           gapless_to_block;         /* the last block in the fully received range  */
     retransmit_t        retransmit;               /* the retransmission data for the transfer    */
     statistics_t        stats;                    /* the statistical data for the transfer       */
     ring_buffer_t      *ring_buffer;              /* the blocks waiting for a disk write         */
-    u_char             *received;                 /* bitfield for the received blocks of data    */
-    u_int32_t           blocks_left;              /* the number of blocks left to receive        */
+    spill_buffer_t     *spill_buffer;             /* the blocks that overflowed the ring buffer  */
+    super_cache_t      *super_cache;              /* the super-block state, NULL if not in use   */
+    fec_cache_t        *fec_cache;                /* the parity recovery state, NULL if not in use */
+    stream_t           *stream;                   /* the in-order output, NULL for a local file  */
+    bundle_t           *bundle;                   /* the files of a bundle, NULL for a single file */
+    const sink_t       *sink;                     /* the backend the blocks are written to       */
+    void               *sink_data;                /* the state of that backend                   */
+    blockmap_t         *received;                 /* bitfield for the received blocks of data    */
+    blockmap_t         *written;                  /* bitfield for the blocks on disk (disk thread) */
+    u_char              resume;                   /* 1 to resume from the block record unchecked */
+    u_int64_t           blocks_left;              /* the number of blocks left to receive        */
     u_char              restart_pending;          /* 1 to ignore too new packets                 */
-    u_int32_t           restart_lastidx;          /* the last index in the restart list          */
-    u_int32_t           restart_wireclearidx;     /* the max on-wire block number before react   */
-    u_int32_t           on_wire_estimate;         /* the max packets on wire if RTT is 500ms     */
+    u_int64_t           restart_lastidx;          /* the last index in the restart list          */
+    u_int64_t           restart_wireclearidx;     /* the max on-wire block number before react   */
+    u_int64_t           on_wire_estimate;         /* the max packets on wire if RTT is 500ms     */
+    u_int32_t           options;                  /* the TS_OPT_* options accepted by the server */
+    u_int16_t           tag;                      /* the tag of the datagrams of this transfer   */
+    u_int32_t           rtt_usec;                 /* the round trip time of the session          */
+    u_int32_t           udp_buffer;               /* the receive buffer size the kernel granted  */
+    u_int32_t           udp_request;              /* the receive buffer size last asked for      */
+    u_int32_t           super_size;               /* the blocks per super-block agreed upon      */
+    u_int32_t           mcast_group;              /* the multicast group (network order)         */
+    u_int16_t           mcast_port;               /* the UDP port of the multicast group         */
+    u_int32_t           probe_bottleneck_kbps;    /* the probed bottleneck bandwidth (kbit/s)    */
+    u_int32_t           probe_onset_kbps;         /* the probed rate where queueing set in       */
+    u_int64_t           disk_blocks;              /* the blocks written by the disk thread       */
+    u_int64_t           disk_usec;                /* the time the disk thread spent writing      */
+    u_char              disk_failed;              /* 1 once the disk thread gave up on an error  */
+    u_int32_t           digest;                   /* the CRC32C tree hash of the file we wrote   */
+    u_int32_t           server_digest;            /* the CRC32C tree hash of the server's file   */
+    int                 verified;                 /* 1 if the hashes matched, 0 if not, -1 if not checked */
 } ttp_transfer_t;
 
-/* state of a Tsunami session as a whole */
+/* the sessions of one parallel get, which share its target rate, see parallel.c */
 typedef struct {
+    pthread_mutex_t     mutex;                    /* a mutex to guard the rates                  */
+    u_int32_t           target_rate;              /* the target rate of all sessions together    */
+    u_int32_t           count;                    /* the number of sessions                      */
+    double              rate[PARALLEL_MAX];       /* the last receive rate of each session (bps) */
+    u_char              active[PARALLEL_MAX];     /* 1 while that session transfers its range    */
+    u_char              failed;                   /* 1 once a session failed, which stops the rest */
+} parallel_t;
+
+/* state of a Tsunami session as a whole */
+typedef struct ttp_session {
     ttp_parameter_t    *parameter;                /* the TTP protocol parameters                 */
     ttp_transfer_t      transfer;                 /* the current transfer in progress, if any    */
     FILE               *server;                   /* the connection to the remote server         */
     struct sockaddr    *server_address;           /* the socket address of the remote server     */
     socklen_t           server_address_length;    /* the size of the socket address              */
+    int                 udp_fd;                   /* the data socket of every transfer, or -1    */
+    u_int32_t           rtt_usec;                 /* the round trip time of the authentication   */
+    int                 path_block_size;          /* the block size path MTU discovery found     */
+    int               (*progress)(struct ttp_session *session);  /* called with every statistics update, non-zero cancels */
+    void               *progress_data;            /* the state of the progress callback          */
+    u_char              cancelled;                /* 1 once the transfer is to be cut short      */
+    u_int64_t           range_offset;             /* the first byte wanted, with a byte range    */
+    u_int64_t           range_length;             /* the bytes wanted from there, 0 for the file */
+    parallel_t         *parallel;                 /* the parallel get this session is part of    */
+    int                 parallel_slot;            /* the index of this session in it             */
 } ttp_session_t;
 
 
@@ -230,38 +449,82 @@ typedef struct {
  * Function prototypes.
  *------------------------------------------------------------------------*/
 
+/* bundle.c */
+int            bundle_add            (bundle_t *bundle, const char *name, u_int64_t size, u_int32_t mode);
+int            bundle_close          (bundle_t *bundle, int complete);
+bundle_t      *bundle_create         (const char *root);
+void           bundle_destroy        (bundle_t *bundle);
+int            bundle_digest         (bundle_t *bundle, u_int32_t *digest);
+int            bundle_prepare        (bundle_t *bundle);
+int            bundle_write          (bundle_t *bundle, u_int64_t offset, const u_char *data, u_int32_t length);
+
 /* command.c */
 int            command_close         (command_t *command, ttp_session_t *session);
 ttp_session_t *command_connect       (command_t *command, ttp_parameter_t *parameter);
 int            command_get           (command_t *command, ttp_session_t *session);
 int            command_help          (command_t *command, ttp_session_t *session);
 int            command_quit          (command_t *command, ttp_session_t *session);
+int            command_resume        (command_t *command, ttp_session_t *session);
 int            command_set           (command_t *command, ttp_parameter_t *parameter);
 int            command_dir           (command_t *command, ttp_session_t *session);
 
-inline int     got_block             (ttp_session_t* session, u_int32_t blocknr);
+inline int     got_block             (ttp_session_t* session, u_int64_t blocknr);
 
 /* config.c */
 void           reset_client          (ttp_parameter_t *parameter);
 
+/* fec.c */
+fec_cache_t   *fec_create            (ttp_session_t *session);
+int            fec_destroy           (fec_cache_t *cache);
+int            fec_recover           (ttp_session_t *session, u_char *datagram);
+void           fec_store             (fec_cache_t *cache, const u_char *datagram, u_int32_t length);
+
 /* io.c */
-int            accept_block          (ttp_session_t *session, u_int32_t block_index, u_char *block);
+int            accept_block          (ttp_session_t *session, u_int64_t block_index, u_char *block);
+int            accept_datagram       (ttp_session_t *session, u_char *datagram, u_char *scratch);
 
 /* network.c */
 int            create_tcp_socket     (ttp_session_t *session, const char *server_name, u_int16_t server_port);
 int            create_udp_socket     (ttp_parameter_t *parameter);
+int            create_mcast_socket   (u_int32_t group, u_int16_t port);
+
+/* parallel.c */
+int            parallel_get          (command_t *command, ttp_session_t *session);
+double         parallel_share        (ttp_session_t *session);
+
+/* profile.c */
+int            profile_load          (ttp_session_t *session);
+int            profile_save          (ttp_session_t *session, double rate_bps, double secs);
 
 /* protocol.c */
 int            ttp_authenticate      (ttp_session_t *session, u_char *secret);
+int            ttp_check_held        (ttp_session_t *session);
 int            ttp_negotiate         (ttp_session_t *session);
 int            ttp_open_port         (ttp_session_t *session);
 int            ttp_open_transfer     (ttp_session_t *session, const char *remote_filename, const char *local_filename);
+int            ttp_probe_path        (ttp_session_t *session);
+int            ttp_query_size        (ttp_session_t *session, const char *remote_filename, u_int64_t *size);
 int            ttp_repeat_retransmit (ttp_session_t *session);
-int            ttp_request_retransmit(ttp_session_t *session, u_int32_t block);
+int            ttp_request_retransmit(ttp_session_t *session, u_int64_t block);
 int            ttp_request_stop      (ttp_session_t *session);
+int            ttp_read_blockmap     (ttp_session_t *session, blockmap_t *map);
+int            ttp_read_growth       (ttp_session_t *session, u_int64_t block);
+int            ttp_read_holes        (ttp_session_t *session);
+int            ttp_read_manifest     (ttp_session_t *session);
+int            ttp_send_delta        (ttp_session_t *session);
+int            ttp_send_skip         (ttp_session_t *session);
+int            ttp_size_buffer       (ttp_session_t *session, u_int32_t size);
 int            ttp_update_stats      (ttp_session_t *session);
+int            ttp_verify_file       (ttp_session_t *session);
+
+/* resume.c */
+int            resume_exists         (const char *local_filename);
+int            resume_load           (ttp_session_t *session);
+int            resume_remove         (ttp_session_t *session);
+int            resume_save           (ttp_session_t *session);
 
 /* ring.c */
+int            ring_abandon          (ring_buffer_t *ring);
 int            ring_cancel           (ring_buffer_t *ring);
 int            ring_confirm          (ring_buffer_t *ring);
 ring_buffer_t *ring_create           (ttp_session_t *session);
@@ -272,6 +535,34 @@ int            ring_pop              (ring_buffer_t *ring);
 int            ring_full             (ring_buffer_t *ring);
 u_char        *ring_reserve          (ring_buffer_t *ring);
 
+/* spill.c */
+spill_buffer_t *spill_create         (ttp_session_t *session);
+int            spill_destroy         (spill_buffer_t *spill);
+int            spill_full            (spill_buffer_t *spill);
+u_int64_t      spill_count           (spill_buffer_t *spill);
+int            spill_push            (spill_buffer_t *spill, const u_char *datagram);
+int            spill_pop             (spill_buffer_t *spill, u_char *datagram);
+
+/* sink.c */
+const sink_t  *sink_find             (const char *name);
+
+/* stream.c */
+int            stream_close          (ttp_session_t *session, int fill);
+void           stream_destroy        (stream_t *stream);
+stream_t      *stream_open           (ttp_session_t *session, const char *target);
+FILE          *stream_stdout         (void);
+int            stream_write          (ttp_session_t *session, u_int64_t block, const u_char *data, u_int32_t length);
+
+/* superblock.c */
+int            super_accept          (ttp_session_t *session, u_int64_t block_index, u_char *block);
+super_cache_t *super_create          (ttp_session_t *session);
+int            super_destroy         (super_cache_t *cache);
+int            super_evict           (ttp_session_t *session, super_slot_t *slot);
+int            super_flush           (ttp_session_t *session);
+int            super_received        (super_cache_t *cache, u_int64_t block_index);
+int            super_requests        (ttp_session_t *session, retransmission_t *request, int room, u_int64_t *wanted);
+int            super_write           (ttp_session_t *session, u_int64_t block_index, const u_char *data, u_int32_t blocks);
+
 #ifdef VSIB_REALTIME
 /* vsibctl.c */ 
 void start_vsib (ttp_session_t *session); 
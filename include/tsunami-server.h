@@ -64,6 +64,7 @@
 #define __TSUNAMI_SERVER_H
 
 #include <netinet/in.h>  /* for struct sockaddr_in, etc.                 */
+#include <pthread.h>     /* for pthread_mutex_t                          */
 #include <stdio.h>       /* for NULL, FILE *, etc.                       */
 #include <sys/types.h>   /* for various system data types                */
 
@@ -77,20 +78,146 @@
 extern const u_int32_t  DEFAULT_BLOCK_SIZE;         /* default size of a single file block     */
 extern const u_char    *DEFAULT_SECRET;             /* default shared secret                   */
 extern const u_int16_t  DEFAULT_TCP_PORT;           /* default TCP port to listen on           */
-extern const u_int32_t  DEFAULT_UDP_BUFFER;         /* default size of the UDP transmit buffer */
+extern const u_int32_t  DEFAULT_UDP_BUFFER;         /* least size of an automatic send buffer  */
 extern const u_char     DEFAULT_VERBOSE_YN;         /* the default verbosity setting           */
 extern const u_char     DEFAULT_TRANSCRIPT_YN;      /* the default transcript setting          */
 extern const u_char     DEFAULT_IPV6_YN;            /* the default IPv6 setting                */
 extern const u_int16_t  DEFAULT_HEARTBEAT_TIMEOUT;  /* the default timeout after no client heartbeat */
+extern const u_char     DEFAULT_MCAST_TTL;          /* the default TTL of multicast datagrams  */
+extern const u_int32_t  DEFAULT_MCAST_WAIT;         /* the default join window of a multicast  */
+extern const u_int32_t  DEFAULT_FOLLOW_IDLE;        /* the default idle timeout of a followed file */
 
 #define MAX_FILENAME_LENGTH  1024               /* maximum length of a requested filename  */
 #define RINGBUF_BLOCKS  1                       /* Size of ring buffer (disabled now) */
 #define FRAMES_IN_SLOT  40                      /* 0.02s timeslots for computers */
+#define FLOW_FILL_SECS  0.5                     /* time to fill the client's free buffer slots */
+#define COMPRESS_REGION 4096                    /* blocks under one adaptive compression decision */
+#define COMPRESS_SAMPLE 32                      /* blocks of a region packed to make that decision */
+#define COMPRESS_GAIN   0.9                     /* largest packed/raw ratio still worth sending    */
+#define COMPRESS_ON     1                       /* region decision: send its blocks packed         */
+#define COMPRESS_OFF    2                       /* region decision: send its blocks as they are    */
+#define FEC_GROUP_MIN   4                       /* fewest blocks under one parity block           */
+#define FEC_GROUP_START 16                      /* blocks under one parity block until feedback   */
+#define FEC_LOSS_TARGET 0.1                     /* blocks a group should lose on average          */
+#define MCAST_MEMBERS   64                      /* most receivers of one multicast stream          */
+#define MCAST_REPAIRS   8192                    /* most repair requests queued for the sender      */
+#define MCAST_HOLD      250000                  /* usec in which a block is repaired only once     */
+#define MCAST_STREAM    (TS_OPT_CHECKSUM | TS_OPT_COMPRESS | TS_OPT_FEC)  /* options that the stream decides */
+#define MCAST_EXCLUDED  (TS_OPT_PROBE | TS_OPT_MERKLE | TS_OPT_SKIP | TS_OPT_DELTA | TS_OPT_SPARSE | TS_OPT_RANGE)  /* options a shared stream can't have */
+#define RELAY_WINDOW    65536                   /* most blocks the upstream hop runs ahead         */
+#define RELAY_REQUESTS  2048                    /* most retransmissions asked upstream per period  */
+#define RELAY_PERIOD    350000                  /* usec between feedback reports to upstream       */
+#define RELAY_HISTORY   0.25                    /* weight of the old upstream error rate           */
+#define RELAY_EXCLUDED  (TS_OPT_MERKLE | TS_OPT_DELTA | TS_OPT_SPARSE | TS_OPT_MULTICAST | TS_OPT_FOLLOW | TS_OPT_BUNDLE | TS_OPT_RANGE)  /* options that need the whole file at hand */
+#define FOLLOW_PERIOD   5000                    /* usec between looks at a followed file           */
+#define FOLLOW_SIDECAR  ".done"                 /* suffix of the file whose presence ends following */
+#define FOLLOW_EXCLUDED (TS_OPT_SUPERBLOCK | TS_OPT_MERKLE | TS_OPT_SKIP | TS_OPT_DELTA | TS_OPT_SPARSE | TS_OPT_FEC | TS_OPT_MULTICAST | TS_OPT_RANGE)  /* options that need the final size */
+#define SOURCE_PREFETCH (8 * 1024 * 1024)       /* bytes the source is asked to read ahead         */
+#define SOURCE_SEPARATOR ':'                    /* ends the name of a source prefixed to a file    */
+#define FILELESS_EXCLUDED (TS_OPT_MERKLE | TS_OPT_DELTA | TS_OPT_SPARSE | TS_OPT_MULTICAST | TS_OPT_FOLLOW | TS_OPT_BUNDLE)  /* options that need a real file */
+#define BUNDLE_EXCLUDED (TS_OPT_MERKLE | TS_OPT_DELTA | TS_OPT_SPARSE | TS_OPT_MULTICAST | TS_OPT_FOLLOW | TS_OPT_RANGE)  /* options that need a single file */
+#define RANGE_EXCLUDED  (TS_OPT_MERKLE | TS_OPT_SKIP | TS_OPT_DELTA | TS_OPT_SPARSE | TS_OPT_MULTICAST | TS_OPT_FOLLOW | TS_OPT_BUNDLE)  /* options that need the whole file wanted */
+#define BUNDLE_DEPTH    64                      /* deepest directory a bundle walks into           */
+#define SERVER_OPTIONS  (TS_OPT_PROBE | TS_OPT_AUTOBLOCK | TS_OPT_SUPERBLOCK | TS_OPT_CHECKSUM | TS_OPT_MERKLE | TS_OPT_SKIP | TS_OPT_DELTA | TS_OPT_SPARSE | TS_OPT_COMPRESS | TS_OPT_FEC | TS_OPT_MULTICAST | TS_OPT_FOLLOW | TS_OPT_BUNDLE | TS_OPT_RANGE)  /* the TS_OPT_* transfer options we support */
 
 /*------------------------------------------------------------------------
  * Data structures.
  *------------------------------------------------------------------------*/
 
+/* one receiver of the multicast stream, as its handler process sees it */
+typedef struct {
+    pid_t               pid;          /* the handler process, 0 for a free slot     */
+    double              ipd_current;  /* the IPD its client's error rate allows     */
+    double              ipd_flow;     /* the least IPD its client's disk absorbs    */
+    u_int32_t           error_rate;   /* the last error rate its client reported    */
+} mcast_member_t;
+
+/* the multicast stream, in memory shared by all server processes */
+typedef struct {
+    pthread_mutex_t     lock;         /* a process-shared mutex guarding the rest   */
+    pid_t               sender;       /* the process sending the stream, 0 for none */
+    int                 active;       /* 1 while the stream has receivers           */
+    char                filename[MAX_FILENAME_LENGTH];  /* the file being streamed  */
+    u_int32_t           block_size;   /* the block size of the stream               */
+    u_int32_t           options;      /* the MCAST_STREAM options of the stream     */
+    u_int64_t           restart;      /* the earliest block to restart at, 0 for none */
+    u_int32_t           repair_head;  /* the oldest queued repair request           */
+    u_int32_t           repair_count; /* the number of queued repair requests       */
+    u_int64_t           repair[MCAST_REPAIRS]; /* the blocks asked to be sent again */
+    mcast_member_t      member[MCAST_MEMBERS]; /* the receivers                     */
+} multicast_t;
+
+/* the upstream hop of a relayed transfer */
+typedef struct {
+    FILE               *server;       /* the control connection to the upstream server */
+    char               *filename;     /* the file to ask the upstream server for    */
+    int                 udp_fd;       /* the socket the upstream data arrives on    */
+    int                 spool_fd;     /* the file the data is written to            */
+    pthread_t           thread;       /* the thread receiving the upstream data     */
+    pthread_mutex_t     lock;         /* guards the fields below                    */
+    pthread_cond_t      arrival;      /* signalled whenever a block arrives         */
+    blockmap_t         *arrived;      /* the blocks written to the spool file       */
+    u_int64_t           highest;      /* the highest block seen upstream            */
+    u_int64_t           wanted;       /* the highest block asked for downstream     */
+    int                 stop;         /* 1 to have the thread stop                  */
+    int                 failed;       /* 1 once the upstream transfer failed        */
+    u_int64_t           file_size;    /* the size of the file                       */
+    u_int64_t           block_count;  /* the number of blocks in the file           */
+    u_int32_t           block_size;   /* the block size of both hops                */
+    u_int16_t           tag;          /* the tag of the upstream datagrams          */
+    double              error_rate;   /* the smoothed upstream error rate           */
+    u_int64_t           requests;     /* the retransmissions asked upstream         */
+    u_int64_t           received;     /* the datagrams received upstream            */
+} relay_t;
+
+/* a file that is still growing while it is sent */
+typedef struct {
+    int                 open;         /* 1 while the file may still grow            */
+    u_int64_t           size;         /* the size of the file when last looked at   */
+    struct timeval      polled;       /* when the file was last looked at           */
+    struct timeval      grown;        /* when it was last seen to grow              */
+} follow_t;
+
+/* a buffer that a program using the library shares as a file */
+typedef struct shared_memory {
+    char               *name;         /* the name it is requested by, after "memory:" */
+    const u_char       *data;         /* the contents                               */
+    u_int64_t           size;         /* the size of the contents                   */
+    struct shared_memory *next;       /* the next buffer shared, NULL for the last  */
+} shared_memory_t;
+
+/* a file or directory of a bundle, see bundle.c */
+typedef struct {
+    char               *path;         /* where it is on this server                 */
+    char               *name;         /* its name in the manifest                   */
+    u_int64_t           offset;       /* where its data starts in the stream        */
+    u_int64_t           size;         /* the size of its data, 0 for a directory    */
+    u_int32_t           mode;         /* its type and permission bits               */
+} bundle_entry_t;
+
+/* files and directory trees sent as one stream of their data */
+typedef struct {
+    bundle_entry_t     *entry;        /* the entries, in the order of their data    */
+    u_int32_t           count;        /* the number of entries                      */
+    u_int32_t           room;         /* the number of entries allocated            */
+    u_int64_t           size;         /* the size of the stream                     */
+    int                 fd;           /* the file last read from, -1 for none       */
+    u_int32_t           fd_entry;     /* the entry of that file                     */
+} bundle_t;
+
+struct ttp_session;
+
+/* a backend that the blocks of a file are read from, see source.c */
+typedef struct {
+    const char         *name;         /* the prefix that picks it, NULL for plain files */
+    u_int32_t           excluded;     /* the TS_OPT_* options it cannot serve       */
+    int               (*open)      (struct ttp_session *session, const char *name);
+    u_int64_t         (*size)      (struct ttp_session *session);
+    int               (*read_block)(struct ttp_session *session, u_int64_t block, u_char *buffer);
+    void              (*prefetch)  (struct ttp_session *session, u_int64_t first, u_int64_t count);
+    void              (*close)     (struct ttp_session *session);
+} source_t;
+
 /* Tsunami transfer protocol parameters */
 typedef struct {
     time_t              epoch;          /* the Unix epoch used to identify this run   */
@@ -98,7 +225,7 @@ typedef struct {
     u_char              transcript_yn;  /* transcript mode (0=no, 1=yes)              */
     u_char              ipv6_yn;        /* IPv6 mode (0=no, 1=yes)                    */
     u_int16_t           tcp_port;       /* TCP port number for listening on           */
-    u_int32_t           udp_buffer;     /* size of the UDP send buffer in bytes       */
+    u_int32_t           udp_buffer;     /* size of the UDP send buffer, 0 for auto    */
     u_int16_t           hb_timeout;     /* the client heartbeat timeout               */
     const u_char       *secret;         /* the shared secret for users to prove       */
     const char         *client;         /* the alternate client IP to stream to       */
@@ -106,7 +233,7 @@ typedef struct {
     const u_char       *allhook;        /* program to run to get listing of files for "get *" */
     u_int32_t           block_size;     /* the size of each block (in bytes)          */
     u_int64_t           file_size;      /* the total file size (in bytes)             */
-    u_int32_t           block_count;    /* the total number of blocks in the file     */
+    u_int64_t           block_count;    /* the total number of blocks in the file     */
     u_int32_t           target_rate;    /* the transfer rate that we're targetting    */
     u_int32_t           error_rate;     /* the threshhold error rate (in % x 1000)    */
     u_int32_t           ipd_time;       /* the inter-packet delay in usec             */
@@ -124,28 +251,93 @@ typedef struct {
     u_int16_t           file_name_size; /* Store the total size of the array          */
     u_int16_t           total_files;    /* Store the total number of served files     */
     long                wait_u_sec;
+    u_int32_t           mcast_group;    /* the multicast group (network order), 0 for none */
+    u_int16_t           mcast_port;     /* the UDP port of the multicast group        */
+    u_char              mcast_ttl;      /* the TTL of multicast datagrams             */
+    u_int32_t           mcast_wait;     /* seconds receivers have to join a stream    */
+    multicast_t        *multicast;      /* the stream state shared between processes  */
+    char               *relay_host;     /* the server we relay files from, NULL for none */
+    u_int16_t           relay_port;     /* the TCP port of that server                */
+    const u_char       *relay_secret;   /* the shared secret for that server          */
+    u_int32_t           follow_idle;    /* seconds a followed file may not grow, 0 for ever */
+    shared_memory_t    *shared_memory;  /* the buffers shared through the library     */
+    int               (*size_callback)(const char *name, u_int64_t *size, void *user);
+    int               (*read_callback)(const char *name, u_int64_t offset, u_char *data, u_int32_t length, void *user);
+    void               *callback_user;  /* the last argument of the callbacks         */
 } ttp_parameter_t;
 
+/* state of adaptive block compression */
+typedef struct {
+    u_char             *region;       /* the COMPRESS_* decision for each region, 0 until made */
+    u_char             *buffer;       /* scratch space for one packed block         */
+    u_int64_t           sampling;     /* the region being sampled plus one, or 0    */
+    u_int32_t           samples;      /* the blocks of it packed so far             */
+    u_int64_t           sample_raw;   /* the bytes of those blocks                  */
+    u_int64_t           sample_packed; /* the bytes they packed into                */
+    u_int64_t           sample_usec;  /* the time spent packing them                */
+    u_int64_t           blocks;       /* the blocks sent packed                     */
+    u_int64_t           raw;          /* the bytes of data in them                  */
+    u_int64_t           packed;       /* the bytes they were sent as                */
+} compress_t;
+
+/* state of the parity blocks */
+typedef struct {
+    u_char             *sum;          /* the datagram accumulating the open group   */
+    u_char             *datagram;     /* the parity datagram of the last closed group */
+    u_int64_t           first;        /* the first block of the open group          */
+    u_int32_t           count;        /* the blocks in the open group               */
+    u_int16_t           packed;       /* the XOR of their packed flags              */
+    u_int32_t           group;        /* the blocks to put in a group at present    */
+    u_int64_t           last;         /* the last original added                    */
+    int                 pending;      /* 1 while the parity datagram waits to go    */
+    u_int64_t           sent;         /* the parity blocks sent                     */
+} fec_t;
+
 /* state of a transfer */
 typedef struct {
     ttp_parameter_t    *parameter;    /* the TTP protocol parameters                */
     char               *filename;     /* the path to the file                       */
-    FILE               *file;         /* the open file that we're transmitting      */
+    FILE               *file;         /* the open file that we're transmitting, if the source has one */
+    const source_t     *source;       /* the backend the blocks are read from       */
+    void               *source_data;  /* the state of that backend                  */
+    u_int64_t           prefetched;   /* the last block the source was asked to read ahead */
     FILE               *vsib;         /* the vsib file number                       */
     FILE               *transcript;   /* the open transcript file for statistics    */
     int                 udp_fd;       /* the file descriptor of our UDP socket      */
     struct sockaddr    *udp_address;  /* the destination for our file data          */
     socklen_t           udp_length;   /* the length of the UDP socket address       */
+    u_int16_t           udp_port;     /* the client's data port, in network order   */
     double              ipd_current;  /* the inter-packet delay currently in usec   */
-    u_int32_t           block;        /* the current block that we're up to         */
+    double              ipd_flow;     /* the least IPD the client disk can absorb   */
+    u_int64_t           block;        /* the current block that we're up to         */
+    u_int32_t           options;      /* the TS_OPT_* options agreed with the client */
+    u_int16_t           tag;          /* the tag of the datagrams of this transfer  */
+    u_int32_t           udp_buffer;   /* the send buffer size granted by the kernel */
+    u_int32_t           udp_request;  /* the send buffer size last asked for        */
+    u_int32_t           super_size;   /* the blocks per super-block, if agreed      */
+    u_int64_t           super_next;   /* the block of the next super-block bitmap bit */
+    u_int32_t           super_left;   /* the bitmap bits still to come in requests  */
+    u_int32_t           datagram_size; /* the bytes in each block datagram          */
+    u_int32_t           sent_size;    /* the bytes in the last block datagram sent  */
+    blockmap_t         *skip;         /* the blocks the client holds, NULL for none */
+    u_int64_t           range_offset; /* the first byte wanted, with TS_OPT_RANGE   */
+    u_int64_t           range_length; /* the number of bytes wanted from there      */
+    compress_t          compress;     /* adaptive compression state, if agreed      */
+    fec_t               fec;          /* parity block state, if agreed              */
+    int                 mcast_slot;   /* our member slot in the multicast stream    */
+    relay_t            *relay;        /* the upstream hop, NULL unless relaying     */
+    follow_t            follow;       /* growth of the file, if followed            */
+    u_int32_t           iteration;    /* the number of statistics lines shown       */
 } ttp_transfer_t;
 
 /* state of a Tsunami session as a whole */
-typedef struct {
+typedef struct ttp_session {
     ttp_parameter_t    *parameter;    /* the TTP protocol parameters                */
     ttp_transfer_t      transfer;     /* the current transfer in progress, if any   */
     int                 client_fd;    /* the connection to the remote client        */
     int                 session_id;   /* the ID of the server session, autonumber   */
+    int                 udp_fd;       /* the data socket of every transfer, or -1   */
+    int                 path_block_size; /* the block size path MTU discovery found */
 } ttp_session_t;
 
 
@@ -153,11 +345,22 @@ typedef struct {
  * Function prototypes.
  *------------------------------------------------------------------------*/
 
+/* bundle.c */
+int  bundle_open          (ttp_session_t *session, const char *name);
+u_int64_t bundle_size     (ttp_session_t *session);
+int  bundle_read          (ttp_session_t *session, u_int64_t block, u_char *buffer);
+void bundle_close         (ttp_session_t *session);
+
 /* config.c */
 void reset_server         (ttp_parameter_t *parameter);
 
+/* handler.c */
+void client_handler       (ttp_session_t *session);
+void finish_hook          (ttp_session_t *session);
+
 /* io.c */
-int  build_datagram       (ttp_session_t *session, u_int32_t block_index, u_int16_t block_type, u_char *datagram);
+int  build_datagram       (ttp_session_t *session, u_int64_t block_index, u_int16_t block_type, u_char *datagram);
+void parity_add           (ttp_session_t *session, const u_char *datagram, u_int32_t length);
 
 /* vsibctl.c */
 #ifdef VSIB_REALTIME
@@ -169,16 +372,48 @@ void read_vsib_block(ttp_session_t *session, unsigned char *memblk, size_t blksi
 /* log.c */
 /* void log                  (FILE *log_file, const char *format, ...); */
 
+/* multicast.c */
+multicast_t *mcast_create (void);
+int  mcast_join           (ttp_session_t *session);
+void mcast_leave          (ttp_session_t *session);
+int  mcast_serve          (ttp_session_t *session);
+
+/* relay.c */
+FILE *relay_request       (ttp_session_t *session, const char *filename);
+int  relay_start          (ttp_session_t *session);
+int  relay_wait           (ttp_session_t *session, u_int64_t block);
+void relay_close          (ttp_session_t *session);
+
+/* source.c */
+int  source_digest        (ttp_session_t *session, u_int32_t *digest);
+int  source_open          (ttp_session_t *session);
+
+/* follow.c */
+void follow_start         (ttp_session_t *session);
+int  follow_poll          (ttp_session_t *session);
+
 /* network.c */
 int  create_tcp_socket    (ttp_parameter_t *parameter);
 int  create_udp_socket    (ttp_parameter_t *parameter);
 
 /* protocol.c */
+int  ttp_accept_bitmap    (ttp_session_t *session, const u_char *bitmap, u_char *datagram);
 int  ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmission, u_char *datagram);
 int  ttp_authenticate     (ttp_session_t *session, const u_char *secret);
+void ttp_close_transfer   (ttp_session_t *session);
 int  ttp_negotiate        (ttp_session_t *session);
 int  ttp_open_port        (ttp_session_t *session);
 int  ttp_open_transfer    (ttp_session_t *session);
+int  ttp_probe_path       (ttp_session_t *session);
+int  ttp_read_skip        (ttp_session_t *session);
+int  ttp_send_blockmap    (ttp_session_t *session, const blockmap_t *map);
+int  ttp_send_digest      (ttp_session_t *session);
+int  ttp_send_holes       (ttp_session_t *session);
+int  ttp_send_manifest    (ttp_session_t *session);
+int  ttp_serve_delta      (ttp_session_t *session);
+int  ttp_serve_merkle     (ttp_session_t *session);
+int  ttp_size_buffer      (ttp_session_t *session, u_int32_t size);
+int  ttp_skip_range       (ttp_session_t *session);
 
 /* transcript.c */
 void xscript_close        (ttp_session_t *session, u_int64_t delta);
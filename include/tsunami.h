@@ -70,6 +70,8 @@
 
 #include <sys/types.h>  /* for u_char, u_int16_t, etc. */
 #include <sys/time.h>   /* for struct timeval          */
+#include <sys/socket.h> /* for struct sockaddr         */
+#include <setjmp.h>     /* for jmp_buf                 */
 #include <stdio.h>      /* for NULL, FILE *, etc.      */
 
 #include "tsunami-cvs-buildnr.h"   /* for the current TSUNAMI_CVS_BUILDNR */
@@ -95,6 +97,16 @@ typedef unsigned long long ull_t;
 
 #define MAX_ERROR_MESSAGE  512        /* maximum length of an error message */
 #define MAX_BLOCK_SIZE     65530      /* maximum size of a data block       */
+#define MAX_UDP_BUFFER     268435456  /* maximum size of a UDP socket buffer */
+#define TS_HEADER_SIZE     12         /* u64 block index, u16 block type and u16 transfer tag */
+#define TS_CRC_SIZE        4          /* CRC32C trailer in checksum mode    */
+#define BLOCKMAP_PAGE_BITS 20         /* log2 of the blocks per blockmap page */
+#define MERKLE_LEAF_SIZE   16777216   /* file bytes under each Merkle tree leaf */
+#define MERKLE_ROUND       4096       /* most node hashes asked for at a time   */
+#define MERKLE_POSTFIX     ".tsmerkle" /* sidecar file caching a served file's tree */
+#define DELTA_DIGEST       8          /* bytes of the digest of a block in delta mode */
+#define DELTA_ROUND        65536      /* most block digests sent at a time            */
+#define DELTA_POSTFIX      ".tsdelta" /* sidecar file caching a served file's digests */
 
 extern const u_int32_t PROTOCOL_REVISION;
 
@@ -102,6 +114,8 @@ extern const u_int16_t REQUEST_RETRANSMIT;
 extern const u_int16_t REQUEST_RESTART;
 extern const u_int16_t REQUEST_STOP;
 extern const u_int16_t REQUEST_ERROR_RATE;
+extern const u_int16_t REQUEST_FLOW_CONTROL;
+extern const u_int16_t REQUEST_RETRANSMIT_SUPER;
 
 #define  TS_TCP_PORT    51038   /* default TCP port of the remote server        */
 #define  TS_UDP_PORT    51038   /* default UDP port of the client               */
@@ -109,32 +123,142 @@ extern const u_int16_t REQUEST_ERROR_RATE;
 #define  TS_BLOCK_ORIGINAL          'O'   /* blocktype "original block" */
 #define  TS_BLOCK_TERMINATE         'X'   /* blocktype "end transmission" */
 #define  TS_BLOCK_RETRANSMISSION    'R'   /* blocktype "retransmitted block" */
+#define  TS_BLOCK_PROBE             'P'   /* blocktype "path probe packet" */
+#define  TS_BLOCK_PARITY            'F'   /* blocktype "XOR parity of a group of blocks", see below */
+
+#define  TS_OPT_PROBE               0x00000001  /* transfer option: packet-train path probe before the data */
+#define  TS_OPT_AUTOBLOCK           0x00000002  /* transfer option: server may lower the block size to its path MTU */
+#define  TS_OPT_SUPERBLOCK          0x00000004  /* transfer option: blocks grouped into super-blocks, u32 blocks per super-block follows */
+#define  TS_OPT_CHECKSUM            0x00000008  /* transfer option: CRC32C trailer on every datagram, file tree hash after the stop */
+#define  TS_OPT_MERKLE              0x00000010  /* transfer option: client queries Merkle tree node hashes after the reply */
+#define  TS_OPT_SKIP                0x00000020  /* transfer option: client sends the blocks it already holds */
+#define  TS_OPT_DELTA               0x00000040  /* transfer option: client sends block digests of its old copy, server answers the matching blocks */
+#define  TS_OPT_SPARSE              0x00000080  /* transfer option: server sends the blocks that lie in holes of the file */
+#define  TS_OPT_COMPRESS            0x00000100  /* transfer option: server may send blocks packed by compress_block() */
+#define  TS_OPT_FEC                 0x00000200  /* transfer option: server sends XOR parity blocks over groups of originals */
+#define  TS_OPT_MULTICAST           0x00000400  /* transfer option: data comes from a shared multicast stream, u32 group and u16 port follow */
+#define  TS_OPT_FOLLOW              0x00000800  /* transfer option: file still grows, u64 file size and u64 block count of its growth precede new blocks on the control channel */
+#define  TS_OPT_BUNDLE              0x00001000  /* transfer option: file is a bundle of files and directories, u32 entry count and the manifest follow */
+#define  TS_OPT_RANGE               0x00002000  /* transfer option: only a byte range of the file is wanted, u64 offset and u64 length follow */
+
+#define  TS_BLOCK_COMPRESSED        0x8000  /* block type flag: data is a u16 packed length and the packed block */
+#define  TS_PACKED_SIZE             2       /* bytes of the packed length ahead of a packed block              */
+#define  TS_PARITY_PACKED           0x4000  /* parity type flag: XOR of the packed flags of the group's blocks */
+#define  TS_PARITY_SHIFT            8       /* parity type bits 8-13: the blocks in the group                */
+#define  FEC_GROUP_MAX              63      /* most blocks under one parity block                            */
+
+#define  TS_SKIP_RUNS               0     /* held blocks encoding: varint gap and length of each run    */
+#define  TS_SKIP_BITMAP             1     /* held blocks encoding: flat bitfield from blockmap_write()  */
+
+#define  PROBE_TRAINS               5     /* number of packet trains in a path probe       */
+#define  PROBE_TRAIN_LENGTH         64    /* number of packets in one probe train          */
 
 #define  TS_DIRLIST_HACK_CMD        "!#DIR??" /* "file name" sent by the client to request a list of the shared files */
+#define  TS_SIZE_QUERY_CMD          "!#SIZE?" /* "file name" sent by the client to ask the u64 size of the file named on the next line */
 
 /*------------------------------------------------------------------------
  * Data structures.
  *------------------------------------------------------------------------*/
 
-/* retransmission request */
+/* retransmission request, for REQUEST_FLOW_CONTROL the block field carries */
+/* the free receive buffer slots and error_rate the disk drain rate (blocks/s), */
+/* for REQUEST_RETRANSMIT_SUPER error_rate is the number of blocks from block */
+/* on that the bitmap after it covers, in as many requests as it fills, one */
+/* bit per block from the lowest bit of the first byte on */
 typedef struct {
     u_int16_t           request_type;  /* the retransmission request type           */
-    u_int32_t           block;         /* the block number to retransmit {at}       */
+    u_int16_t           reserved;      /* zero, pads the block to 8-byte alignment  */
     u_int32_t           error_rate;    /* the current error rate (in % x 1000)      */
+    u_int64_t           block;         /* the block number to retransmit {at}       */
 } retransmission_t;
 
+#define TS_SUPER_REQUEST_BLOCKS (8 * sizeof(retransmission_t))  /* the blocks one request of a super-block bitmap covers */
+
+/* bitfield of the blocks received so far, kept in pages allocated on */
+/* first use and released again once every block of the page is in    */
+typedef struct {
+    u_int64_t           blocks;        /* the number of blocks, numbered from 1     */
+    u_int64_t           pages;         /* the number of pages in the directory      */
+    u_char            **page;          /* the pages, NULL if empty, or full marker  */
+    u_int32_t          *count;         /* the number of blocks set per page         */
+    u_int64_t           allocated;     /* the number of pages allocated right now   */
+} blockmap_t;
+
+/* hash tree of a file: an MD5 hash of every MERKLE_LEAF_SIZE bytes at  */
+/* the leaves and of the child hashes above, stored level after level   */
+typedef struct {
+    u_int64_t           file_size;     /* the size of the file described            */
+    u_int64_t           leaves;        /* the number of leaves, at least one        */
+    u_int64_t           nodes;         /* the number of nodes on all levels         */
+    u_int32_t           levels;        /* the number of levels, leaves to root      */
+    u_int64_t          *level;         /* the index of the first node of each level */
+    u_char             *hash;          /* 16 bytes per node, the root comes last    */
+    u_char             *valid;         /* nonzero for the nodes that are hashed     */
+} merkle_t;
+
+/* running CRC32C tree hash, as crc32c_tree() would give, of data that */
+/* comes in order rather than from a file                              */
+typedef struct {
+    u_int64_t           size;          /* the bytes hashed so far                   */
+    u_int32_t           leaf;          /* the CRC32C of the current chunk so far    */
+    u_int32_t           root;          /* the CRC32C of the finished chunk CRCs     */
+} crc32c_tree_t;
+
 
 /*------------------------------------------------------------------------
  * Global variables.
  *------------------------------------------------------------------------*/
 
-extern char g_error[];  /* buffer for the most recent error string    */
+extern __thread char     g_error[];     /* buffer for the most recent error string of this thread */
+extern __thread jmp_buf *g_error_trap;  /* where a fatal error returns to instead of exiting      */
 
 
 /*------------------------------------------------------------------------
  * Function prototypes.
  *------------------------------------------------------------------------*/
 
+/* blockmap.c */
+blockmap_t *blockmap_create        (u_int64_t blocks);
+blockmap_t *blockmap_copy          (const blockmap_t *map);
+int        blockmap_grow           (blockmap_t *map, u_int64_t blocks);
+void       blockmap_destroy        (blockmap_t *map);
+int        blockmap_get            (const blockmap_t *map, u_int64_t block);
+int        blockmap_set            (blockmap_t *map, u_int64_t block);
+int64_t    blockmap_set_range      (blockmap_t *map, u_int64_t first, u_int64_t last);
+int        blockmap_clear_range    (blockmap_t *map, u_int64_t first, u_int64_t last);
+u_int64_t  blockmap_next           (const blockmap_t *map, u_int64_t block, int arrived);
+u_int64_t  blockmap_count          (const blockmap_t *map);
+int        blockmap_write          (const blockmap_t *map, FILE *out);
+int        blockmap_read           (blockmap_t *map, FILE *in);
+u_int64_t  blockmap_encode         (const blockmap_t *map, u_char *buffer, u_int32_t *encoding);
+int        blockmap_decode         (blockmap_t *map, u_int32_t encoding, const u_char *buffer, u_int64_t length);
+
+/* merkle.c */
+merkle_t  *merkle_create           (u_int64_t file_size);
+void       merkle_destroy          (merkle_t *tree);
+int        merkle_children         (const merkle_t *tree, u_int64_t node, u_int64_t *child);
+void       merkle_span             (const merkle_t *tree, u_int64_t node, u_int64_t *first, u_int64_t *end);
+int        merkle_hash             (merkle_t *tree, int fd, const u_char *want);
+int        merkle_load             (merkle_t *tree, const char *path, time_t mtime);
+int        merkle_save             (const merkle_t *tree, const char *path, time_t mtime);
+
+/* delta.c */
+int        delta_hash              (int fd, u_int64_t file_size, u_int32_t block_size, u_int64_t first, u_int64_t count, u_char *digest);
+FILE      *delta_open              (const char *path, u_int64_t file_size, u_int32_t block_size, time_t mtime);
+int        delta_save              (int fd, const char *path, u_int64_t file_size, u_int32_t block_size, time_t mtime);
+
+/* compress.c */
+u_int32_t  compress_block          (const u_char *in, u_int32_t length, u_char *out, u_int32_t room);
+int        decompress_block        (const u_char *in, u_int32_t length, u_char *out, u_int32_t room);
+
+/* crc32c.c */
+u_int32_t  crc32c                  (u_int32_t crc, const void *data, size_t length);
+const char *crc32c_engine          (void);
+int        crc32c_tree             (int fd, u_int64_t size, u_int32_t *digest);
+int        crc32c_tree_range       (int fd, u_int64_t offset, u_int64_t size, u_int32_t *digest);
+void       crc32c_tree_add         (crc32c_tree_t *tree, const void *data, size_t length);
+u_int32_t  crc32c_tree_end         (crc32c_tree_t *tree);
+
 /* common.c */
 int        get_random_data         (u_char *buffer, size_t bytes);
 u_int64_t  get_usec_since          (struct timeval *old_time);
@@ -146,6 +270,10 @@ int        read_line               (int fd, char *buffer, size_t buffer_length);
 int        fread_line              (FILE *f, char *buffer, size_t buffer_length);
 void       usleep_that_works       (u_int64_t usec);
 u_int64_t  get_udp_in_errors       ();
+u_int32_t  udp_buffer_for_path     (u_int32_t floor, double rate_bps, u_int64_t rtt_usec);
+u_int32_t  set_udp_buffer          (int fd, int sending, u_int32_t size);
+int        get_path_block_size     (const struct sockaddr *address, socklen_t length, u_int64_t wait_usec);
+int        punch_hole              (int fd, u_int64_t offset, u_int64_t length);
 ssize_t    full_write              (int, const void*, size_t);
 ssize_t    full_read               (int, void*, size_t);
 
@@ -252,10 +252,10 @@ int command_get(command_t *command, ttp_session_t *session)
 {
     u_char         *datagram = NULL;            /* the buffer (in ring) for incoming blocks       */
     u_char         *local_datagram = NULL;      /* the local temp space for incoming block        */
-    u_int32_t       this_block = 0;             /* the block number for the block just received   */
+    u_int64_t       this_block = 0;             /* the block number for the block just received   */
     u_int16_t       this_type = 0;              /* the block type for the block just received     */
     u_int64_t       delta = 0;                  /* generic holder of elapsed times                */
-    u_int32_t       block = 0;                  /* generic holder of a block number               */
+    u_int64_t       block = 0;                  /* generic holder of a block number               */
 
     double          mbit_thru, mbit_good;       /* helpers for final statistics                   */
     double          mbit_file;
@@ -373,21 +373,23 @@ int command_get(command_t *command, ttp_session_t *session)
        printf("GET *: now requesting file '%s'\n", xfer->local_filename);
     }
 
-    /* negotiate the file request with the server */
-    if (ttp_open_transfer(session, xfer->remote_filename, xfer->local_filename) < 0)
-	return warn("File transfer request failed");
-
-    /* create the UDP data socket */
+    /* create the UDP data socket, the port of which goes along with the request */
     if (ttp_open_port(session) < 0)
 	return warn("Creation of data socket failed");
 
+    /* negotiate the file request with the server */
+    if (ttp_open_transfer(session, xfer->remote_filename, xfer->local_filename) < 0) {
+	close(xfer->udp_fd);
+	return warn("File transfer request failed");
+    }
+
     /* allocate the retransmission table */
-    rexmit->table = (u_int32_t *) calloc(DEFAULT_TABLE_SIZE, sizeof(u_int32_t));
+    rexmit->table = (u_int64_t *) calloc(DEFAULT_TABLE_SIZE, sizeof(u_int64_t));
     if (rexmit->table == NULL)
 	error("Could not allocate retransmission table");
 
     /* allocate the received bitfield */
-    xfer->received = (u_char *) calloc(xfer->block_count / 8 + 2, sizeof(u_char));
+    xfer->received = blockmap_create(xfer->block_count);
     if (xfer->received == NULL)
 	error("Could not allocate received-data bitfield");
 
@@ -395,7 +397,7 @@ int command_get(command_t *command, ttp_session_t *session)
     xfer->ring_buffer = ring_create(session);
 
     /* allocate the faster local buffer */
-    local_datagram = (u_char *) calloc(6 + session->parameter->block_size, sizeof(u_char));
+    local_datagram = (u_char *) calloc(TS_HEADER_SIZE + session->parameter->block_size, sizeof(u_char));
     if (local_datagram == NULL)
         error("Could not allocate fast local datagram buffer in command_get()");
 
@@ -428,7 +430,7 @@ int command_get(command_t *command, ttp_session_t *session)
    while (1) {
 
       /* try to receive a datagram */
-      status = recvfrom(xfer->udp_fd, local_datagram, 6 + session->parameter->block_size, 0, NULL, 0);
+      status = recvfrom(xfer->udp_fd, local_datagram, TS_HEADER_SIZE + session->parameter->block_size, 0, NULL, 0);
       if (status < 0) {
           warn("UDP data transmission error");
           printf("Apparently frozen transfer, trying to do retransmit request\n");
@@ -438,9 +440,13 @@ int command_get(command_t *command, ttp_session_t *session)
           }
       }
 
+      /* late datagrams of an earlier transfer on our data port are not part of this one */
+      if ((status >= 0) && (ntohs(*((u_int16_t *) (local_datagram + 10))) != xfer->tag))
+          continue;
+
       /* retrieve the block number and block type */
-      this_block = ntohl(*((u_int32_t *) local_datagram));       // in range of 1..xfer->block_count
-      this_type  = ntohs(*((u_int16_t *) (local_datagram + 4))); // TS_BLOCK_ORIGINAL etc
+      this_block = ntohll(*((u_int64_t *) local_datagram));      // in range of 1..xfer->block_count
+      this_type  = ntohs(*((u_int16_t *) (local_datagram + 8))); // TS_BLOCK_ORIGINAL etc
 
       /* keep statistics on received blocks */
       xfer->stats.total_blocks++;
@@ -460,18 +466,21 @@ int command_get(command_t *command, ttp_session_t *session)
 
               /* reserve ring space, copy the data in, confirm the reservation */
               datagram = ring_reserve(xfer->ring_buffer);
-              memcpy(datagram, local_datagram, 6 + session->parameter->block_size);
+              memcpy(datagram, local_datagram, TS_HEADER_SIZE + session->parameter->block_size);
               if (ring_confirm(xfer->ring_buffer) < 0) {
                   warn("Error in accepting block");
                   goto abort;
               }
 
               /* mark the block as received */
-              xfer->received[this_block / 8] |= (1 << (this_block % 8));
+              if (blockmap_set(xfer->received, this_block) < 0) {
+                  warn("Could not allocate received-data bitfield page");
+                  goto abort;
+              }
               if (xfer->blocks_left > 0) {
                   --(xfer->blocks_left);
               } else {
-                  printf("Oops! Negative-going blocks_left count at block: type=%c this=%u final=%u left=%u\n", this_type, this_block, xfer->block_count, xfer->blocks_left);
+                  printf("Oops! Negative-going blocks_left count at block: type=%c this=%llu final=%llu left=%llu\n", this_type, (ull_t) this_block, (ull_t) xfer->block_count, (ull_t) xfer->blocks_left);
               }
           }
 
@@ -495,7 +504,7 @@ int command_get(command_t *command, ttp_session_t *session)
                     double path_capability;
                     path_capability  = 0.8 * (xfer->stats.this_transmit_rate + xfer->stats.this_retransmit_rate); // reduced effective Mbit/s rate
                     path_capability *= (0.001 * session->parameter->losswindow_ms); // MBit inside window, round-trip user estimated in losswindow_ms!
-                    u_int32_t earliest_block = this_block -
+                    u_int64_t earliest_block = this_block -
                        min(
                          1024 * 1024 * path_capability / (8 * session->parameter->block_size),  // # of blocks inside window
                          (this_block - xfer->gapless_to_block)                                  // # of blocks missing (tops)
@@ -542,8 +551,9 @@ int command_get(command_t *command, ttp_session_t *session)
           if (this_type == TS_BLOCK_TERMINATE) {
 
               #if DEBUG_RETX
-              fprintf(stderr, "Got end block: blk %u, final blk %u, left blks %u, tail %u, head %u\n",
-                      this_block, xfer->block_count, xfer->blocks_left, xfer->gapless_to_block, xfer->next_block);
+              fprintf(stderr, "Got end block: blk %llu, final blk %llu, left blks %llu, tail %llu, head %llu\n",
+                      (ull_t) this_block, (ull_t) xfer->block_count, (ull_t) xfer->blocks_left,
+                      (ull_t) xfer->gapless_to_block, (ull_t) xfer->next_block);
               #endif
 
               /* got all blocks by now */
@@ -604,7 +614,7 @@ int command_get(command_t *command, ttp_session_t *session)
 
     /* add a stop block to the ring buffer */
     datagram = ring_reserve(xfer->ring_buffer);
-    *((u_int32_t *) datagram) = 0;
+    *((u_int64_t *) datagram) = 0;
     if (ring_confirm(xfer->ring_buffer) < 0)
 	warn("Error in terminating disk thread");
 
@@ -650,7 +660,7 @@ int command_get(command_t *command, ttp_session_t *session)
         if (xfer->stats.total_lost == 0) {
            printf("lossless\n");
         } else {
-           printf("lossless mode - but lost count=%u > 0, please file a bug report!!\n", xfer->stats.total_lost);
+           printf("lossless mode - but lost count=%llu > 0, please file a bug report!!\n", (ull_t)xfer->stats.total_lost);
         }
     } else { 
         if (session->parameter->losswindow_ms == 0) {
@@ -678,11 +688,11 @@ int command_get(command_t *command, ttp_session_t *session)
        strcpy((char*)dump_file, xfer->local_filename);
        strcat((char*)dump_file, ".blockmap");
 
-       /* write: [4 bytes block_count] [map byte 0] [map byte 1] ... [map (partial) byte N] */
+       /* write: [8 bytes block_count] [map byte 0] [map byte 1] ... [map (partial) byte N] */
        fbits = fopen((char*)dump_file, "wb");
        if (fbits != NULL) {
          fwrite(&xfer->block_count, sizeof(xfer->block_count), 1, fbits);
-         fwrite(xfer->received, sizeof(u_char), xfer->block_count / 8 + 1, fbits);
+         blockmap_write(xfer->received, fbits);
          fclose(fbits);
        } else {
          warn("Could not create a file for the blockmap dump");
@@ -697,7 +707,7 @@ int command_get(command_t *command, ttp_session_t *session)
     /* deallocate memory */
     ring_destroy(xfer->ring_buffer);
     if (rexmit->table != NULL)  { free(rexmit->table);   rexmit->table  = NULL; }
-    if (xfer->received != NULL) { free(xfer->received);  xfer->received = NULL; }
+    blockmap_destroy(xfer->received);  xfer->received = NULL;
     if (local_datagram != NULL) { free(local_datagram);  local_datagram = NULL; }
 
     /* more files in "GET *" ? */
@@ -720,7 +730,7 @@ int command_get(command_t *command, ttp_session_t *session)
     ring_destroy(xfer->ring_buffer);
     if (xfer->file     != NULL) { fclose(xfer->file);    xfer->file     = NULL; }
     if (rexmit->table  != NULL) { free(rexmit->table);   rexmit->table  = NULL; }
-    if (xfer->received != NULL) { free(xfer->received);  xfer->received = NULL; }
+    blockmap_destroy(xfer->received);  xfer->received = NULL;
     if (local_datagram != NULL) { free(local_datagram);  local_datagram = NULL; }    
     return -1;
 }
@@ -915,7 +925,7 @@ void *disk_thread(void *arg)
     ttp_session_t *session = (ttp_session_t *) arg;
     u_char        *datagram;
     int            status;
-    u_int32_t      block_index;
+    u_int64_t      block_index;
     u_int16_t      block_type;
 
     /* while the world is turning */
@@ -923,8 +933,8 @@ void *disk_thread(void *arg)
 
 	/* get another block */
 	datagram    = ring_peek(session->transfer.ring_buffer);
-	block_index = ntohl(*((u_int32_t *) datagram));
-	block_type  = ntohs(*((u_int16_t *) (datagram + 4)));
+	block_index = ntohll(*((u_int64_t *) datagram));
+	block_type  = ntohs(*((u_int16_t *) (datagram + 8)));
 
 	/* quit if we got the mythical 0 block */
 	if (block_index == 0) {
@@ -933,7 +943,7 @@ void *disk_thread(void *arg)
 	}
 
 	/* save it to disk */
-	status = accept_block(session, block_index, datagram + 6);
+	status = accept_block(session, block_index, datagram + TS_HEADER_SIZE);
 	if (status < 0) {
 	    warn("Block accept failed");
 	    return NULL;
@@ -972,13 +982,13 @@ int parse_fraction(const char *fraction, u_int16_t *num, u_int16_t *den)
 
 
 /*------------------------------------------------------------------------
- * int got_block(ttp_session_t* session, u_int32_t blocknr)
+ * int got_block(ttp_session_t* session, u_int64_t blocknr)
  *
  * Returns non-0 if the block has already been received
  *------------------------------------------------------------------------*/
-int got_block(ttp_session_t* session, u_int32_t blocknr)
+int got_block(ttp_session_t* session, u_int64_t blocknr)
 {
-    return (session->transfer.received[blocknr / 8] & (1 << (blocknr % 8)));
+    return blockmap_get(session->transfer.received, blocknr);
 }
 
 
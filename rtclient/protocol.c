@@ -161,58 +161,80 @@ int ttp_negotiate(ttp_session_t *session)
  *
  * Tries to create a new TTP file request object for the given session
  * by submitting a file request to the server (which is waiting for
- * the name of a file to transfer).  If the request is accepted, we
- * retrieve the file parameters, open the file for writing, and return
- * 0 for success.  If anything goes wrong, we return a non-zero value.
+ * the name of a file to transfer).  The request is one message with
+ * the filename, the transfer parameters and the port of the data
+ * socket that ttp_open_port() created.  If the request is accepted,
+ * we retrieve the file parameters and datagram tag, open the file for
+ * writing, and return 0 for success.  If anything goes wrong, we
+ * return a non-zero value.
  *------------------------------------------------------------------------*/
 int ttp_open_transfer(ttp_session_t *session, const char *remote_filename, const char *local_filename)
 {
     u_char           result;    /* the result byte from the server     */
     u_int32_t        temp;      /* used for transmitting 32-bit values */
+    u_int32_t        block_size; /* the block size the server agreed to */
     u_int16_t        temp16;    /* used for transmitting 16-bit values */
+    struct sockaddr_storage udp_address; /* the address of our data socket */
+    socklen_t        udp_length = sizeof(udp_address);
+    u_int16_t        port;      /* the port of our data socket         */
+    int              udp_fd;    /* our data socket                     */
     int              status;
     ttp_transfer_t  *xfer  = &session->transfer;
     ttp_parameter_t *param =  session->parameter;
 
-    /* submit the transfer request */
+    /* find out the port of the data socket, which goes along with the request */
+    memset(&udp_address, 0, sizeof(udp_address));
+    getsockname(xfer->udp_fd, (struct sockaddr *) &udp_address, &udp_length);
+    port = (udp_address.ss_family == AF_INET6) ? ((struct sockaddr_in6 *) &udp_address)->sin6_port : ((struct sockaddr_in *) &udp_address)->sin_port;
+
+    /* submit the filename, block size, target bitrate, and maximum error rate */
     status = fprintf(session->server, "%s\n", remote_filename);
-    if ((status <= 0) || fflush(session->server))
+    if (status <= 0)
 	return warn("Could not request file");
-
-    /* see if the request was successful */
-    status = fread(&result, 1, 1, session->server);
-    if (status < 1)
-	return warn("Could not read response to file request");
-
-    /* make sure the result was a good one */
-    if (result != 0)
-	return warn("Server: File does not exist or cannot be transmitted");
-
-    /* Submit the block size, target bitrate, and maximum error rate */
     temp = htonl(param->block_size);   if (fwrite(&temp, 4, 1, session->server) < 1) return warn("Could not submit block size");
     temp = htonl(param->target_rate);  if (fwrite(&temp, 4, 1, session->server) < 1) return warn("Could not submit target rate");
     temp = htonl(param->error_rate);   if (fwrite(&temp, 4, 1, session->server) < 1) return warn("Could not submit error rate");
-    if (fflush(session->server))
-	return warn("Could not flush control channel");
 
-    /* submit the slower and faster factors */
+    /* submit the slower and faster factors, no transfer options and the port, sending the request off in one piece */
     temp16 = htons(param->slower_num);  if (fwrite(&temp16, 2, 1, session->server) < 1) return warn("Could not submit slowdown numerator");
     temp16 = htons(param->slower_den);  if (fwrite(&temp16, 2, 1, session->server) < 1) return warn("Could not submit slowdown denominator");
     temp16 = htons(param->faster_num);  if (fwrite(&temp16, 2, 1, session->server) < 1) return warn("Could not submit speedup numerator");
     temp16 = htons(param->faster_den);  if (fwrite(&temp16, 2, 1, session->server) < 1) return warn("Could not submit speedup denominator");
+    temp   = 0;                         if (fwrite(&temp,   4, 1, session->server) < 1) return warn("Could not submit transfer options");
+    if (fwrite(&port, 2, 1, session->server) < 1)
+	return warn("Could not send UDP port number");
     if (fflush(session->server))
 	return warn("Could not flush control channel");
 
-    /* populate the fields of the transfer object */
+    /* see if the request was successful */
+    status = fread(&result, 1, 1, session->server);
+    if (status < 1)
+	return warn("Could not read response to file request");
+
+    /* make sure the result was a good one */
+    if (result != 0)
+	return warn("Server: File does not exist or cannot be transmitted");
+
+    /* populate the fields of the transfer object, keeping its data socket */
+    udp_fd = xfer->udp_fd;
     memset(xfer, 0, sizeof(*xfer));
+    xfer->udp_fd          = udp_fd;
     xfer->remote_filename = remote_filename;
     xfer->local_filename  = local_filename;
 
-    /* read in the file length, block size, block count, and run epoch */
-    if (fread(&xfer->file_size,   8, 1, session->server) < 1) return warn("Could not read file size");         xfer->file_size   = ntohll(xfer->file_size);
-    if (fread(&temp,              4, 1, session->server) < 1) return warn("Could not read block size");        if (htonl(temp) != param->block_size) return warn("Block size disagreement");
-    if (fread(&xfer->block_count, 4, 1, session->server) < 1) return warn("Could not read number of blocks");  xfer->block_count = ntohl (xfer->block_count);
-    if (fread(&xfer->epoch,       4, 1, session->server) < 1) return warn("Could not read run epoch");         xfer->epoch       = ntohl (xfer->epoch);
+    /* read in the file length, block size, block count, run epoch, options and datagram tag */
+    if (fread(&xfer->file_size,   8, 1, session->server) < 1) return warn("Could not read file size");
+    if (fread(&block_size,        4, 1, session->server) < 1) return warn("Could not read block size");
+    if (fread(&xfer->block_count, 8, 1, session->server) < 1) return warn("Could not read number of blocks");
+    if (fread(&xfer->epoch,       4, 1, session->server) < 1) return warn("Could not read run epoch");
+    if (fread(&temp,              4, 1, session->server) < 1) return warn("Could not read transfer options");  /* none used in realtime mode */
+    if (fread(&xfer->tag,         2, 1, session->server) < 1) return warn("Could not read datagram tag");
+    xfer->file_size   = ntohll(xfer->file_size);
+    xfer->block_count = ntohll(xfer->block_count);
+    xfer->epoch       = ntohl (xfer->epoch);
+    xfer->tag         = ntohs (xfer->tag);
+    if (ntohl(block_size) != param->block_size)
+        return warn("Block size disagreement");
 
     /* we start out with every block yet to transfer */
     xfer->blocks_left = xfer->block_count;
@@ -248,7 +270,7 @@ int ttp_open_transfer(ttp_session_t *session, const char *remote_filename, const
     #endif
 
     /* make crude estimate of blocks on the wire if RTT delay is 500ms */
-    xfer->on_wire_estimate = (u_int32_t)(0.5 * param->target_rate/(8*param->block_size));
+    xfer->on_wire_estimate = (u_int64_t)(0.5 * param->target_rate/(8*param->block_size));
     xfer->on_wire_estimate = min(xfer->block_count, xfer->on_wire_estimate);
 
     /* if we're doing a transcript */
@@ -264,35 +286,17 @@ int ttp_open_transfer(ttp_session_t *session, const char *remote_filename, const
  * int ttp_open_port(ttp_session_t *session);
  *
  * Creates a new UDP socket for receiving the file data associated with
- * our pending transfer and communicates the port number back to the
- * server.  Returns 0 on success and non-zero on failure.
+ * our next transfer, before ttp_open_transfer() sends its port number
+ * to the server along with the request.  Returns 0 on success and
+ * non-zero on failure.
  *------------------------------------------------------------------------*/
 int ttp_open_port(ttp_session_t *session)
 {
-    struct sockaddr udp_address;
-    unsigned int    udp_length = sizeof(udp_address);
-    int             status;
-    u_int16_t      *port;
-
     /* open a new datagram socket */
     session->transfer.udp_fd = create_udp_socket(session->parameter);
     if (session->transfer.udp_fd < 0)
 	return warn("Could not create UDP socket");
 
-    /* find out the port number we're using */
-    memset(&udp_address, 0, sizeof(udp_address));
-    getsockname(session->transfer.udp_fd, (struct sockaddr *) &udp_address, &udp_length);
-
-    /* get a hold of the port number */
-    port = (session->parameter->ipv6_yn ? &((struct sockaddr_in6 *) &udp_address)->sin6_port : &((struct sockaddr_in *) &udp_address)->sin_port);
-
-    /* send that port number to the server */
-    status = fwrite(port, 2, 1, session->server);
-    if ((status < 1) || fflush(session->server)) {
-	close(session->transfer.udp_fd);
-	return warn("Could not send UDP port number");
-    }
-
     /* we succeeded */
     return 0;
 }
@@ -312,7 +316,7 @@ int ttp_repeat_retransmit(ttp_session_t *session)
     retransmission_t  retransmission[MAX_RETRANSMISSION_BUFFER];  /* the retransmission request object        */
     int               entry;                                      /* an index into the retransmission table   */
     int               status;
-    int               block;
+    u_int64_t         block;
     int               count = 0;
     retransmit_t     *rexmit = &(session->transfer.retransmit);
     ttp_transfer_t   *xfer = &session->transfer;
@@ -340,7 +344,7 @@ int ttp_repeat_retransmit(ttp_session_t *session)
 
             /* insert retransmit request */
             retransmission[count].request_type = htons(REQUEST_RETRANSMIT);
-            retransmission[count].block        = htonl(block);
+            retransmission[count].block        = htonll(block);
             ++count;
 
             #ifdef DEBUG_RETX
@@ -355,7 +359,7 @@ int ttp_repeat_retransmit(ttp_session_t *session)
         /* restart from first missing block */
         block                          = min(xfer->block_count, xfer->gapless_to_block + 1);
         retransmission[0].request_type = htons(REQUEST_RESTART);
-        retransmission[0].block        = htonl(block);
+        retransmission[0].block        = htonll(block);
 
         /* send out the request */
         status = fwrite(&retransmission[0], sizeof(retransmission[0]), 1, session->server);
@@ -369,8 +373,9 @@ int ttp_repeat_retransmit(ttp_session_t *session)
         xfer->restart_wireclearidx   = min(xfer->block_count, xfer->restart_lastidx + xfer->on_wire_estimate);
 
         #ifdef DEBUG_RETX
-        printf("ttp_repeat_restransmit: restart_pending=1, range %u to %u, clear at %u, gapless to %u, old head %u\n",
-               block, xfer->restart_lastidx, xfer->restart_wireclearidx, xfer->gapless_to_block, xfer->next_block);
+        printf("ttp_repeat_restransmit: restart_pending=1, range %llu to %llu, clear at %llu, gapless to %llu, old head %llu\n",
+               (ull_t) block, (ull_t) xfer->restart_lastidx, (ull_t) xfer->restart_wireclearidx,
+               (ull_t) xfer->gapless_to_block, (ull_t) xfer->next_block);
         #endif
 
         /* reset the retransmission table and head block */
@@ -413,19 +418,19 @@ int ttp_repeat_retransmit(ttp_session_t *session)
 
 
 /*------------------------------------------------------------------------
- * int ttp_request_retransmit(ttp_session_t *session, u_int32_t block);
+ * int ttp_request_retransmit(ttp_session_t *session, u_int64_t block);
  *
  * Requests a retransmission of the given block in the current transfer.
  * Returns 0 on success and non-zero otherwise.
  *------------------------------------------------------------------------*/
-int ttp_request_retransmit(ttp_session_t *session, u_int32_t block)
+int ttp_request_retransmit(ttp_session_t *session, u_int64_t block)
 {
    #ifdef RETX_REQBLOCK_SORTING
-   u_int32_t     tmp32_ins = 0, tmp32_up;
+   u_int64_t     tmp64_ins = 0, tmp64_up;
    u_int32_t     idx = 0;
    #endif
 
-   u_int32_t    *ptr;
+   u_int64_t    *ptr;
    retransmit_t *rexmit = &(session->transfer.retransmit);
 
    /* double checking: if we already got the block, don't add it */
@@ -441,13 +446,13 @@ int ttp_request_retransmit(ttp_session_t *session, u_int32_t block)
          return 0;
 
       /* try to reallocate the table twice the size*/
-      ptr = (u_int32_t *) realloc(rexmit->table, 2 * sizeof(u_int32_t)*rexmit->table_size);
+      ptr = (u_int64_t *) realloc(rexmit->table, 2 * sizeof(u_int64_t)*rexmit->table_size);
       if (ptr == NULL)
          return warn("Could not grow retransmission table");
 
       /* prepare the new table space */
       rexmit->table = ptr;
-      memset(rexmit->table + rexmit->table_size, 0, sizeof(u_int32_t) * rexmit->table_size);
+      memset(rexmit->table + rexmit->table_size, 0, sizeof(u_int64_t) * rexmit->table_size);
       rexmit->table_size *= 2;
 
       #if DEBUG_RETX
@@ -484,11 +489,11 @@ int ttp_request_retransmit(ttp_session_t *session, u_int32_t block)
       // fprintf(stderr, "duplicate retransmit req for block %d discarded\n", block);
    } else { 
       /* insert and shift remaining table upwards - linked list could be nice... */
-      tmp32_ins = block;
+      tmp64_ins = block;
       do {
-         tmp32_up = rexmit->table[idx];
-         rexmit->table[idx++] = tmp32_ins;
-         tmp32_ins = tmp32_up;
+         tmp64_up = rexmit->table[idx];
+         rexmit->table[idx++] = tmp64_ins;
+         tmp64_ins = tmp64_up;
       } while(idx <= rexmit->index_max);
       rexmit->index_max++;
    }
@@ -619,22 +624,22 @@ int ttp_update_stats(ttp_session_t *session)
 
     /* build the stats string */    
     #ifdef STATS_MATLABFORMAT
-    sprintf(stats_line, "%02d\t%02d\t%02d\t%03d\t%4u\t%6.2f\t%6.1f\t%5.1f\t%7u\t%6.1f\t%6.1f\t%5.1f\t%5d\t%5d\t%7u\t%8u\t%8Lu\n",
+    sprintf(stats_line, "%02d\t%02d\t%02d\t%03d\t%4llu\t%6.2f\t%6.1f\t%5.1f\t%7llu\t%6.1f\t%6.1f\t%5.1f\t%5d\t%5d\t%7llu\t%8u\t%8Lu\n",
     #else
-    sprintf(stats_line, "%02d:%02d:%02d.%03d %4u %6.2fM %6.1fMbps %5.1f%% %7u %6.1fG %6.1fMbps %5.1f%% %5d %5d %7u %8u %8Lu\n",
+    sprintf(stats_line, "%02d:%02d:%02d.%03d %4llu %6.2fM %6.1fMbps %5.1f%% %7llu %6.1fG %6.1fMbps %5.1f%% %5d %5d %7llu %8u %8Lu\n",
     #endif
         hours, minutes, seconds, milliseconds,
-        stats->total_blocks - stats->this_blocks,
+        (ull_t)(stats->total_blocks - stats->this_blocks),
         stats->this_retransmit_rate,
         stats->this_transmit_rate,
         100.0 * retransmits_fraction,
-        session->transfer.stats.total_blocks,
+        (ull_t)session->transfer.stats.total_blocks,
         data_total / u_giga,
         data_total_rate,
         100.0 * total_retransmits_fraction,
         session->transfer.retransmit.index_max,
         session->transfer.ring_buffer->count_data,
-        session->transfer.blocks_left, 
+        (ull_t)session->transfer.blocks_left,
         stats->this_retransmits,
         (ull_t)(stats->this_udp_errors - stats->start_udp_errors)
         );
@@ -648,15 +653,15 @@ int ttp_update_stats(ttp_session_t *session)
             printf("Current time:   %s\n", ctime(&now_epoch));
             printf("Elapsed time:   %02d:%02d:%02d.%03d\n\n", hours, minutes, seconds, milliseconds);
             printf("Last interval\n--------------------------------------------------\n");
-            printf("Blocks count:     %u\n",             stats->total_blocks - stats->this_blocks);
+            printf("Blocks count:     %llu\n",           (ull_t)(stats->total_blocks - stats->this_blocks));
             printf("Data transferred: %0.2f GB\n",       data_this  / u_giga);
             printf("Transfer rate:    %0.2f Mbps\n",     stats->this_transmit_rate);
             printf("Retransmissions:  %u (%0.2f%%)\n\n", stats->this_retransmits, 100.0*retransmits_fraction);
             printf("Cumulative\n--------------------------------------------------\n");
-            printf("Blocks count:     %u\n",             session->transfer.stats.total_blocks);
+            printf("Blocks count:     %llu\n",           (ull_t)session->transfer.stats.total_blocks);
             printf("Data transferred: %0.2f GB\n",       data_total / u_giga);
             printf("Transfer rate:    %0.2f Mbps\n",     data_total_rate);
-            printf("Retransmissions:  %u (%0.2f%%)\n\n", stats->total_retransmits, 100.0*total_retransmits_fraction);
+            printf("Retransmissions:  %llu (%0.2f%%)\n\n", (ull_t)stats->total_retransmits, 100.0*total_retransmits_fraction);
             printf("OS UDP rx errors: %Lu\n",            (ull_t)(stats->this_udp_errors - stats->start_udp_errors));
 
         /* line mode */
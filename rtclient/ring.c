@@ -193,7 +193,7 @@ ring_buffer_t *ring_create(ttp_session_t *session)
 	error("Could not allocate ring buffer object");
 
     /* try to allocate the buffer */
-    ring->datagram_size = 6 + session->parameter->block_size;
+    ring->datagram_size = TS_HEADER_SIZE + session->parameter->block_size;
     ring->datagrams = (u_char *) malloc(ring->datagram_size * MAX_BLOCKS_QUEUED);
     if (ring->datagrams == NULL)
 	error("Could not allocate buffer for ring buffer");
@@ -287,7 +287,7 @@ int ring_dump(ring_buffer_t *ring, FILE *out)
     fprintf(out, "block list     = [");
     for (index = ring->base_data; index < ring->base_data + ring->count_data; ++index) {
 	datagram = ring->datagrams + ((index % MAX_BLOCKS_QUEUED) * ring->datagram_size);
-	fprintf(out, "%d ", ntohl(*((u_int32_t *) datagram)));
+	fprintf(out, "%llu ", (ull_t) ntohll(*((u_int64_t *) datagram)));
     }
     fprintf(out, "]\n");
 
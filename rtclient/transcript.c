@@ -158,7 +158,7 @@ void xscript_open(ttp_session_t *session)
     fprintf(xfer->transcript, "remote_filename = %s\n", xfer->remote_filename);
     fprintf(xfer->transcript, "local_filename = %s\n",  xfer->local_filename);
     fprintf(xfer->transcript, "file_size = %Lu\n",      (ull_t)xfer->file_size);
-    fprintf(xfer->transcript, "block_count = %u\n",     xfer->block_count);
+    fprintf(xfer->transcript, "block_count = %llu\n",   (ull_t)xfer->block_count);
     fprintf(xfer->transcript, "udp_buffer = %u\n",      param->udp_buffer);
     fprintf(xfer->transcript, "block_size = %u\n",      param->block_size);
     fprintf(xfer->transcript, "target_rate = %u\n",     param->target_rate);
@@ -64,31 +64,32 @@
 //#define MODE_34TH 1
 
 /*------------------------------------------------------------------------
- * int build_datagram(ttp_session_t *session, u_int32_t block_index,
+ * int build_datagram(ttp_session_t *session, u_int64_t block_index,
  *                    u_int16_t block_type, u_char *datagram);
  *
  * Constructs to hold the given block of data, with the given type
  * stored in it.  The format of the datagram is:
  *
- *     32                    0
- *     +---------------------+
- *     |     block_number    |
- *     +----------+----------+
- *     |   type   |   data   |
- *     +----------+     :    |
- *     :     :          :    :
- *     +---------------------+
- *
- * The datagram is stored in the given buffer, which must be at least
- * six bytes longer than the block size for the transfer.  Returns 0 on
- * success and non-zero on failure.
+ *     64                                          0
+ *     +-------------------------------------------+
+ *     |               block_number                |
+ *     +----------+----------+---------------------+
+ *     |   type   |   tag    |        data         |
+ *     +----------+----------+          :          |
+ *     :     :                    :                :
+ *     +-------------------------------------------+
+ *
+ * The tag is that of the transfer, given to the client in the reply to
+ * its request.  The datagram is stored in the given buffer, which must be at least
+ * TS_HEADER_SIZE bytes longer than the block size for the transfer.
+ * Returns 0 on success and non-zero on failure.
  *------------------------------------------------------------------------*/
-int build_datagram(ttp_session_t *session, u_int32_t block_index,
+int build_datagram(ttp_session_t *session, u_int64_t block_index,
 		   u_int16_t block_type, u_char *datagram)
 {
     u_int32_t        block_size = session->parameter->block_size;
-    static u_int32_t last_block = 0;
-    static u_int32_t last_written_vsib_block = 0;
+    static u_int64_t last_block = 0;
+    static u_int64_t last_written_vsib_block = 0;
     int              status = 0;
     u_int32_t        write_size;
     #ifdef MODE_34TH
@@ -129,7 +130,7 @@ int build_datagram(ttp_session_t *session, u_int32_t block_index,
             inbufpos++;
             vsib_byte_pos++;
         } else {
-            *(datagram + 6 + (outbufpos++)) = packingbuffer[inbufpos++];
+            *(datagram + TS_HEADER_SIZE + (outbufpos++)) = packingbuffer[inbufpos++];
             vsib_byte_pos++;
         }
     }   
@@ -152,9 +153,9 @@ int build_datagram(ttp_session_t *session, u_int32_t block_index,
     //last_block = block_index; // reading the next block in line, no seek required
     
     /* try to read in the block */
-    read_vsib_block(session, datagram + 6, session->parameter->block_size);
+    read_vsib_block(session, datagram + TS_HEADER_SIZE, session->parameter->block_size);
     //if (status < 0) { /* Expired ? */
-      /*      memset(datagram + 6, 0, session->parameter->block_size);  */
+      /*      memset(datagram + TS_HEADER_SIZE, 0, session->parameter->block_size);  */
       /*      sprintf(g_error, "Could not read block #%u", block_index); */
       /*      return warn(g_error); */
     //}
@@ -173,19 +174,20 @@ int build_datagram(ttp_session_t *session, u_int32_t block_index,
         if (write_size == 0) { write_size = block_size; }
 
         /* write the block to disk */
-        status = fwrite(datagram +6, 1, 
+        status = fwrite(datagram + TS_HEADER_SIZE, 1, 
               write_size, session->transfer.file);
 
         if (status < write_size) {
-           sprintf(g_error, "Could not write block %d of file", block_index);
+           sprintf(g_error, "Could not write block %llu of file", (ull_t) block_index);
            return warn(g_error);
        }   
     }
 
 
     /* build the datagram header */
-    *((u_int32_t *) (datagram + 0)) = htonl(block_index);
-    *((u_int16_t *) (datagram + 4)) = htons(block_type);
+    *((u_int64_t *) (datagram + 0)) = htonll(block_index);
+    *((u_int16_t *) (datagram + 8)) = htons(block_type);
+    *((u_int16_t *) (datagram + 10)) = htons(session->transfer.tag);
 
     /* return success */
     return 0;
@@ -216,7 +216,7 @@ void client_handler(ttp_session_t *session)
     struct timeval    lasthblostreport;              /* the time since last 'heartbeat lost' report    */
     u_int32_t         deadconnection_counter;        /* the counter for checking dead conn timeout     */
     int               retransmitlen = 0;             /* number of bytes read from retransmission queue */
-    u_char            datagram[MAX_BLOCK_SIZE + 6];  /* the datagram containing the file block         */
+    u_char            datagram[MAX_BLOCK_SIZE + TS_HEADER_SIZE];  /* the datagram containing the file block */
     int64_t           ipd_time;                      /* the time to delay/sleep after packet, signed   */
     int64_t           ipd_usleep_diff;               /* the time correction to ipd_time, signed        */
     int64_t           ipd_time_max;
@@ -347,14 +347,14 @@ void client_handler(ttp_session_t *session)
             block_type = (xfer->block == param->block_count) ? TS_BLOCK_TERMINATE : TS_BLOCK_ORIGINAL;
             status = build_datagram(session, xfer->block, block_type, datagram);
             if (status < 0) {
-                sprintf(g_error, "Could not read block #%u", xfer->block);
+                sprintf(g_error, "Could not read block #%llu", (ull_t) xfer->block);
                 error(g_error);
             }
 
             /* transmit the block */
-            status = sendto(xfer->udp_fd, datagram, 6 + param->block_size, 0, xfer->udp_address, xfer->udp_length);
+            status = sendto(xfer->udp_fd, datagram, TS_HEADER_SIZE + param->block_size, 0, xfer->udp_address, xfer->udp_length);
             if (status < 0) {
-                sprintf(g_error, "Could not transmit block #%u", xfer->block);
+                sprintf(g_error, "Could not transmit block #%llu", (ull_t) xfer->block);
                 warn(g_error);
                 continue;
             }
@@ -389,8 +389,8 @@ void client_handler(ttp_session_t *session)
 
             /* show an (additional) statistics line */
             snprintf(stats_line, sizeof(stats_line)-1,
-                                "   n/a     n/a     n/a %7u %6.2f %3u -- no heartbeat since %3.2fs\n",
-                                xfer->block, 100.0 * xfer->block / param->block_count, session->session_id,
+                                "   n/a     n/a     n/a %7llu %6.2f %3u -- no heartbeat since %3.2fs\n",
+                                (ull_t) xfer->block, 100.0 * xfer->block / param->block_count, session->session_id,
                                 1e-6*delta);
             if (param->transcript_yn)
                xscript_data_log(session, stats_line);
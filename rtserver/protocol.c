@@ -107,7 +107,7 @@ int ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmissi
     u_int16_t        type;
   
     /* convert the retransmission fields to host byte order */
-    retransmission->block      = ntohl(retransmission->block);
+    retransmission->block      = ntohll(retransmission->block);
     retransmission->error_rate = ntohl(retransmission->error_rate);
     type                       = ntohs(retransmission->request_type);
 
@@ -127,8 +127,8 @@ int ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmissi
     xfer->ipd_current = max(min(xfer->ipd_current, 10000.0), param->ipd_time);
 
     /* build the stats string */
-    sprintf(stats_line, "%6u %3.2fus %5uus %7u %6.2f %3u\n",
-        retransmission->error_rate, (float)xfer->ipd_current, param->ipd_time, xfer->block,
+    sprintf(stats_line, "%6u %3.2fus %5uus %7llu %6.2f %3u\n",
+        retransmission->error_rate, (float)xfer->ipd_current, param->ipd_time, (ull_t) xfer->block,
         100.0 * xfer->block / param->block_count, session->session_id);
 
 	/* print a status report */
@@ -140,12 +140,15 @@ int ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmissi
 	if (param->transcript_yn)
 	    xscript_data_log(session, stats_line);
 
+    /* flow control is not applicable, the realtime source sets the pace */
+    } else if (type == REQUEST_FLOW_CONTROL) {
+
     /* if it's a restart request */
     } else if (type == REQUEST_RESTART) {
 
 	/* do range-checking first */
 	if ((retransmission->block == 0) || (retransmission->block > param->block_count)) {
-	    sprintf(g_error, "Attempt to restart at illegal block %u", retransmission->block);
+	    sprintf(g_error, "Attempt to restart at illegal block %llu", (ull_t) retransmission->block);
 	    return warn(g_error);
 	} else
 	    xfer->block = retransmission->block;
@@ -156,14 +159,14 @@ int ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmissi
         /* build the retransmission */
         status = build_datagram(session, retransmission->block, TS_BLOCK_RETRANSMISSION, datagram);
         if (status < 0) {
-            sprintf(g_error, "Could not build retransmission for block %u", retransmission->block);
+            sprintf(g_error, "Could not build retransmission for block %llu", (ull_t) retransmission->block);
             return warn(g_error);
         }
       
         /* try to send out the block */
-        status = sendto(xfer->udp_fd, datagram, 6 + param->block_size, 0, xfer->udp_address, xfer->udp_length);
+        status = sendto(xfer->udp_fd, datagram, TS_HEADER_SIZE + param->block_size, 0, xfer->udp_address, xfer->udp_length);
         if (status < 0) {
-            sprintf(g_error, "Could not retransmit block %u", retransmission->block);
+            sprintf(g_error, "Could not retransmit block %llu", (ull_t) retransmission->block);
             return warn(g_error);
         }
 
@@ -197,12 +200,16 @@ int ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmissi
  *         If the authentication succeeds, the server transmits a
  *         result byte of 0.  Otherwise, it transmits a non-zero
  *         result byte.
+ *
+ * The time the client takes to answer the challenge is the round trip
+ * time of the session, as the file requests no longer wait for one.
  *------------------------------------------------------------------------*/
 int ttp_authenticate(ttp_session_t *session, const u_char *secret)
 {
     u_char random[64];         /* the buffer of random data               */
     u_char server_digest[16];  /* the MD5 message digest (for us)         */
     u_char client_digest[16];  /* the MD5 message digest (for the client) */
+    struct timeval ping_s;     /* the time the challenge was sent         */
     int    i;
     int    status;
 
@@ -212,6 +219,7 @@ int ttp_authenticate(ttp_session_t *session, const u_char *secret)
 	return warn("Access to random data is broken");
 
     /* send the random data to the client */
+    gettimeofday(&ping_s, NULL);
     status = full_write(session->client_fd, random, 64);
     if (status < 0)
 	return warn("Could not send authentication challenge to client");
@@ -221,6 +229,10 @@ int ttp_authenticate(ttp_session_t *session, const u_char *secret)
     if (status < 0)
 	return warn("Could not read authentication response from client");
 
+    /* keep the round trip time, with a 10% safety margin */
+    session->parameter->wait_u_sec = get_usec_since(&ping_s);
+    session->parameter->wait_u_sec = session->parameter->wait_u_sec + ((int)(session->parameter->wait_u_sec* 0.1));
+
     /* compare the two digests */
     prepare_proof(random, 64, secret, server_digest);
     for (i = 0; i < 16; ++i)
@@ -274,14 +286,13 @@ int ttp_negotiate(ttp_session_t *session)
  * int ttp_open_port(ttp_session_t *session);
  *
  * Creates a new UDP socket for transmitting the file data associated
- * with our pending transfer and receives the destination port number
- * from the client.  Returns 0 on success and non-zero on failure.
+ * with our pending transfer, to the port the client sent along with
+ * its request.  Returns 0 on success and non-zero on failure.
  *------------------------------------------------------------------------*/
 int ttp_open_port(ttp_session_t *session)
 {
     struct sockaddr    *address;
-    int                 status;
-    u_int16_t           port;
+    u_int16_t           port = session->transfer.udp_port;
     u_char              ipv6_yn = session->parameter->ipv6_yn;
 
     /* create the address structure */
@@ -293,10 +304,7 @@ int ttp_open_port(ttp_session_t *session)
     /* prepare the UDP address structure, minus the UDP port number */
     getpeername(session->client_fd, address, &(session->transfer.udp_length));
 
-    /* read in the port number from the client */
-    status = full_read(session->client_fd, &port, 2);
-    if (status < 0)
-	return warn("Could not read UDP port number");
+    /* fill in the port number from the request */
     if (ipv6_yn)
 	((struct sockaddr_in6 *) address)->sin6_port = port;
     else
@@ -326,16 +334,28 @@ int ttp_open_port(ttp_session_t *session)
  * can't negotiate the transfer because of I/O or file errors, we
  * return a negative vlaue.
  *
- * The client is sent a result byte of 0 if the request is accepted
- * (because the file can be read) and a non-zero result byte otherwise.
+ * The request is one message: the filename line is followed by the
+ * block size, target bitrate, error rate, slowdown and speedup
+ * factors, transfer options and data port of the client.  None of the
+ * options is used in realtime mode, but the fields they add to the
+ * request are read all the same.  The client is sent a result byte of
+ * 0 if the request is accepted, together with the transfer parameters
+ * and the datagram tag, and a non-zero result byte on its own
+ * otherwise.
  *------------------------------------------------------------------------*/
 int ttp_open_transfer(ttp_session_t *session)
 {
     char             filename[MAX_FILENAME_LENGTH];  /* the name of the file to transfer     */
     u_int64_t        file_size;                      /* network-order version of file size   */
     u_int32_t        block_size;                     /* network-order version of block size  */
-    u_int32_t        block_count;                    /* network-order version of block count */
-    time_t           epoch;
+    u_int64_t        block_count;                    /* network-order version of block count */
+    u_int32_t        options;                        /* network-order version of the options */
+    u_int32_t        super_size;                     /* network-order blocks per super-block */
+    u_int64_t        range[2];                       /* network-order byte range             */
+    u_int32_t        epoch;                          /* network-order run epoch              */
+    u_int16_t        tag;                            /* the tag of the last transfer's datagrams */
+    u_char           reply[35];                      /* the result byte and the parameters   */
+    size_t           length;                         /* the length of the reply so far       */
     int              status;
     ttp_transfer_t  *xfer  = &session->transfer;
     ttp_parameter_t *param =  session->parameter;
@@ -351,9 +371,9 @@ int ttp_open_transfer(ttp_session_t *session)
     char       file_no[10];
     char       message[20];
     u_int16_t  i;
-    struct     timeval ping_s, ping_e;
 
     /* clear out the transfer data */
+    tag = xfer->tag;
     memset(xfer, 0, sizeof(*xfer));
 
     /* read in the requested filename */
@@ -418,6 +438,32 @@ int ttp_open_transfer(ttp_session_t *session)
        }
     }
 
+    /* read in the rest of the request, which a multi-GET without files does not send */
+    if (strcmp(filename, "*")) {
+        if (full_read(session->client_fd, &param->block_size,  4) < 0) return warn("Could not read block size");
+        if (full_read(session->client_fd, &param->target_rate, 4) < 0) return warn("Could not read target bitrate");
+        if (full_read(session->client_fd, &param->error_rate,  4) < 0) return warn("Could not read error rate");
+        if (full_read(session->client_fd, &param->slower_num,  2) < 0) return warn("Could not read slowdown numerator");
+        if (full_read(session->client_fd, &param->slower_den,  2) < 0) return warn("Could not read slowdown denominator");
+        if (full_read(session->client_fd, &param->faster_num,  2) < 0) return warn("Could not read speedup numerator");
+        if (full_read(session->client_fd, &param->faster_den,  2) < 0) return warn("Could not read speedup denominator");
+        if (full_read(session->client_fd, &options,            4) < 0) return warn("Could not read transfer options");
+        param->block_size  = ntohl(param->block_size);
+        param->target_rate = ntohl(param->target_rate);
+        param->error_rate  = ntohl(param->error_rate);
+        param->slower_num  = ntohs(param->slower_num);
+        param->slower_den  = ntohs(param->slower_den);
+        param->faster_num  = ntohs(param->faster_num);
+        param->faster_den  = ntohs(param->faster_den);
+        if (ntohl(options) & TS_OPT_SUPERBLOCK) {
+            if (full_read(session->client_fd, &super_size,     4) < 0) return warn("Could not read super-block size");
+        }
+        if (ntohl(options) & TS_OPT_RANGE) {
+            if (full_read(session->client_fd, range,          16) < 0) return warn("Could not read byte range");
+        }
+        if (full_read(session->client_fd, &xfer->udp_port,     2) < 0) return warn("Could not read UDP port number");
+    }
+
     /* store the filename in the transfer object */
     xfer->filename = strdup(filename);
     if (xfer->filename == NULL)
@@ -521,28 +567,6 @@ int ttp_open_transfer(ttp_session_t *session)
 
     #endif // end of VSIB_REALTIME section
 
-    /* begin round trip time estimation */
-    gettimeofday(&ping_s,NULL);
-
-    /* try to signal success to the client */
-    status = full_write(session->client_fd, "\000", 1);
-    if (status < 0)
-    return warn("Could not signal request approval to client");
-
-    /* read in the block size, target bitrate, and error rate */
-    if (full_read(session->client_fd, &param->block_size,  4) < 0) return warn("Could not read block size");            param->block_size  = ntohl(param->block_size);
-    if (full_read(session->client_fd, &param->target_rate, 4) < 0) return warn("Could not read target bitrate");        param->target_rate = ntohl(param->target_rate);
-    if (full_read(session->client_fd, &param->error_rate,  4) < 0) return warn("Could not read error rate");            param->error_rate  = ntohl(param->error_rate);
-
-    /* end round trip time estimation */
-    gettimeofday(&ping_e,NULL);
-
-    /* read in the slowdown and speedup factors */
-    if (full_read(session->client_fd, &param->slower_num,  2) < 0) return warn("Could not read slowdown numerator");    param->slower_num  = ntohs(param->slower_num);
-    if (full_read(session->client_fd, &param->slower_den,  2) < 0) return warn("Could not read slowdown denominator");  param->slower_den  = ntohs(param->slower_den);
-    if (full_read(session->client_fd, &param->faster_num,  2) < 0) return warn("Could not read speedup numerator");     param->faster_num  = ntohs(param->faster_num);
-    if (full_read(session->client_fd, &param->faster_den,  2) < 0) return warn("Could not read speedup denominator");   param->faster_den  = ntohs(param->faster_den);
-
     #ifndef VSIB_REALTIME
     /* try to find the file statistics */
     fseeko(xfer->file, 0, SEEK_END);
@@ -575,16 +599,20 @@ int ttp_open_transfer(ttp_session_t *session)
     param->block_count = (param->file_size / param->block_size) + ((param->file_size % param->block_size) != 0);
     param->epoch       = time(NULL);
 
-    /* reply with the length, block size, number of blocks, and run epoch */
-    file_size   = htonll(param->file_size);    if (full_write(session->client_fd, &file_size,   8) < 0) return warn("Could not submit file size");
-    block_size  = htonl (param->block_size);   if (full_write(session->client_fd, &block_size,  4) < 0) return warn("Could not submit block size");
-    block_count = htonl (param->block_count);  if (full_write(session->client_fd, &block_count, 4) < 0) return warn("Could not submit block count");
-    epoch       = htonl (param->epoch);        if (full_write(session->client_fd, &epoch,       4) < 0) return warn("Could not submit run epoch");
-
-    /*calculate and convert RTT to u_sec*/
-    session->parameter->wait_u_sec=(ping_e.tv_sec - ping_s.tv_sec)*1000000+(ping_e.tv_usec-ping_s.tv_usec);
-    /*add a 10% safety margin*/
-    session->parameter->wait_u_sec = session->parameter->wait_u_sec + ((int)(session->parameter->wait_u_sec* 0.1));  
+    /* a new tag for the datagrams, so that the client can tell late ones of the last transfer from ours */
+    if ((get_random_data((u_char *) &xfer->tag, 2) < 0) || (xfer->tag == tag))
+        xfer->tag = tag + 1;
+
+    /* reply with the result byte, length, block size, number of blocks, run epoch and tag in one message */
+    reply[0] = 0;                                                          length  = 1;
+    file_size   = htonll(param->file_size);    memcpy(reply + length, &file_size,   8); length += 8;
+    block_size  = htonl (param->block_size);   memcpy(reply + length, &block_size,  4); length += 4;
+    block_count = htonll(param->block_count);  memcpy(reply + length, &block_count, 8); length += 8;
+    epoch       = htonl (param->epoch);        memcpy(reply + length, &epoch,       4); length += 4;
+    options     = 0;                           memcpy(reply + length, &options,     4); length += 4;  /* none used in realtime mode */
+    tag         = htons (xfer->tag);           memcpy(reply + length, &tag,         2); length += 2;
+    if (full_write(session->client_fd, reply, length) < 0)
+        return warn("Could not submit the transfer parameters");
 
     /* and store the inter-packet delay */
     param->ipd_time   = (u_int32_t) ((1000000LL * 8 * param->block_size) / param->target_rate);
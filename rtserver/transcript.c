@@ -145,7 +145,7 @@ void xscript_open(ttp_session_t *session)
     /* write out all the header information */
     fprintf(xfer->transcript, "filename = %s\n",    xfer->filename);
     fprintf(xfer->transcript, "file_size = %llu\n",  (ull_t)param->file_size);
-    fprintf(xfer->transcript, "block_count = %u\n", param->block_count);
+    fprintf(xfer->transcript, "block_count = %llu\n", (ull_t)param->block_count);
     fprintf(xfer->transcript, "udp_buffer = %u\n",  param->udp_buffer);
     fprintf(xfer->transcript, "block_size = %u\n",  param->block_size);
     fprintf(xfer->transcript, "target_rate = %u\n", param->target_rate);
@@ -0,0 +1,371 @@
+/*========================================================================
+ * bundle.c  --  File bundle routines for Tsunami server.
+ *
+ * This contains the block source for a bundle: a set of files and
+ * whole directory trees that go out as one stream, their data one
+ * after the other in the order of the manifest, without padding.  A
+ * request for 'bundle:*' bundles every file that we share, and one for
+ * 'bundle:path' the file or the directory tree at the path, under the
+ * last part of the path.  The manifest of names, sizes and modes goes
+ * to the client after the transfer is agreed (see ttp_send_manifest()),
+ * and the client splits the stream back into the files.  That way
+ * thousands of small files take one handshake, one ramp-up and one
+ * tail instead of one each.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <dirent.h>       /* for scandir(), alphasort()            */
+#include <fcntl.h>        /* for open(), posix_fadvise()           */
+#include <stdlib.h>       /* for calloc(), realloc(), free()       */
+#include <string.h>       /* for strdup(), strcmp()                */
+#include <sys/stat.h>     /* for stat(), lstat()                   */
+#include <unistd.h>       /* for pread(), close()                  */
+
+#include <tsunami-server.h>
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static int   bundle_add (bundle_t *bundle, const char *path, const char *name, const struct stat *filestat);
+static int   bundle_walk(bundle_t *bundle, const char *path, const char *name, int depth);
+static char *bundle_join(const char *first, const char *second);
+
+
+/*------------------------------------------------------------------------
+ * int bundle_open(ttp_session_t *session, const char *name);
+ *
+ * Builds the manifest of the bundle with the given name, "*" for all
+ * the files we share or else a file or directory, into the source data
+ * of the transfer.  The entries of a directory are taken in the order
+ * of their names, and what cannot be read is left out with a warning.
+ * Returns 0 on success and non-zero if there is nothing to send.
+ *------------------------------------------------------------------------*/
+int bundle_open(ttp_session_t *session, const char *name)
+{
+    ttp_parameter_t *param = session->parameter;
+    bundle_t        *bundle;
+    const char      *base;
+    char            *top;
+    size_t           length;
+    int              status = 0;
+    u_int32_t        index;
+
+    bundle = (bundle_t *) calloc(1, sizeof(bundle_t));
+    if (bundle == NULL)
+        return -1;
+    bundle->fd = -1;
+    session->transfer.source_data = bundle;
+
+    /* all the files we share go in under their names, less a leading '/' */
+    if (!strcmp(name, "*")) {
+        for (index = 0; (index < param->total_files) && (status == 0); ++index) {
+            for (base = param->file_names[index]; *base == '/'; ++base);
+            status = bundle_walk(bundle, param->file_names[index], base, 0);
+        }
+
+    /* and a single path under its last part, or its contents for "." or "/" */
+    } else {
+        top = strdup(name);
+        if (top == NULL) {
+            bundle_close(session);
+            return -1;
+        }
+        for (length = strlen(top); (length > 1) && (top[length - 1] == '/'); top[--length] = '\0');
+        base = strrchr(top, '/');
+        base = (base == NULL) ? top : base + 1;
+        if (!strcmp(base, ".") || !strcmp(base, ".."))
+            base = "";
+        status = bundle_walk(bundle, top, base, 0);
+        free(top);
+    }
+
+    if ((status < 0) || (bundle->count == 0)) {
+        bundle_close(session);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * u_int64_t bundle_size(ttp_session_t *session);
+ *
+ * Returns the size of the stream of the bundle of the transfer, which
+ * is the sum of the sizes of its files.
+ *------------------------------------------------------------------------*/
+u_int64_t bundle_size(ttp_session_t *session)
+{
+    return ((bundle_t *) session->transfer.source_data)->size;
+}
+
+
+/*------------------------------------------------------------------------
+ * int bundle_read(ttp_session_t *session, u_int64_t block,
+ *                 u_char *buffer);
+ *
+ * Reads the given block of the stream of the bundle into the buffer,
+ * from as many files as it spans.  The file read last is kept open, so
+ * that the blocks of a large file take one open.  A file that shrank
+ * since the manifest was made reads as zeros past its new end.  Returns
+ * the bytes read, or -1 on error.
+ *------------------------------------------------------------------------*/
+int bundle_read(ttp_session_t *session, u_int64_t block, u_char *buffer)
+{
+    bundle_t       *bundle = (bundle_t *) session->transfer.source_data;
+    u_int64_t       offset = ((u_int64_t) session->parameter->block_size) * (block - 1);
+    u_int64_t       end    = min(offset + session->parameter->block_size, bundle->size);
+    u_int64_t       done   = 0;
+    u_int64_t       piece;
+    u_int32_t       low    = 0;
+    u_int32_t       high   = bundle->count;
+    u_int32_t       middle;
+    ssize_t         bytes;
+    bundle_entry_t *entry;
+
+    if (offset >= end)
+        return 0;
+
+    /* find the last entry that starts at or before the offset */
+    while (high - low > 1) {
+        middle = (low + high) / 2;
+        if (bundle->entry[middle].offset <= offset)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    /* and read on through the files until the block is full */
+    while (offset + done < end) {
+        entry = &bundle->entry[low];
+        if (offset + done >= entry->offset + entry->size) {
+            ++low;
+            continue;
+        }
+        if ((bundle->fd < 0) || (bundle->fd_entry != low)) {
+            if (bundle->fd >= 0)
+                close(bundle->fd);
+            bundle->fd       = open(entry->path, O_RDONLY);
+            bundle->fd_entry = low;
+            if (bundle->fd < 0) {
+                sprintf(g_error, "Could not open '%s' of the bundle", entry->path);
+                return warn(g_error);
+            }
+            #ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(bundle->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            #endif
+        }
+        piece = min(end - offset - done, entry->offset + entry->size - offset - done);
+        bytes = pread(bundle->fd, buffer + done, piece, offset + done - entry->offset);
+        if (bytes < 0)
+            return -1;
+        if ((u_int64_t) bytes < piece)
+            memset(buffer + done + bytes, 0, piece - bytes);
+        done += piece;
+    }
+    return done;
+}
+
+
+/*------------------------------------------------------------------------
+ * void bundle_close(ttp_session_t *session);
+ *
+ * Closes the file the bundle of the transfer read last and frees the
+ * bundle.
+ *------------------------------------------------------------------------*/
+void bundle_close(ttp_session_t *session)
+{
+    bundle_t  *bundle = (bundle_t *) session->transfer.source_data;
+    u_int32_t  index;
+
+    if (bundle == NULL)
+        return;
+    if (bundle->fd >= 0)
+        close(bundle->fd);
+    for (index = 0; index < bundle->count; ++index) {
+        free(bundle->entry[index].path);
+        free(bundle->entry[index].name);
+    }
+    free(bundle->entry);
+    free(bundle);
+    session->transfer.source_data = NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * static int bundle_add(bundle_t *bundle, const char *path,
+ *                       const char *name, const struct stat *filestat);
+ *
+ * Appends the file or directory at the given path to the manifest of
+ * the bundle under the given name, its data after that of the entries
+ * before it.  Returns 0 on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+static int bundle_add(bundle_t *bundle, const char *path, const char *name, const struct stat *filestat)
+{
+    bundle_entry_t *entry;
+
+    if (strlen(name) >= MAX_FILENAME_LENGTH)
+        return warn("Name in the bundle is too long");
+
+    /* make room, doubling it as needed */
+    if (bundle->count == bundle->room) {
+        entry = (bundle_entry_t *) realloc(bundle->entry, (bundle->room ? 2 * bundle->room : 64) * sizeof(bundle_entry_t));
+        if (entry == NULL)
+            return warn("Could not grow the bundle manifest");
+        bundle->entry = entry;
+        bundle->room  = bundle->room ? 2 * bundle->room : 64;
+    }
+
+    entry         = &bundle->entry[bundle->count];
+    entry->path   = strdup(path);
+    entry->name   = strdup(name);
+    entry->offset = bundle->size;
+    entry->size   = S_ISDIR(filestat->st_mode) ? 0 : filestat->st_size;
+    entry->mode   = filestat->st_mode & (S_IFMT | 07777);
+    if ((entry->path == NULL) || (entry->name == NULL)) {
+        free(entry->path);
+        free(entry->name);
+        return warn("Could not allocate a bundle entry");
+    }
+    bundle->size += entry->size;
+    ++bundle->count;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * static int bundle_walk(bundle_t *bundle, const char *path,
+ *                        const char *name, int depth);
+ *
+ * Adds the file at the given path to the bundle under the given name,
+ * or the directory there with everything below it, down to BUNDLE_DEPTH
+ * levels.  The directory itself goes in before its entries, unless it
+ * is the top of a bundle without a name.  Symbolic links are followed
+ * to files but not to directories, which keeps loops out.  What cannot
+ * be read below the top is left out with a warning.  Returns 0 on
+ * success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+static int bundle_walk(bundle_t *bundle, const char *path, const char *name, int depth)
+{
+    struct dirent **list = NULL;
+    struct stat     filestat;
+    char           *child_path, *child_name;
+    int             count, index;
+    int             status = 0;
+
+    /* the top of the bundle is taken as it is named, links below it only to files */
+    status = (depth == 0) ? stat(path, &filestat) : lstat(path, &filestat);
+    if ((status == 0) && S_ISLNK(filestat.st_mode) && ((stat(path, &filestat) < 0) || !S_ISREG(filestat.st_mode)))
+        return 0;
+
+    /* a file only has to be readable, what is below a directory is left out if it is not */
+    if ((status == 0) && S_ISREG(filestat.st_mode)) {
+        if (access(path, R_OK) == 0)
+            return bundle_add(bundle, path, (*name != '\0') ? name : path, &filestat);
+        status = -1;
+    } else if ((status == 0) && !S_ISDIR(filestat.st_mode)) {
+        return 0;
+    } else if ((status == 0) && (depth < BUNDLE_DEPTH)) {
+        if ((*name != '\0') && (bundle_add(bundle, path, name, &filestat) < 0))
+            return -1;
+        count  = scandir(path, &list, NULL, alphasort);
+        status = (count < 0) ? -1 : 0;
+    } else {
+        status = -1;
+    }
+    if (status < 0) {
+        sprintf(g_error, "Leaving '%s' out of the bundle, it cannot be read", path);
+        warn(g_error);
+        return (depth == 0) ? -1 : 0;
+    }
+
+    for (index = 0; index < count; ++index) {
+        if ((status == 0) && strcmp(list[index]->d_name, ".") && strcmp(list[index]->d_name, "..")) {
+            child_path = bundle_join(path, list[index]->d_name);
+            child_name = (*name != '\0') ? bundle_join(name, list[index]->d_name) : strdup(list[index]->d_name);
+            status = ((child_path == NULL) || (child_name == NULL)) ? warn("Could not allocate a bundle path")
+                                                                    : bundle_walk(bundle, child_path, child_name, depth + 1);
+            free(child_path);
+            free(child_name);
+        }
+        free(list[index]);
+    }
+    free(list);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * static char *bundle_join(const char *first, const char *second);
+ *
+ * Returns the two parts of a path joined by a '/', newly allocated, or
+ * NULL if there is no memory.
+ *------------------------------------------------------------------------*/
+static char *bundle_join(const char *first, const char *second)
+{
+    size_t  length = strlen(first);
+    char   *joined = (char *) malloc(length + strlen(second) + 2);
+
+    if (joined != NULL)
+        sprintf(joined, "%s%s%s", first, ((length > 0) && (first[length - 1] == '/')) ? "" : "/", second);
+    return joined;
+}
+
+
+/*========================================================================
+ * $Log: bundle.c,v $
+ */
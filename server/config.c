@@ -72,11 +72,14 @@
 const u_int32_t  DEFAULT_BLOCK_SIZE    = 1024;      /* default size of a single file block     */
 const u_char    *DEFAULT_SECRET        = (u_char*)"kitten";  /* default shared secret          */
 const u_int16_t  DEFAULT_TCP_PORT      = TS_TCP_PORT;/* default TCP port to listen on          */
-const u_int32_t  DEFAULT_UDP_BUFFER    = 20000000;  /* default size of the UDP transmit buffer */
+const u_int32_t  DEFAULT_UDP_BUFFER    = 20000000;  /* least size of an automatic send buffer  */
 const u_char     DEFAULT_VERBOSE_YN    = 1;         /* the default verbosity setting           */
 const u_char     DEFAULT_TRANSCRIPT_YN = 0;         /* the default transcript setting          */
 const u_char     DEFAULT_IPV6_YN       = 0;         /* the default IPv6 setting                */
 const u_int16_t  DEFAULT_HEARTBEAT_TIMEOUT = 15;    /* the timeout to disconnect after no client feedback */
+const u_char     DEFAULT_MCAST_TTL     = 1;         /* the default TTL of multicast datagrams  */
+const u_int32_t  DEFAULT_MCAST_WAIT    = 2;         /* the default join window of a multicast  */
+const u_int32_t  DEFAULT_FOLLOW_IDLE   = 30;        /* the default idle timeout of a followed file */
 
 /*------------------------------------------------------------------------
  * void reset_server(ttp_parameter_t *parameter);
@@ -93,11 +96,16 @@ void reset_server(ttp_parameter_t *parameter)
     parameter->secret        = DEFAULT_SECRET;
     parameter->client        = NULL;
     parameter->tcp_port      = DEFAULT_TCP_PORT;
-    parameter->udp_buffer    = DEFAULT_UDP_BUFFER;
+    parameter->udp_buffer    = 0;  /* sized from the path */
     parameter->hb_timeout    = DEFAULT_HEARTBEAT_TIMEOUT;
     parameter->verbose_yn    = DEFAULT_VERBOSE_YN;
     parameter->transcript_yn = DEFAULT_TRANSCRIPT_YN;
     parameter->ipv6_yn       = DEFAULT_IPV6_YN;
+    parameter->mcast_port    = TS_UDP_PORT;
+    parameter->mcast_ttl     = DEFAULT_MCAST_TTL;
+    parameter->mcast_wait    = DEFAULT_MCAST_WAIT;
+    parameter->relay_port    = DEFAULT_TCP_PORT;
+    parameter->follow_idle   = DEFAULT_FOLLOW_IDLE;
 }
 
 
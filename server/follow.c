@@ -0,0 +1,194 @@
+/*========================================================================
+ * follow.c  --  Growing file routines for Tsunami server.
+ *
+ * This contains routines for sending a file that is still being
+ * written.  Only the full blocks of such a file are offered at first.
+ * The file is looked at whenever the sender has caught up with it, and
+ * every time it has grown the new file size and block count go to the
+ * client on the control channel before the new blocks go out.  The
+ * file is taken to be complete once its sidecar file, the file name
+ * with FOLLOW_SIDECAR appended, appears or it has not grown for the
+ * idle timeout, and then the rest of it is sent as usual.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <stdio.h>        /* for snprintf(), clearerr()            */
+#include <stdlib.h>       /* for realloc()                         */
+#include <string.h>       /* for memset()                          */
+#include <sys/stat.h>     /* for stat(), fstat()                   */
+#include <sys/time.h>     /* for gettimeofday()                    */
+#include <unistd.h>       /* for standard Unix system calls        */
+
+#include <tsunami-server.h>
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static int follow_done(ttp_session_t *session);
+
+
+/*------------------------------------------------------------------------
+ * void follow_start(ttp_session_t *session);
+ *
+ * Starts following the file of the transfer, whose size has just been
+ * found.  Unless its sidecar file is there already, the file size and
+ * block count of the transfer are cut back to the full blocks.
+ *------------------------------------------------------------------------*/
+void follow_start(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer   = &session->transfer;
+    ttp_parameter_t *param  =  session->parameter;
+    follow_t        *follow = &xfer->follow;
+
+    follow->size = param->file_size;
+    follow->open = !follow_done(session);
+    gettimeofday(&follow->polled, NULL);
+    follow->grown = follow->polled;
+
+    if (follow->open) {
+        param->block_count = param->file_size / param->block_size;
+        param->file_size   = param->block_count * param->block_size;
+    }
+    if (param->verbose_yn)
+        printf("Following '%s' from %llu bytes\n", xfer->filename, (ull_t) follow->size);
+}
+
+
+/*------------------------------------------------------------------------
+ * int follow_poll(ttp_session_t *session);
+ *
+ * Looks at the followed file, if it has not been looked at within the
+ * last FOLLOW_PERIOD, and passes any growth on to the client.  Returns
+ * 1 if there are new blocks to send or the file is complete, 0 if the
+ * sender has to wait for more, and a negative value on failure.
+ *------------------------------------------------------------------------*/
+int follow_poll(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer   = &session->transfer;
+    ttp_parameter_t *param  =  session->parameter;
+    follow_t        *follow = &xfer->follow;
+    struct stat      filestat;
+    u_int64_t        block_count, file_size, temp;
+    u_char          *region;
+    int              done;
+
+    if (get_usec_since(&follow->polled) < FOLLOW_PERIOD)
+        return 0;
+    gettimeofday(&follow->polled, NULL);
+
+    /* look for the sidecar first, so that what was written before it is in the size */
+    done = follow_done(session);
+    if (fstat(fileno(xfer->file), &filestat) < 0)
+        return warn("Could not look at the followed file");
+    if ((u_int64_t) filestat.st_size > follow->size) {
+        follow->size  = filestat.st_size;
+        follow->grown = follow->polled;
+    }
+    if ((param->follow_idle > 0) && (tv_diff_usec(follow->polled, follow->grown) >= 1e6 * param->follow_idle))
+        done = 1;
+    follow->open = !done;
+
+    /* until the end only the full blocks are offered */
+    block_count = (follow->size / param->block_size) + (done && ((follow->size % param->block_size) != 0));
+    file_size   = done ? follow->size : block_count * param->block_size;
+    if (block_count == param->block_count)
+        return done;
+
+    /* make room for the compression decisions of the new regions */
+    if (xfer->options & TS_OPT_COMPRESS) {
+        region = (u_char *) realloc(xfer->compress.region, block_count / COMPRESS_REGION + 1);
+        if (region == NULL)
+            return warn("Could not extend the compression regions");
+        memset(region + param->block_count / COMPRESS_REGION + 1, 0, block_count / COMPRESS_REGION - param->block_count / COMPRESS_REGION);
+        xfer->compress.region = region;
+    }
+
+    /* tell the client before any of the new blocks reach it */
+    temp = htonll(file_size);    if (full_write(session->client_fd, &temp, 8) < 8) return warn("Could not submit file size");
+    temp = htonll(block_count);  if (full_write(session->client_fd, &temp, 8) < 8) return warn("Could not submit block count");
+    param->file_size   = file_size;
+    param->block_count = block_count;
+
+    /* an end of file seen before it grew must not stick */
+    clearerr(xfer->file);
+
+    if (param->verbose_yn)
+        printf("File '%s' %s at %llu bytes\n", xfer->filename, done ? "complete" : "grew", (ull_t) file_size);
+    return 1;
+}
+
+
+/*------------------------------------------------------------------------
+ * int follow_done(ttp_session_t *session);
+ *
+ * Returns 1 if the sidecar file that marks the followed file complete
+ * is there, and 0 if it is not.
+ *------------------------------------------------------------------------*/
+static int follow_done(ttp_session_t *session)
+{
+    char        path[MAX_FILENAME_LENGTH + sizeof(FOLLOW_SIDECAR)];
+    struct stat filestat;
+
+    snprintf(path, sizeof(path), "%s%s", session->transfer.filename, FOLLOW_SIDECAR);
+    return (stat(path, &filestat) == 0);
+}
+
+
+/*========================================================================
+ * $Log: follow.c,v $
+ */
@@ -0,0 +1,463 @@
+/*========================================================================
+ * handler.c  --  Client session handler for Tsunami server.
+ *
+ * This contains the routine that serves the file requests of one
+ * connected client until it leaves, as run by the child processes of
+ * tsunamid and by programs using the library.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <errno.h>       /* for the errno variable and perror()   */
+#include <fcntl.h>       /* for the fcntl() function              */
+#include <stdlib.h>      /* for memory allocation, system(), etc. */
+#include <string.h>      /* for memset(), sprintf(), etc.         */
+#include <sys/types.h>   /* for standard system data types        */
+#include <sys/socket.h>  /* for the BSD sockets library           */
+#include <netinet/in.h>  /* for IPPROTO_TCP                       */
+#include <netinet/tcp.h> /* for TCP_NODELAY                       */
+#include <unistd.h>      /* for Unix system calls                 */
+
+#include <tsunami-server.h>
+#ifdef VSIB_REALTIME
+#include "vsibctl.h"
+#endif
+
+/*------------------------------------------------------------------------
+ * void client_handler(ttp_session_t *session);
+ *
+ * This routine is run by the client processes that are created in
+ * response to incoming connections, or by a program using the library
+ * on a connection it accepted.  It returns once the client ends the
+ * session.
+ *------------------------------------------------------------------------*/
+void client_handler(ttp_session_t *session)
+{
+    retransmission_t  retransmission;                /* the retransmission data object                 */
+    struct timeval    start, stop;                   /* the start and stop times for the transfer      */
+    struct timeval    prevpacketT;                   /* the send time of the previous packet           */
+    struct timeval    currpacketT;                   /* the interpacket delay value                    */
+    struct timeval    lastfeedback;                  /* the time since last client feedback            */
+    struct timeval    lasthblostreport;              /* the time since last 'heartbeat lost' report    */
+    u_int32_t         deadconnection_counter;        /* the counter for checking dead conn timeout     */
+    int               retransmitlen;                 /* number of bytes read from retransmission queue */
+    u_char            datagram[TS_HEADER_SIZE + MAX_BLOCK_SIZE + TS_CRC_SIZE];  /* the datagram containing the file block */
+    int64_t           ipd_time;                      /* the time to delay/sleep after packet, signed   */
+    int64_t           ipd_usleep_diff;               /* the time correction to ipd_time, signed        */
+    int64_t           ipd_time_max;
+    int               status;
+    ttp_transfer_t   *xfer  = &session->transfer;
+    ttp_parameter_t  *param =  session->parameter;
+    u_int64_t         delta;
+    u_char            block_type;
+    int               yes = 1;
+
+    /* the control messages are small, and none should wait for the one before it to be acknowledged */
+    setsockopt(session->client_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    /* negotiate the connection parameters */
+    status = ttp_negotiate(session);
+    if (status < 0)
+        error("Protocol revision number mismatch");
+
+    /* have the client try to authenticate to us */
+    status = ttp_authenticate(session, session->parameter->secret);
+    if (status < 0)
+        error("Client authentication failure");
+
+    if (1==param->verbose_yn) {
+        fprintf(stderr,"Client authenticated. Negotiated parameters are:\n");
+        fprintf(stderr,"Block size: %d\n", param->block_size);
+        if (param->udp_buffer) fprintf(stderr,"Buffer size: %d\n", param->udp_buffer);
+        else fprintf(stderr,"Buffer size: auto\n");
+        fprintf(stderr,"Port: %d\n", param->tcp_port);    
+    }
+
+    /* while we haven't been told to stop */
+    while (1) {
+
+    /* make the client descriptor blocking */
+    status = fcntl(session->client_fd, F_SETFL, 0);
+    if (status < 0)
+        error("Could not make client socket blocking");
+
+    /* negotiate another transfer, unless the client is done */
+    status = ttp_open_transfer(session);
+    if (status > 0)
+        break;
+    if (status < 0) {
+        ttp_close_transfer(session);
+        warn("Invalid file request");
+        continue;
+    }
+
+    /* negotiate a data transfer port */
+    status = ttp_open_port(session);
+    if (status < 0) {
+        ttp_close_transfer(session);
+        warn("UDP socket creation failed");
+        continue;
+    }
+
+    /* probe the path for a starting rate if the client wants it */
+    if (xfer->options & TS_OPT_PROBE) {
+        status = ttp_probe_path(session);
+        if (status < 0) {
+            ttp_close_transfer(session);
+            warn("Path probe failed");
+            continue;
+        }
+    }
+
+    /* a multicast receiver only has its feedback passed on to the stream */
+    if (xfer->options & TS_OPT_MULTICAST) {
+        gettimeofday(&start, NULL);
+        if (mcast_serve(session) == 0)
+            finish_hook(session);
+        gettimeofday(&stop, NULL);
+        if (param->transcript_yn)
+            xscript_close(session, 1000000LL * (stop.tv_sec - start.tv_sec) + stop.tv_usec - start.tv_usec);
+        ttp_close_transfer(session);
+        continue;
+    }
+
+    /* make the client descriptor non-blocking again */
+    status = fcntl(session->client_fd, F_SETFL, O_NONBLOCK);
+    if (status < 0)
+        error("Could not make client socket non-blocking");
+
+    /*---------------------------
+     * START TIMING
+     *---------------------------*/
+    gettimeofday(&start, NULL);
+    if (param->transcript_yn)
+        xscript_data_start(session, &start);
+
+    lasthblostreport       = start;
+    lastfeedback           = start;
+    prevpacketT            = start;
+    deadconnection_counter = 0;
+    ipd_time               = 0;
+    ipd_time_max           = 0;
+    ipd_usleep_diff        = 0;
+    retransmitlen          = 0;
+
+    /* start by blasting out every block */
+    xfer->block = 0;
+    while (xfer->block <= param->block_count) {
+
+        /* default: flag as retransmitted block */
+        block_type = TS_BLOCK_RETRANSMISSION;
+
+        /* precalculate time to wait after sending the next packet */
+        gettimeofday(&currpacketT, NULL);
+        ipd_usleep_diff = max(xfer->ipd_current * xfer->sent_size / xfer->datagram_size, xfer->ipd_flow) + tv_diff_usec(prevpacketT, currpacketT);
+        prevpacketT = currpacketT;
+        if (ipd_usleep_diff > 0 || ipd_time > 0) {
+            ipd_time += ipd_usleep_diff;
+        }
+        ipd_time_max = (ipd_time > ipd_time_max) ? ipd_time : ipd_time_max;
+
+        /* see if transmit requests are available */
+        status = read(session->client_fd, ((char*)&retransmission)+retransmitlen, sizeof(retransmission)-retransmitlen);
+        #ifndef VSIB_REALTIME
+        if ((status <= 0) && (errno != EAGAIN))
+            error("Retransmission read failed");
+        #else
+        if ((status <= 0) && (errno != EAGAIN) && (!session->parameter->fileout))
+            error("Retransmission read failed and not writing local backup file");
+        #endif
+        if (status > 0)
+            retransmitlen += status;
+
+        /* if we have a retransmission */
+        if (retransmitlen == sizeof(retransmission_t)) {
+
+            /* store current time */
+            lastfeedback           = currpacketT;
+            lasthblostreport       = currpacketT;
+            deadconnection_counter = 0;
+
+            /* the bitmap of a super-block comes in the requests after the one that announced it */
+            if (xfer->super_left > 0) {
+                status = ttp_accept_bitmap(session, (u_char *) &retransmission, datagram);
+                if (status < 0)
+                    warn("Retransmission error");
+
+            /* if it's a stop request, go back to waiting for a filename */
+            } else if (ntohs(retransmission.request_type) == REQUEST_STOP) {
+
+               fprintf(stderr, "Transmission of %s complete.\n", xfer->filename);
+
+               /* in checksum mode the client checks its copy against our file hash */
+               if ((xfer->options & TS_OPT_CHECKSUM) && (ttp_send_digest(session) < 0))
+                   warn("Could not send the file digest");
+
+               finish_hook(session);
+               break;
+
+            /* otherwise, handle the retransmission */
+            } else {
+                status = ttp_accept_retransmit(session, &retransmission, datagram);
+                if (status < 0)
+                    warn("Retransmission error");
+            }
+            retransmitlen = 0;
+
+        /* if a parity block is ready, it takes the slot of the next original */
+        } else if ((retransmitlen < sizeof(retransmission_t)) && xfer->fec.pending) {
+
+            xfer->fec.pending = 0;
+            xfer->sent_size   = xfer->datagram_size;
+            status = sendto(xfer->udp_fd, xfer->fec.datagram, xfer->sent_size, 0, xfer->udp_address, xfer->udp_length);
+            if (status < 0)
+                warn("Could not transmit parity block");
+            else
+                xfer->fec.sent++;
+
+        /* if we have no retransmission */
+        } else if (retransmitlen < sizeof(retransmission_t)) {
+
+            /* a followed file that has not grown gets its last block again, which keeps the feedback coming */
+            if (xfer->follow.open && (xfer->block == param->block_count)) {
+                status = follow_poll(session);
+                if (status < 0)
+                    error("Could not follow the growing file");
+                if (status == 0)
+                    usleep_that_works(FOLLOW_PERIOD);
+                if ((status == 0) && (xfer->block == 0)) {
+                    lastfeedback = currpacketT;  /* nothing for the client to answer yet */
+                    continue;
+                }
+            }
+
+            /* build the block */
+            if (!xfer->follow.open || (xfer->block < param->block_count))
+                xfer->block = min(xfer->block + 1, param->block_count);
+            if (xfer->skip != NULL)
+                xfer->block = min(blockmap_next(xfer->skip, xfer->block, 0), param->block_count);
+            block_type = ((xfer->block == param->block_count) && !xfer->follow.open) ? TS_BLOCK_TERMINATE : TS_BLOCK_ORIGINAL;
+            status = build_datagram(session, xfer->block, block_type, datagram);
+            if (status < 0) {
+                sprintf(g_error, "Could not read block #%llu", (ull_t) xfer->block);
+                error(g_error);
+            }
+            xfer->sent_size = status;
+
+            /* transmit the block */
+            status = sendto(xfer->udp_fd, datagram, xfer->sent_size, 0, xfer->udp_address, xfer->udp_length);
+            if (status < 0) {
+                sprintf(g_error, "Could not transmit block #%llu", (ull_t) xfer->block);
+                warn(g_error);
+                continue;
+            }
+
+            /* and add it to the parity of its group */
+            if (xfer->options & TS_OPT_FEC)
+                parity_add(session, datagram, xfer->sent_size);
+
+        /* if we have too long retransmission message */
+        } else if (retransmitlen > sizeof(retransmission_t)) {
+
+            fprintf(stderr, "warn: retransmitlen > %d\n", (int)sizeof(retransmission_t));
+            retransmitlen = 0;
+
+        }
+
+        /* monitor client heartbeat and disconnect dead client */
+        if ((deadconnection_counter++) > 2048) {
+            char stats_line[160];
+
+            deadconnection_counter = 0;
+
+            /* limit 'heartbeat lost' reports to 500ms intervals */
+            if (get_usec_since(&lasthblostreport) < 500000.0) continue;
+            gettimeofday(&lasthblostreport, NULL);
+
+            /* throttle IPD with fake 100% loss report */
+            #ifndef VSIB_REALTIME
+            retransmission.request_type = htons(REQUEST_ERROR_RATE);
+            retransmission.error_rate   = htonl(100000);
+            retransmission.block = 0;
+            ttp_accept_retransmit(session, &retransmission, datagram);
+            #endif
+
+            delta = get_usec_since(&lastfeedback);
+
+            /* show an (additional) statistics line */
+            snprintf(stats_line, sizeof(stats_line)-1,
+                                "   n/a     n/a     n/a %7llu %6.2f %3u -- no heartbeat since %3.2fs\n",
+                                (ull_t) xfer->block, 100.0 * xfer->block / param->block_count, session->session_id,
+                                1e-6*delta);
+            if (param->transcript_yn)
+               xscript_data_log(session, stats_line);
+            fprintf(stderr, "%s", stats_line);
+
+            /* handle timeout for normal file transfers */
+            #ifndef VSIB_REALTIME
+            if ((1e-6 * delta) > param->hb_timeout) {
+                fprintf(stderr, "Heartbeat timeout of %d seconds reached, terminating transfer.\n", param->hb_timeout);
+                break;
+            }
+            #else
+            /* handle timeout condition for : realtime with local backup, simple realtime */
+            if ((1e-6 * delta) > param->hb_timeout) {
+                if ((session->parameter->fileout) && (block_type == TS_BLOCK_TERMINATE)) {
+                    fprintf(stderr, "Reached the Terminate block and timed out, terminating transfer.\n");
+                    break;
+                } else if(!session->parameter->fileout) {
+                    fprintf(stderr, "Heartbeat timeout of %d seconds reached and not doing local backup, terminating transfer now.\n", param->hb_timeout);
+                    break;
+                } else {
+                    lastfeedback = currpacketT;
+                }
+            }
+            #endif
+        }
+
+         /* wait before handling the next packet */
+         if (block_type == TS_BLOCK_TERMINATE) {
+             usleep_that_works(10*ipd_time_max);
+         }
+         if (ipd_time > 0) {
+             usleep_that_works(ipd_time);
+         }
+
+    }
+
+    /*---------------------------
+     * STOP TIMING
+     *---------------------------*/
+    gettimeofday(&stop, NULL);
+    if (param->transcript_yn)
+        xscript_data_stop(session, &stop);
+    delta = 1000000LL * (stop.tv_sec - start.tv_sec) + stop.tv_usec - start.tv_usec;
+
+    /* report on the transfer */
+    if (param->verbose_yn)
+        fprintf(stderr, "Server %d transferred %llu bytes in %0.2f seconds (%0.1f Mbps)\n",
+                session->session_id, (ull_t)param->file_size, delta / 1000000.0, 
+                8.0 * param->file_size / (delta * 1e-6 * 1024*1024) );
+    if (param->verbose_yn && (xfer->options & TS_OPT_COMPRESS))
+        fprintf(stderr, "Server %d sent %llu blocks packed, %llu bytes as %llu\n",
+                session->session_id, (ull_t) xfer->compress.blocks,
+                (ull_t) xfer->compress.raw, (ull_t) xfer->compress.packed);
+    if (param->verbose_yn && (xfer->options & TS_OPT_FEC))
+        fprintf(stderr, "Server %d sent %llu parity blocks\n",
+                session->session_id, (ull_t) xfer->fec.sent);
+
+    /* close the transcript */
+    if (param->transcript_yn)
+        xscript_close(session, delta);
+
+    #ifdef VSIB_REALTIME
+
+    /* VSIB local disk copy: close file only if file output was requested */
+    if (param->fileout) {
+        fclose(xfer->file);
+    }
+
+    /* stop the VSIB */
+    stop_vsib(session);
+    fclose(xfer->vsib);
+
+    #endif
+
+    /* close the file, keeping the UDP socket for the next transfer */
+    ttp_close_transfer(session);
+
+    } //while(1)
+
+    /* the session is over, and its UDP socket with it */
+    if (session->udp_fd >= 0)
+        close(session->udp_fd);
+    session->udp_fd = -1;
+}
+
+
+/*------------------------------------------------------------------------
+ * void finish_hook(ttp_session_t *session);
+ *
+ * Runs the command given with --finishhook on the file just sent, if
+ * there is one.
+ *------------------------------------------------------------------------*/
+void finish_hook(ttp_session_t *session)
+{
+    ttp_parameter_t *param = session->parameter;
+
+    if(param->finishhook)
+    {
+        const int MaxCommandLength = 1024;
+        char cmd[MaxCommandLength];
+        int v;
+
+        v = snprintf(cmd, MaxCommandLength, "%s %s", param->finishhook, session->transfer.filename);
+        if(v >= MaxCommandLength)
+        {
+            fprintf(stderr, "Error: command buffer too short\n");
+        }
+        else
+        {
+            fprintf(stderr, "Executing: %s\n", cmd);
+            system(cmd);
+        }
+    }
+}
+
+
+/*========================================================================
+ * $Log: handler.c,v $
+ */
@@ -60,61 +60,252 @@
  * INFORMATION GENERATED USING SOFTWARE.
  *========================================================================*/
 
+#include <string.h>      /* for memcpy()                          */
+
 #include <tsunami-server.h>
 
 
 /*------------------------------------------------------------------------
- * int build_datagram(ttp_session_t *session, u_int32_t block_index,
+ * void append_checksum(ttp_session_t *session, u_char *datagram,
+ *                      u_int32_t length);
+ *
+ * Stores the CRC32C of the first length bytes of the given datagram,
+ * its header and data, right after them.
+ *------------------------------------------------------------------------*/
+static void append_checksum(ttp_session_t *session, u_char *datagram, u_int32_t length)
+{
+    u_int32_t crc = htonl(crc32c(0, datagram, length));
+
+    memcpy(datagram + length, &crc, TS_CRC_SIZE);
+}
+
+
+#ifndef DEBUG_DISKLESS
+/*------------------------------------------------------------------------
+ * u_int32_t pack_datagram(ttp_session_t *session, u_int64_t block_index,
+ *                         u_char *datagram, u_int32_t bytes);
+ *
+ * Replaces the data of the given datagram, of which the first bytes
+ * were read from the file, with the TS_PACKED_SIZE length and the data
+ * packed by compress_block(), and flags the block type, if the block
+ * lies in a region where compression pays and it packs smaller.  The
+ * first COMPRESS_SAMPLE blocks sent from each region are always packed
+ * and timed; compression is then left on for the region only if they
+ * shrank below COMPRESS_GAIN and packing a block took less time than
+ * the inter-packet delay left for it at the current rate.  Returns the
+ * length of the datagram header and data.
+ *------------------------------------------------------------------------*/
+static u_int32_t pack_datagram(ttp_session_t *session, u_int64_t block_index,
+			       u_char *datagram, u_int32_t bytes)
+{
+    ttp_transfer_t *xfer   = &session->transfer;
+    compress_t     *pack   = &xfer->compress;
+    u_int32_t       length = TS_HEADER_SIZE + session->parameter->block_size;
+    u_int64_t       region = (block_index - 1) / COMPRESS_REGION;
+    struct timeval  start;
+    u_int32_t       packed;
+    u_int16_t       size;
+    double          ratio;
+
+    /* leave blocks of unpromising regions alone */
+    if ((bytes == 0) || (block_index == 0) || (block_index > session->parameter->block_count) ||
+        (pack->region[region] == COMPRESS_OFF))
+        return length;
+
+    /* sample the first undecided region that comes along */
+    if ((pack->region[region] == 0) && (pack->sampling == 0)) {
+        pack->sampling      = region + 1;
+        pack->samples       = 0;
+        pack->sample_raw    = 0;
+        pack->sample_packed = 0;
+        pack->sample_usec   = 0;
+    }
+
+    /* pack the block, worth it only if it saves a byte */
+    gettimeofday(&start, NULL);
+    packed = compress_block(datagram + TS_HEADER_SIZE, bytes, pack->buffer,
+                            session->parameter->block_size - TS_PACKED_SIZE - 1);
+
+    /* decide on the region once enough of it has been sampled */
+    if (pack->sampling == region + 1) {
+        pack->sample_usec   += get_usec_since(&start);
+        pack->sample_raw    += bytes;
+        pack->sample_packed += packed ? (TS_PACKED_SIZE + packed) : bytes;
+        if (++pack->samples == COMPRESS_SAMPLE) {
+            ratio = (double) pack->sample_packed / pack->sample_raw;
+            pack->region[region] = ((ratio <= COMPRESS_GAIN) &&
+                                    ((double) pack->sample_usec / COMPRESS_SAMPLE < xfer->ipd_current * ratio))
+                                 ? COMPRESS_ON : COMPRESS_OFF;
+            pack->sampling = 0;
+        }
+    }
+    if (packed == 0)
+        return length;
+
+    /* store the packed block in place of the data */
+    size = htons((u_int16_t) packed);
+    memcpy(datagram + TS_HEADER_SIZE, &size, TS_PACKED_SIZE);
+    memcpy(datagram + TS_HEADER_SIZE + TS_PACKED_SIZE, pack->buffer, packed);
+    *((u_int16_t *) (datagram + 8)) |= htons(TS_BLOCK_COMPRESSED);
+    ++pack->blocks;
+    pack->raw    += bytes;
+    pack->packed += TS_PACKED_SIZE + packed;
+    return TS_HEADER_SIZE + TS_PACKED_SIZE + packed;
+}
+#endif
+
+
+/*------------------------------------------------------------------------
+ * int build_datagram(ttp_session_t *session, u_int64_t block_index,
  *                    u_int16_t block_type, u_char *datagram);
  *
  * Constructs to hold the given block of data, with the given type
  * stored in it.  The format of the datagram is:
  *
- *     32                    0
- *     +---------------------+
- *     |     block_number    |
- *     +----------+----------+
- *     |   type   |   data   |
- *     +----------+     :    |
- *     :     :          :    :
- *     +---------------------+
+ *     64                                          0
+ *     +-------------------------------------------+
+ *     |               block_number                |
+ *     +----------+----------+---------------------+
+ *     |   type   |   tag    |        data         |
+ *     +----------+----------+          :          |
+ *     :     :                    :                :
+ *     +-------------------------------------------+
  *
+ * The tag is that of the transfer, given to the client in the reply to
+ * its request.  The data is read through the source of the transfer,
+ * which is asked to read ahead SOURCE_PREFETCH bytes at a time as the
+ * blocks go out.
+ * In compression mode the data may be packed by pack_datagram(), and
+ * in checksum mode the CRC32C of all of the above follows the data.
  * The datagram is stored in the given buffer, which must be at least
- * six bytes longer than the block size for the transfer.  Returns 0 on
- * success and non-zero on failure.
+ * TS_HEADER_SIZE + TS_CRC_SIZE bytes longer than the block size for the
+ * transfer.  Returns the length of the datagram on success and a
+ * negative value on failure.
  *------------------------------------------------------------------------*/
-int build_datagram(ttp_session_t *session, u_int32_t block_index,
+int build_datagram(ttp_session_t *session, u_int64_t block_index,
 		   u_int16_t block_type, u_char *datagram)
 {
+    u_int32_t length = TS_HEADER_SIZE + session->parameter->block_size;
+
 #ifdef DEBUG_DISKLESS
     /* build the datagram header */
-    *((u_int32_t *) (datagram + 0)) = htonl(block_index);
-    *((u_int16_t *) (datagram + 4)) = htons(block_type);
-
-   return 0;
+    *((u_int64_t *) (datagram + 0)) = htonll(block_index);
+    *((u_int16_t *) (datagram + 8)) = htons(block_type);
+    *((u_int16_t *) (datagram + 10)) = htons(session->transfer.tag);
 #else
-    static u_int32_t last_block = 0;
+    ttp_transfer_t  *xfer = &session->transfer;
+    u_int64_t        ahead, first;
     int              status;
 
-    /* move the file pointer to the appropriate location */
-    if (block_index != (last_block + 1))
-	fseeko(session->transfer.file, ((u_int64_t) session->parameter->block_size) * (block_index - 1), SEEK_SET);
+    /* a relay can only send what the upstream hop has delivered */
+    if ((session->transfer.relay != NULL) && (relay_wait(session, block_index) < 0)) {
+	sprintf(g_error, "Block #%llu did not arrive from upstream", (ull_t) block_index);
+	return warn(g_error);
+    }
+
+    /* have the source read ahead once the blocks sent catch up with half of what it was asked for */
+    ahead = SOURCE_PREFETCH / session->parameter->block_size + 1;
+    if ((xfer->source->prefetch != NULL) && (block_index + ahead / 2 > xfer->prefetched) &&
+        (block_index <= session->parameter->block_count)) {
+        first = max(block_index, xfer->prefetched + 1);
+        xfer->source->prefetch(session, first, block_index + ahead - first);
+        xfer->prefetched = block_index + ahead - 1;
+    }
 
     /* try to read in the block */
-    status = fread(datagram + 6, 1, session->parameter->block_size, session->transfer.file);
+    status = xfer->source->read_block(session, block_index, datagram + TS_HEADER_SIZE);
     if (status < 0) {
-	sprintf(g_error, "Could not read block #%u", block_index);
+	sprintf(g_error, "Could not read block #%llu", (ull_t) block_index);
 	return warn(g_error);
     }
 
     /* build the datagram header */
-    *((u_int32_t *) (datagram + 0)) = htonl(block_index);
-    *((u_int16_t *) (datagram + 4)) = htons(block_type);
-
-    /* return success */
-    last_block = block_index;
-    return 0;
+    *((u_int64_t *) (datagram + 0)) = htonll(block_index);
+    *((u_int16_t *) (datagram + 8)) = htons(block_type);
+    *((u_int16_t *) (datagram + 10)) = htons(xfer->tag);
+    if (session->transfer.options & TS_OPT_COMPRESS)
+        length = pack_datagram(session, block_index, datagram, status);
 #endif
+
+    /* add the checksum and return the length */
+    if (session->transfer.options & TS_OPT_CHECKSUM) {
+        append_checksum(session, datagram, length);
+        length += TS_CRC_SIZE;
+    }
+    return length;
+}
+
+
+/*------------------------------------------------------------------------
+ * void close_parity(ttp_session_t *session);
+ *
+ * Closes the open parity group.  A group of two or more blocks becomes
+ * the parity datagram waiting to go out, replacing any that has not
+ * gone yet: its block number is the first block of the group, and its
+ * type carries the number of blocks and the XOR of their packed flags.
+ *------------------------------------------------------------------------*/
+static void close_parity(ttp_session_t *session)
+{
+    fec_t  *fec = &session->transfer.fec;
+    u_char *swap;
+
+    if (fec->count >= 2) {
+        *((u_int64_t *) (fec->sum + 0)) = htonll(fec->first);
+        *((u_int16_t *) (fec->sum + 8)) = htons(TS_BLOCK_PARITY | (fec->count << TS_PARITY_SHIFT) | fec->packed);
+        *((u_int16_t *) (fec->sum + 10)) = htons(session->transfer.tag);
+        if (session->transfer.options & TS_OPT_CHECKSUM)
+            append_checksum(session, fec->sum, TS_HEADER_SIZE + session->parameter->block_size);
+        swap          = fec->datagram;
+        fec->datagram = fec->sum;
+        fec->sum      = swap;
+        fec->pending  = 1;
+    }
+
+    memset(fec->sum, 0, session->transfer.datagram_size);
+    fec->count  = 0;
+    fec->packed = 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * void parity_add(ttp_session_t *session, const u_char *datagram,
+ *                 u_int32_t length);
+ *
+ * Adds the original block in the given datagram, just sent with the
+ * given length, to the XOR parity of its group, the data being taken
+ * as zeros past the length.  A group holds consecutive blocks only, and
+ * is closed when it reaches the current group size, at the last block
+ * of the file, or when an original does not follow on from it.
+ *------------------------------------------------------------------------*/
+void parity_add(ttp_session_t *session, const u_char *datagram, u_int32_t length)
+{
+    fec_t     *fec   = &session->transfer.fec;
+    u_int64_t  block = ntohll(*((u_int64_t *) datagram));
+    u_int16_t  type  = ntohs(*((u_int16_t *) (datagram + 8)));
+    u_int32_t  i;
+
+    /* the terminating block goes out again and again, but counts once */
+    if (block == fec->last)
+        return;
+    fec->last = block;
+
+    /* a block that does not follow on starts a new group */
+    if (fec->count && (block != fec->first + fec->count))
+        close_parity(session);
+    if (fec->count == 0)
+        fec->first = block;
+
+    /* add the data as it was sent */
+    if (session->transfer.options & TS_OPT_CHECKSUM)
+        length -= TS_CRC_SIZE;
+    for (i = TS_HEADER_SIZE; i < length; ++i)
+        fec->sum[i] ^= datagram[i];
+    if (type & TS_BLOCK_COMPRESSED)
+        fec->packed ^= TS_PARITY_PACKED;
+
+    /* close the group when it is full */
+    if ((++fec->count >= fec->group) || (block == session->parameter->block_count))
+        close_parity(session);
 }
 
 
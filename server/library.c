@@ -0,0 +1,299 @@
+/*========================================================================
+ * library.c  --  Library interface of Tsunami server.
+ *
+ * This contains the server calls of libtsunami.h, which serve the
+ * file requests of a client on a connection that the calling program
+ * accepted, in the calling thread, with the files the program shares
+ * from memory or through callbacks besides the local ones, and with
+ * fatal errors caught and returned.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <setjmp.h>     /* for setjmp()                 */
+#include <stdio.h>      /* for snprintf()               */
+#include <stdlib.h>     /* for calloc(), free(), atoi() */
+#include <string.h>     /* for strdup(), strcasecmp()   */
+#include <unistd.h>     /* for close()                  */
+
+#include <tsunami-server.h>
+#include <libtsunami.h>
+
+
+/*------------------------------------------------------------------------
+ * Data structures.
+ *------------------------------------------------------------------------*/
+
+/* a server of the library */
+struct ts_server {
+    ttp_parameter_t     parameter;      /* the settings each connection starts from   */
+    char               *secret;         /* the shared secret set, NULL for the default */
+    char               *client;         /* the alternate client address set, if any   */
+    char               *finishhook;     /* the finish hook set, if any                */
+    int                 sessions;       /* the number of connections served           */
+    char                error[MAX_ERROR_MESSAGE];  /* the message of the last error   */
+};
+
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static int  server_string  (char **field, const char *value);
+
+
+/*------------------------------------------------------------------------
+ * ts_server_t *ts_server_create(void);
+ *
+ * Returns a new server with the default settings of the tsunamid
+ * program, except that it is quiet, or NULL if there is no memory.
+ *------------------------------------------------------------------------*/
+ts_server_t *ts_server_create(void)
+{
+    ts_server_t *server = (ts_server_t *) calloc(1, sizeof(ts_server_t));
+
+    if (server == NULL)
+        return NULL;
+    reset_server(&server->parameter);
+    server->parameter.verbose_yn = 0;
+    return server;
+}
+
+
+/*------------------------------------------------------------------------
+ * void ts_server_destroy(ts_server_t *server);
+ *
+ * Frees the given server and its list of shared buffers, but not the
+ * buffers themselves.
+ *------------------------------------------------------------------------*/
+void ts_server_destroy(ts_server_t *server)
+{
+    shared_memory_t *shared, *next;
+
+    if (server == NULL)
+        return;
+    for (shared = server->parameter.shared_memory; shared != NULL; shared = next) {
+        next = shared->next;
+        free(shared->name);
+        free(shared);
+    }
+    free(server->secret);
+    free(server->client);
+    free(server->finishhook);
+    free(server);
+}
+
+
+/*------------------------------------------------------------------------
+ * int ts_server_set(ts_server_t *server, const char *name,
+ *                   const char *value);
+ *
+ * Changes a setting of the server, by the names of the tsunamid
+ * options that make sense for a single connection: secret, client,
+ * finishhook, buffer, hbtimeout, followidle, and verbose, transcript
+ * and v6 with "yes" or "no".  Returns 0 on success and non-zero on
+ * failure.
+ *------------------------------------------------------------------------*/
+int ts_server_set(ts_server_t *server, const char *name, const char *value)
+{
+    ttp_parameter_t *param  = &server->parameter;
+    int              yes    = !strcmp(value, "yes");
+    int              status = 0;
+
+    if (!strcasecmp(name, "secret")) {
+        status = server_string(&server->secret, value);
+        param->secret = (const u_char *) server->secret;
+    } else if (!strcasecmp(name, "client")) {
+        status = server_string(&server->client, value);
+        param->client = server->client;
+    } else if (!strcasecmp(name, "finishhook")) {
+        status = server_string(&server->finishhook, value);
+        param->finishhook = (const u_char *) server->finishhook;
+    }
+    else if (!strcasecmp(name, "buffer"))     param->udp_buffer    = atoi(value);
+    else if (!strcasecmp(name, "hbtimeout"))  param->hb_timeout    = atoi(value);
+    else if (!strcasecmp(name, "followidle")) param->follow_idle   = atoi(value);
+    else if (!strcasecmp(name, "verbose"))    param->verbose_yn    = yes;
+    else if (!strcasecmp(name, "transcript")) param->transcript_yn = yes;
+    else if (!strcasecmp(name, "v6"))         param->ipv6_yn       = yes;
+    else {
+        snprintf(server->error, sizeof(server->error), "No such setting: %s", name);
+        return -1;
+    }
+
+    if (status < 0)
+        snprintf(server->error, sizeof(server->error), "Could not store the %s setting", name);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ts_server_share_memory(ts_server_t *server, const char *name,
+ *                            const u_char *data, u_int64_t size);
+ *
+ * Shares the given buffer of the given size, which clients then get as
+ * "memory:" and the given name.  The buffer has to stay as it is while
+ * the server serves it.  Returns 0 on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ts_server_share_memory(ts_server_t *server, const char *name, const u_char *data, u_int64_t size)
+{
+    shared_memory_t *shared = (shared_memory_t *) calloc(1, sizeof(shared_memory_t));
+
+    if (shared != NULL)
+        shared->name = strdup(name);
+    if ((shared == NULL) || (shared->name == NULL)) {
+        free(shared);
+        snprintf(server->error, sizeof(server->error), "Could not allocate the shared buffer entry");
+        return -1;
+    }
+    shared->data = data;
+    shared->size = size;
+    shared->next = server->parameter.shared_memory;
+    server->parameter.shared_memory = shared;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * void ts_server_share_callback(ts_server_t *server, ts_size_fn size,
+ *                               ts_read_fn read, void *user);
+ *
+ * Has the server serve the files that clients get as "callback:" and
+ * a name by asking the given callbacks, with the given argument, for
+ * their sizes and data.
+ *------------------------------------------------------------------------*/
+void ts_server_share_callback(ts_server_t *server, ts_size_fn size, ts_read_fn read, void *user)
+{
+    server->parameter.size_callback = size;
+    server->parameter.read_callback = read;
+    server->parameter.callback_user = user;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ts_server_serve(ts_server_t *server, int client_fd);
+ *
+ * Serves the file requests of the client on the given connection until
+ * it ends the session, in the calling thread.  The connection stays
+ * open for the caller to close.  Every connection starts from the
+ * settings of the server and negotiates its own block size and rates,
+ * so that several threads can serve with the same server at once.
+ * Returns 0 once the client is done and non-zero on a fatal error.
+ *------------------------------------------------------------------------*/
+int ts_server_serve(ts_server_t *server, int client_fd)
+{
+    ttp_parameter_t  parameter = server->parameter;
+    ttp_session_t    session;
+    jmp_buf          trap;
+    jmp_buf         *outer = g_error_trap;
+    int              status;
+
+    memset(&session, 0, sizeof(session));
+    session.client_fd  = client_fd;
+    session.parameter  = &parameter;
+    session.session_id = __sync_add_and_fetch(&server->sessions, 1);
+    session.udp_fd     = -1;
+
+    g_error[0]   = '\0';
+    g_error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        client_handler(&session);
+        status = 0;
+    } else {
+        /* give back what the transfer in progress held on to */
+        ttp_close_transfer(&session);
+        if (session.udp_fd >= 0)
+            close(session.udp_fd);
+        snprintf(server->error, sizeof(server->error), "%s", g_error);
+        status = -1;
+    }
+    g_error_trap = outer;
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * const char *ts_server_error(const ts_server_t *server);
+ *
+ * Returns the message of the last call of the server that failed.
+ *------------------------------------------------------------------------*/
+const char *ts_server_error(const ts_server_t *server)
+{
+    return server->error;
+}
+
+
+/*------------------------------------------------------------------------
+ * static int server_string(char **field, const char *value);
+ *
+ * Replaces the string in the given field with a copy of the given
+ * value.  Returns 0 on success and non-zero if there is no memory.
+ *------------------------------------------------------------------------*/
+static int server_string(char **field, const char *value)
+{
+    char *copy = strdup(value);
+
+    if (copy == NULL)
+        return -1;
+    free(*field);
+    *field = copy;
+    return 0;
+}
+
+
+/*========================================================================
+ * $Log: library.c,v $
+ */
@@ -86,7 +86,6 @@
  * Function prototypes (module scope).
  *------------------------------------------------------------------------*/
 
-void client_handler (ttp_session_t *session);
 void process_options(int argc, char *argv[], ttp_parameter_t *parameter);
 void reap           (int signum);
 
@@ -110,6 +109,13 @@ int main(int argc, char *argv[])
     /* process our command-line options */
     process_options(argc, argv, &parameter);
 
+    /* set up the multicast stream shared by our children */
+    if (parameter.mcast_group != 0) {
+        parameter.multicast = mcast_create();
+        if (parameter.multicast == NULL)
+            return error("Could not create the multicast stream state");
+    }
+
     /* obtain our server socket */
     server_fd = create_tcp_socket(&parameter);
     if (server_fd < 0) {
@@ -162,8 +168,11 @@ int main(int argc, char *argv[])
             /* set up the session structure */
             session.client_fd = client_fd;
             session.parameter = &parameter;
+            session.udp_fd    = -1;
+            session.path_block_size = 0;
             memset(&session.transfer, 0, sizeof(session.transfer));
             session.transfer.ipd_current = 0.0;
+            session.transfer.ipd_flow    = 0.0;
 
             /* and run the client handler */
             client_handler(&session);
@@ -179,294 +188,6 @@ int main(int argc, char *argv[])
 }
 
 
-/*------------------------------------------------------------------------
- * void client_handler(ttp_session_t *session);
- *
- * This routine is run by the client processes that are created in
- * response to incoming connections.
- *------------------------------------------------------------------------*/
-void client_handler(ttp_session_t *session)
-{
-    retransmission_t  retransmission;                /* the retransmission data object                 */
-    struct timeval    start, stop;                   /* the start and stop times for the transfer      */
-    struct timeval    prevpacketT;                   /* the send time of the previous packet           */
-    struct timeval    currpacketT;                   /* the interpacket delay value                    */
-    struct timeval    lastfeedback;                  /* the time since last client feedback            */
-    struct timeval    lasthblostreport;              /* the time since last 'heartbeat lost' report    */
-    u_int32_t         deadconnection_counter;        /* the counter for checking dead conn timeout     */
-    int               retransmitlen;                 /* number of bytes read from retransmission queue */
-    u_char            datagram[MAX_BLOCK_SIZE + 6];  /* the datagram containing the file block         */
-    int64_t           ipd_time;                      /* the time to delay/sleep after packet, signed   */
-    int64_t           ipd_usleep_diff;               /* the time correction to ipd_time, signed        */
-    int64_t           ipd_time_max;
-    int               status;
-    ttp_transfer_t   *xfer  = &session->transfer;
-    ttp_parameter_t  *param =  session->parameter;
-    u_int64_t         delta;
-    u_char            block_type;
-
-    /* negotiate the connection parameters */
-    status = ttp_negotiate(session);
-    if (status < 0)
-        error("Protocol revision number mismatch");
-
-    /* have the client try to authenticate to us */
-    status = ttp_authenticate(session, session->parameter->secret);
-    if (status < 0)
-        error("Client authentication failure");
-
-    if (1==param->verbose_yn) {
-        fprintf(stderr,"Client authenticated. Negotiated parameters are:\n");
-        fprintf(stderr,"Block size: %d\n", param->block_size);
-        fprintf(stderr,"Buffer size: %d\n", param->udp_buffer); 
-        fprintf(stderr,"Port: %d\n", param->tcp_port);    
-    }
-
-    /* while we haven't been told to stop */
-    while (1) {
-
-    /* make the client descriptor blocking */
-    status = fcntl(session->client_fd, F_SETFL, 0);
-    if (status < 0)
-        error("Could not make client socket blocking");
-
-    /* negotiate another transfer */
-    status = ttp_open_transfer(session);
-    if (status < 0) {
-        warn("Invalid file request");
-        continue;
-    }
-
-    /* negotiate a data transfer port */
-    status = ttp_open_port(session);
-    if (status < 0) {
-        warn("UDP socket creation failed");
-        continue;
-    }
-
-    /* make the client descriptor non-blocking again */
-    status = fcntl(session->client_fd, F_SETFL, O_NONBLOCK);
-    if (status < 0)
-        error("Could not make client socket non-blocking");
-
-    /*---------------------------
-     * START TIMING
-     *---------------------------*/
-    gettimeofday(&start, NULL);
-    if (param->transcript_yn)
-        xscript_data_start(session, &start);
-
-    lasthblostreport       = start;
-    lastfeedback           = start;
-    prevpacketT            = start;
-    deadconnection_counter = 0;
-    ipd_time               = 0;
-    ipd_time_max           = 0;
-    ipd_usleep_diff        = 0;
-    retransmitlen          = 0;
-
-    /* start by blasting out every block */
-    xfer->block = 0;
-    while (xfer->block <= param->block_count) {
-
-        /* default: flag as retransmitted block */
-        block_type = TS_BLOCK_RETRANSMISSION;
-
-        /* precalculate time to wait after sending the next packet */
-        gettimeofday(&currpacketT, NULL);
-        ipd_usleep_diff = xfer->ipd_current + tv_diff_usec(prevpacketT, currpacketT);
-        prevpacketT = currpacketT;
-        if (ipd_usleep_diff > 0 || ipd_time > 0) {
-            ipd_time += ipd_usleep_diff;
-        }
-        ipd_time_max = (ipd_time > ipd_time_max) ? ipd_time : ipd_time_max;
-
-        /* see if transmit requests are available */
-        status = read(session->client_fd, ((char*)&retransmission)+retransmitlen, sizeof(retransmission)-retransmitlen);
-        #ifndef VSIB_REALTIME
-        if ((status <= 0) && (errno != EAGAIN))
-            error("Retransmission read failed");
-        #else
-        if ((status <= 0) && (errno != EAGAIN) && (!session->parameter->fileout))
-            error("Retransmission read failed and not writing local backup file");
-        #endif
-        if (status > 0)
-            retransmitlen += status;
-
-        /* if we have a retransmission */
-        if (retransmitlen == sizeof(retransmission_t)) {
-
-            /* store current time */
-            lastfeedback           = currpacketT;
-            lasthblostreport       = currpacketT;
-            deadconnection_counter = 0;
-
-            /* if it's a stop request, go back to waiting for a filename */
-            if (ntohs(retransmission.request_type) == REQUEST_STOP) {
-
-               fprintf(stderr, "Transmission of %s complete.\n", xfer->filename);
-
-               if(param->finishhook)
-               {
-                   const int MaxCommandLength = 1024;
-                   char cmd[MaxCommandLength];
-                   int v;
-
-                   v = snprintf(cmd, MaxCommandLength, "%s %s", param->finishhook, xfer->filename);
-                   if(v >= MaxCommandLength)
-                   {
-                       fprintf(stderr, "Error: command buffer too short\n");
-                   }
-                   else
-                   {
-                       fprintf(stderr, "Executing: %s\n", cmd);
-                       system(cmd);
-                   }
-                }
-
-                break;
-            }
-
-            /* otherwise, handle the retransmission */
-            status = ttp_accept_retransmit(session, &retransmission, datagram);
-            if (status < 0)
-                warn("Retransmission error");
-            retransmitlen = 0;
-
-        /* if we have no retransmission */
-        } else if (retransmitlen < sizeof(retransmission_t)) {
-
-            /* build the block */
-            xfer->block = min(xfer->block + 1, param->block_count);
-            block_type = (xfer->block == param->block_count) ? TS_BLOCK_TERMINATE : TS_BLOCK_ORIGINAL;
-            status = build_datagram(session, xfer->block, block_type, datagram);
-            if (status < 0) {
-                sprintf(g_error, "Could not read block #%u", xfer->block);
-                error(g_error);
-            }
-
-            /* transmit the block */
-            status = sendto(xfer->udp_fd, datagram, 6 + param->block_size, 0, xfer->udp_address, xfer->udp_length);
-            if (status < 0) {
-                sprintf(g_error, "Could not transmit block #%u", xfer->block);
-                warn(g_error);
-                continue;
-            }
-
-        /* if we have too long retransmission message */
-        } else if (retransmitlen > sizeof(retransmission_t)) {
-
-            fprintf(stderr, "warn: retransmitlen > %d\n", (int)sizeof(retransmission_t));
-            retransmitlen = 0;
-
-        }
-
-        /* monitor client heartbeat and disconnect dead client */
-        if ((deadconnection_counter++) > 2048) {
-            char stats_line[160];
-
-            deadconnection_counter = 0;
-
-            /* limit 'heartbeat lost' reports to 500ms intervals */
-            if (get_usec_since(&lasthblostreport) < 500000.0) continue;
-            gettimeofday(&lasthblostreport, NULL);
-
-            /* throttle IPD with fake 100% loss report */
-            #ifndef VSIB_REALTIME
-            retransmission.request_type = htons(REQUEST_ERROR_RATE);
-            retransmission.error_rate   = htonl(100000);
-            retransmission.block = 0;
-            ttp_accept_retransmit(session, &retransmission, datagram);
-            #endif
-
-            delta = get_usec_since(&lastfeedback);
-
-            /* show an (additional) statistics line */
-            snprintf(stats_line, sizeof(stats_line)-1,
-                                "   n/a     n/a     n/a %7u %6.2f %3u -- no heartbeat since %3.2fs\n",
-                                xfer->block, 100.0 * xfer->block / param->block_count, session->session_id,
-                                1e-6*delta);
-            if (param->transcript_yn)
-               xscript_data_log(session, stats_line);
-            fprintf(stderr, "%s", stats_line);
-
-            /* handle timeout for normal file transfers */
-            #ifndef VSIB_REALTIME
-            if ((1e-6 * delta) > param->hb_timeout) {
-                fprintf(stderr, "Heartbeat timeout of %d seconds reached, terminating transfer.\n", param->hb_timeout);
-                break;
-            }
-            #else
-            /* handle timeout condition for : realtime with local backup, simple realtime */
-            if ((1e-6 * delta) > param->hb_timeout) {
-                if ((session->parameter->fileout) && (block_type == TS_BLOCK_TERMINATE)) {
-                    fprintf(stderr, "Reached the Terminate block and timed out, terminating transfer.\n");
-                    break;
-                } else if(!session->parameter->fileout) {
-                    fprintf(stderr, "Heartbeat timeout of %d seconds reached and not doing local backup, terminating transfer now.\n", param->hb_timeout);
-                    break;
-                } else {
-                    lastfeedback = currpacketT;
-                }
-            }
-            #endif
-        }
-
-         /* wait before handling the next packet */
-         if (block_type == TS_BLOCK_TERMINATE) {
-             usleep_that_works(10*ipd_time_max);
-         }
-         if (ipd_time > 0) {
-             usleep_that_works(ipd_time);
-         }
-
-    }
-
-    /*---------------------------
-     * STOP TIMING
-     *---------------------------*/
-    gettimeofday(&stop, NULL);
-    if (param->transcript_yn)
-        xscript_data_stop(session, &stop);
-    delta = 1000000LL * (stop.tv_sec - start.tv_sec) + stop.tv_usec - start.tv_usec;
-
-    /* report on the transfer */
-    if (param->verbose_yn)
-        fprintf(stderr, "Server %d transferred %llu bytes in %0.2f seconds (%0.1f Mbps)\n",
-                session->session_id, (ull_t)param->file_size, delta / 1000000.0, 
-                8.0 * param->file_size / (delta * 1e-6 * 1024*1024) );
-
-    /* close the transcript */
-    if (param->transcript_yn)
-        xscript_close(session, delta);
-
-    #ifndef VSIB_REALTIME
-
-    /* close the file */
-    fclose(xfer->file);
-
-    #else
-
-    /* VSIB local disk copy: close file only if file output was requested */
-    if (param->fileout) {
-        fclose(xfer->file);
-    }
-
-    /* stop the VSIB */
-    stop_vsib(session);
-    fclose(xfer->vsib);
-
-    #endif
-
-    /* close the UDP socket */
-    close(xfer->udp_fd);
-    memset(xfer, 0, sizeof(*xfer));
-
-    } //while(1)
-
-}
-
-
 /*------------------------------------------------------------------------
  * void process_options(int argc, char *argv[],
  *                      ttp_parameter_t *parameter);
@@ -487,12 +208,20 @@ void process_options(int argc, char *argv[], ttp_parameter_t *parameter)
                      { "client",     1, NULL, 'c' },
                      { "finishhook", 1, NULL, 'f' },
                      { "allhook",    1, NULL, 'a' },
+                     { "multicast",  1, NULL, 'm' },
+                     { "mcttl",      1, NULL, 'T' },
+                     { "mcwait",     1, NULL, 'w' },
+                     { "relay",      1, NULL, 'r' },
+                     { "relaysecret", 1, NULL, 'R' },
+                     { "followidle", 1, NULL, 'i' },
                      #ifdef VSIB_REALTIME
                      { "vsibmode",   1, NULL, 'M' },
                      { "vsibskip",   1, NULL, 'S' },
                      #endif
                      { NULL,         0, NULL, 0 } };
     struct stat   filestat;
+    struct in_addr group;
+    char         *port;
     int           which;
 
     /* for each option found */
@@ -541,6 +270,44 @@ void process_options(int argc, char *argv[], ttp_parameter_t *parameter)
         case 'h': parameter->hb_timeout = atoi(optarg);
              break;
 
+        /* --multicast=g[:p] : group (and port) to multicast files to */
+        case 'm':  port = strchr(optarg, ':');
+             if (port != NULL) {
+                 *port++ = '\0';
+                 parameter->mcast_port = atoi(port);
+             }
+             if (!inet_aton(optarg, &group) || !IN_MULTICAST(ntohl(group.s_addr))) {
+                 fprintf(stderr, "Not an IPv4 multicast group: %s\n", optarg);
+                 exit(1);
+             }
+             parameter->mcast_group = group.s_addr;
+             break;
+
+        /* --mcttl=i    : TTL of the multicast datagrams */
+        case 'T':  parameter->mcast_ttl = atoi(optarg);
+             break;
+
+        /* --mcwait=i   : seconds that clients have to join a multicast */
+        case 'w':  parameter->mcast_wait = atoi(optarg);
+             break;
+
+        /* --relay=h[:p] : server (and port) to relay files from */
+        case 'r':  parameter->relay_host = optarg;
+             port = strrchr(optarg, ':');
+             if ((port != NULL) && (strchr(optarg, ':') == port)) {
+                 *port++ = '\0';
+                 parameter->relay_port = atoi(port);
+             }
+             break;
+
+        /* --relaysecret=s : shared secret for the upstream server */
+        case 'R':  parameter->relay_secret = (unsigned char*)optarg;
+             break;
+
+        /* --followidle=i : seconds a growing file may stand still before it counts as complete */
+        case 'i':  parameter->follow_idle = atoi(optarg);
+             break;
+
         #ifdef VSIB_REALTIME
         /* --vsibmode=i   : size of socket buffer */
         case 'M':  vsib_mode = atoi(optarg);
@@ -555,6 +322,8 @@ void process_options(int argc, char *argv[], ttp_parameter_t *parameter)
         default: 
              fprintf(stderr, "Usage: tsunamid [--verbose] [--transcript] [--v6] [--port=n] [--buffer=bytes]\n");
              fprintf(stderr, "                [--hbtimeout=seconds] [--allhook=cmd] [--finishhook=cmd]\n");
+             fprintf(stderr, "                [--multicast=group[:port]] [--mcttl=n] [--mcwait=seconds]\n");
+             fprintf(stderr, "                [--relay=host[:port]] [--relaysecret=secret] [--followidle=seconds]\n");
 			 fprintf(stderr, "                ");
              #ifdef VSIB_REALTIME
              fprintf(stderr, "[--vsibmode=mode] [--vsibskip=skip] [filename1 filename2 ...]\n\n");
@@ -567,10 +336,16 @@ void process_options(int argc, char *argv[], ttp_parameter_t *parameter)
              fprintf(stderr, "port         : specifies which TCP port on which to listen to incoming connections\n");
              fprintf(stderr, "secret       : specifies the shared secret for the client and server\n");
              fprintf(stderr, "client       : specifies an alternate client IP or host where to send data\n");
-             fprintf(stderr, "buffer       : specifies the desired size for UDP socket send buffer (in bytes)\n");
+             fprintf(stderr, "buffer       : specifies the desired size for UDP socket send buffer (in bytes), 0 for auto\n");
              fprintf(stderr, "hbtimeout    : specifies the timeout in seconds for disconnect after client heartbeat lost\n");
 			 fprintf(stderr, "finishhook   : run command on transfer completion, file name is appended automatically\n");
 			 fprintf(stderr, "allhook      : run command on 'get *' to produce a custom file list for client downloads\n");			 
+             fprintf(stderr, "multicast    : specifies an IPv4 multicast group to send a file once to all clients that get it together\n");
+             fprintf(stderr, "mcttl        : specifies the TTL of the multicast datagrams\n");
+             fprintf(stderr, "mcwait       : specifies the seconds that clients have to join a multicast before it starts\n");
+             fprintf(stderr, "relay        : fetches every requested file from another server and forwards it as it arrives\n");
+             fprintf(stderr, "relaysecret  : specifies the shared secret for the server relayed from\n");
+             fprintf(stderr, "followidle   : specifies the seconds a file followed while it grows may stand still before it is complete, 0 to wait for its '%s' file\n", FOLLOW_SIDECAR);
              #ifdef VSIB_REALTIME
              fprintf(stderr, "vsibmode     : specifies the VSIB mode to use (see VSIB documentation for modes)\n");
              fprintf(stderr, "vsibskip     : a value N other than 0 will skip N samples after every 1 sample\n");
@@ -581,8 +356,14 @@ void process_options(int argc, char *argv[], ttp_parameter_t *parameter)
              fprintf(stderr, "          transcript = %d\n",   DEFAULT_TRANSCRIPT_YN);
              fprintf(stderr, "          v6         = %d\n",   DEFAULT_IPV6_YN);
              fprintf(stderr, "          port       = %d\n",   DEFAULT_TCP_PORT);
-             fprintf(stderr, "          buffer     = %d bytes\n",   DEFAULT_UDP_BUFFER);
+             fprintf(stderr, "          buffer     = auto, 2 x bandwidth-delay product but at least %d bytes\n",   DEFAULT_UDP_BUFFER);
              fprintf(stderr, "          hbtimeout  = %d seconds\n",   DEFAULT_HEARTBEAT_TIMEOUT);
+             fprintf(stderr, "          multicast  = none, port %d\n", TS_UDP_PORT);
+             fprintf(stderr, "          mcttl      = %d\n",   DEFAULT_MCAST_TTL);
+             fprintf(stderr, "          mcwait     = %d seconds\n",   DEFAULT_MCAST_WAIT);
+             fprintf(stderr, "          relay      = none, port %d\n", DEFAULT_TCP_PORT);
+             fprintf(stderr, "          relaysecret = secret\n");
+             fprintf(stderr, "          followidle = %d seconds\n",   DEFAULT_FOLLOW_IDLE);
              #ifdef VSIB_REALTIME
              fprintf(stderr, "          vsibmode   = %d\n",   0);
              fprintf(stderr, "          vsibskip   = %d\n",   0);
@@ -592,6 +373,10 @@ void process_options(int argc, char *argv[], ttp_parameter_t *parameter)
     }
     }
 
+    /* the upstream server of a relay shares our secret unless told otherwise */
+    if (parameter->relay_secret == NULL)
+        parameter->relay_secret = parameter->secret;
+
     if (argc>optind) {
         int counter;
         parameter->file_names = argv+optind;
@@ -610,7 +395,8 @@ void process_options(int argc, char *argv[], ttp_parameter_t *parameter)
 
     if (1==parameter->verbose_yn) {
        fprintf(stderr,"Block size: %d\n", parameter->block_size);
-       fprintf(stderr,"Buffer size: %d\n", parameter->udp_buffer);
+       if (parameter->udp_buffer) fprintf(stderr,"Buffer size: %d\n", parameter->udp_buffer);
+       else fprintf(stderr,"Buffer size: auto\n");
        fprintf(stderr,"Port: %d\n", parameter->tcp_port);
     }
 }
@@ -0,0 +1,533 @@
+/*========================================================================
+ * multicast.c  --  Multicast distribution routines for Tsunami server.
+ *
+ * This contains routines for sending one file to many clients at once.
+ * Clients that ask for the same file while it is being multicast join
+ * the running stream instead of starting a transfer of their own.  One
+ * sender process sends every block once to the multicast group, and
+ * the handler process of each client only passes that client's
+ * feedback on: retransmission requests are pooled and repaired once
+ * for all receivers, and the stream is paced for the slowest receiver.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <errno.h>       /* for the errno variable                */
+#include <signal.h>      /* for kill()                            */
+#include <stdlib.h>      /* for exit(), etc.                      */
+#include <string.h>      /* for memset(), strcmp(), etc.          */
+#include <sys/mman.h>    /* for mmap()                            */
+#include <sys/socket.h>  /* for the BSD sockets library           */
+#include <arpa/inet.h>   /* for inet_ntoa()                       */
+#include <unistd.h>      /* for fork(), read(), etc.              */
+
+#include <tsunami-server.h>
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static void mcast_lock (multicast_t *multicast);
+static int  mcast_post (multicast_t *multicast, u_int64_t block);
+static void mcast_send (ttp_session_t *session);
+
+
+/*------------------------------------------------------------------------
+ * multicast_t *mcast_create(void);
+ *
+ * Creates the multicast stream state in memory that the server keeps
+ * sharing with every client process it forks.  Returns a pointer to the
+ * new state, or NULL if it could not be set up.
+ *------------------------------------------------------------------------*/
+multicast_t *mcast_create(void)
+{
+    multicast_t         *multicast;
+    pthread_mutexattr_t  attr;
+
+    multicast = (multicast_t *) mmap(NULL, sizeof(*multicast), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (multicast == MAP_FAILED)
+        return NULL;
+    memset(multicast, 0, sizeof(*multicast));
+
+    /* the lock must survive a process that dies while holding it */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&multicast->lock, &attr) != 0) {
+        pthread_mutexattr_destroy(&attr);
+        munmap(multicast, sizeof(*multicast));
+        return NULL;
+    }
+    pthread_mutexattr_destroy(&attr);
+    return multicast;
+}
+
+
+/*------------------------------------------------------------------------
+ * int mcast_join(ttp_session_t *session);
+ *
+ * Makes the client of the given session a receiver of the multicast
+ * stream of its file, starting a new stream if none is running.  Later
+ * receivers take over the block size and MCAST_STREAM options of the
+ * stream.  If another file is being multicast, or the stream is full,
+ * the client gets an ordinary transfer.  Returns 0 if the client joined
+ * and non-zero otherwise.
+ *------------------------------------------------------------------------*/
+int mcast_join(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer      = &session->transfer;
+    ttp_parameter_t *param     = session->parameter;
+    multicast_t     *multicast = param->multicast;
+    int              slot;
+
+    xfer->mcast_slot = -1;
+    if (multicast == NULL) {
+        xfer->options &= ~TS_OPT_MULTICAST;
+        return -1;
+    }
+    mcast_lock(multicast);
+
+    /* only one file is multicast at a time */
+    if (multicast->active && strcmp(multicast->filename, xfer->filename)) {
+        pthread_mutex_unlock(&multicast->lock);
+        xfer->options &= ~TS_OPT_MULTICAST;
+        return warn("Another file is being multicast, sending to this client alone");
+    }
+
+    /* find a free member slot */
+    for (slot = 0; slot < MCAST_MEMBERS; ++slot)
+        if ((multicast->member[slot].pid == 0) || (kill(multicast->member[slot].pid, 0) < 0 && errno == ESRCH))
+            break;
+    if (slot == MCAST_MEMBERS) {
+        pthread_mutex_unlock(&multicast->lock);
+        xfer->options &= ~TS_OPT_MULTICAST;
+        return warn("The multicast stream is full, sending to this client alone");
+    }
+
+    /* found a new stream or fall in with the running one */
+    if (!multicast->active) {
+        strncpy(multicast->filename, xfer->filename, MAX_FILENAME_LENGTH - 1);
+        multicast->block_size   = param->block_size;
+        multicast->options      = xfer->options & MCAST_STREAM;
+        multicast->restart      = 0;
+        multicast->repair_head  = 0;
+        multicast->repair_count = 0;
+        multicast->active       = 1;
+    } else {
+        param->block_size = multicast->block_size;
+    }
+    xfer->options = (xfer->options & ~(MCAST_STREAM | MCAST_EXCLUDED)) | multicast->options;
+
+    memset(&multicast->member[slot], 0, sizeof(mcast_member_t));
+    multicast->member[slot].pid = getpid();
+    xfer->mcast_slot = slot;
+    pthread_mutex_unlock(&multicast->lock);
+
+    if (param->verbose_yn)
+        printf("Client joins the multicast of '%s' as receiver %d\n", xfer->filename, slot);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * void mcast_leave(ttp_session_t *session);
+ *
+ * Takes the client of the given session out of the multicast stream.
+ * The sender stops once the last receiver has left.
+ *------------------------------------------------------------------------*/
+void mcast_leave(ttp_session_t *session)
+{
+    multicast_t *multicast = session->parameter->multicast;
+
+    if (session->transfer.mcast_slot < 0)
+        return;
+    mcast_lock(multicast);
+    multicast->member[session->transfer.mcast_slot].pid = 0;
+    pthread_mutex_unlock(&multicast->lock);
+    session->transfer.mcast_slot = -1;
+}
+
+
+/*------------------------------------------------------------------------
+ * int mcast_serve(ttp_session_t *session);
+ *
+ * Serves the client of the given session while it receives from the
+ * multicast stream, starting the sender first if it is not running.
+ * Retransmission and restart requests are handed on to the sender,
+ * error rate and flow control reports set the pace this client allows.
+ * Returns 0 once the client asked us to stop and non-zero if we lost
+ * it.  Either way the client has left the stream afterwards.
+ *------------------------------------------------------------------------*/
+int mcast_serve(ttp_session_t *session)
+{
+    ttp_transfer_t   *xfer      = &session->transfer;
+    ttp_parameter_t  *param     = session->parameter;
+    multicast_t      *multicast = param->multicast;
+    mcast_member_t   *member    = &multicast->member[xfer->mcast_slot];
+    retransmission_t  retransmission;
+    u_char           *bitmap = (u_char *) &retransmission;
+    u_int64_t         block;
+    u_int32_t         blocks, bit;
+    u_int16_t         type;
+    ssize_t           length, status;
+    pid_t             sender;
+
+    /* start the sender if we are the first receiver to get here */
+    mcast_lock(multicast);
+    if ((multicast->sender == 0) || (kill(multicast->sender, 0) < 0 && errno == ESRCH)) {
+        fflush(stdout);
+        sender = fork();
+        if (sender == 0)
+            mcast_send(session);
+        if (sender < 0) {
+            pthread_mutex_unlock(&multicast->lock);
+            mcast_leave(session);
+            return warn("Could not start the multicast sender");
+        }
+        multicast->sender = sender;
+    }
+    pthread_mutex_unlock(&multicast->lock);
+
+    /* pass on the feedback of our client */
+    while (1) {
+        for (length = 0; length < sizeof(retransmission); length += status) {
+            status = read(session->client_fd, ((char *) &retransmission) + length, sizeof(retransmission) - length);
+            if (status <= 0) {
+                mcast_leave(session);
+                return warn("Lost the client of a multicast");
+            }
+        }
+
+        /* the bitmap of a super-block comes in the requests after the one that announced it */
+        if (xfer->super_left > 0) {
+            blocks = min(xfer->super_left, TS_SUPER_REQUEST_BLOCKS);
+            mcast_lock(multicast);
+            for (bit = 0; (bit < blocks) && (xfer->super_next + bit <= param->block_count); ++bit)
+                if ((bitmap[bit / 8] & (1 << (bit % 8))) && (xfer->super_next + bit > 0) && (mcast_post(multicast, xfer->super_next + bit) < 0))
+                    break;
+            pthread_mutex_unlock(&multicast->lock);
+            xfer->super_next += blocks;
+            xfer->super_left -= blocks;
+            continue;
+        }
+        type  = ntohs (retransmission.request_type);
+        block = ntohll(retransmission.block);
+
+        /* a block to repair */
+        if (type == REQUEST_RETRANSMIT) {
+            mcast_lock(multicast);
+            if ((block > 0) && (block <= param->block_count))
+                mcast_post(multicast, block);
+            pthread_mutex_unlock(&multicast->lock);
+
+        /* the start of a bitmap of them in a super-block */
+        } else if (type == REQUEST_RETRANSMIT_SUPER) {
+            xfer->super_next = block;
+            xfer->super_left = ntohl(retransmission.error_rate);
+
+        /* a restart takes the whole stream back to the earliest block asked for */
+        } else if (type == REQUEST_RESTART) {
+            if ((block == 0) || (block > param->block_count)) {
+                sprintf(g_error, "Attempt to restart at illegal block %llu", (ull_t) block);
+                warn(g_error);
+                continue;
+            }
+            mcast_lock(multicast);
+            if ((multicast->restart == 0) || (block < multicast->restart))
+                multicast->restart = block;
+            pthread_mutex_unlock(&multicast->lock);
+
+        /* the pace our client allows */
+        } else if ((type == REQUEST_ERROR_RATE) || (type == REQUEST_FLOW_CONTROL)) {
+            if (ttp_accept_retransmit(session, &retransmission, NULL) < 0)
+                continue;
+            mcast_lock(multicast);
+            member->ipd_current = xfer->ipd_current;
+            member->ipd_flow    = xfer->ipd_flow;
+            if (type == REQUEST_ERROR_RATE)
+                member->error_rate = retransmission.error_rate;
+            pthread_mutex_unlock(&multicast->lock);
+
+        /* our client has the whole file */
+        } else if (type == REQUEST_STOP) {
+            fprintf(stderr, "Transmission of %s complete.\n", xfer->filename);
+            mcast_leave(session);
+            if ((xfer->options & TS_OPT_CHECKSUM) && (ttp_send_digest(session) < 0))
+                warn("Could not send the file digest");
+            return 0;
+
+        } else {
+            sprintf(g_error, "Received unknown retransmission request of type %u", type);
+            warn(g_error);
+        }
+    }
+}
+
+
+/*------------------------------------------------------------------------
+ * static void mcast_lock(multicast_t *multicast);
+ *
+ * Takes the lock of the multicast stream state, taking it over in a
+ * consistent state if its last holder died.
+ *------------------------------------------------------------------------*/
+static void mcast_lock(multicast_t *multicast)
+{
+    if (pthread_mutex_lock(&multicast->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&multicast->lock);
+}
+
+
+/*------------------------------------------------------------------------
+ * static int mcast_post(multicast_t *multicast, u_int64_t block);
+ *
+ * Queues the given block to be repaired by the sender.  The caller
+ * holds the lock.  Returns 0 on success and non-zero if the queue is
+ * full, in which case the client asks again later.
+ *------------------------------------------------------------------------*/
+static int mcast_post(multicast_t *multicast, u_int64_t block)
+{
+    if (multicast->repair_count == MCAST_REPAIRS)
+        return -1;
+    multicast->repair[(multicast->repair_head + multicast->repair_count++) % MCAST_REPAIRS] = block;
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * static void mcast_send(ttp_session_t *session);
+ *
+ * Runs the sender of the multicast stream in a process of its own.  It
+ * sends every block to the group in order, then the terminating block
+ * until the last receiver has left, and exits.  Queued repairs come
+ * first, but each block is repaired only once within MCAST_HOLD usec
+ * however many receivers lost it.  Parity blocks and compression work
+ * as for a single client.  The pace is that of the slowest receiver.
+ *------------------------------------------------------------------------*/
+static void mcast_send(ttp_session_t *session)
+{
+    ttp_transfer_t     *xfer      = &session->transfer;
+    ttp_parameter_t    *param     = session->parameter;
+    multicast_t        *multicast = param->multicast;
+    u_char              datagram[TS_HEADER_SIZE + MAX_BLOCK_SIZE + TS_CRC_SIZE];
+    struct sockaddr_in  group;
+    struct timeval      prevpacketT, currpacketT, held;
+    blockmap_t         *recent;
+    u_int64_t           block, repair, sent = 0, repaired = 0;
+    double              ipd_current, ipd_flow;
+    u_int32_t           error_rate;
+    int64_t             ipd_time = 0, ipd_time_max = 0, ipd_usleep_diff;
+    u_int16_t           type;
+    u_char              ttl = param->mcast_ttl;
+    int                 slot, live, status;
+
+    /* we talk to no client directly, and read the file on our own */
+    close(session->client_fd);
+    close(xfer->udp_fd);
+    xfer->source->close(session);
+    if (xfer->source->open(session, xfer->filename) < 0)
+        error("Could not reopen the multicast file");
+
+    /* send to the group */
+    xfer->udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (xfer->udp_fd < 0)
+        error("Could not create the multicast socket");
+    if (setsockopt(xfer->udp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+        warn("Could not set the multicast TTL");
+    ttp_size_buffer(session, param->udp_buffer ? param->udp_buffer : udp_buffer_for_path(DEFAULT_UDP_BUFFER, param->target_rate, param->wait_u_sec));
+    memset(&group, 0, sizeof(group));
+    group.sin_family      = AF_INET;
+    group.sin_addr.s_addr = param->mcast_group;
+    group.sin_port        = htons(param->mcast_port);
+    free(xfer->udp_address);
+    xfer->udp_address     = (struct sockaddr *) malloc(sizeof(group));
+    if (xfer->udp_address == NULL)
+        error("Could not allocate space for the multicast address");
+    memcpy(xfer->udp_address, &group, sizeof(group));
+    xfer->udp_length      = sizeof(group);
+
+    recent = blockmap_create(param->block_count);
+    if (recent == NULL)
+        error("Could not allocate the repaired-block bitfield");
+
+    /* give the other receivers time to join */
+    if (param->verbose_yn)
+        printf("Multicasting '%s' to %s:%u in %u seconds\n", xfer->filename, inet_ntoa(group.sin_addr), param->mcast_port, param->mcast_wait);
+    usleep_that_works(1000000ULL * param->mcast_wait);
+
+    gettimeofday(&prevpacketT, NULL);
+    held        = prevpacketT;
+    xfer->block = 0;
+    while (1) {
+
+        /* take the pace of the slowest receiver, and the requests of all */
+        repair      = 0;
+        live        = 0;
+        ipd_current = 0.0;
+        ipd_flow    = 0.0;
+        error_rate  = 0;
+        mcast_lock(multicast);
+        for (slot = 0; slot < MCAST_MEMBERS; ++slot) {
+            mcast_member_t *member = &multicast->member[slot];
+            if (member->pid == 0)
+                continue;
+            if (kill(member->pid, 0) < 0 && errno == ESRCH) {
+                member->pid = 0;
+                continue;
+            }
+            ++live;
+            ipd_current = max(ipd_current, member->ipd_current);
+            ipd_flow    = max(ipd_flow,    member->ipd_flow);
+            error_rate  = max(error_rate,  member->error_rate);
+        }
+        if (live == 0) {
+            multicast->active = 0;
+            multicast->sender = 0;
+            pthread_mutex_unlock(&multicast->lock);
+            break;
+        }
+        if (multicast->restart) {
+            xfer->block        = multicast->restart - 1;
+            multicast->restart = 0;
+        }
+        while ((repair == 0) && multicast->repair_count) {
+            block = multicast->repair[multicast->repair_head];
+            multicast->repair_head = (multicast->repair_head + 1) % MCAST_REPAIRS;
+            --multicast->repair_count;
+            if (blockmap_set(recent, block) == 1)
+                repair = block;
+        }
+        pthread_mutex_unlock(&multicast->lock);
+
+        if (ipd_current > 0.0)
+            xfer->ipd_current = ipd_current;
+        xfer->ipd_flow = ipd_flow;
+        if ((xfer->options & TS_OPT_FEC) && (error_rate > 0))
+            xfer->fec.group = (u_int32_t) max(FEC_GROUP_MIN, min(FEC_GROUP_MAX, FEC_LOSS_TARGET * 100000.0 / error_rate));
+
+        /* a block may be repaired again once the hold time is over */
+        if (get_usec_since(&held) > MCAST_HOLD) {
+            blockmap_clear_range(recent, 1, param->block_count);
+            gettimeofday(&held, NULL);
+        }
+
+        /* precalculate time to wait after sending the next packet */
+        gettimeofday(&currpacketT, NULL);
+        ipd_usleep_diff = max(xfer->ipd_current * xfer->sent_size / xfer->datagram_size, xfer->ipd_flow) + tv_diff_usec(prevpacketT, currpacketT);
+        prevpacketT = currpacketT;
+        if (ipd_usleep_diff > 0 || ipd_time > 0)
+            ipd_time += ipd_usleep_diff;
+        ipd_time_max = (ipd_time > ipd_time_max) ? ipd_time : ipd_time_max;
+
+        /* a repair goes first */
+        type = TS_BLOCK_RETRANSMISSION;
+        if (repair) {
+            status = build_datagram(session, repair, TS_BLOCK_RETRANSMISSION, datagram);
+            if (status < 0) {
+                sprintf(g_error, "Could not build retransmission for block %llu", (ull_t) repair);
+                error(g_error);
+            }
+            xfer->sent_size = status;
+            if (sendto(xfer->udp_fd, datagram, xfer->sent_size, 0, xfer->udp_address, xfer->udp_length) < 0)
+                warn("Could not multicast a retransmission");
+            else
+                ++repaired;
+
+        /* then a ready parity block */
+        } else if (xfer->fec.pending) {
+            xfer->fec.pending = 0;
+            xfer->sent_size   = xfer->datagram_size;
+            if (sendto(xfer->udp_fd, xfer->fec.datagram, xfer->sent_size, 0, xfer->udp_address, xfer->udp_length) < 0)
+                warn("Could not multicast a parity block");
+            else
+                xfer->fec.sent++;
+
+        /* then the next block of the file */
+        } else {
+            xfer->block = min(xfer->block + 1, param->block_count);
+            type = (xfer->block == param->block_count) ? TS_BLOCK_TERMINATE : TS_BLOCK_ORIGINAL;
+            status = build_datagram(session, xfer->block, type, datagram);
+            if (status < 0) {
+                sprintf(g_error, "Could not read block #%llu", (ull_t) xfer->block);
+                error(g_error);
+            }
+            xfer->sent_size = status;
+            if (sendto(xfer->udp_fd, datagram, xfer->sent_size, 0, xfer->udp_address, xfer->udp_length) < 0) {
+                warn("Could not multicast a block");
+                continue;
+            }
+            ++sent;
+            if (xfer->options & TS_OPT_FEC)
+                parity_add(session, datagram, xfer->sent_size);
+        }
+
+        /* wait before sending the next packet */
+        if (type == TS_BLOCK_TERMINATE)
+            usleep_that_works(10 * ipd_time_max);
+        if (ipd_time > 0)
+            usleep_that_works(ipd_time);
+    }
+
+    if (param->verbose_yn)
+        printf("Multicast of '%s' ended: %llu blocks sent, %llu repaired, %llu parity blocks\n",
+               xfer->filename, (ull_t) sent, (ull_t) repaired, (ull_t) xfer->fec.sent);
+    blockmap_destroy(recent);
+    exit(0);
+}
+
+
+/*========================================================================
+ * $Log: multicast.c,v $
+ */
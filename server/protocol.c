@@ -64,9 +64,11 @@
 #include <stdlib.h>      /* for *alloc() and free()        */
 #include <stdio.h>
 #include <string.h>      /* for memset(), strdup(), etc.   */
+#include <fcntl.h>       /* for fcntl()                    */
 #include <sys/types.h>   /* for standard system data types */
 #include <inttypes.h>    /* for scanf/printf data types    */
 #include <sys/socket.h>  /* for the BSD sockets library    */
+#include <sys/stat.h>    /* for fstat()                    */
 #include <sys/time.h>    /* gettimeofday()                 */
 #include <netdb.h>       /* needed on OS X                 */
 #include <time.h>        /* for time()                     */
@@ -81,6 +83,54 @@
 #include "parse_evn_filename.h" /* EVN file name parsing for start time, station code, etc */
 #endif
 
+/*------------------------------------------------------------------------
+ * int ttp_accept_bitmap(ttp_session_t *session, const u_char *bitmap,
+ *                       u_char *datagram);
+ *
+ * Handles the given request as the next part of the bitmap that a
+ * REQUEST_RETRANSMIT_SUPER announced, with one bit for each of up to
+ * TS_SUPER_REQUEST_BLOCKS blocks.  The blocks flagged are retransmitted,
+ * paced at the current IPD.  The given buffer must be large enough to
+ * hold a datagram.  Returns 0 on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_accept_bitmap(ttp_session_t *session, const u_char *bitmap, u_char *datagram)
+{
+    ttp_transfer_t  *xfer   = &session->transfer;
+    u_int32_t        blocks = min(xfer->super_left, TS_SUPER_REQUEST_BLOCKS);
+    u_int32_t        bit;
+    u_int64_t        block;
+    int              status;
+
+    /* this part of the bitmap is used up, whatever becomes of it */
+    block             = xfer->super_next;
+    xfer->super_next += blocks;
+    xfer->super_left -= blocks;
+
+    for (bit = 0; (bit < blocks) && (block + bit <= session->parameter->block_count); ++bit) {
+        if (!(bitmap[bit / 8] & (1 << (bit % 8))) || (block + bit == 0))
+            continue;
+
+        /* build the retransmission */
+        status = build_datagram(session, block + bit, TS_BLOCK_RETRANSMISSION, datagram);
+        if (status < 0) {
+            sprintf(g_error, "Could not build retransmission for block %llu", (ull_t) (block + bit));
+            return warn(g_error);
+        }
+        xfer->sent_size = status;
+
+        /* send it, pacing the burst as the main loop paces single blocks */
+        status = sendto(xfer->udp_fd, datagram, xfer->sent_size, 0, xfer->udp_address, xfer->udp_length);
+        if (status < 0) {
+            sprintf(g_error, "Could not retransmit block %llu", (ull_t) (block + bit));
+            return warn(g_error);
+        }
+        usleep_that_works(max(xfer->ipd_current * xfer->sent_size / xfer->datagram_size, xfer->ipd_flow));
+    }
+
+    return 0;
+}
+
+
 /*------------------------------------------------------------------------
  * int ttp_accept_retransmit(ttp_session_t *session,
  *                           retransmission_t *retransmission,
@@ -92,6 +142,11 @@
  *   REQUEST_RETRANSMIT -- Retransmit the given block.
  *   REQUEST_RESTART    -- Restart the transfer at the given block.
  *   REQUEST_ERROR_RATE -- Use the given error rate to adjust the IPD.
+ *   REQUEST_FLOW_CONTROL -- Use the client's free buffer slots and disk
+ *                         drain rate to limit the IPD from below.
+ *   REQUEST_RETRANSMIT_SUPER -- Expect the bitmap of the given number of
+ *                         blocks from the given block on in the requests
+ *                         after it, see ttp_accept_bitmap().
  *
  * For REQUEST_RETRANSMIT messsages, the given buffer must be large
  * enough to hold (block_size + 6) bytes.  For other messages, the
@@ -103,13 +158,12 @@ int ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmissi
 {
     ttp_transfer_t  *xfer      = &session->transfer;
     ttp_parameter_t *param     = session->parameter;
-    static int       iteration = 0;
-    static char      stats_line[80];
+    char             stats_line[96];
     int              status;
     u_int16_t        type;
 
     /* convert the retransmission fields to host byte order */
-    retransmission->block      = ntohl(retransmission->block);
+    retransmission->block      = ntohll(retransmission->block);
     retransmission->error_rate = ntohl(retransmission->error_rate);
     type                       = ntohs(retransmission->request_type);
 
@@ -128,26 +182,56 @@ int ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmissi
     /* make sure the IPD is still in range, for later calculations */
     xfer->ipd_current = max(min(xfer->ipd_current, 10000.0), param->ipd_time);
 
+    /* size the parity groups so that few lose more than the one block their parity restores */
+    if (xfer->options & TS_OPT_FEC)
+        xfer->fec.group = (u_int32_t) max(FEC_GROUP_MIN, min(FEC_GROUP_MAX,
+                          FEC_LOSS_TARGET * 100000.0 / max(retransmission->error_rate, 1)));
+
+    /* let an automatic send buffer follow the rate the IPD now allows */
+    if (param->udp_buffer == 0) {
+	double    rate   = 8e6 * (param->block_size + TS_HEADER_SIZE) / max(xfer->ipd_current, xfer->ipd_flow);
+	u_int32_t wanted = udp_buffer_for_path(DEFAULT_UDP_BUFFER, rate, param->wait_u_sec);
+	if ((wanted > 1.25 * xfer->udp_request) || (wanted < 0.5 * xfer->udp_request))
+	    ttp_size_buffer(session, wanted);
+    }
+
     /* build the stats string */
-    sprintf(stats_line, "%6u %3.2fus %5uus %7u %6.2f %3u\n",
-        retransmission->error_rate, (float)xfer->ipd_current, param->ipd_time, xfer->block,
-        100.0 * xfer->block / param->block_count, session->session_id);
+    sprintf(stats_line, "%6u %3.2fus %5uus %7llu %6.2f %3u %3.2fus\n",
+        retransmission->error_rate, (float)xfer->ipd_current, param->ipd_time, (ull_t) xfer->block,
+        100.0 * xfer->block / param->block_count, session->session_id, (float)xfer->ipd_flow);
 
 	/* print a status report */
-	if (!(iteration++ % 23))
-	    printf(" erate     ipd  target   block   %%done srvNr\n");
+	if (!(xfer->iteration++ % 23))
+	    printf(" erate     ipd  target   block   %%done srvNr  flowipd\n");
 	printf("%s", stats_line);
 
 	/* print to the transcript if the user wants */
 	if (param->transcript_yn)
 	    xscript_data_log(session, stats_line);
 
+    /* if it's a flow control notification */
+    } else if (type == REQUEST_FLOW_CONTROL) {
+
+	/* a stalled disk with no space left: go as slow as the IPD range allows */
+	if (retransmission->block == 0 && retransmission->error_rate == 0) {
+	    xfer->ipd_flow = 10000.0;
+
+	/* no disk rate measured yet: nothing to limit */
+	} else if (retransmission->error_rate == 0) {
+	    xfer->ipd_flow = 0.0;
+
+	/* allow what the disk drains plus what fits into the free slots */
+	} else {
+	    xfer->ipd_flow = 1e6 / (retransmission->error_rate + retransmission->block / FLOW_FILL_SECS);
+	    xfer->ipd_flow = min(xfer->ipd_flow, 10000.0);
+	}
+
     /* if it's a restart request */
     } else if (type == REQUEST_RESTART) {
 
 	/* do range-checking first */
 	if ((retransmission->block == 0) || (retransmission->block > param->block_count)) {
-	    sprintf(g_error, "Attempt to restart at illegal block %u", retransmission->block);
+	    sprintf(g_error, "Attempt to restart at illegal block %llu", (ull_t) retransmission->block);
 	    return warn(g_error);
 	} else
 	    xfer->block = retransmission->block;
@@ -158,17 +242,23 @@ int ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmissi
         /* build the retransmission */
         status = build_datagram(session, retransmission->block, TS_BLOCK_RETRANSMISSION, datagram);
         if (status < 0) {
-            sprintf(g_error, "Could not build retransmission for block %u", retransmission->block);
+            sprintf(g_error, "Could not build retransmission for block %llu", (ull_t) retransmission->block);
             return warn(g_error);
         }
+        xfer->sent_size = status;
       
         /* try to send out the block */
-        status = sendto(xfer->udp_fd, datagram, 6 + param->block_size, 0, xfer->udp_address, xfer->udp_length);
+        status = sendto(xfer->udp_fd, datagram, xfer->sent_size, 0, xfer->udp_address, xfer->udp_length);
         if (status < 0) {
-            sprintf(g_error, "Could not retransmit block %u", retransmission->block);
+            sprintf(g_error, "Could not retransmit block %llu", (ull_t) retransmission->block);
             return warn(g_error);
         }
 
+    /* if it's the start of a bitmap of blocks to retransmit in a super-block */
+    } else if ((type == REQUEST_RETRANSMIT_SUPER) && (xfer->options & TS_OPT_SUPERBLOCK)) {
+        xfer->super_next = retransmission->block;
+        xfer->super_left = retransmission->error_rate;
+
     /* if it's another kind of request */
     } else {
 	sprintf(g_error, "Received unknown retransmission request of type %u", ntohs(retransmission->request_type));
@@ -199,12 +289,16 @@ int ttp_accept_retransmit(ttp_session_t *session, retransmission_t *retransmissi
  *         If the authentication succeeds, the server transmits a
  *         result byte of 0.  Otherwise, it transmits a non-zero
  *         result byte.
+ *
+ * The time the client takes to answer the challenge is the round trip
+ * time of the session, as the file requests no longer wait for one.
  *------------------------------------------------------------------------*/
 int ttp_authenticate(ttp_session_t *session, const u_char *secret)
 {
     u_char random[64];         /* the buffer of random data               */
     u_char server_digest[16];  /* the MD5 message digest (for us)         */
     u_char client_digest[16];  /* the MD5 message digest (for the client) */
+    struct timeval ping_s;     /* the time the challenge was sent         */
     int    i;
     int    status;
 
@@ -214,6 +308,7 @@ int ttp_authenticate(ttp_session_t *session, const u_char *secret)
 	return warn("Access to random data is broken");
 
     /* send the random data to the client */
+    gettimeofday(&ping_s, NULL);
     status = full_write(session->client_fd, random, 64);
     if (status < 0)
 	return warn("Could not send authentication challenge to client");
@@ -223,6 +318,10 @@ int ttp_authenticate(ttp_session_t *session, const u_char *secret)
     if (status < 0)
 	return warn("Could not read authentication response from client");
 
+    /* keep the round trip time, with a 10% safety margin */
+    session->parameter->wait_u_sec = get_usec_since(&ping_s);
+    session->parameter->wait_u_sec = session->parameter->wait_u_sec + ((int)(session->parameter->wait_u_sec* 0.1));
+
     /* compare the two digests */
     prepare_proof(random, 64, secret, server_digest);
     for (i = 0; i < 16; ++i)
@@ -241,6 +340,43 @@ int ttp_authenticate(ttp_session_t *session, const u_char *secret)
 }
 
 
+/*------------------------------------------------------------------------
+ * void ttp_close_transfer(ttp_session_t *session);
+ *
+ * Releases what the transfer of the given session holds, whether it
+ * ended or failed on the way: its place in a multicast stream, the
+ * upstream hop of a relay, the source, the transcript, the buffers and
+ * the address of the client.  The UDP socket is kept for the next
+ * transfer, and so is the tag of the datagrams, which the next one has
+ * to differ from.
+ *------------------------------------------------------------------------*/
+void ttp_close_transfer(ttp_session_t *session)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+    u_int16_t       tag  = xfer->tag;
+
+    mcast_leave(session);
+    relay_close(session);
+    #ifndef VSIB_REALTIME
+    if (xfer->source != NULL)
+        xfer->source->close(session);
+    #endif
+    if (xfer->transcript != NULL)
+        fclose(xfer->transcript);
+    blockmap_destroy(xfer->skip);
+    free(xfer->compress.region);
+    free(xfer->compress.buffer);
+    free(xfer->fec.sum);
+    free(xfer->fec.datagram);
+    free(xfer->filename);
+    free(xfer->udp_address);
+
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->tag        = tag;
+    xfer->mcast_slot = -1;
+}
+
+
 /*------------------------------------------------------------------------
  * int ttp_negotiate(ttp_session_t *session);
  *
@@ -275,15 +411,16 @@ int ttp_negotiate(ttp_session_t *session)
 /*------------------------------------------------------------------------
  * int ttp_open_port(ttp_session_t *session);
  *
- * Creates a new UDP socket for transmitting the file data associated
- * with our pending transfer and receives the destination port number
- * from the client.  Returns 0 on success and non-zero on failure.
+ * Sets up the UDP socket for transmitting the file data associated
+ * with our pending transfer, to the port the client sent along with
+ * its request.  The socket is created for the first transfer of the
+ * session and used again for the ones after it.  Returns 0 on success
+ * and non-zero on failure.
  *------------------------------------------------------------------------*/
 int ttp_open_port(ttp_session_t *session)
 {
     struct sockaddr    *address;
-    int                 status;
-    u_int16_t           port;
+    u_int16_t           port = session->transfer.udp_port;
     u_char              ipv6_yn = session->parameter->ipv6_yn;
 
     /* create the address structure */
@@ -329,10 +466,7 @@ int ttp_open_port(ttp_session_t *session)
       freeaddrinfo(result);
     }
 
-    /* read in the port number from the client */
-    status = full_read(session->client_fd, &port, 2);
-    if (status < 0)
-	return warn("Could not read UDP port number");
+    /* fill in the port number from the request */
     if (ipv6_yn)
 	((struct sockaddr_in6 *) address)->sin6_port = port;
     else
@@ -342,10 +476,18 @@ int ttp_open_port(ttp_session_t *session)
     if (session->parameter->verbose_yn)
 	printf("Sending to client port %d\n", ntohs(port));
 
-    /* open a new datagram socket */
-    session->transfer.udp_fd = create_udp_socket(session->parameter);
-    if (session->transfer.udp_fd < 0)
+    /* open a datagram socket, unless an earlier transfer left us one */
+    if (session->udp_fd < 0)
+	session->udp_fd = create_udp_socket(session->parameter);
+    if (session->udp_fd < 0)
 	return warn("Could not create UDP socket");
+    session->transfer.udp_fd = session->udp_fd;
+
+    /* size its send buffer for the path, unless the user fixed the size */
+    if (session->parameter->udp_buffer)
+	ttp_size_buffer(session, session->parameter->udp_buffer);
+    else
+	ttp_size_buffer(session, udp_buffer_for_path(DEFAULT_UDP_BUFFER, session->parameter->target_rate, session->parameter->wait_u_sec));
 
     /* we succeeded */
     session->transfer.udp_address = address;
@@ -360,18 +502,30 @@ int ttp_open_port(ttp_session_t *session)
  * by reading the name of a requested file from the client.  If we are
  * able to negotiate the transfer successfully, we return 0.  If we
  * can't negotiate the transfer because of I/O or file errors, we
- * return a negative vlaue.
- *
- * The client is sent a result byte of 0 if the request is accepted
- * (because the file can be read) and a non-zero result byte otherwise.
+ * return a negative vlaue, and if the client ended the session
+ * instead of asking for another file, 1.
+ *
+ * The request is one message: the filename line is followed by the
+ * block size, target bitrate, error rate, slowdown and speedup
+ * factors, transfer options and data port of the client, which sends
+ * them all without waiting for the file to be accepted.  The client is
+ * sent a result byte of 0 if the request is accepted (because the file
+ * can be read), together with the transfer parameters, and a non-zero
+ * result byte on its own otherwise.
  *------------------------------------------------------------------------*/
 int ttp_open_transfer(ttp_session_t *session)
 {
     char             filename[MAX_FILENAME_LENGTH];  /* the name of the file to transfer     */
     u_int64_t        file_size;                      /* network-order version of file size   */
     u_int32_t        block_size;                     /* network-order version of block size  */
-    u_int32_t        block_count;                    /* network-order version of block count */
-    time_t           epoch;
+    u_int64_t        block_count;                    /* network-order version of block count */
+    u_int32_t        options;                        /* network-order version of the options */
+    u_int32_t        super_size;                     /* network-order blocks per super-block */
+    u_int16_t        mcast_port;                     /* network-order multicast port         */
+    u_int32_t        epoch;                          /* network-order run epoch              */
+    u_int16_t        tag;                            /* the tag of the last transfer's datagrams */
+    u_char           reply[41];                      /* the result byte and the parameters   */
+    size_t           length;                         /* the length of the reply so far       */
     int              status;
     ttp_transfer_t  *xfer  = &session->transfer;
     ttp_parameter_t *param =  session->parameter;
@@ -387,15 +541,16 @@ int ttp_open_transfer(ttp_session_t *session)
     char       file_no[10];
     char       message[20];
     u_int16_t  i;
-    struct     timeval ping_s, ping_e;
 
     /* clear out the transfer data */
+    tag = xfer->tag;
     memset(xfer, 0, sizeof(*xfer));
+    xfer->mcast_slot = -1;
 
-    /* read in the requested filename */
+    /* read in the requested filename, which the client not sending ends the session */
     status = read_line(session->client_fd, filename, MAX_FILENAME_LENGTH);
     if (status < 0)
-        error("Could not read filename from client");
+        return 1;
     filename[MAX_FILENAME_LENGTH - 1] = '\0';
 
     if(!strcmp(filename, TS_DIRLIST_HACK_CMD)) {
@@ -413,6 +568,26 @@ int ttp_open_transfer(ttp_session_t *session)
         full_read(session->client_fd, message, 1);
         return warn("File list sent!");
 
+    } else if (!strcmp(filename, TS_SIZE_QUERY_CMD)) {
+
+       /* The client asks for the size of the file on the next line, all ones if we can't
+        * tell, before it fetches the file in byte ranges over several sessions
+        */
+        status = read_line(session->client_fd, filename, MAX_FILENAME_LENGTH);
+        if (status < 0)
+            return warn("Could not read the name of the file to size");
+        filename[MAX_FILENAME_LENGTH - 1] = '\0';
+        file_size = ~0ULL;
+        xfer->filename = strdup(filename);
+        #ifndef VSIB_REALTIME
+        if ((xfer->filename != NULL) && (param->relay_host == NULL) && (source_open(session) == 0))
+            file_size = xfer->source->size(session);
+        #endif
+        ttp_close_transfer(session);
+        file_size = htonll(file_size);
+        full_write(session->client_fd, &file_size, 8);
+        return warn("File size sent!");
+
     } else if(!strcmp(filename,"*")) {
       
         if(param->allhook != 0)
@@ -521,6 +696,37 @@ int ttp_open_transfer(ttp_session_t *session)
         }
     }
 
+    /* read in the rest of the request, which a multi-GET without files does not send */
+    if (strcmp(filename, "*")) {
+        if (full_read(session->client_fd, &param->block_size,  4) < 0) return warn("Could not read block size");
+        if (full_read(session->client_fd, &param->target_rate, 4) < 0) return warn("Could not read target bitrate");
+        if (full_read(session->client_fd, &param->error_rate,  4) < 0) return warn("Could not read error rate");
+        if (full_read(session->client_fd, &param->slower_num,  2) < 0) return warn("Could not read slowdown numerator");
+        if (full_read(session->client_fd, &param->slower_den,  2) < 0) return warn("Could not read slowdown denominator");
+        if (full_read(session->client_fd, &param->faster_num,  2) < 0) return warn("Could not read speedup numerator");
+        if (full_read(session->client_fd, &param->faster_den,  2) < 0) return warn("Could not read speedup denominator");
+        if (full_read(session->client_fd, &options,            4) < 0) return warn("Could not read transfer options");
+        param->block_size  = ntohl(param->block_size);
+        param->target_rate = ntohl(param->target_rate);
+        param->error_rate  = ntohl(param->error_rate);
+        param->slower_num  = ntohs(param->slower_num);
+        param->slower_den  = ntohs(param->slower_den);
+        param->faster_num  = ntohs(param->faster_num);
+        param->faster_den  = ntohs(param->faster_den);
+        xfer->options      = ntohl(options) & SERVER_OPTIONS;
+        if (ntohl(options) & TS_OPT_SUPERBLOCK) {
+            if (full_read(session->client_fd, &super_size,     4) < 0) return warn("Could not read super-block size");
+            xfer->super_size = ntohl(super_size);
+        }
+        if (ntohl(options) & TS_OPT_RANGE) {
+            if (full_read(session->client_fd, &xfer->range_offset, 8) < 0) return warn("Could not read range offset");
+            if (full_read(session->client_fd, &xfer->range_length, 8) < 0) return warn("Could not read range length");
+            xfer->range_offset = ntohll(xfer->range_offset);
+            xfer->range_length = ntohll(xfer->range_length);
+        }
+        if (full_read(session->client_fd, &xfer->udp_port,     2) < 0) return warn("Could not read UDP port number");
+    }
+
     /* store the filename in the transfer object */
     xfer->filename = strdup(filename);
     if (xfer->filename == NULL)
@@ -532,9 +738,8 @@ int ttp_open_transfer(ttp_session_t *session)
 
     #ifndef VSIB_REALTIME
 
-    /* try to open the file for reading */
-    xfer->file = fopen(filename, "r");
-    if (xfer->file == NULL) {
+    /* try to open the file with its source, or have the upstream server send it */
+    if (source_open(session) < 0) {
         sprintf(g_error, "File '%s' does not exist or cannot be read", filename);
         /* signal failure to the client */
         status = full_write(session->client_fd, "\x008", 1);
@@ -621,33 +826,61 @@ int ttp_open_transfer(ttp_session_t *session)
 
     #endif // end of VSIB_REALTIME section
 
-    /* begin round trip time estimation */
-    gettimeofday(&ping_s,NULL);
+    #ifdef VSIB_REALTIME
+    xfer->options = 0;
+    #endif
 
-    /* try to signal success to the client */
-    status = full_write(session->client_fd, "\000", 1);
-    if (status < 0)
-        return warn("Could not signal request approval to client");
+    /* lower the block size to what fits through our path to the client, found once a session */
+    if ((xfer->options & TS_OPT_AUTOBLOCK) && (param->client == NULL)) {
+        struct sockaddr_storage address;
+        socklen_t               address_length = sizeof(address);
+        int                     path_block_size;
+
+        if ((session->path_block_size == 0) && (getpeername(session->client_fd, (struct sockaddr *) &address, &address_length) == 0))
+            session->path_block_size = get_path_block_size((struct sockaddr *) &address, address_length, max(2 * param->wait_u_sec, 20000));
+        path_block_size = session->path_block_size;
+        if ((path_block_size > 0) && (xfer->options & TS_OPT_CHECKSUM))
+            path_block_size -= TS_CRC_SIZE;
+        if ((path_block_size > 0) && (path_block_size < param->block_size))
+            param->block_size = path_block_size;
+        if (param->verbose_yn)
+            printf("Path MTU discovery: block size %u\n", param->block_size);
+    }
+    if (param->block_size < 12)
+        xfer->options &= ~TS_OPT_PROBE;
+    if (xfer->super_size < 2)
+        xfer->options &= ~TS_OPT_SUPERBLOCK;
+
+    /* a relayed file is only at hand block by block, as it arrives */
+    if (xfer->relay != NULL) {
+        xfer->options &= ~RELAY_EXCLUDED;
+        if (relay_start(session) < 0) {
+            if (full_write(session->client_fd, "\x008", 1) < 0)
+                warn("Could not signal request failure to client");
+            return warn("Could not start the upstream transfer");
+        }
+    }
 
-    /* read in the block size, target bitrate, and error rate */
-    if (full_read(session->client_fd, &param->block_size,  4) < 0) return warn("Could not read block size");            param->block_size  = ntohl(param->block_size);
-    if (full_read(session->client_fd, &param->target_rate, 4) < 0) return warn("Could not read target bitrate");        param->target_rate = ntohl(param->target_rate);
-    if (full_read(session->client_fd, &param->error_rate,  4) < 0) return warn("Could not read error rate");            param->error_rate  = ntohl(param->error_rate);
+    /* a file that is still growing has no final size to go by */
+    if (xfer->options & TS_OPT_FOLLOW)
+        xfer->options &= ~FOLLOW_EXCLUDED;
 
-    /* end round trip time estimation */
-    gettimeofday(&ping_e,NULL);
+    /* and not every source has a file behind it */
+    #ifndef VSIB_REALTIME
+    xfer->options &= ~xfer->source->excluded;
+    #endif
+
+    /* and a byte range is sent as the whole file less the blocks outside it */
+    if (xfer->options & TS_OPT_RANGE)
+        xfer->options &= ~RANGE_EXCLUDED;
 
-    /* read in the slowdown and speedup factors */
-    if (full_read(session->client_fd, &param->slower_num,  2) < 0) return warn("Could not read slowdown numerator");    param->slower_num  = ntohs(param->slower_num);
-    if (full_read(session->client_fd, &param->slower_den,  2) < 0) return warn("Could not read slowdown denominator");  param->slower_den  = ntohs(param->slower_den);
-    if (full_read(session->client_fd, &param->faster_num,  2) < 0) return warn("Could not read speedup numerator");     param->faster_num  = ntohs(param->faster_num);
-    if (full_read(session->client_fd, &param->faster_den,  2) < 0) return warn("Could not read speedup denominator");   param->faster_den  = ntohs(param->faster_den);
+    /* receive from the multicast of this file, if the client wants it and we can */
+    if (xfer->options & TS_OPT_MULTICAST)
+        mcast_join(session);
 
     #ifndef VSIB_REALTIME
     /* try to find the file statistics */
-    fseeko(xfer->file, 0, SEEK_END);
-    param->file_size   = ftello(xfer->file);
-    fseeko(xfer->file, 0, SEEK_SET);
+    param->file_size   = xfer->source->size(session);
     #else
     /* get length of recording in bytes from filename */
     if (get_aux_entry("flen", ef->auxinfo, ef->nr_auxinfo) != 0) {
@@ -661,18 +894,72 @@ int ttp_open_transfer(ttp_session_t *session)
     #endif
 
     param->block_count = (param->file_size / param->block_size) + ((param->file_size % param->block_size) != 0);
+    if (xfer->options & TS_OPT_FOLLOW)
+        follow_start(session);
     param->epoch       = time(NULL);
+    xfer->datagram_size = TS_HEADER_SIZE + param->block_size + ((xfer->options & TS_OPT_CHECKSUM) ? TS_CRC_SIZE : 0);
+    xfer->sent_size     = xfer->datagram_size;
+
+    /* set up adaptive compression, or go without it */
+    if (xfer->options & TS_OPT_COMPRESS) {
+        xfer->compress.region = (u_char *) calloc(param->block_count / COMPRESS_REGION + 1, 1);
+        xfer->compress.buffer = (u_char *) malloc(param->block_size);
+        if ((xfer->compress.region == NULL) || (xfer->compress.buffer == NULL) || (param->block_size < 12)) {
+            free(xfer->compress.region);
+            free(xfer->compress.buffer);
+            memset(&xfer->compress, 0, sizeof(xfer->compress));
+            xfer->options &= ~TS_OPT_COMPRESS;
+        }
+    }
 
-    /* reply with the length, block size, number of blocks, and run epoch */
-    file_size   = htonll(param->file_size);    if (full_write(session->client_fd, &file_size,   8) < 0) return warn("Could not submit file size");
-    block_size  = htonl (param->block_size);   if (full_write(session->client_fd, &block_size,  4) < 0) return warn("Could not submit block size");
-    block_count = htonl (param->block_count);  if (full_write(session->client_fd, &block_count, 4) < 0) return warn("Could not submit block count");
-    epoch       = htonl (param->epoch);        if (full_write(session->client_fd, &epoch,       4) < 0) return warn("Could not submit run epoch");
+    /* set up the parity blocks, or go without them */
+    if (xfer->options & TS_OPT_FEC) {
+        xfer->fec.sum      = (u_char *) calloc(xfer->datagram_size, 1);
+        xfer->fec.datagram = (u_char *) calloc(xfer->datagram_size, 1);
+        xfer->fec.group    = FEC_GROUP_START;
+        if ((xfer->fec.sum == NULL) || (xfer->fec.datagram == NULL)) {
+            free(xfer->fec.sum);
+            free(xfer->fec.datagram);
+            memset(&xfer->fec, 0, sizeof(xfer->fec));
+            xfer->options &= ~TS_OPT_FEC;
+        }
+    }
 
-    /*calculate and convert RTT to u_sec*/
-    session->parameter->wait_u_sec=(ping_e.tv_sec - ping_s.tv_sec)*1000000+(ping_e.tv_usec-ping_s.tv_usec);
-    /*add a 10% safety margin*/
-    session->parameter->wait_u_sec = session->parameter->wait_u_sec + ((int)(session->parameter->wait_u_sec* 0.1));  
+    /* a new tag for the datagrams, so that the client can tell late ones of the last transfer from ours */
+    if ((get_random_data((u_char *) &xfer->tag, 2) < 0) || (xfer->tag == tag))
+        xfer->tag = tag + 1;
+
+    /* reply with the result byte, length, block size, number of blocks, run epoch and tag in one message */
+    reply[0] = 0;                                                          length  = 1;
+    file_size   = htonll(param->file_size);    memcpy(reply + length, &file_size,   8); length += 8;
+    block_size  = htonl (param->block_size);   memcpy(reply + length, &block_size,  4); length += 4;
+    block_count = htonll(param->block_count);  memcpy(reply + length, &block_count, 8); length += 8;
+    epoch       = htonl (param->epoch);        memcpy(reply + length, &epoch,       4); length += 4;
+    options     = htonl (xfer->options);       memcpy(reply + length, &options,     4); length += 4;
+    tag         = htons (xfer->tag);           memcpy(reply + length, &tag,         2); length += 2;
+    if (xfer->options & TS_OPT_SUPERBLOCK) {
+        super_size = htonl (xfer->super_size); memcpy(reply + length, &super_size,  4); length += 4;
+    }
+    if (xfer->options & TS_OPT_MULTICAST) {
+        memcpy(reply + length, &param->mcast_group, 4);                                  length += 4;
+        mcast_port = htons (param->mcast_port); memcpy(reply + length, &mcast_port, 2); length += 2;
+    }
+    if (full_write(session->client_fd, reply, length) < 0)
+        return warn("Could not submit the transfer parameters");
+
+    /* let the client check what it already holds and tell us to skip it */
+    if ((xfer->options & TS_OPT_MERKLE) && (ttp_serve_merkle(session) < 0))
+        return warn("Could not answer the Merkle tree queries");
+    if ((xfer->options & TS_OPT_SKIP) && (ttp_read_skip(session) < 0))
+        return warn("Could not read the block ranges to skip");
+    if ((xfer->options & TS_OPT_DELTA) && (ttp_serve_delta(session) < 0))
+        return warn("Could not compare the client's block digests");
+    if ((xfer->options & TS_OPT_SPARSE) && (ttp_send_holes(session) < 0))
+        return warn("Could not send the holes of the file");
+    if ((xfer->options & TS_OPT_BUNDLE) && (ttp_send_manifest(session) < 0))
+        return warn("Could not send the manifest of the bundle");
+    if ((xfer->options & TS_OPT_RANGE) && (ttp_skip_range(session) < 0))
+        return warn("Could not leave out the blocks outside the range");
 
     /* and store the inter-packet delay */
     param->ipd_time   = (u_int32_t) ((1000000LL * 8 * param->block_size) / param->target_rate);
@@ -687,6 +974,562 @@ int ttp_open_transfer(ttp_session_t *session)
 }
 
 
+/*------------------------------------------------------------------------
+ * int ttp_probe_path(ttp_session_t *session);
+ *
+ * Sends PROBE_TRAINS trains of PROBE_TRAIN_LENGTH probe datagrams to the
+ * client, each train at twice the rate of the previous one and the last
+ * one at the target rate.  The client answers with the bottleneck rate
+ * it estimated from the packet dispersion and with the highest rate that
+ * did not yet build up a queue (both in kbit/s).  The starting IPD of the
+ * transfer is seeded from these instead of from 3 x ipd_time.  Returns 0
+ * on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_probe_path(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param =  session->parameter;
+    u_char          *datagram;
+    u_int16_t        plan[2];
+    u_int32_t        result[2];
+    u_int32_t        train, seq, rate_kbps;
+    u_int64_t        gap, next, now, stamp;
+    struct timeval   tv;
+    double           seed_kbps;
+    char             probe_line[128];
+
+    /* announce the probe layout */
+    plan[0] = htons(PROBE_TRAINS);
+    plan[1] = htons(PROBE_TRAIN_LENGTH);
+    if (full_write(session->client_fd, plan, 4) < 0)
+        return warn("Could not send probe layout");
+
+    datagram = (u_char *) calloc(TS_HEADER_SIZE + param->block_size, 1);
+    if (datagram == NULL)
+        error("Could not allocate probe datagram");
+
+    /* send the trains with increasing rates */
+    for (train = 0; train < PROBE_TRAINS; ++train) {
+        rate_kbps = (param->target_rate / 1000) >> (PROBE_TRAINS - 1 - train);
+        if (rate_kbps == 0) rate_kbps = 1;
+        gap = (8000ULL * (TS_HEADER_SIZE + param->block_size)) / rate_kbps;
+
+        gettimeofday(&tv, NULL);
+        next = 1000000ULL * tv.tv_sec + tv.tv_usec;
+        for (seq = 0; seq < PROBE_TRAIN_LENGTH; ++seq) {
+
+            /* wait for the send slot of this packet */
+            do {
+                gettimeofday(&tv, NULL);
+                now = 1000000ULL * tv.tv_sec + tv.tv_usec;
+            } while (now < next);
+            next += gap;
+
+            /* header, then the send time and the nominal train rate */
+            *((u_int64_t *) datagram)       = htonll((train << 16) | seq);
+            *((u_int16_t *) (datagram + 8)) = htons(TS_BLOCK_PROBE);
+            *((u_int16_t *) (datagram + 10)) = htons(xfer->tag);
+            stamp = htonll(now);
+            memcpy(datagram + TS_HEADER_SIZE, &stamp, 8);
+            rate_kbps = htonl(rate_kbps);
+            memcpy(datagram + TS_HEADER_SIZE + 8, &rate_kbps, 4);
+            rate_kbps = ntohl(rate_kbps);
+
+            if (sendto(xfer->udp_fd, datagram, TS_HEADER_SIZE + param->block_size, 0, xfer->udp_address, xfer->udp_length) < 0)
+                warn("Could not send probe datagram");
+        }
+
+        /* let the bottleneck queue drain before the next train */
+        usleep_that_works(max(20000ULL, gap * PROBE_TRAIN_LENGTH));
+    }
+    free(datagram);
+
+    /* read back the estimates of the client */
+    if (full_read(session->client_fd, result, 8) < 0)
+        return warn("Could not read probe result");
+    result[0] = ntohl(result[0]);
+    result[1] = ntohl(result[1]);
+
+    /* seed the IPD, preferring the queueing onset rate over the raw bottleneck */
+    seed_kbps = (result[1] > 0) ? result[1] : 0.8 * result[0];
+    if (seed_kbps > 0) {
+        xfer->ipd_current = (8000.0 * param->block_size) / seed_kbps;
+        xfer->ipd_current = max(min(xfer->ipd_current, 10000.0), param->ipd_time);
+    }
+
+    /* report the outcome */
+    snprintf(probe_line, sizeof(probe_line), "PROBE bottleneck %u kbps onset %u kbps ipd_start %0.2f us\n",
+             result[0], result[1], xfer->ipd_current);
+    if (param->verbose_yn)
+        printf("%s", probe_line);
+    if (param->transcript_yn)
+        xscript_data_log(session, probe_line);
+
+    /* we succeeded */
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_read_skip(ttp_session_t *session);
+ *
+ * Reads the blocks the client already holds, which the first pass over
+ * the file leaves out: a 32-bit encoding and a 64-bit length, then the
+ * blocks as encoded by blockmap_encode().  Returns 0 on success and
+ * non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_read_skip(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param = session->parameter;
+    u_int32_t        encoding;
+    u_int64_t        length;
+    u_char          *held;
+
+    if ((full_read(session->client_fd, &encoding, 4) < 4) || (full_read(session->client_fd, &length, 8) < 8))
+        return warn("Could not read the held blocks encoding");
+    encoding = ntohl(encoding);
+    length   = ntohll(length);
+    if (length == 0)
+        return 0;
+    if (length > param->block_count / 8 + 1)
+        return warn("Held blocks list is longer than a bitfield");
+
+    /* read them in */
+    held = (u_char *) malloc(length);
+    if (held == NULL)
+        return warn("Could not allocate the held blocks list");
+    if (full_read(session->client_fd, held, length) < (ssize_t) length) {
+        free(held);
+        return warn("Could not read the held blocks list");
+    }
+
+    /* and mark them */
+    if (xfer->skip == NULL)
+        xfer->skip = blockmap_create(param->block_count);
+    if (xfer->skip == NULL)
+        error("Could not allocate the skipped-block bitfield");
+    if (blockmap_decode(xfer->skip, encoding, held, length) < 0) {
+        free(held);
+        return warn("Could not decode the held blocks list");
+    }
+    free(held);
+
+    if (param->verbose_yn)
+        printf("Client holds %llu of %llu blocks already\n", (ull_t) blockmap_count(xfer->skip), (ull_t) param->block_count);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_send_digest(ttp_session_t *session);
+ *
+ * Sends the client the CRC32C tree hash of the file just transferred,
+ * which it compares with the same hash of the file it wrote.  Only used
+ * in checksum mode, after the client asked us to stop.  Returns 0 on
+ * success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_send_digest(ttp_session_t *session)
+{
+    ttp_parameter_t *param = session->parameter;
+    u_int32_t        digest;
+    char             digest_line[80];
+
+    if (source_digest(session, &digest) < 0)
+        return warn("Could not hash the file");
+
+    /* log it */
+    snprintf(digest_line, sizeof(digest_line), "DIGEST crc32c tree %08x (%s)\n", digest, crc32c_engine());
+    if (param->verbose_yn)
+        printf("%s", digest_line);
+    if (param->transcript_yn)
+        xscript_data_log(session, digest_line);
+
+    /* the control channel is non-blocking during the transfer */
+    fcntl(session->client_fd, F_SETFL, 0);
+    digest = htonl(digest);
+    if (full_write(session->client_fd, &digest, 4) < 4)
+        return warn("Could not send file digest");
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_send_blockmap(ttp_session_t *session, const blockmap_t *map);
+ *
+ * Sends the blocks marked in the given bitfield to the client: a 32-bit
+ * encoding and a 64-bit length, followed by the blocks as encoded by
+ * blockmap_encode().  Returns 0 on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_send_blockmap(ttp_session_t *session, const blockmap_t *map)
+{
+    u_int64_t  length, value64;
+    u_int32_t  encoding;
+    u_char    *blocks;
+    int        status = 0;
+
+    length = blockmap_encode(map, NULL, &encoding);
+    blocks = (u_char *) malloc(length + 1);
+    if (blocks == NULL)
+        return warn("Could not allocate the block list");
+    blockmap_encode(map, blocks, &encoding);
+
+    encoding = htonl(encoding);
+    value64  = htonll(length);
+    if ((full_write(session->client_fd, &encoding, 4) < 4) || (full_write(session->client_fd, &value64, 8) < 8) ||
+        (full_write(session->client_fd, blocks, length) < (ssize_t) length))
+        status = warn("Could not send the block list");
+    free(blocks);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_send_holes(ttp_session_t *session);
+ *
+ * Finds the blocks of the file that lie wholly in holes, sends them to
+ * the client with ttp_send_blockmap() and leaves them out of the first
+ * pass, so that sparse files cross the network as only their data.
+ * Where the system cannot seek to holes no block is a hole.  Returns 0
+ * on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_send_holes(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param = session->parameter;
+    blockmap_t      *holes;
+    u_int64_t        first, last;
+    int              status;
+
+    holes = blockmap_create(param->block_count);
+    if (holes == NULL)
+        error("Could not allocate the hole bitfield");
+
+    #ifdef SEEK_HOLE
+    {
+        int        fd = fileno(xfer->file);
+        off_t      hole, data;
+
+        /* walk the holes, each of which runs up to the next data or the end */
+        for (data = 0; (u_int64_t) data < param->file_size; ) {
+            hole = lseek(fd, data, SEEK_HOLE);
+            if ((hole < 0) || ((u_int64_t) hole >= param->file_size))
+                break;
+            data = lseek(fd, hole, SEEK_DATA);
+            if (data < 0)
+                data = param->file_size;
+
+            /* the blocks from the first that starts in it to the last that ends in it */
+            first = (hole + param->block_size - 1) / param->block_size + 1;
+            last  = ((u_int64_t) data >= param->file_size) ? param->block_count : data / param->block_size;
+            if ((first <= last) && (blockmap_set_range(holes, first, last) < 0))
+                error("Could not allocate a hole bitfield page");
+        }
+        fseeko(xfer->file, 0, SEEK_SET);
+    }
+    #endif
+
+    /* leave them out, and tell the client */
+    if (xfer->skip == NULL)
+        xfer->skip = blockmap_create(param->block_count);
+    if (xfer->skip == NULL)
+        error("Could not allocate the skipped-block bitfield");
+    for (first = blockmap_next(holes, 1, 1); first <= param->block_count; first = blockmap_next(holes, last + 1, 1)) {
+        last = blockmap_next(holes, first, 0) - 1;
+        if (blockmap_set_range(xfer->skip, first, last) < 0)
+            error("Could not allocate a skipped-block bitfield page");
+    }
+    status = ttp_send_blockmap(session, holes);
+
+    if (param->verbose_yn)
+        printf("%llu of %llu blocks are holes\n", (ull_t) blockmap_count(holes), (ull_t) param->block_count);
+    blockmap_destroy(holes);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_send_manifest(ttp_session_t *session);
+ *
+ * Sends the manifest of the bundle being transferred to the client:
+ * the number of entries as a u32, and then for each entry, in the order
+ * of their data in the stream, its size as a u64, its mode as a u32
+ * and its name as a u16 length and that many bytes.  The manifest goes
+ * out in one write.  Returns 0 on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_send_manifest(ttp_session_t *session)
+{
+    bundle_t  *bundle = (bundle_t *) session->transfer.source_data;
+    u_char    *manifest, *next;
+    size_t     length = 4;
+    u_int64_t  size;
+    u_int32_t  value;
+    u_int16_t  name_length, temp16;
+    u_int32_t  index;
+    int        status;
+
+    for (index = 0; index < bundle->count; ++index)
+        length += 8 + 4 + 2 + strlen(bundle->entry[index].name);
+    manifest = (u_char *) malloc(length);
+    if (manifest == NULL)
+        return warn("Could not allocate the bundle manifest");
+
+    value = htonl(bundle->count);
+    memcpy(manifest, &value, 4);
+    for (index = 0, next = manifest + 4; index < bundle->count; ++index) {
+        name_length = strlen(bundle->entry[index].name);
+        size        = htonll(bundle->entry[index].size);   memcpy(next, &size,   8);  next += 8;
+        value       = htonl (bundle->entry[index].mode);   memcpy(next, &value,  4);  next += 4;
+        temp16      = htons (name_length);                 memcpy(next, &temp16, 2);  next += 2;
+        memcpy(next, bundle->entry[index].name, name_length);                         next += name_length;
+    }
+    status = full_write(session->client_fd, manifest, length);
+    free(manifest);
+
+    if (session->parameter->verbose_yn)
+        printf("Bundle of %u entries, %llu bytes\n", bundle->count, (ull_t) bundle->size);
+    return (status < 0) ? -1 : 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_serve_delta(ttp_session_t *session);
+ *
+ * Compares the digests of the blocks of the client's old copy of the
+ * file with those of ours, and leaves the blocks that match out of the
+ * first pass.  The digests come in rounds of a 32-bit count followed by
+ * DELTA_DIGEST bytes per block, from block 1 on; a count of 0 ends them.
+ * The matching blocks then go back as encoded by blockmap_encode().
+ * Our digests are read from the sidecar file next to the file if that
+ * is still current, and otherwise computed and cached there.  Returns 0
+ * on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_serve_delta(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param = session->parameter;
+    char             path[MAX_FILENAME_LENGTH + sizeof(DELTA_POSTFIX)];
+    struct stat      filestat;
+    FILE            *sidecar;
+    u_char          *ours, *theirs;
+    u_int64_t        block = 1;
+    u_int32_t        count, index;
+    int              status = 0;
+
+    snprintf(path, sizeof(path), "%s%s", xfer->filename, DELTA_POSTFIX);
+    if (fstat(fileno(xfer->file), &filestat) < 0)
+        return warn("Could not stat the file");
+
+    /* our digests, from the cache if we can */
+    sidecar = delta_open(path, param->file_size, param->block_size, filestat.st_mtime);
+    if (sidecar == NULL) {
+        if (param->verbose_yn)
+            printf("Hashing the blocks of %s\n", xfer->filename);
+        if (delta_save(fileno(xfer->file), path, param->file_size, param->block_size, filestat.st_mtime) < 0) {
+            sprintf(g_error, "Could not cache the block digests in %s", path);
+            warn(g_error);
+        }
+        sidecar = delta_open(path, param->file_size, param->block_size, filestat.st_mtime);
+    }
+
+    ours   = (u_char *) malloc(DELTA_ROUND * DELTA_DIGEST);
+    theirs = (u_char *) malloc(DELTA_ROUND * DELTA_DIGEST);
+    if ((ours == NULL) || (theirs == NULL))
+        error("Could not allocate the block digest buffers");
+    if (xfer->skip == NULL)
+        xfer->skip = blockmap_create(param->block_count);
+    if (xfer->skip == NULL)
+        error("Could not allocate the skipped-block bitfield");
+
+    while (1) {
+
+        /* read the next round */
+        if (full_read(session->client_fd, &count, 4) < 4) {
+            status = warn("Could not read the number of block digests");
+            break;
+        }
+        count = ntohl(count);
+        if (count == 0)
+            break;
+        if ((count > DELTA_ROUND) || (count > param->block_count - block + 1) ||
+            (full_read(session->client_fd, theirs, count * DELTA_DIGEST) < count * DELTA_DIGEST)) {
+            status = warn("Could not read the block digests");
+            break;
+        }
+
+        /* and compare it with ours */
+        if ((sidecar != NULL) ? (fread(ours, DELTA_DIGEST, count, sidecar) < count)
+                              : (delta_hash(fileno(xfer->file), param->file_size, param->block_size, block, count, ours) < 0)) {
+            status = warn("Could not get the digests of our blocks");
+            break;
+        }
+        for (index = 0; index < count; ++index)
+            if (!memcmp(ours + index * DELTA_DIGEST, theirs + index * DELTA_DIGEST, DELTA_DIGEST) &&
+                (blockmap_set(xfer->skip, block + index) < 0))
+                error("Could not allocate a skipped-block bitfield page");
+        block += count;
+    }
+    if (sidecar != NULL)
+        fclose(sidecar);
+    free(ours);
+    free(theirs);
+
+    /* tell the client which blocks it can keep */
+    if ((status == 0) && (ttp_send_blockmap(session, xfer->skip) < 0))
+        status = warn("Could not send the matching blocks");
+
+    if (param->verbose_yn)
+        printf("Client holds %llu of %llu blocks already\n", (ull_t) blockmap_count(xfer->skip), (ull_t) param->block_count);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_serve_merkle(ttp_session_t *session);
+ *
+ * Answers the client's queries for node hashes of the Merkle tree of
+ * the file, with which it checks the parts of the file it holds.  Each
+ * query is a 32-bit count of nodes followed by the 64-bit node indices,
+ * and is answered with 16 bytes per node; a count of 0 ends them.  The
+ * tree is read from the sidecar file next to the file if that is still
+ * current, and otherwise built and cached there.  Returns 0 on success
+ * and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_serve_merkle(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param = session->parameter;
+    merkle_t        *tree  = NULL;
+    char             sidecar[MAX_FILENAME_LENGTH + sizeof(MERKLE_POSTFIX)];
+    struct stat      filestat;
+    u_int64_t        node[MERKLE_ROUND];
+    u_char           hash[MERKLE_ROUND][16];
+    u_int32_t        count, index;
+    int              status = 0;
+
+    snprintf(sidecar, sizeof(sidecar), "%s%s", xfer->filename, MERKLE_POSTFIX);
+    if (fstat(fileno(xfer->file), &filestat) < 0)
+        return warn("Could not stat the file");
+
+    while (1) {
+
+        /* read the next query */
+        if (full_read(session->client_fd, &count, 4) < 4) {
+            status = warn("Could not read the number of Merkle tree nodes");
+            break;
+        }
+        count = ntohl(count);
+        if (count == 0)
+            break;
+        if ((count > MERKLE_ROUND) || (full_read(session->client_fd, node, 8 * count) < 8 * count)) {
+            status = warn("Could not read the Merkle tree nodes");
+            break;
+        }
+
+        /* the tree is only needed once somebody asks */
+        if (tree == NULL) {
+            tree = merkle_create(param->file_size);
+            if (tree == NULL)
+                error("Could not allocate the Merkle tree");
+            if (merkle_load(tree, sidecar, filestat.st_mtime) < 0) {
+                if (param->verbose_yn)
+                    printf("Building the Merkle tree of %s\n", xfer->filename);
+                if (merkle_hash(tree, fileno(xfer->file), NULL) < 0) {
+                    status = warn("Could not hash the file");
+                    break;
+                }
+                if (merkle_save(tree, sidecar, filestat.st_mtime) < 0) {
+                    sprintf(g_error, "Could not cache the Merkle tree in %s", sidecar);
+                    warn(g_error);
+                }
+            }
+        }
+
+        /* and answer it */
+        for (index = 0; index < count; ++index) {
+            node[index] = ntohll(node[index]);
+            if (node[index] < tree->nodes)
+                memcpy(hash[index], tree->hash + 16 * node[index], 16);
+            else
+                memset(hash[index], 0, 16);
+        }
+        if (full_write(session->client_fd, hash, 16 * count) < 16 * count) {
+            status = warn("Could not send the Merkle tree hashes");
+            break;
+        }
+    }
+
+    merkle_destroy(tree);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_size_buffer(ttp_session_t *session, u_int32_t size);
+ *
+ * Asks for a UDP send buffer of the given size on the data socket and
+ * remembers what the kernel actually granted.  Both go to the
+ * transcript, so that truncated buffers don't go unnoticed.  Returns 0
+ * on success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+int ttp_size_buffer(ttp_session_t *session, u_int32_t size)
+{
+    ttp_transfer_t  *xfer = &session->transfer;
+    char             buffer_line[96];
+
+    /* set the buffer and read back the real size */
+    xfer->udp_request = size;
+    xfer->udp_buffer  = set_udp_buffer(xfer->udp_fd, 1, size);
+    if (xfer->udp_buffer == 0)
+        return warn("Could not size the UDP send buffer");
+
+    /* report it */
+    snprintf(buffer_line, sizeof(buffer_line), "UDPBUF requested %u granted %u bytes\n", size, xfer->udp_buffer);
+    if (session->parameter->verbose_yn)
+        printf("%s", buffer_line);
+    if (session->parameter->transcript_yn)
+        xscript_data_log(session, buffer_line);
+
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int ttp_skip_range(ttp_session_t *session);
+ *
+ * Leaves out of the transfer every block that holds none of the byte
+ * range the client asked for with TS_OPT_RANGE, so that the range is
+ * sent as the whole file less the other blocks.  The client marks the
+ * same blocks received up front.  Returns 0 on success and non-zero on
+ * failure.
+ *------------------------------------------------------------------------*/
+int ttp_skip_range(ttp_session_t *session)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param = session->parameter;
+    u_int64_t        start, end, first, last;
+
+    /* the range, clipped to the file, and the blocks from the one it starts in to the one it ends in */
+    start = min(xfer->range_offset, param->file_size);
+    end   = start + min(xfer->range_length, param->file_size - start);
+    first = start / param->block_size + 1;
+    last  = (end + param->block_size - 1) / param->block_size;
+
+    xfer->skip = blockmap_create(param->block_count);
+    if (xfer->skip == NULL)
+        error("Could not allocate the skipped-block bitfield");
+    if ((first > 1) && (blockmap_set_range(xfer->skip, 1, min(first - 1, param->block_count)) < 0))
+        error("Could not allocate a skipped-block bitfield page");
+    if ((last < param->block_count) && (blockmap_set_range(xfer->skip, last + 1, param->block_count) < 0))
+        error("Could not allocate a skipped-block bitfield page");
+
+    if (param->verbose_yn)
+        printf("Sending bytes %llu to %llu, blocks %llu to %llu of %llu\n", (ull_t) start, (ull_t) end,
+               (ull_t) first, (ull_t) last, (ull_t) param->block_count);
+    return 0;
+}
+
+
 /*========================================================================
  * $Log: protocol.c,v $
  * Revision 1.35  2013/08/15 15:50:49  jwagnerhki
@@ -0,0 +1,494 @@
+/*========================================================================
+ * relay.c  --  Relay routines for Tsunami server.
+ *
+ * This contains routines for relaying files from another Tsunami
+ * server.  With --relay the server fetches each requested file from
+ * the upstream server as a client would, and sends every block on to
+ * its own client as soon as it has arrived.  Each hop recovers its own
+ * losses: a receiving thread asks upstream for what went missing while
+ * the downstream loop answers the retransmission requests of our
+ * client from the spooled data.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <netdb.h>        /* for getaddrinfo()                     */
+#include <netinet/tcp.h>  /* for TCP_NODELAY                       */
+#include <poll.h>         /* for poll()                            */
+#include <stdlib.h>       /* for calloc(), free()                  */
+#include <string.h>       /* for memset(), etc.                    */
+#include <sys/socket.h>   /* for the BSD sockets library           */
+#include <unistd.h>       /* for pwrite(), ftruncate(), etc.       */
+
+#include <tsunami-server.h>
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static FILE *relay_abort   (ttp_session_t *session, relay_t *relay, const char *message);
+static int   relay_feedback(relay_t *relay, u_int64_t received);
+static void *relay_receive (void *arg);
+
+
+/*------------------------------------------------------------------------
+ * FILE *relay_request(ttp_session_t *session, const char *filename);
+ *
+ * Connects to the upstream server and authenticates with the relay
+ * secret.  Returns the unlinked spool file that the given file will be
+ * written to, which the transfer reads like a local file, or NULL on
+ * failure.  The file is asked for by relay_start(), as the request
+ * carries the transfer parameters along with the filename.
+ *------------------------------------------------------------------------*/
+FILE *relay_request(ttp_session_t *session, const char *filename)
+{
+    ttp_parameter_t *param = session->parameter;
+    relay_t         *relay;
+    struct addrinfo  hints, *info, *entry;
+    char             port[8];
+    u_char           random[64];
+    u_char           digest[16];
+    u_char           result;
+    u_int32_t        revision;
+    FILE            *spool;
+    int              socket_fd = -1;
+    int              yes = 1;
+
+    relay = (relay_t *) calloc(1, sizeof(*relay));
+    if (relay == NULL) {
+        warn("Could not allocate the relay state");
+        return NULL;
+    }
+    relay->udp_fd   = -1;
+    relay->spool_fd = -1;
+    pthread_mutex_init(&relay->lock, NULL);
+    pthread_cond_init(&relay->arrival, NULL);
+
+    /* connect to the upstream server */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(port, "%u", param->relay_port);
+    if (getaddrinfo(param->relay_host, port, &hints, &info) != 0)
+        return relay_abort(session, relay, "Could not look up the upstream server");
+    for (entry = info; entry != NULL; entry = entry->ai_next) {
+        socket_fd = socket(entry->ai_family, entry->ai_socktype, entry->ai_protocol);
+        if (socket_fd < 0)
+            continue;
+        if (connect(socket_fd, entry->ai_addr, entry->ai_addrlen) == 0)
+            break;
+        close(socket_fd);
+        socket_fd = -1;
+    }
+    freeaddrinfo(info);
+    if (socket_fd < 0)
+        return relay_abort(session, relay, "Could not connect to the upstream server");
+    if (setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0)
+        warn("Could not disable Nagle's algorithm");
+    relay->server = fdopen(socket_fd, "w+");
+    if (relay->server == NULL) {
+        close(socket_fd);
+        return relay_abort(session, relay, "Could not convert the upstream connection into a stream");
+    }
+
+    /* compare protocol revisions */
+    revision = htonl(PROTOCOL_REVISION);
+    if ((fwrite(&revision, 4, 1, relay->server) < 1) || fflush(relay->server) || (fread(&revision, 4, 1, relay->server) < 1))
+        return relay_abort(session, relay, "Could not exchange protocol revisions with the upstream server");
+    if (ntohl(revision) != PROTOCOL_REVISION)
+        return relay_abort(session, relay, "Upstream server protocol revision number mismatch");
+
+    /* prove the shared secret */
+    if (fread(random, 1, 64, relay->server) < 64)
+        return relay_abort(session, relay, "Could not read authentication challenge from the upstream server");
+    prepare_proof(random, 64, param->relay_secret, digest);
+    if ((fwrite(digest, 1, 16, relay->server) < 16) || fflush(relay->server) || (fread(&result, 1, 1, relay->server) < 1))
+        return relay_abort(session, relay, "Could not authenticate to the upstream server");
+    if (result != 0)
+        return relay_abort(session, relay, "Upstream server authentication failure");
+
+    /* and keep the name of the file for the request */
+    relay->filename = strdup(filename);
+    if (relay->filename == NULL)
+        return relay_abort(session, relay, "Could not allocate the relay state");
+
+    /* spool it unbuffered, the receiving thread writes behind our back */
+    spool = tmpfile();
+    if (spool == NULL)
+        return relay_abort(session, relay, "Could not create the relay spool file");
+    setvbuf(spool, NULL, _IONBF, 0);
+    relay->spool_fd = fileno(spool);
+
+    session->transfer.relay = relay;
+    return spool;
+}
+
+
+/*------------------------------------------------------------------------
+ * int relay_start(ttp_session_t *session);
+ *
+ * Requests the file from the upstream server with the block size,
+ * rates and factors our client asked us for, in one message together
+ * with the port of a new data socket, sizes the spool file and starts
+ * the thread that receives the data.  Returns 0 on success and
+ * non-zero on failure, which includes the upstream server not having
+ * the file.
+ *------------------------------------------------------------------------*/
+int relay_start(ttp_session_t *session)
+{
+    ttp_parameter_t         *param = session->parameter;
+    relay_t                 *relay = session->transfer.relay;
+    struct sockaddr_storage  address;
+    socklen_t                length = sizeof(address);
+    u_int32_t                temp, block_size, epoch, options;
+    u_int16_t                temp16, port, tag;
+    u_char                   result;
+    int                      udp_fd, status = -1;
+
+    /* open a data socket on the address the upstream server knows us by */
+    if (getsockname(fileno(relay->server), (struct sockaddr *) &address, &length) < 0)
+        return warn("Could not find our upstream address");
+    if (address.ss_family == AF_INET6)
+        ((struct sockaddr_in6 *) &address)->sin6_port = 0;
+    else
+        ((struct sockaddr_in *)  &address)->sin_port  = 0;
+    udp_fd = socket(address.ss_family, SOCK_DGRAM, 0);
+    if (udp_fd < 0)
+        return warn("Could not create the upstream UDP socket");
+    if ((bind(udp_fd, (struct sockaddr *) &address, length) < 0) || (getsockname(udp_fd, (struct sockaddr *) &address, &length) < 0)) {
+        status = warn("Could not bind the upstream UDP socket");
+        goto done;
+    }
+    port = (address.ss_family == AF_INET6) ? ((struct sockaddr_in6 *) &address)->sin6_port : ((struct sockaddr_in *) &address)->sin_port;
+
+    /* blocks wait in the buffer for up to one feedback period */
+    set_udp_buffer(udp_fd, 0, param->udp_buffer ? param->udp_buffer : udp_buffer_for_path(DEFAULT_UDP_BUFFER, param->target_rate, RELAY_PERIOD));
+
+    /* ask for the file as our client asked us for it, with no options and our data port, in one message */
+    if (fprintf(relay->server, "%s\n", relay->filename) <= 0) { status = warn("Could not request the file from the upstream server"); goto done; }
+    temp   = htonl(param->block_size);   if (fwrite(&temp,   4, 1, relay->server) < 1) { status = warn("Could not submit block size upstream"); goto done; }
+    temp   = htonl(param->target_rate);  if (fwrite(&temp,   4, 1, relay->server) < 1) { status = warn("Could not submit target rate upstream"); goto done; }
+    temp   = htonl(param->error_rate);   if (fwrite(&temp,   4, 1, relay->server) < 1) { status = warn("Could not submit error rate upstream"); goto done; }
+    temp16 = htons(param->slower_num);   if (fwrite(&temp16, 2, 1, relay->server) < 1) { status = warn("Could not submit slowdown numerator upstream"); goto done; }
+    temp16 = htons(param->slower_den);   if (fwrite(&temp16, 2, 1, relay->server) < 1) { status = warn("Could not submit slowdown denominator upstream"); goto done; }
+    temp16 = htons(param->faster_num);   if (fwrite(&temp16, 2, 1, relay->server) < 1) { status = warn("Could not submit speedup numerator upstream"); goto done; }
+    temp16 = htons(param->faster_den);   if (fwrite(&temp16, 2, 1, relay->server) < 1) { status = warn("Could not submit speedup denominator upstream"); goto done; }
+    temp   = 0;                          if (fwrite(&temp,   4, 1, relay->server) < 1) { status = warn("Could not submit transfer options upstream"); goto done; }
+    if ((fwrite(&port, 2, 1, relay->server) < 1) || fflush(relay->server)) {
+        status = warn("Could not send the upstream UDP port number");
+        goto done;
+    }
+
+    /* see if the upstream server has the file */
+    if (fread(&result, 1, 1, relay->server) < 1) { status = warn("Could not read the upstream response to the file request"); goto done; }
+    if (result != 0) { status = warn("Upstream server: File does not exist or cannot be transmitted"); goto done; }
+
+    /* read in the file length, block size, number of blocks, run epoch, options and datagram tag */
+    if (fread(&relay->file_size,   8, 1, relay->server) < 1) { status = warn("Could not read file size from upstream"); goto done; }
+    if (fread(&block_size,         4, 1, relay->server) < 1) { status = warn("Could not read block size from upstream"); goto done; }
+    if (fread(&relay->block_count, 8, 1, relay->server) < 1) { status = warn("Could not read number of blocks from upstream"); goto done; }
+    if (fread(&epoch,              4, 1, relay->server) < 1) { status = warn("Could not read run epoch from upstream"); goto done; }
+    if (fread(&options,            4, 1, relay->server) < 1) { status = warn("Could not read transfer options from upstream"); goto done; }
+    if (fread(&tag,                2, 1, relay->server) < 1) { status = warn("Could not read datagram tag from upstream"); goto done; }
+    relay->file_size   = ntohll(relay->file_size);
+    relay->block_count = ntohll(relay->block_count);
+    block_size         = ntohl (block_size);
+    relay->tag         = ntohs (tag);
+    if (block_size != param->block_size) {
+        status = warn("Block size disagreement with the upstream server");
+        goto done;
+    }
+    relay->block_size = block_size;
+
+    /* the spool file has the size of the file, blocks not yet in read as zeros */
+    if (ftruncate(relay->spool_fd, relay->file_size) < 0) {
+        status = warn("Could not size the relay spool file");
+        goto done;
+    }
+    relay->arrived = blockmap_create(relay->block_count);
+    if (relay->arrived == NULL) {
+        status = warn("Could not allocate the relayed-block bitfield");
+        goto done;
+    }
+
+    /* and start receiving */
+    relay->udp_fd = udp_fd;
+    if (pthread_create(&relay->thread, NULL, relay_receive, session) != 0) {
+        relay->udp_fd = -1;
+        status = warn("Could not start the relay thread");
+        goto done;
+    }
+
+    if (param->verbose_yn)
+        printf("Relaying from %s: %llu bytes in %llu blocks\n", param->relay_host,
+               (ull_t) relay->file_size, (ull_t) relay->block_count);
+    return 0;
+
+ done:
+    close(udp_fd);
+    return status;
+}
+
+
+/*------------------------------------------------------------------------
+ * int relay_wait(ttp_session_t *session, u_int64_t block);
+ *
+ * Waits until the given block has arrived from upstream.  Also notes
+ * how far our client has got, which bounds the lead of the upstream
+ * hop.  Returns 0 once the block is in the spool file and non-zero if
+ * the upstream transfer failed before that.
+ *------------------------------------------------------------------------*/
+int relay_wait(ttp_session_t *session, u_int64_t block)
+{
+    relay_t *relay = session->transfer.relay;
+    int      arrived;
+
+    pthread_mutex_lock(&relay->lock);
+    relay->wanted = max(relay->wanted, block);
+    while (!(arrived = blockmap_get(relay->arrived, block)) && !relay->failed)
+        pthread_cond_wait(&relay->arrival, &relay->lock);
+    pthread_mutex_unlock(&relay->lock);
+    return arrived ? 0 : -1;
+}
+
+
+/*------------------------------------------------------------------------
+ * void relay_close(ttp_session_t *session);
+ *
+ * Stops the upstream transfer of the given session, if any, and frees
+ * its state.  The spool file is closed with the transfer's file.
+ *------------------------------------------------------------------------*/
+void relay_close(ttp_session_t *session)
+{
+    relay_t *relay = session->transfer.relay;
+
+    if (relay == NULL)
+        return;
+
+    /* stop the thread if it is still running */
+    if (relay->udp_fd >= 0) {
+        pthread_mutex_lock(&relay->lock);
+        relay->stop = 1;
+        pthread_mutex_unlock(&relay->lock);
+        pthread_join(relay->thread, NULL);
+        close(relay->udp_fd);
+        if (session->parameter->verbose_yn)
+            printf("Relay received %llu datagrams from upstream and asked for %llu retransmissions\n",
+                   (ull_t) relay->received, (ull_t) relay->requests);
+    }
+
+    if (relay->server != NULL)
+        fclose(relay->server);
+    free(relay->filename);
+    blockmap_destroy(relay->arrived);
+    pthread_cond_destroy(&relay->arrival);
+    pthread_mutex_destroy(&relay->lock);
+    free(relay);
+    session->transfer.relay = NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * static FILE *relay_abort(ttp_session_t *session, relay_t *relay,
+ *                          const char *message);
+ *
+ * Gives up on a relay request with the given warning and frees the
+ * relay state.  Always returns NULL.
+ *------------------------------------------------------------------------*/
+static FILE *relay_abort(ttp_session_t *session, relay_t *relay, const char *message)
+{
+    session->transfer.relay = relay;
+    relay_close(session);
+    warn(message);
+    return NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * static int relay_feedback(relay_t *relay, u_int64_t received);
+ *
+ * Sends the upstream server what a client sends it every update period:
+ * requests for the blocks missing below the highest one seen, the error
+ * rate that follows from those and the given number of datagrams
+ * received since the last time, and flow control that stalls upstream
+ * while it is RELAY_WINDOW blocks ahead of our client.  Returns 0 on
+ * success and non-zero on failure.
+ *------------------------------------------------------------------------*/
+static int relay_feedback(relay_t *relay, u_int64_t received)
+{
+    retransmission_t retransmission;
+    u_int64_t        block, highest, wanted, requests = 0;
+
+    pthread_mutex_lock(&relay->lock);
+    highest = relay->highest;
+    wanted  = relay->wanted;
+    pthread_mutex_unlock(&relay->lock);
+
+    /* ask for the missing blocks again */
+    memset(&retransmission, 0, sizeof(retransmission));
+    retransmission.request_type = htons(REQUEST_RETRANSMIT);
+    for (block = blockmap_next(relay->arrived, 1, 0); (block < highest) && (requests < RELAY_REQUESTS); block = blockmap_next(relay->arrived, block + 1, 0)) {
+        retransmission.block = htonll(block);
+        if (fwrite(&retransmission, sizeof(retransmission), 1, relay->server) < 1)
+            return warn("Could not request a retransmission upstream");
+        ++requests;
+    }
+    relay->requests += requests;
+
+    /* report the error rate as a client does */
+    relay->error_rate = RELAY_HISTORY * relay->error_rate + (1.0 - RELAY_HISTORY) * 500 * 100 * requests / (1.0 + requests + received);
+    retransmission.request_type = htons(REQUEST_ERROR_RATE);
+    retransmission.block        = 0;
+    retransmission.error_rate   = htonl((u_int32_t) relay->error_rate);
+    if (fwrite(&retransmission, sizeof(retransmission), 1, relay->server) < 1)
+        return warn("Could not report the error rate upstream");
+
+    /* and keep upstream from running too far ahead */
+    retransmission.request_type = htons(REQUEST_FLOW_CONTROL);
+    retransmission.block        = htonll((highest >= wanted + RELAY_WINDOW) ? 0 : wanted + RELAY_WINDOW - highest);
+    retransmission.error_rate   = 0;
+    if ((fwrite(&retransmission, sizeof(retransmission), 1, relay->server) < 1) || fflush(relay->server))
+        return warn("Could not send flow control upstream");
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * static void *relay_receive(void *arg);
+ *
+ * The thread receiving the upstream data of the session given as arg.
+ * It writes every block to the spool file, wakes up relay_wait(), and
+ * sends relay_feedback() every RELAY_PERIOD usec.  Once the whole file
+ * is in it asks the upstream server to stop.
+ *------------------------------------------------------------------------*/
+static void *relay_receive(void *arg)
+{
+    ttp_session_t    *session = (ttp_session_t *) arg;
+    relay_t          *relay   = session->transfer.relay;
+    u_char            datagram[TS_HEADER_SIZE + MAX_BLOCK_SIZE + TS_CRC_SIZE];
+    struct pollfd     ready;
+    struct timeval    last;
+    retransmission_t  retransmission;
+    u_int64_t         block, offset, received = 0;
+    u_int16_t         type;
+    ssize_t           status;
+    int               stop, complete = 0;
+
+    ready.fd     = relay->udp_fd;
+    ready.events = POLLIN;
+    gettimeofday(&last, NULL);
+    while (1) {
+
+        /* spool whatever data arrives */
+        if (poll(&ready, 1, RELAY_PERIOD / 1000) > 0) {
+            status = recv(relay->udp_fd, datagram, sizeof(datagram), 0);
+            block  = ntohll(*((u_int64_t *) datagram));
+            type   = ntohs(*((u_int16_t *) (datagram + 8)));
+            if ((status >= TS_HEADER_SIZE + relay->block_size) && (block > 0) && (block <= relay->block_count) &&
+                (ntohs(*((u_int16_t *) (datagram + 10))) == relay->tag) &&
+                ((type == TS_BLOCK_ORIGINAL) || (type == TS_BLOCK_RETRANSMISSION) || (type == TS_BLOCK_TERMINATE))) {
+                offset = (block - 1) * relay->block_size;
+                if (pwrite(relay->spool_fd, datagram + TS_HEADER_SIZE, min(relay->block_size, relay->file_size - offset), offset) < 0) {
+                    warn("Could not write to the relay spool file");
+                    break;
+                }
+                ++received;
+                pthread_mutex_lock(&relay->lock);
+                ++relay->received;
+                relay->highest = max(relay->highest, block);
+                if (blockmap_set(relay->arrived, block) == 1)
+                    pthread_cond_broadcast(&relay->arrival);
+                pthread_mutex_unlock(&relay->lock);
+            }
+        }
+
+        /* see whether we are done */
+        pthread_mutex_lock(&relay->lock);
+        stop     = relay->stop;
+        complete = (blockmap_count(relay->arrived) == relay->block_count);
+        pthread_mutex_unlock(&relay->lock);
+        if (stop || complete)
+            break;
+
+        /* give feedback */
+        if (get_usec_since(&last) >= RELAY_PERIOD) {
+            if (relay_feedback(relay, received) < 0)
+                break;
+            received = 0;
+            gettimeofday(&last, NULL);
+        }
+    }
+
+    /* have upstream stop, also if we give up */
+    memset(&retransmission, 0, sizeof(retransmission));
+    retransmission.request_type = htons(REQUEST_STOP);
+    if ((fwrite(&retransmission, sizeof(retransmission), 1, relay->server) < 1) || fflush(relay->server))
+        warn("Could not stop the upstream transfer");
+
+    /* wake up the sender if the file will not be complete */
+    if (!complete) {
+        pthread_mutex_lock(&relay->lock);
+        relay->failed = 1;
+        pthread_cond_broadcast(&relay->arrival);
+        pthread_mutex_unlock(&relay->lock);
+    }
+    return NULL;
+}
+
+
+/*========================================================================
+ * $Log: relay.c,v $
+ */
@@ -0,0 +1,506 @@
+/*========================================================================
+ * source.c  --  Block sources for Tsunami server.
+ *
+ * This contains the backends that the server reads the blocks of a
+ * requested file from, and the routines that pick one for a request.
+ * A request names a plain file, or a file or generator behind the name
+ * of a source and a colon, e.g. "mmap:/data/scan.vdif" or
+ * "synthetic:10G", a buffer or callback of a program using the library
+ * behind "memory:" or "callback:", or a bundle of files and directory
+ * trees behind "bundle:" (see bundle.c).  Every source serves blocks
+ * through the same calls, so that the datagram building, compression,
+ * parity and read-ahead in io.c work the same for all of them.
+ *
+ * Copyright (C) 2002 The Trustees of Indiana University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1) All redistributions of source code must retain the above
+ *    copyright notice, the list of authors in the original source
+ *    code, this list of conditions and the disclaimer listed in this
+ *    license;
+ *
+ * 2) All redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the disclaimer
+ *    listed in this license in the documentation and/or other
+ *    materials provided with the distribution;
+ *
+ * 3) Any documentation included with all redistributions must include
+ *    the following acknowledgement:
+ *
+ *      "This product includes software developed by Indiana
+ *      University`s Advanced Network Management Lab. For further
+ *      information, contact Steven Wallace at 812-855-0960."
+ *
+ *    Alternatively, this acknowledgment may appear in the software
+ *    itself, and wherever such third-party acknowledgments normally
+ *    appear.
+ *
+ * 4) The name "tsunami" shall not be used to endorse or promote
+ *    products derived from this software without prior written
+ *    permission from Indiana University.  For written permission,
+ *    please contact Steven Wallace at 812-855-0960.
+ *
+ * 5) Products derived from this software may not be called "tsunami",
+ *    nor may "tsunami" appear in their name, without prior written
+ *    permission of Indiana University.
+ *
+ * Indiana University provides no reassurances that the source code
+ * provided does not infringe the patent or any other intellectual
+ * property rights of any other entity.  Indiana University disclaims
+ * any liability to any recipient for claims brought by any other
+ * entity based on infringement of intellectual property rights or
+ * otherwise.
+ *
+ * LICENSEE UNDERSTANDS THAT SOFTWARE IS PROVIDED "AS IS" FOR WHICH
+ * NO WARRANTIES AS TO CAPABILITIES OR ACCURACY ARE MADE. INDIANA
+ * UNIVERSITY GIVES NO WARRANTIES AND MAKES NO REPRESENTATION THAT
+ * SOFTWARE IS FREE OF INFRINGEMENT OF THIRD PARTY PATENT, COPYRIGHT,
+ * OR OTHER PROPRIETARY RIGHTS. INDIANA UNIVERSITY MAKES NO
+ * WARRANTIES THAT SOFTWARE IS FREE FROM "BUGS", "VIRUSES", "TROJAN
+ * HORSES", "TRAP DOORS", "WORMS", OR OTHER HARMFUL CODE.  LICENSEE
+ * ASSUMES THE ENTIRE RISK AS TO THE PERFORMANCE OF SOFTWARE AND/OR
+ * ASSOCIATED MATERIALS, AND TO THE PERFORMANCE AND VALIDITY OF
+ * INFORMATION GENERATED USING SOFTWARE.
+ *========================================================================*/
+
+#include <ctype.h>        /* for toupper()                         */
+#include <fcntl.h>        /* for posix_fadvise()                   */
+#include <stdlib.h>       /* for malloc(), strtoull()              */
+#include <string.h>       /* for memcpy(), strncmp()               */
+#include <sys/mman.h>     /* for mmap(), madvise()                 */
+#include <sys/stat.h>     /* for fstat()                           */
+#include <unistd.h>       /* for sysconf()                         */
+
+#include <tsunami-server.h>
+
+/*------------------------------------------------------------------------
+ * Function prototypes (module scope).
+ *------------------------------------------------------------------------*/
+
+static int       file_open      (ttp_session_t *session, const char *name);
+static u_int64_t file_size      (ttp_session_t *session);
+static int       file_read      (ttp_session_t *session, u_int64_t block, u_char *buffer);
+static void      file_prefetch  (ttp_session_t *session, u_int64_t first, u_int64_t count);
+static void      file_close     (ttp_session_t *session);
+
+static int       map_open       (ttp_session_t *session, const char *name);
+static int       map_read       (ttp_session_t *session, u_int64_t block, u_char *buffer);
+static void      map_prefetch   (ttp_session_t *session, u_int64_t first, u_int64_t count);
+static void      map_close      (ttp_session_t *session);
+static int       map_extend     (ttp_session_t *session);
+
+static int       synthetic_open (ttp_session_t *session, const char *name);
+static u_int64_t synthetic_size (ttp_session_t *session);
+static int       synthetic_read (ttp_session_t *session, u_int64_t block, u_char *buffer);
+static void      synthetic_close(ttp_session_t *session);
+
+static int       memory_open    (ttp_session_t *session, const char *name);
+static u_int64_t memory_size    (ttp_session_t *session);
+static int       memory_read    (ttp_session_t *session, u_int64_t block, u_char *buffer);
+static void      memory_close   (ttp_session_t *session);
+
+static int       callback_open  (ttp_session_t *session, const char *name);
+static u_int64_t callback_size  (ttp_session_t *session);
+static int       callback_read  (ttp_session_t *session, u_int64_t block, u_char *buffer);
+static void      callback_close (ttp_session_t *session);
+
+/* a memory-mapped file */
+typedef struct {
+    u_char             *base;         /* the start of the mapping, NULL if empty    */
+    u_int64_t           length;       /* the bytes mapped                           */
+} map_t;
+
+/* a file read through the callbacks of a program using the library */
+typedef struct {
+    char               *name;         /* the name it was requested by               */
+    u_int64_t           size;         /* its size, as the size callback gave it     */
+} callback_file_t;
+
+/* the sources, plain files first */
+static const source_t source_list[] = {
+    { NULL,        TS_OPT_BUNDLE,      file_open,      file_size,      file_read,      file_prefetch, file_close      },
+    { "mmap",      TS_OPT_BUNDLE,      map_open,       file_size,      map_read,       map_prefetch,  map_close       },
+    { "synthetic", FILELESS_EXCLUDED,  synthetic_open, synthetic_size, synthetic_read, NULL,          synthetic_close },
+    { "memory",    FILELESS_EXCLUDED,  memory_open,    memory_size,    memory_read,    NULL,          memory_close    },
+    { "callback",  FILELESS_EXCLUDED,  callback_open,  callback_size,  callback_read,  NULL,          callback_close  },
+    { "bundle",    BUNDLE_EXCLUDED,    bundle_open,    bundle_size,    bundle_read,    NULL,          bundle_close    }
+};
+#define SOURCES (sizeof(source_list) / sizeof(source_list[0]))
+
+
+/*------------------------------------------------------------------------
+ * int source_open(ttp_session_t *session);
+ *
+ * Picks the source for the requested file by the prefix of its name,
+ * plain files if there is none that we know, takes the prefix off the
+ * filename of the transfer, so that sidecar files and messages go by
+ * the file itself, and opens the file with the source.  A relay leaves
+ * the prefix to the upstream server and reads the blocks it passes on
+ * as a plain file.  Returns 0 on success and non-zero on failure, in
+ * which case the transfer is left without a source.
+ *------------------------------------------------------------------------*/
+int source_open(ttp_session_t *session)
+{
+    ttp_transfer_t *xfer   = &session->transfer;
+    const source_t *source = &source_list[0];
+    size_t          length;
+    u_int32_t       index;
+
+    for (index = 1; (index < SOURCES) && (session->parameter->relay_host == NULL); ++index) {
+        length = strlen(source_list[index].name);
+        if (!strncmp(xfer->filename, source_list[index].name, length) && (xfer->filename[length] == SOURCE_SEPARATOR)) {
+            source = &source_list[index];
+            memmove(xfer->filename, xfer->filename + length + 1, strlen(xfer->filename + length + 1) + 1);
+            break;
+        }
+    }
+
+    xfer->source      = source;
+    xfer->source_data = NULL;
+    xfer->prefetched  = 0;
+    if (source->open(session, xfer->filename) < 0) {
+        xfer->source = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * int source_digest(ttp_session_t *session, u_int32_t *digest);
+ *
+ * Computes the CRC32C tree hash of the file, or of the byte range the
+ * client asked for, straight from the file if the source has one and
+ * block by block through the source otherwise, and stores it in digest.
+ * Returns 0 on success and non-zero on error.
+ *------------------------------------------------------------------------*/
+int source_digest(ttp_session_t *session, u_int32_t *digest)
+{
+    ttp_transfer_t  *xfer  = &session->transfer;
+    ttp_parameter_t *param = session->parameter;
+    crc32c_tree_t    tree;
+    u_char          *buffer;
+    u_int64_t        block, start = 0, end = param->file_size, from, to;
+    int              bytes = 0;
+
+    /* the range, clipped to the file, if the client only wants that */
+    if (xfer->options & TS_OPT_RANGE) {
+        start = min(xfer->range_offset, param->file_size);
+        end   = start + min(xfer->range_length, param->file_size - start);
+    }
+
+    if (xfer->file != NULL)
+        return crc32c_tree_range(fileno(xfer->file), start, end - start, digest);
+
+    buffer = (u_char *) malloc(param->block_size);
+    if (buffer == NULL)
+        return warn("Could not allocate the hashing buffer");
+    memset(&tree, 0, sizeof(tree));
+    for (block = start / param->block_size + 1; (block <= param->block_count) && (bytes >= 0); ++block) {
+        from = (block - 1) * param->block_size;
+        if (from >= end)
+            break;
+        bytes = xfer->source->read_block(session, block, buffer);
+        to    = min(from + max(bytes, 0), end);
+        from  = max(from, start);
+        if (to > from)
+            crc32c_tree_add(&tree, buffer + from - (block - 1) * param->block_size, to - from);
+    }
+    free(buffer);
+    if (bytes < 0)
+        return warn("Could not read the file for hashing");
+    *digest = crc32c_tree_end(&tree);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * Plain files, read through stdio, or the spool file of a relay.
+ *------------------------------------------------------------------------*/
+
+static int file_open(ttp_session_t *session, const char *name)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+
+    xfer->file = (session->parameter->relay_host != NULL) ? relay_request(session, name) : fopen(name, "r");
+    return (xfer->file == NULL) ? -1 : 0;
+}
+
+static u_int64_t file_size(ttp_session_t *session)
+{
+    FILE      *file = session->transfer.file;
+    u_int64_t  size;
+
+    fseeko(file, 0, SEEK_END);
+    size = ftello(file);
+    fseeko(file, 0, SEEK_SET);
+    return size;
+}
+
+static int file_read(ttp_session_t *session, u_int64_t block, u_char *buffer)
+{
+    FILE      *file   = session->transfer.file;
+    u_int64_t  offset = ((u_int64_t) session->parameter->block_size) * (block - 1);
+    size_t     bytes;
+
+    /* only seek when we do not read on from the last block, or to read on past an end that moved */
+    if ((feof(file) || ((u_int64_t) ftello(file) != offset)) && (fseeko(file, offset, SEEK_SET) < 0))
+        return -1;
+    bytes = fread(buffer, 1, session->parameter->block_size, file);
+    return ferror(file) ? -1 : (int) bytes;
+}
+
+static void file_prefetch(ttp_session_t *session, u_int64_t first, u_int64_t count)
+{
+    #ifdef POSIX_FADV_WILLNEED
+    u_int32_t block_size = session->parameter->block_size;
+
+    posix_fadvise(fileno(session->transfer.file), (off_t) block_size * (first - 1), (off_t) block_size * count, POSIX_FADV_WILLNEED);
+    #endif
+}
+
+static void file_close(ttp_session_t *session)
+{
+    fclose(session->transfer.file);
+    session->transfer.file = NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * Memory-mapped files, read without a copy into stdio.  The mapping is
+ * extended when a followed file grows past it.
+ *------------------------------------------------------------------------*/
+
+static int map_open(ttp_session_t *session, const char *name)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+
+    xfer->file        = fopen(name, "r");
+    xfer->source_data = calloc(1, sizeof(map_t));
+    if ((xfer->file != NULL) && (xfer->source_data != NULL) && (map_extend(session) == 0))
+        return 0;
+    map_close(session);
+    return -1;
+}
+
+static int map_read(ttp_session_t *session, u_int64_t block, u_char *buffer)
+{
+    map_t     *map    = (map_t *) session->transfer.source_data;
+    u_int64_t  offset = ((u_int64_t) session->parameter->block_size) * (block - 1);
+    u_int64_t  end    = min(offset + session->parameter->block_size, session->parameter->file_size);
+
+    if ((end > map->length) && (map_extend(session) < 0))
+        return -1;
+    end = min(end, map->length);
+    if (offset >= end)
+        return 0;
+    memcpy(buffer, map->base + offset, end - offset);
+    return end - offset;
+}
+
+static void map_prefetch(ttp_session_t *session, u_int64_t first, u_int64_t count)
+{
+    map_t     *map        = (map_t *) session->transfer.source_data;
+    u_int64_t  page       = sysconf(_SC_PAGESIZE);
+    u_int64_t  block_size = session->parameter->block_size;
+    u_int64_t  offset     = block_size * (first - 1) / page * page;
+    u_int64_t  end        = min(block_size * (first - 1 + count), map->length);
+
+    if (offset < end)
+        madvise(map->base + offset, end - offset, MADV_WILLNEED);
+}
+
+static void map_close(ttp_session_t *session)
+{
+    ttp_transfer_t *xfer = &session->transfer;
+    map_t          *map  = (map_t *) xfer->source_data;
+
+    if ((map != NULL) && (map->base != NULL))
+        munmap(map->base, map->length);
+    free(map);
+    xfer->source_data = NULL;
+    if (xfer->file != NULL)
+        fclose(xfer->file);
+    xfer->file = NULL;
+}
+
+static int map_extend(ttp_session_t *session)
+{
+    map_t       *map = (map_t *) session->transfer.source_data;
+    struct stat  filestat;
+    void        *base;
+
+    if (fstat(fileno(session->transfer.file), &filestat) < 0)
+        return -1;
+    if ((u_int64_t) filestat.st_size <= map->length)
+        return 0;
+    base = mmap(NULL, filestat.st_size, PROT_READ, MAP_SHARED, fileno(session->transfer.file), 0);
+    if (base == MAP_FAILED)
+        return -1;
+    if (map->base != NULL)
+        munmap(map->base, map->length);
+    map->base   = (u_char *) base;
+    map->length = filestat.st_size;
+    madvise(map->base, map->length, MADV_SEQUENTIAL);
+    return 0;
+}
+
+
+/*------------------------------------------------------------------------
+ * A generator of the given number of bytes, with an optional k, M or G
+ * suffix, for testing the network without a disk in the way.  Each
+ * block is filled with xorshift64 noise seeded by its number, so that
+ * it is the same each time it is sent and does not compress.
+ *------------------------------------------------------------------------*/
+
+static int synthetic_open(ttp_session_t *session, const char *name)
+{
+    u_int64_t *size;
+    char      *end;
+
+    size = (u_int64_t *) malloc(sizeof(*size));
+    if (size == NULL)
+        return -1;
+    *size = strtoull(name, &end, 10);
+    switch (toupper(*end)) {
+        case 'G': *size *= 1024;  /* fall through */
+        case 'M': *size *= 1024;  /* fall through */
+        case 'K': *size *= 1024; ++end;
+    }
+    if ((end == name) || (*end != '\0')) {
+        free(size);
+        return -1;
+    }
+    session->transfer.source_data = size;
+    return 0;
+}
+
+static u_int64_t synthetic_size(ttp_session_t *session)
+{
+    return *((u_int64_t *) session->transfer.source_data);
+}
+
+static int synthetic_read(ttp_session_t *session, u_int64_t block, u_char *buffer)
+{
+    u_int64_t block_size = session->parameter->block_size;
+    u_int64_t offset     = block_size * (block - 1);
+    u_int64_t size       = *((u_int64_t *) session->transfer.source_data);
+    u_int64_t state      = block * 0x9E3779B97F4A7C15ULL + 1;
+    u_int64_t bytes, index;
+
+    if (offset >= size)
+        return 0;
+    bytes = min(block_size, size - offset);
+    for (index = 0; index < bytes; index += 8) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        memcpy(buffer + index, &state, min(8, bytes - index));
+    }
+    return bytes;
+}
+
+static void synthetic_close(ttp_session_t *session)
+{
+    free(session->transfer.source_data);
+    session->transfer.source_data = NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * Buffers that a program using the library shares by name.
+ *------------------------------------------------------------------------*/
+
+static int memory_open(ttp_session_t *session, const char *name)
+{
+    shared_memory_t *shared;
+
+    for (shared = session->parameter->shared_memory; shared != NULL; shared = shared->next)
+        if (!strcmp(shared->name, name))
+            break;
+    session->transfer.source_data = shared;
+    return (shared == NULL) ? -1 : 0;
+}
+
+static u_int64_t memory_size(ttp_session_t *session)
+{
+    return ((shared_memory_t *) session->transfer.source_data)->size;
+}
+
+static int memory_read(ttp_session_t *session, u_int64_t block, u_char *buffer)
+{
+    shared_memory_t *shared     = (shared_memory_t *) session->transfer.source_data;
+    u_int64_t        block_size = session->parameter->block_size;
+    u_int64_t        offset     = block_size * (block - 1);
+
+    if (offset >= shared->size)
+        return 0;
+    memcpy(buffer, shared->data + offset, min(block_size, shared->size - offset));
+    return min(block_size, shared->size - offset);
+}
+
+static void memory_close(ttp_session_t *session)
+{
+    session->transfer.source_data = NULL;
+}
+
+
+/*------------------------------------------------------------------------
+ * Files that a program using the library reads through its callbacks,
+ * which get the name without the prefix.
+ *------------------------------------------------------------------------*/
+
+static int callback_open(ttp_session_t *session, const char *name)
+{
+    ttp_parameter_t *param = session->parameter;
+    callback_file_t *file;
+
+    if ((param->size_callback == NULL) || (param->read_callback == NULL))
+        return -1;
+    file = (callback_file_t *) calloc(1, sizeof(callback_file_t));
+    if (file == NULL)
+        return -1;
+    file->name = strdup(name);
+    if ((file->name == NULL) || (param->size_callback(file->name, &file->size, param->callback_user) < 0)) {
+        free(file->name);
+        free(file);
+        return -1;
+    }
+    session->transfer.source_data = file;
+    return 0;
+}
+
+static u_int64_t callback_size(ttp_session_t *session)
+{
+    return ((callback_file_t *) session->transfer.source_data)->size;
+}
+
+static int callback_read(ttp_session_t *session, u_int64_t block, u_char *buffer)
+{
+    ttp_parameter_t *param      = session->parameter;
+    callback_file_t *file       = (callback_file_t *) session->transfer.source_data;
+    u_int64_t        block_size = param->block_size;
+    u_int64_t        offset     = block_size * (block - 1);
+
+    if (offset >= file->size)
+        return 0;
+    return param->read_callback(file->name, offset, buffer, min(block_size, file->size - offset), param->callback_user);
+}
+
+static void callback_close(ttp_session_t *session)
+{
+    callback_file_t *file = (callback_file_t *) session->transfer.source_data;
+
+    free(file->name);
+    free(file);
+    session->transfer.source_data = NULL;
+}
+
+
+/*========================================================================
+ * $Log: source.c,v $
+ */
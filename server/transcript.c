@@ -79,6 +79,7 @@ void xscript_close(ttp_session_t *session, u_int64_t delta)
     fprintf(xfer->transcript, "duration = %0.2f\n", delta / 1000000.0);
     fprintf(xfer->transcript, "throughput = %0.2f\n", param->file_size * 8.0 / (delta * 1e-6 * 1024*1024));
     fclose(xfer->transcript);
+    xfer->transcript = NULL;
 }
 
 